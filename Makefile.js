@@ -31,7 +31,7 @@ SYSFLAGS=$(OPTIMIZED_FLAGS)
 #UPDATE = --update --java
 UPDATE =
 
-ALLOBJECTS = objects/periodogram.o objects/extras.o objects/mercury.o objects/integration.o objects/mcmc.o objects/utils.o objects/simplex.o objects/kernel.o objects/bootstrap.o objects/kl.o objects/qsortimp.o objects/lm.o objects/lm.o objects/ode.o objects/odex.o objects/sa.o objects/de.o
+ALLOBJECTS = objects/periodogram.o objects/extras.o objects/mercury.o objects/integration.o objects/mcmc.o objects/utils.o objects/simplex.o objects/kernel.o objects/bootstrap.o objects/kl.o objects/qsortimp.o objects/lm.o objects/lm.o objects/ode.o objects/odex.o objects/sa.o objects/de.o objects/cmaes.o objects/lbfgsb.o objects/budget.o objects/ga.o objects/ensemble.o objects/diagnostics.o objects/nested.o objects/hmc.o objects/rng.o objects/sink.o objects/sketch.o
 
 JS_FILES = ui help systemic
 
@@ -97,6 +97,39 @@ objects/sa.o: src/sa.c
 objects/de.o: src/de.c
 	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/de.o src/de.c
 
+objects/cmaes.o: src/cmaes.c
+	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/cmaes.o src/cmaes.c
+
+objects/lbfgsb.o: src/lbfgsb.c
+	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/lbfgsb.o src/lbfgsb.c
+
+objects/budget.o: src/budget.c
+	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/budget.o src/budget.c
+
+objects/ga.o: src/ga.c
+	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/ga.o src/ga.c
+
+objects/ensemble.o: src/ensemble.c
+	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/ensemble.o src/ensemble.c
+
+objects/diagnostics.o: src/diagnostics.c
+	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/diagnostics.o src/diagnostics.c
+
+objects/nested.o: src/nested.c
+	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/nested.o src/nested.c
+
+objects/hmc.o: src/hmc.c
+	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/hmc.o src/hmc.c
+
+objects/rng.o: src/rng.c
+	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/rng.o src/rng.c
+
+objects/sink.o: src/sink.c
+	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/sink.o src/sink.c
+
+objects/sketch.o: src/sketch.c
+	$(CC) $(CCFLAGS) $(SYSFLAGS) -c -o objects/sketch.o src/sketch.c
+
 .PHONY: clean cleanreqs
 
 f2c: 
@@ -28,6 +28,8 @@ K_STAT_MEAN <- 0
 K_STAT_MEDIAN <- -1
 K_STAT_STDDEV <- -2
 K_STAT_MAD <- -3
+K_STAT_IAT <- -4
+K_STAT_ESS <- -5
 K_STAT_QUART_25 <- 25
 K_STAT_QUART_50 <- 50
 K_STAT_QUART_75 <- 75
@@ -101,7 +103,18 @@ K_OPT_MCMC_VERBOSE_DIAGS <- 7
 K_OPT_MCMC_ACCRATIO <- 8
 K_OPT_MCMC_NMIN <- 9
 K_OPT_MCMC_SAVE_EVERY <- 40
+K_OPT_MCMC_ADAPTIVE <- 41
+K_OPT_MCMC_CHECKPOINT_EVERY <- 42
+K_OPT_MCMC_SWAP_EVERY <- 43
+K_OPT_MCMC_ADAPT_TEMPS <- 44
+K_OPT_MCMC_EVIDENCE <- 45
+K_OPT_MCMC_SURROGATE <- 46
+K_OPT_MCMC_SURROGATE_ACC <- 47
+K_OPT_MCMC_STREAM <- 48
 K_OPT_VERBOSE_DIAGS <- 7
+K_SURROGATE_NONE <- 0
+K_SURROGATE_KEPLER <- 1
+K_SURROGATE_LOOSE <- 2
 K_OPT_LM_MINCHI_PAR <- 10
 K_OPT_LM_HIGH_DF <- 11
 K_OPT_LM_MAX_ITER_AT_SCALE <- 12
@@ -115,9 +128,43 @@ K_OPT_DE_NP_FAC <- 31
 K_OPT_DE_F_MIN <- 32
 K_OPT_DE_F_MAX <- 33
 K_OPT_DE_USE_STEPS <- 34
+K_OPT_CMAES_POPSIZE <- 50
+K_OPT_CMAES_SIGMA <- 51
+K_OPT_CMAES_RESTARTS <- 52
+K_OPT_CMAES_BIPOP <- 53
+K_OPT_CMAES_TOLFUN <- 54
+K_OPT_LBFGS_MEMORY <- 60
+K_OPT_LBFGS_PGTOL <- 61
+K_OPT_LBFGS_FTOL <- 62
+K_OPT_LBFGS_CENTRAL <- 63
+K_OPT_GA_POPSIZE <- 70
+K_OPT_GA_TOURNAMENT <- 71
+K_OPT_GA_CROSSOVER <- 72
+K_OPT_GA_BLEND <- 73
+K_OPT_GA_MUTATION <- 74
+K_OPT_GA_MUTATION_SCALE <- 75
+K_OPT_GA_ELITE <- 76
+K_OPT_GA_STALL <- 77
+K_OPT_GA_POLISH <- 78
+K_OPT_ENSEMBLE_A <- 80
+K_OPT_ENSEMBLE_DE <- 81
+K_OPT_ENSEMBLE_INIT <- 82
+K_OPT_NESTED_SLICES <- 90
+K_OPT_NESTED_BATCH <- 91
+K_OPT_NESTED_TOL <- 92
+K_OPT_NESTED_EQUAL_WEIGHTS <- 93
+K_OPT_NUTS_TARGET_ACCEPT <- 100
+K_OPT_NUTS_MAX_DEPTH <- 101
+K_OPT_NUTS_DENSE <- 102
+K_OPT_NUTS_FD_STEP <- 103
+K_OPT_NUTS_INIT <- 104
 K_PROGRESS_CONTINUE <- 0
 K_PROGRESS_STOP <- 1
 K_PROGRESS_BREAK <- 2
+K_BUDGET_OK <- 0
+K_BUDGET_EVALS <- 1
+K_BUDGET_TIME <- 2
+K_BUDGET_TARGET <- 3
 K_TDS_PRIMARY <- 1
 K_TDS_SECONDARY <- 2
 K_DONE <- -1
@@ -127,6 +174,10 @@ K_LM <- 1
 K_DIFFEVOL <- 2
 K_SA <- 3
 K_GD <- 4
+K_CMAES <- 5
+K_LBFGSB <- 6
+K_GA <- 7
+K_MINIMIZERS_SIZE <- 16
 K_INTEGRATION_SUCCESS <- 0
 K_ELEMENT <- 0
 K_PARAMETER <- 1
@@ -151,6 +202,10 @@ K_PS_WIN <- 5
 K_PS_SIZE <- 6
 K_PS_TYPE_DATA <- 0
 K_PS_TYPE_RESIDUALS <- 1
+K_PS_METHOD_EXACT <- 0
+K_PS_METHOD_FAST <- 1
+K_PS_FAP_EMPIRICAL <- 0
+K_PS_FAP_GEV <- 1
 K_T_INAPPLICABLE <- -1
 K_T_STABLE <- 0
 K_T_UNSTABLE <- 1
@@ -170,6 +225,7 @@ K_GUI_RESERVED_1 <- 4096
 K_GUI_RESERVED_2 <- 8192
 K_GUI_RESERVED_3 <- 16384
 K_GUI_RESERVED_4 <- 32768
+K_SHARE_BUDGET <- 65536
 K_JACOBI <- 1024
 K_INTEGRATION_FAILURE_SMALL_TIMESTEP <- 2048
 K_INTEGRATION_FAILURE_INCREASE_TOLERANCE <- 4096
@@ -447,6 +503,28 @@ tryCatch({.lib <- dynbind(c("libsystemic.so", "libsystemic.dylib"), paste(sep=";
 "K_setMinFunc(pp)v",
 # ok_callback K_getMinFunc(ok_kernel* k)
 "K_getMinFunc(p)p",
+# void K_setGradFunc(ok_kernel* k, ok_callback2 f)
+"K_setGradFunc(pp)v",
+# ok_callback2 K_getGradFunc(ok_kernel* k)
+"K_getGradFunc(p)p",
+# void K_default_gradient(ok_kernel* k, double* grad)
+"K_default_gradient(p*d)v",
+# void K_setBudget(ok_kernel* k, unsigned long int maxEvals, double maxTime, double target)
+"K_setBudget(pLdd)v",
+# unsigned long int K_getBudgetEvals(ok_kernel* k)
+"K_getBudgetEvals(p)L",
+# double K_getBudgetElapsed(ok_kernel* k)
+"K_getBudgetElapsed(p)d",
+# int K_getBudgetStatus(ok_kernel* k)
+"K_getBudgetStatus(p)i",
+# ok_budget* K_getBudget(ok_kernel* k)
+"K_getBudget(p)*<ok_budget>",
+# ok_budget* ok_budget_alloc()
+"ok_budget_alloc()*<ok_budget>",
+# void ok_budget_set(ok_budget* b, unsigned long int maxEvals, double maxTime, double target)
+"ok_budget_set(*<ok_budget>Ldd)v",
+# void ok_budget_free(ok_budget* b)
+"ok_budget_free(*<ok_budget>)v",
 # void K_setElementSteps(ok_kernel* k, gsl_matrix* value)
 "K_setElementSteps(p*<gsl_matrix>)v",
 # gsl_matrix* K_getElementSteps(ok_kernel* k)
@@ -557,6 +635,8 @@ tryCatch({.lib <- dynbind(c("libsystemic.so", "libsystemic.dylib"), paste(sep=";
 "K_save_old(pZ)v",
 # void K_setSeed(ok_kernel* k, unsigned long int seed)
 "K_setSeed(pL)v",
+# void K_setRngStream(ok_kernel* k, unsigned long int seed, unsigned long int stream)
+"K_setRngStream(pLL)v",
 # void* ok_bridge_kernel_buf(void* buf, int n, ok_kernel* k)
 "ok_bridge_kernel_buf(pip)p",
 # ok_system* ok_alloc_system(int nplanets)
@@ -609,6 +689,16 @@ tryCatch({.lib <- dynbind(c("libsystemic.so", "libsystemic.dylib"), paste(sep=";
 "KL_load(*<FILE>i)*<ok_list>",
 # void KL_save(const ok_list* kl, FILE* out)
 "KL_save(*<ok_list>*<FILE>)v",
+# ok_list* KL_load_bin(FILE* fid, ok_kernel* prototype)
+"KL_load_bin(*<FILE>p)*<ok_list>",
+# bool KL_save_columns(const ok_list* kl, FILE* out)
+"KL_save_columns(*<ok_list>*<FILE>)B",
+# ok_list* KL_map(const char* file)
+"KL_map(Z)*<ok_list>",
+# bool KL_text_to_columns(const char* text, const char* columns)
+"KL_text_to_columns(ZZ)B",
+# bool KL_columns_to_text(const char* columns, const char* text)
+"KL_columns_to_text(ZZ)B",
 # void KL_append(ok_list* dest, ok_list* src)
 "KL_append(*<ok_list>*<ok_list>)v",
 # gsl_vector* KL_getParsStats(const ok_list* kl, const int what)
@@ -619,6 +709,14 @@ tryCatch({.lib <- dynbind(c("libsystemic.so", "libsystemic.dylib"), paste(sep=";
 "KL_getPars(*<ok_list>i)*<gsl_vector>",
 # gsl_matrix* KL_getElementsStats(const ok_list* kl, const int what)
 "KL_getElementsStats(*<ok_list>i)*<gsl_matrix>",
+# gsl_matrix* KL_getQuantiles(const ok_list* kl, const double* q, const int nq)
+"KL_getQuantiles(*<ok_list>*di)*<gsl_matrix>",
+# void KL_to_columns(ok_list* kl)
+"KL_to_columns(*<ok_list>)v",
+# gsl_matrix* KL_getTempStats(const ok_list* kl)
+"KL_getTempStats(*<ok_list>)*<gsl_matrix>",
+# bool KL_getEvidence(const ok_list* kl, double* ret)
+"KL_getEvidence(*<ok_list>*d)B",
 # ok_list_item* KL_set(ok_list* kl, const int idx, gsl_matrix* elements, gsl_vector* pars, double merit, int tag)
 "KL_set(*<ok_list>i*<gsl_matrix>*<gsl_vector>di)*<ok_list_item>",
 # int KL_getSize(const ok_list* kl)
@@ -639,16 +737,60 @@ tryCatch({.lib <- dynbind(c("libsystemic.so", "libsystemic.dylib"), paste(sep=";
 "K_mcmc_single(pIII*d*<ok_list>pi*i)*<ok_list>",
 # ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, unsigned int skip, unsigned int discard, const double params[], double Rstop, ok_callback2 merit_function)
 "K_mcmc_mult(pIIII*ddp)*<ok_list>",
+# ok_list* K_mcmc_resume(ok_kernel* k, const char* file, const double params[], double Rstop, ok_callback2 merit_function)
+"K_mcmc_resume(pZ*ddp)*<ok_list>",
 # double K_default_prior(ok_kernel* k)
 "K_default_prior(p)d",
 # void K_mcmc_likelihood_and_prior_default(ok_kernel* k, double* ret)
 "K_mcmc_likelihood_and_prior_default(p*d)v",
+# ok_list* K_mcmc_ensemble(ok_kernel* k, unsigned int nwalkers, unsigned int nsteps, unsigned int skip, unsigned int discard, const double params[], ok_callback2 merit_function)
+"K_mcmc_ensemble(pIIII*dp)*<ok_list>",
+# ok_list* K_nested(ok_kernel* k, unsigned int nlive, const double params[], ok_callback2 merit_function, double* ret)
+"K_nested(pI*dp*d)*<ok_list>",
+# ok_list* K_mcmc_nuts(ok_kernel* k, unsigned int nchains, unsigned int nsteps, unsigned int skip, unsigned int discard, const double params[], ok_callback2 merit_function)
+"K_mcmc_nuts(pIIII*dp)*<ok_list>",
+# ok_diag* ok_diag_alloc(const int nchains, const int npars, const bool* angle)
+"ok_diag_alloc(ii*B)*<ok_diag>",
+# void ok_diag_free(ok_diag* d)
+"ok_diag_free(*<ok_diag>)v",
+# void ok_diag_reset(ok_diag* d)
+"ok_diag_reset(*<ok_diag>)v",
+# void ok_diag_add(ok_diag* d, const int chain, const double* x)
+"ok_diag_add(*<ok_diag>i*d)v",
+# double ok_diag_count(const ok_diag* d, const int chain)
+"ok_diag_count(*<ok_diag>i)d",
+# double ok_diag_mean(const ok_diag* d, const int chain, const int par)
+"ok_diag_mean(*<ok_diag>ii)d",
+# double ok_diag_sd(const ok_diag* d, const int chain, const int par)
+"ok_diag_sd(*<ok_diag>ii)d",
+# double ok_diag_rhat(const ok_diag* d, const int par)
+"ok_diag_rhat(*<ok_diag>i)d",
+# double ok_diag_iat(const ok_diag* d, const int chain, const int par)
+"ok_diag_iat(*<ok_diag>ii)d",
+# double ok_diag_ess(const ok_diag* d, const int chain, const int par)
+"ok_diag_ess(*<ok_diag>ii)d",
 # ok_list* K_bootstrap(ok_kernel* k, int trials, int warmup, int malgo, int miter, double mparams[])
 "K_bootstrap(piiii*d)*<ok_list>",
+# ok_list* K_bootstrapTimed(ok_kernel* k, int trials, int warmup, int malgo, int miter, double mparams[], gsl_matrix* times)
+"K_bootstrapTimed(piiii*d*<gsl_matrix>)*<ok_list>",
+# ok_summary* K_bootstrapSummary(ok_kernel* k, int trials, int warmup, int malgo, int miter, double mparams[], int size)
+"K_bootstrapSummary(piiii*di)*<ok_summary>",
+# void KS_free(ok_summary* s)
+"KS_free(*<ok_summary>)v",
+# int KS_getSize(const ok_summary* s)
+"KS_getSize(*<ok_summary>)i",
+# int KS_getNplanets(const ok_summary* s)
+"KS_getNplanets(*<ok_summary>)i",
+# gsl_matrix* KS_getElementsStats(const ok_summary* s, const int what)
+"KS_getElementsStats(*<ok_summary>i)*<gsl_matrix>",
+# gsl_vector* KS_getParsStats(const ok_summary* s, const int what)
+"KS_getParsStats(*<ok_summary>i)*<gsl_vector>",
 # gsl_matrix* ok_periodogram_ls(const gsl_matrix* data, const unsigned int samples, const double Pmin, const double Pmax, const int method,         unsigned int timecol, unsigned int valcol, unsigned int sigcol, ok_periodogram_workspace* p)
 "ok_periodogram_ls(*<gsl_matrix>IddiIII*<ok_periodogram_workspace>)*<gsl_matrix>",
-# gsl_matrix* ok_periodogram_boot(const gsl_matrix* data, const unsigned int trials, const unsigned int samples,         const double Pmin, const double Pmax, const int method,         const unsigned int timecol, const unsigned int valcol, const unsigned int sigcol,         const unsigned long int seed, ok_periodogram_workspace* p, ok_progress prog)
-"ok_periodogram_boot(*<gsl_matrix>IIddiIIIL*<ok_periodogram_workspace>p)*<gsl_matrix>",
+# gsl_matrix* ok_periodogram_boot(const gsl_matrix* data, const unsigned int trials, const unsigned int samples,         const double Pmin, const double Pmax, const int method, const int fap,         const unsigned int timecol, const unsigned int valcol, const unsigned int sigcol,         const unsigned long int seed, ok_budget* budget, ok_periodogram_workspace* p, ok_progress prog)
+"ok_periodogram_boot(*<gsl_matrix>IIddiiIIIL*<ok_budget>*<ok_periodogram_workspace>p)*<gsl_matrix>",
+# gsl_matrix* ok_periodogram_gls(const gsl_matrix* data, const unsigned int samples, const double Pmin, const double Pmax,         const bool trend, unsigned int timecol, unsigned int valcol, unsigned int sigcol, int setcol,         ok_periodogram_workspace* p)
+"ok_periodogram_gls(*<gsl_matrix>IddBIIIi*<ok_periodogram_workspace>)*<gsl_matrix>",
 # gsl_matrix* ok_periodogram_full(ok_kernel* k, int type, int algo, bool circular, unsigned int sample,         const unsigned int samples, const double Pmin, const double Pmax)
 "ok_periodogram_full(piiBIIdd)*<gsl_matrix>",
 # int K_isMstable_coplanar(const gsl_matrix* alle)
@@ -747,6 +889,9 @@ SIMPLEX <- K_SIMPLEX
 LM <- K_LM
 SA <- K_SA
 DIFFEVOL <- K_DIFFEVOL
+CMAES <- K_CMAES
+LBFGSB <- K_LBFGSB
+GA <- K_GA
 
 ASTROCENTRIC <- K_ASTROCENTRIC
 JACOBI <- K_JACOBI
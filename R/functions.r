@@ -1221,7 +1221,7 @@ print.periodogram <- function(x, what='peaks') {
     cat(sprintf("\n# Trials: %d\n", attr(x, 'trials')))
 }
 
-kperiodogram <- function(k, per_type = "all", samples = getOption("systemic.psamples", 50000), pmin = getOption("systemic.pmin", 0.5), pmax = getOption("systemic.pmax", 1e4), data.flag = T_RV, timing.planet = NULL, val.col = SVAL, time.col = TIME, err.col = ERR, pred.col = PRED, plot = FALSE, print = FALSE, peaks = 25, add.noise=TRUE, window.cutoff=FALSE, .keep.h = FALSE) {
+kperiodogram <- function(k, per_type = "all", samples = getOption("systemic.psamples", 50000), pmin = getOption("systemic.pmin", 0.5), pmax = getOption("systemic.pmax", 1e4), data.flag = T_RV, timing.planet = NULL, val.col = SVAL, time.col = TIME, err.col = ERR, pred.col = PRED, plot = FALSE, print = FALSE, peaks = 25, add.noise=TRUE, window.cutoff=FALSE, method = getOption("systemic.pmethod", "exact"), offsets = getOption("systemic.poffsets", FALSE), trend = FALSE, set.col = SET, .keep.h = FALSE) {
   ## Returns a periodogram of the supplied time series. [7]
   #
   # If the first parameter is a kernel, then this function will return 
@@ -1261,6 +1261,18 @@ kperiodogram <- function(k, per_type = "all", samples = getOption("systemic.psam
   #	- plot: if TRUE, plot the periodogram after the calculation
   #	window
   # - print: if TRUE, pretty-prints the periodogram sorted by power.
+  # - method: "exact", or "fast" to compute all the frequencies at once
+  #	with FFTs (Press & Rybicki, 1989); "fast" is accurate to about 1e-6
+  #	and much faster for large datasets and many samples
+  # - offsets: if TRUE, computes a generalized periodogram (Zechmeister &
+  #	Kurster, 2009) that fits one offset per dataset together with the
+  #	sinusoid at each period, instead of subtracting the mean (method is 
+  #	then ignored). This is much faster than fitting the offsets with a
+  #	full minimization at each period.
+  # - trend: if TRUE, also fits a linear trend (generalized periodogram)
+  # - set.col: the column containing the dataset of each point (by
+  #	default, the SET column); if the matrix has no such column, a single
+  #	offset is fitted
   # 
   # Returns:
   #	 A matrix with columns containing, respectively: period, power 
@@ -1322,7 +1334,11 @@ kperiodogram <- function(k, per_type = "all", samples = getOption("systemic.psam
   stopifnot(nrow(d) > 0)
 
   m <- .R_to_gsl_matrix(d)
-  per <- ok_periodogram_ls(m, samples, pmin, pmax, 0, time.col-1, val.col-1, err.col-1, NULL)
+  if (offsets || trend)
+    per <- ok_periodogram_gls(m, samples, pmin, pmax, trend, time.col-1, val.col-1, err.col-1,
+                              if (offsets && set.col <= ncol(d)) set.col-1 else -1, NULL)
+  else
+    per <- ok_periodogram_ls(m, samples, pmin, pmax, .pmethod(method), time.col-1, val.col-1, err.col-1, NULL)
 
   if (samples > 1e4) {
     .periodogram.tol <- double(1)
@@ -1375,7 +1391,7 @@ kperiodogram <- function(k, per_type = "all", samples = getOption("systemic.psam
 }
 
 kperiodogram.boot <- function(k, per_type = "all", trials = 1e5, samples = getOption("systemic.psamples", 50000), pmin = getOption("systemic.pmin", 0.5), pmax = getOption("systemic.pmax", 1e4), data.flag = T_RV, timing.planet = NULL, val.col = SVAL, time.col = TIME, err.col = ERR, seed = sample(1:1e4, 1), plot = FALSE, print = FALSE,
-                             overplot.window=TRUE, peaks=25) {
+                             overplot.window=TRUE, peaks=25, method = getOption("systemic.pmethod", "exact"), fap = "empirical", budget = NULL) {
   ## Returns a periodogram of the supplied time series, where the false alarm probabilities are estimated using a bootstrap method. [7]
   #
   # If the first parameter is a kernel, then this function will return 
@@ -1399,6 +1415,15 @@ kperiodogram.boot <- function(k, per_type = "all", trials = 1e5, samples = getOp
   #	- trials: number of periodograms to use in the boostrap estimation
   #	- samples: number of periods (frequencies) at which to sample the
   #	periodogram
+  #	- method: "exact" or "fast", used for all the periodograms (see @kperiodogram)
+  #	- fap: "empirical" (fraction of the trials whose maximum power exceeds
+  #	the power) or "gev" (tail of a generalized extreme-value distribution
+  #	fitted to the maximum powers of the trials, which can estimate FAPs
+  #	much smaller than 1/trials, e.g. with a few hundred trials)
+  #	- budget: a named vector c(evals=..., time=...) limiting the number of
+  #	trials and the wall-clock time in seconds (see @`kbudget<-`); the FAPs
+  #	are estimated from the trials completed within the budget. If NULL and
+  #	k is a kernel, the budget of the kernel is used
   #
   # Returns:
   #	A matrix with columns containing, respectively: period, power 
@@ -1455,7 +1480,17 @@ kperiodogram.boot <- function(k, per_type = "all", trials = 1e5, samples = getOp
   
   m <- .R_to_gsl_matrix(d)
 
-  per <- ok_periodogram_boot(m, trials, samples, pmin, pmax, 0, time.col-1, val.col-1, err.col-1, seed, NULL, if (class(k) == "kernel") K_getProgress(k$h) else NULL)
+  b <- NULL
+  if (!is.null(budget)) {
+    b <- ok_budget_alloc()
+    v <- .budget(budget)
+    ok_budget_set(b, v[1], v[2], v[3])
+  } else if (class(k) == "kernel")
+    b <- K_getBudget(k$h)
+  
+  per <- ok_periodogram_boot(m, trials, samples, pmin, pmax, .pmethod(method), .pfap(fap), time.col-1, val.col-1, err.col-1, seed, b, NULL, if (class(k) == "kernel") K_getProgress(k$h) else NULL)
+  if (!is.null(budget))
+    ok_budget_free(b)
   .job <<- "Bootstrap periodogram"
 
 
@@ -1486,6 +1521,7 @@ kperiodogram.boot <- function(k, per_type = "all", trials = 1e5, samples = getOp
   attr(m, 'pmax') <- pmax
   attr(m, 'samples') <- samples
   attr(m, 'trials') <- trials
+  attr(m, 'fap') <- fap
   attr(m, 'resampled') <- resampled
 
   if (plot)
@@ -1602,7 +1638,10 @@ kflags <- function(k, what = "all", type='standard') {
 
 kminimize <- function(k, iters = 5000, algo = NA, de.CR = 0.2,
                       de.NPfac = 10, de.Fmin = 0.5, de.Fmax = 1.0, de.use.steps = FALSE,
-                      sa.T0 = k$chi2, sa.alpha=2, sa.auto=TRUE, sa.chains=4, repeat.steps = 10, verbose.diags=0) {
+                      sa.T0 = k$chi2, sa.alpha=2, sa.auto=TRUE, sa.chains=4,
+                      cmaes.popsize = 0, cmaes.sigma = 0.3, cmaes.restarts = 9, cmaes.bipop = FALSE,
+                      ga.popsize = 0, ga.mutation.scale = 100, ga.stall = 50, ga.polish = 5000,
+                      repeat.steps = 10, verbose.diags=0) {
   ## Minimizes the chi^2 of the fit. [3]
   #
   # kminimize uses one of the built-in algorithms to minimize the
@@ -1610,12 +1649,19 @@ kminimize <- function(k, iters = 5000, algo = NA, de.CR = 0.2,
   #
   # - SIMPLEX uses the Nelder-Meade algorithm (as implemented in GSL)
   # to search for a local minimum.
-  # - LM uses the Levenberg-Marquardt algorithm (as implemented in GSL)
-  # to search for a local minimum.
+  # - LM uses the Levenberg-Marquardt algorithm (with a finite-difference
+  # Jacobian computed in parallel) to search for a local minimum.
   # - SA uses a simple implementation of the simulated annealing
   # algorithm.
   # - DE uses a simple implementation of the differential evolution
   # algorithm.
+  # - CMAES uses the covariance matrix adaptation evolution strategy,
+  # with IPOP or BIPOP restarts.
+  # - LBFGSB uses a limited-memory quasi-Newton method with box constraints
+  # (the parameter ranges), using analytic derivatives where available.
+  # - GA uses a genetic algorithm (tournament selection, blend crossover
+  # and mutations scaled by the parameter steps), followed by a simplex run.
+  # It is a native (and parallel) replacement for kminimize.genoud.
   #
   # The minimization algorithms may use the parameter steps set by
   # @kstep as initial scale parameters to explore the chi^2 landscape.
@@ -1626,13 +1672,23 @@ kminimize <- function(k, iters = 5000, algo = NA, de.CR = 0.2,
   # Args:
   # - k: kernel to minimize
   # - iters: maximum number of iterations
-  # - algo: one of SIMPLEX, LM, SA or DE. If none is specified, uses
+  # - algo: one of SIMPLEX, LM, SA, DE, CMAES, LBFGSB or GA. If none is specified, uses
   # the value in k$min.method
   # - sa.T0: for SA, the initial temperature of the annealer
   # - sa.alpha: the index of the annealer (T = T0 (1 - (n/N)^alpha))
   # - sa.auto: automatically derive steps that produce a variation of chi^2 = 10% T0
   # - de.CR: crossover probability for DE
   # - de.Fmin, de.Fmax: differential weight for DE
+  # - cmaes.popsize: initial population size for CMAES (0 = 4 + 3 log(N))
+  # - cmaes.sigma: initial step size for CMAES, as a fraction of the range of each parameter
+  # - cmaes.restarts: maximum number of restarts for CMAES
+  # - cmaes.bipop: if TRUE, alternates large and small population restarts (BIPOP), otherwise
+  # doubles the population at each restart (IPOP, the default, as in the C library)
+  # - ga.popsize: population size for GA (0 = 10 times the number of parameters)
+  # - ga.mutation.scale: width of the mutations of GA at the first generation, in units of the
+  # parameter steps (decreasing to one step at the last generation)
+  # - ga.stall: GA stops after this many generations without improvement
+  # - ga.polish: maximum number of iterations of the final simplex run of GA (0 = skip it)
   # - repeat.steps: repeats the minimization algorithm if there is a change in chi^2 for max number of steps
   
   .check_kernel(k)
@@ -1649,7 +1705,11 @@ kminimize <- function(k, iters = 5000, algo = NA, de.CR = 0.2,
            K_OPT_DE_CR, de.CR, K_OPT_DE_NP_FAC, de.NPfac,
            K_OPT_DE_F_MIN, de.Fmin, K_OPT_DE_F_MAX, de.Fmax,
            K_OPT_VERBOSE_DIAGS, verbose.diags,
-           K_OPT_DE_USE_STEPS, if (de.use.steps) 1 else 0, K_DONE)
+           K_OPT_DE_USE_STEPS, if (de.use.steps) 1 else 0,
+           K_OPT_CMAES_POPSIZE, cmaes.popsize, K_OPT_CMAES_SIGMA, cmaes.sigma,
+           K_OPT_CMAES_RESTARTS, cmaes.restarts, K_OPT_CMAES_BIPOP, if (cmaes.bipop) 1 else 0,
+           K_OPT_GA_POPSIZE, ga.popsize, K_OPT_GA_MUTATION_SCALE, ga.mutation.scale,
+           K_OPT_GA_STALL, ga.stall, K_OPT_GA_POLISH, ga.polish, K_DONE)
   
   .job <<- "Minimization"
   stopifnot(k$ndata > 0)
@@ -1827,6 +1887,55 @@ kranges <- function(k) {
   return(list(min=min, max=max))
 }
 
+kbudget <- function(k) {
+  ## Returns the computational budget used by the last run. [2]
+  #
+  # Returns a list containing the number of evaluations of the model
+  # (evals), the elapsed wall-clock time in seconds (elapsed) and the limit
+  # that stopped the run (status: "ok", "evals", "time" or "target").
+  #
+  # See @`kbudget<-`.
+  .check_kernel(k)
+  
+  return(list(evals=K_getBudgetEvals(k$h), elapsed=K_getBudgetElapsed(k$h),
+              status=c("ok", "evals", "time", "target")[K_getBudgetStatus(k$h) + 1]))
+}
+
+`kbudget<-` <- function(k, value) {
+  ## Sets the computational budget of the kernel. [2]
+  #
+  # The budget limits every run of kminimize, kmcmc, kbootstrap and
+  # kperiodogram.boot; the run
+  # is stopped (returning the results computed so far) once any of the limits
+  # is reached.
+  #
+  # Args:
+  # - k: kernel
+  # - value: a named vector c(evals=..., time=..., target=...), where evals is the
+  # maximum number of evaluations of the model, time is the maximum wall-clock time
+  # in seconds and target is a value of the merit function that stops the run once
+  # reached. Missing or NA entries are not enforced.
+  #
+  # Example:
+  # kbudget(k) <- c(time=60) # Stop minimizations after one minute
+  # kbudget(k) <- c(evals=1e5, target=1.1)
+  .check_kernel(k)
+  
+  v <- .budget(value)
+  K_setBudget(k$h, v[1], v[2], v[3])
+  
+  return(k)
+}
+
+.budget <- function(value) {
+  # Limits (evals, time, target) of a budget from a named vector; missing or NA
+  # entries are not enforced
+  evals <- if (is.na(value['evals'])) 0 else value['evals']
+  time <- if (is.na(value['time'])) 0 else value['time']
+  target <- if (is.na(value['target'])) NaN else value['target']
+  return(c(evals, time, target))
+}
+
 ksteps <- function(k, row, column) {
   .check_kernel(k)
   
@@ -2046,7 +2155,7 @@ kdeactivate <- function(k, row = "all", column = "all") {
     kupdate(k, calculate=TRUE)	
 }
 
-kbootstrap <- function(k, algo = NA, trials = 5000, warmup = 0, min_iter = 2000, plot = FALSE, print = FALSE, save=NA) {
+kbootstrap <- function(k, algo = NA, trials = 5000, warmup = 0, min_iter = 2000, plot = FALSE, print = FALSE, save=NA, summary = FALSE, sketch = 0) {
   ## Runs the bootstrap routine on the given kernel. [4]
   #
   # This function runs the bootstrap algorithm to estimate the
@@ -2058,6 +2167,12 @@ kbootstrap <- function(k, algo = NA, trials = 5000, warmup = 0, min_iter = 2000,
   # - trials: the number of resampling trials
   # - plot: plots the resulting uncertainty object
   # - print: prints the resulting uncertainty object
+  # - summary: if TRUE, the trials are not stored; only their statistics are
+  #   returned (best fit, median, MAD, mean and standard deviation of each element
+  #   and parameter), using memory independent of the number of trials. Medians and
+  #   MADs are approximated by quantile sketches.
+  # - sketch: size of the quantile sketches of the summary (0 for the default; the
+  #   rank error is roughly 2/sketch)
   .check_kernel(k)
   stopifnot(k$ndata > 0)
   
@@ -2065,12 +2180,20 @@ kbootstrap <- function(k, algo = NA, trials = 5000, warmup = 0, min_iter = 2000,
 
   if (is.na(algo))
     algo <- k$min.method
+
+  if (summary)
+    return(.kbootstrap.summary(k, algo, trials, warmup, min_iter, sketch, save))
   
-  kl <- K_bootstrap(k$h, trials, warmup, algo, min_iter, NULL)
+  times <- gsl_matrix_alloc(trials, 2)
+  kl <- K_bootstrapTimed(k$h, trials, warmup, algo, min_iter, NULL, times)
+  times <- .gsl_matrix_to_R(times, free = TRUE)
   if (is.nullptr(kl)) {
     return(NULL)
   } else {
     a <- .klnew(kl, k, type="bootstrap", desc=sprintf("algo = %d, trials = %d", algo, trials))
+    # Duration of each trial and time spent in the minimizer (in seconds)
+    colnames(times) <- c("total", "minimizer")
+    a$trial.time <- times
     if (plot)
       plot(a)
     if (print)
@@ -2081,6 +2204,51 @@ kbootstrap <- function(k, algo = NA, trials = 5000, warmup = 0, min_iter = 2000,
   }
 }
 
+.kbootstrap.summary <- function(k, algo, trials, warmup, min_iter, sketch, save) {
+  ks <- K_bootstrapSummary(k$h, trials, warmup, algo, min_iter, NULL, sketch)
+  if (is.nullptr(ks))
+    return(NULL)
+
+  np <- KS_getNplanets(ks)
+  .stats <- function(what) .gsl_matrix_to_R(KS_getElementsStats(ks, what), free = TRUE)
+  .pstats <- function(what) .gsl_vector_to_R(KS_getParsStats(ks, what), free = TRUE)
+  .els <- kallels(k)
+  .pars <- kpars(k)
+  .names <- c(.kl.stats.names, "mean", "sd")
+  els <- list(.stats(K_STAT_MEDIAN), .stats(K_STAT_MAD), .stats(K_STAT_MEAN), .stats(K_STAT_STDDEV))
+  pars <- list(.pstats(K_STAT_MEDIAN), .pstats(K_STAT_MAD), .pstats(K_STAT_MEAN), .pstats(K_STAT_STDDEV))
+  
+  b <- list()
+  stats <- list()
+  if (np > 0) {
+    for (i in 1:np) {
+      stats[[i]] <- cbind(.els[i, ], sapply(els, function(m) m[i+1, ]))
+      rownames(stats[[i]]) <- .allelements
+      colnames(stats[[i]]) <- .names
+    }
+  }
+  b$stats <- stats
+  b$params.stats <- cbind(.pars, sapply(pars, function(v) v[1:PARAMS_SIZE]))
+  rownames(b$params.stats) <- .params
+  colnames(b$params.stats) <- .names
+  b$merit.stats <- sapply(pars, function(v) v[PARAMS_SIZE+1])
+  names(b$merit.stats) <- .names[-1]
+
+  b$nplanets <- np
+  b$size <- KS_getSize(ks)
+  b$nsets <- k$nsets
+  b$fit.els <- .els
+  b$fit.params <- .pars
+  b$type <- "bootstrap.summary"
+  b$desc <- sprintf("algo = %d, trials = %d", algo, trials)
+  b$date <- date()
+  KS_free(ks)
+
+  if (!is.na(save))
+    save(b, file=save)
+  return(b)
+}
+
 K_LIMITS <- list()
 K_LIMITS[[PER]] <- c(1e-2, 4e4)
 K_LIMITS[[MASS]] <- c(1e-2, 100)
@@ -2091,9 +2259,26 @@ K_LIMITS[[INC]] <- c(0, 360)
 K_LIMITS[[NODE]] <- c(0, 360)
 K_LIMITS[['par']] <- c(-100, 100)
 
+.pmethod <- function(method) {
+  switch(method, exact = K_PS_METHOD_EXACT, fast = K_PS_METHOD_FAST,
+         stop("method should be one of 'exact' or 'fast'"))
+}
+
+.pfap <- function(fap) {
+  switch(fap, empirical = K_PS_FAP_EMPIRICAL, gev = K_PS_FAP_GEV,
+         stop("fap should be one of 'empirical' or 'gev'"))
+}
+
+.surrogate <- function(surrogate) {
+  switch(surrogate, none = K_SURROGATE_NONE, kepler = K_SURROGATE_KEPLER, loose = K_SURROGATE_LOOSE,
+         stop("surrogate should be one of 'none', 'kepler' or 'loose'"))
+}
+
 kmcmc <- function(k, chains= 2, temps = 1, start = "perturb", noise=TRUE, skip.first = 1000, discard = k$nrpars * 10, R.stop = 1.1, 
                   min.length = 5000, max.iters = -1, auto.steps = TRUE, acc.ratio = 0.44, plot = FALSE, print = FALSE, save=NA,
-                  debug.verbose.level = 1, random.log=TRUE, save.every=0) {
+                  debug.verbose.level = 1, random.log=TRUE, save.every=0, adaptive=0, checkpoint.every=0,
+                  temp.fac = NA, swap.every = 50 * discard, adapt.temps = 100, evidence = FALSE,
+                  surrogate = "none", surrogate.acc = 100, stream = 0) {
   ## Runs the MCMC routine on the given kernel. [4]
   #
   # This function runs a simple implementation of MCMC on the kernel
@@ -2102,17 +2287,41 @@ kmcmc <- function(k, chains= 2, temps = 1, start = "perturb", noise=TRUE, skip.f
   # Args:
   # - k: the kernel to run bootstrap on, or a list of kernels with different parameters which represent the starting initial conditions.
   # - chains: number of chains to run in parallel
+  # - temps: number of temperatures of each chain (parallel tempering); only the coldest chains are returned
   # - skip.first: discard the first iterations
   # - R.stop: the Gelman-Rubin statistic used to estimate when to stop the routine.
   # - discard: only retain every n-th element of the chain
   # - min.length: minimum number of iterations
   # - acc.ratio: the acceptance ratio
+  # - adaptive: if > 0, after the step sizes are computed the chains propose joint moves
+  #   using their running covariance (adaptive Metropolis), starting after max(adaptive, 10 * nr. of parameters) steps
+  # - checkpoint.every: if > 0, saves the state of the run to "mcmc_checkpoint.bin" every n convergence checks
+  #   (see kmcmc.resume); cannot be combined with stream
+  # - temp.fac: initial spacing of the inverse temperatures (1, 1 - temp.fac, ...); by default 0.9 / temps,
+  #   or (1 - j / (temps - 1))^(1/0.3) with evidence = TRUE
+  # - swap.every: number of steps between swaps of adjacent temperatures
+  # - adapt.temps: if > 0, the temperatures are adapted to equalize the swap rates, with a gain
+  #   decaying over adapt.temps swap batches
+  # - evidence: if TRUE (and temps > 1), the hottest chains sample the prior and the log-evidence
+  #   is estimated by thermodynamic integration and stepping stone (returned as $evidence = c(logZ, err,
+  #   logZ.ss, err.ss)); the statistics of each temperature are returned as $temps. The prior must
+  #   be proper: every free parameter but the angles needs a range (see krange; noise parameters
+  #   only need a maximum), otherwise NULL is returned
+  # - surrogate: "kepler" or "loose" enables delayed acceptance for N-body kernels: each proposal is
+  #   first screened with the Keplerian model ("kepler") or with the integrator at accuracy loosened by
+  #   surrogate.acc ("loose"), and only the proposals that pass are integrated in full; the chains
+  #   still sample the exact posterior
+  # - stream: if > 0, the chains are written to "mcmc_chain_0.bin", ... as they grow, and only their
+  #   last 'stream' samples are kept in memory (and returned); see kmcmc.load. Checkpoints are not
+  #   written when streaming, so stream > 0 and checkpoint.every > 0 are an error
   # - print: prints the resulting uncertainty object
   # - plot: plots the resulting uncertainty object
   .job <<- "MCMC"
 
   stopifnot(discard > 1)
-  stopifnot(temps == 1)
+  stopifnot(temps >= 1)
+  if (stream > 0 && checkpoint.every > 0)
+    stop("checkpoint.every cannot be used with stream > 0 (no checkpoints are written when streaming)")
   
   ka <- list()
   if (class(k) == "kernel") {
@@ -2177,6 +2386,15 @@ kmcmc <- function(k, chains= 2, temps = 1, start = "perturb", noise=TRUE, skip.f
             K_OPT_MCMC_ACCRATIO, acc.ratio,
             K_OPT_MCMC_SKIP_STEPS, if (auto.steps) 0 else 1,
             K_OPT_MCMC_SAVE_EVERY, save.every,
+            K_OPT_MCMC_ADAPTIVE, adaptive,
+            K_OPT_MCMC_CHECKPOINT_EVERY, checkpoint.every,
+            if (is.na(temp.fac)) NULL else c(K_OPT_MCMC_TEMPFAC, temp.fac),
+            K_OPT_MCMC_SWAP_EVERY, swap.every,
+            K_OPT_MCMC_ADAPT_TEMPS, adapt.temps,
+            K_OPT_MCMC_EVIDENCE, if (evidence) 1 else 0,
+            K_OPT_MCMC_SURROGATE, .surrogate(surrogate),
+            K_OPT_MCMC_SURROGATE_ACC, surrogate.acc,
+            K_OPT_MCMC_STREAM, stream,
             DONE)
   
   kl <- K_mcmc_mult(kbuf, chains, temps, skip.first, discard, opts, R.stop, NULL)
@@ -2186,8 +2404,21 @@ kmcmc <- function(k, chains= 2, temps = 1, start = "perturb", noise=TRUE, skip.f
     return(NULL)
   } else {
     ok_bridge_kernel_buf(kbuf, -chains, NULL);		
+    ts <- KL_getTempStats(kl)
+    if (! is.nullptr(ts)) {
+      temps.stats <- .gsl_matrix_to_R(ts)
+      colnames(temps.stats) <- c("beta", "swaps.attempted", "swaps.accepted", "swap.prob", "loglik", "loglik.err",
+                                 "log.ss.ratio", "log.ss.ratio.err", "loglik.var")
+      Z <- numeric(4)
+      if (! KL_getEvidence(kl, Z))
+        Z <- NULL
+    }
     a <- .klnew(kl, k, type="mcmc", desc=sprintf("chains = %d, R.stop = %e, start = %s, noise=%s, skip = %d, discard = %d, tot. length = %d", chains, R.stop, start, 
                                                  noise, skip.first, discard, KL_getSize(kl)), flags=kflags(ka[[1]], 'par'))
+    if (! is.nullptr(ts)) {
+      a$temps <- temps.stats
+      a$evidence <- Z
+    }
     
     if (plot)
       plot(a)
@@ -2199,6 +2430,269 @@ kmcmc <- function(k, chains= 2, temps = 1, start = "perturb", noise=TRUE, skip.f
   }
 }
 
+kmcmc.resume <- function(k, file = "mcmc_checkpoint.bin", R.stop = 1.1, min.length = 5000, max.iters = -1, acc.ratio = 0.44,
+                         auto.steps = TRUE, noise = TRUE, plot = FALSE, print = FALSE, save = NA, debug.verbose.level = 1,
+                         save.every = 0, adaptive = 0, checkpoint.every = 0, swap.every = NA, adapt.temps = 100,
+                         evidence = FALSE, surrogate = "none", surrogate.acc = 100, stream = 0) {
+  ## Continues an interrupted kmcmc run from its checkpoint. [4]
+  #
+  # The number of chains, skip.first and discard are read from the checkpoint;
+  # the other arguments should match the ones of the interrupted run.
+  #
+  # Args:
+  # - k: the kernel passed to the interrupted kmcmc run
+  # - file: the checkpoint written by kmcmc with checkpoint.every > 0
+  # - (other arguments as in kmcmc; stream > 0 cannot be combined with checkpoint.every > 0)
+  .job <<- "MCMC"
+  .check_kernel(k)
+  stopifnot(k$ndata > 0)
+  if (stream > 0 && checkpoint.every > 0)
+    stop("checkpoint.every cannot be used with stream > 0 (no checkpoints are written when streaming)")
+
+  k2 <- kclone(k)
+  if (noise)
+    for (j in 1:k$nsets) kselect(k2, 'par', j + DATA_SETS_SIZE)
+  K_setProgress(k2$h, K_getProgress(k$h))
+
+  opts <- c(K_OPT_MCMC_NSTOP, max.iters,
+            K_OPT_MCMC_NMIN, min.length,
+            K_OPT_MCMC_VERBOSE_DIAGS, debug.verbose.level,
+            K_OPT_MCMC_ACCRATIO, acc.ratio,
+            K_OPT_MCMC_SKIP_STEPS, if (auto.steps) 0 else 1,
+            K_OPT_MCMC_SAVE_EVERY, save.every,
+            K_OPT_MCMC_ADAPTIVE, adaptive,
+            K_OPT_MCMC_CHECKPOINT_EVERY, checkpoint.every,
+            if (is.na(swap.every)) NULL else c(K_OPT_MCMC_SWAP_EVERY, swap.every),
+            K_OPT_MCMC_ADAPT_TEMPS, adapt.temps,
+            K_OPT_MCMC_EVIDENCE, if (evidence) 1 else 0,
+            K_OPT_MCMC_SURROGATE, .surrogate(surrogate),
+            K_OPT_MCMC_SURROGATE_ACC, surrogate.acc,
+            K_OPT_MCMC_STREAM, stream,
+            DONE)
+  kl <- K_mcmc_resume(k2$h, path.expand(file), opts, R.stop, NULL)
+  if (is.nullptr(kl))
+    return(NULL)
+
+  ts <- KL_getTempStats(kl)
+  if (! is.nullptr(ts)) {
+    temps.stats <- .gsl_matrix_to_R(ts)
+    colnames(temps.stats) <- c("beta", "swaps.attempted", "swaps.accepted", "swap.prob", "loglik", "loglik.err",
+                               "log.ss.ratio", "log.ss.ratio.err", "loglik.var")
+    Z <- numeric(4)
+    if (! KL_getEvidence(kl, Z))
+      Z <- NULL
+  }
+  a <- .klnew(kl, k, type="mcmc", desc=sprintf("resumed from %s, R.stop = %e, noise=%s, tot. length = %d", file, R.stop,
+                                               noise, KL_getSize(kl)), flags=kflags(k2, 'par'))
+  if (! is.nullptr(ts)) {
+    a$temps <- temps.stats
+    a$evidence <- Z
+  }
+  if (plot)
+    plot(a)
+  if (print)
+    print(a)
+  if (!is.na(save))
+    save(a, file=save)
+  return(a)
+}
+
+kmcmc.load <- function(k, files = Sys.glob("mcmc_chain_*.bin"), print = FALSE) {
+  ## Loads the chains written by kmcmc with stream > 0. [4]
+  #
+  # The files can also be loaded while kmcmc is still running.
+  #
+  # Args:
+  # - k: the kernel passed to kmcmc
+  # - files: the chain files to load (by default, all the chains in the working directory)
+  # - print: prints the resulting uncertainty object
+  .check_kernel(k)
+  stopifnot(length(files) > 0)
+
+  kl <- NULL
+  for (file in files) {
+    fid <- fopen(path.expand(file), "rb")
+    if (is.nullptr(fid))
+      stop(paste("Could not open file ", file))
+    kl2 <- KL_load_bin(fid, K_clone(k$h))
+    fclose(fid)
+    if (is.nullptr(kl2))
+      stop(paste("Could not parse file ", file))
+    if (is.null(kl))
+      kl <- kl2
+    else
+      KL_append(kl, kl2)
+  }
+
+  a <- .klnew(kl, k, type="mcmc", desc=sprintf("loaded from %s, tot. length = %d", paste(files, collapse=", "),
+                                               KL_getSize(kl)))
+  if (print)
+    print(a)
+  return(a)
+}
+
+kmcmc.ensemble <- function(k, walkers = 4 * k$nrpars, steps = 5000, skip.first = 1000, discard = 10, a = 2, de.frac = 0,
+                           init.scale = 1, noise = TRUE, plot = FALSE, print = FALSE, save = NA, debug.verbose.level = 0) {
+  ## Runs the affine-invariant ensemble sampler on the kernel. [4]
+  #
+  # This function samples the posterior with an ensemble of walkers moved
+  # with stretch (and, optionally, differential-evolution) moves. No
+  # step sizes need to be tuned; the steps of the kernel are only used to
+  # scatter the walkers around the starting point.
+  #
+  # Args:
+  # - k: the kernel to run the sampler on
+  # - walkers: number of walkers (at least twice the number of parameters)
+  # - steps: number of steps of the ensemble after the burn-in
+  # - skip.first: discard the first steps of the ensemble (burn-in)
+  # - discard: only retain every n-th step of the ensemble
+  # - a: scale parameter of the stretch move
+  # - de.frac: fraction of differential-evolution moves
+  # - init.scale: width of the initial ball of walkers, in units of the steps
+  # - print: prints the resulting uncertainty object
+  # - plot: plots the resulting uncertainty object
+  .job <<- "MCMC"
+  .check_kernel(k)
+  stopifnot(k$ndata > 0)
+  stopifnot(discard >= 1)
+
+  k2 <- kclone(k)
+  if (noise)
+    for (j in 1:k$nsets) kselect(k2, 'par', j + DATA_SETS_SIZE)
+  K_setProgress(k2$h, K_getProgress(k$h))
+
+  opts <- c(K_OPT_ENSEMBLE_A, a, K_OPT_ENSEMBLE_DE, de.frac, K_OPT_ENSEMBLE_INIT, init.scale,
+            K_OPT_MCMC_VERBOSE_DIAGS, debug.verbose.level, K_DONE)
+  kl <- K_mcmc_ensemble(k2$h, walkers, steps, skip.first, discard, opts, NULL)
+  if (is.nullptr(kl))
+    return(NULL)
+
+  ens <- .klnew(kl, k, type="mcmc", desc=sprintf("ensemble, walkers = %d, a = %e, de.frac = %e, noise=%s, skip = %d, discard = %d, tot. length = %d",
+                                             max(walkers, 2 * k2$nrpars), a, de.frac, noise, skip.first, discard, KL_getSize(kl)),
+              flags=kflags(k2, 'par'))
+  if (plot)
+    plot(ens)
+  if (print)
+    print(ens)
+  if (!is.na(save))
+    save(ens, file=save)
+  return(ens)
+}
+
+kmcmc.nuts <- function(k, chains = 4, steps = 2000, skip.first = 1000, discard = 1, target.accept = 0.8, max.depth = 10,
+                       dense = FALSE, fd.step = 1e-4, init.scale = 1, noise = TRUE, plot = FALSE, print = FALSE, save = NA,
+                       debug.verbose.level = 0) {
+  ## Runs the No-U-Turn (Hamiltonian Monte Carlo) sampler on the kernel. [4]
+  #
+  # This function samples the posterior with the No-U-Turn sampler, using
+  # the gradient of the posterior (analytic where the gradient function of
+  # the kernel provides it, numerical otherwise). The step size and the mass
+  # matrix are adapted during the warm-up (skip.first steps); the chains run
+  # in parallel.
+  #
+  # Args:
+  # - k: the kernel to run the sampler on
+  # - chains: number of chains
+  # - steps: number of steps of each chain after the warm-up
+  # - skip.first: number of warm-up steps (discarded)
+  # - discard: only retain every n-th step of each chain
+  # - target.accept: target acceptance statistic of the step size adaptation
+  # - max.depth: maximum depth of the trajectory trees (at most 2^max.depth steps)
+  # - dense: if TRUE, adapts a dense mass matrix (otherwise, a diagonal one)
+  # - fd.step: finite-difference step, in units of the steps of the parameters
+  # - init.scale: width of the initial ball of chains, in units of the steps
+  # - print: prints the resulting uncertainty object
+  # - plot: plots the resulting uncertainty object
+  .job <<- "MCMC"
+  .check_kernel(k)
+  stopifnot(k$ndata > 0)
+  stopifnot(discard >= 1)
+
+  k2 <- kclone(k)
+  if (noise)
+    for (j in 1:k$nsets) kselect(k2, 'par', j + DATA_SETS_SIZE)
+  K_setProgress(k2$h, K_getProgress(k$h))
+
+  opts <- c(K_OPT_NUTS_TARGET_ACCEPT, target.accept, K_OPT_NUTS_MAX_DEPTH, max.depth,
+            K_OPT_NUTS_DENSE, if (dense) 1 else 0, K_OPT_NUTS_FD_STEP, fd.step, K_OPT_NUTS_INIT, init.scale,
+            K_OPT_MCMC_VERBOSE_DIAGS, debug.verbose.level, K_DONE)
+  kl <- K_mcmc_nuts(k2$h, chains, steps, skip.first, discard, opts, NULL)
+  if (is.nullptr(kl))
+    return(NULL)
+
+  nuts <- .klnew(kl, k, type="mcmc", desc=sprintf("NUTS, chains = %d, target.accept = %e, dense = %s, noise=%s, skip = %d, discard = %d, tot. length = %d",
+                                              chains, target.accept, dense, noise, skip.first, discard, KL_getSize(kl)),
+                 flags=kflags(k2, 'par'))
+  if (plot)
+    plot(nuts)
+  if (print)
+    print(nuts)
+  if (!is.na(save))
+    save(nuts, file=save)
+  return(nuts)
+}
+
+knested <- function(k, live = 25 * k$nrpars, slices = NA, batch = NA, tol = 0.01, equal.weights = FALSE,
+                    noise = TRUE, plot = FALSE, print = FALSE, save = NA, debug.verbose.level = 0) {
+  ## Runs nested sampling on the kernel, for the evidence and the posterior. [4]
+  #
+  # This function computes the evidence and samples the posterior in a single
+  # run. Parameters are drawn from their ranges (log-uniform for periods,
+  # masses and noise parameters with a positive minimum, uniform otherwise;
+  # the defaults of the default prior are used for parameters without a
+  # range, and angles always span [0, 360]). This distribution is also the
+  # prior of the evidence, so the ranges should be set explicitly.
+  #
+  # Args:
+  # - k: the kernel to run the sampler on
+  # - live: number of live points
+  # - slices: slice sampling steps per new point (NA for max(3 x number of parameters, 5))
+  # - batch: points replaced at each iteration (NA for the number of threads)
+  # - tol: stop when the live points can change log(Z) by less than tol
+  # - equal.weights: if TRUE, returns equally weighted samples; otherwise,
+  #   all the samples with their weights (in $weights)
+  # - print: prints the resulting uncertainty object
+  # - plot: plots the resulting uncertainty object
+  #
+  # Returns an uncertainty object, with $evidence = c(logZ, logZ.err, H)
+  .job <<- "MCMC"
+  .check_kernel(k)
+  stopifnot(k$ndata > 0)
+
+  k2 <- kclone(k)
+  if (noise)
+    for (j in 1:k$nsets) kselect(k2, 'par', j + DATA_SETS_SIZE)
+  K_setProgress(k2$h, K_getProgress(k$h))
+
+  opts <- c(K_OPT_NESTED_TOL, tol, K_OPT_NESTED_EQUAL_WEIGHTS, if (equal.weights) 1 else 0,
+            K_OPT_MCMC_VERBOSE_DIAGS, debug.verbose.level)
+  if (!is.na(slices))
+    opts <- c(opts, K_OPT_NESTED_SLICES, slices)
+  if (!is.na(batch))
+    opts <- c(opts, K_OPT_NESTED_BATCH, batch)
+  opts <- c(opts, K_DONE)
+
+  Z <- numeric(3)
+  kl <- K_nested(k2$h, live, opts, NULL, Z)
+  if (is.nullptr(kl))
+    return(NULL)
+
+  ns <- .klnew(kl, k, type="mcmc", desc=sprintf("nested, live = %d, log(Z) = %e +- %e, noise=%s, tot. length = %d",
+                                            live, Z[1], Z[2], noise, KL_getSize(kl)),
+               flags=kflags(k2, 'par'))
+  names(Z) <- c("logZ", "logZ.err", "H")
+  ns$evidence <- Z
+  if (!equal.weights)
+    ns$weights <- exp(ns$merit)
+  if (plot)
+    plot(ns)
+  if (print)
+    print(ns)
+  if (!is.na(save))
+    save(ns, file=save)
+  return(ns)
+}
+
 
 
 kxyz <- function(k, internal=TRUE) {
@@ -2393,6 +2887,8 @@ kx2el <- function(mu = 1, x=1, y=0, z=0, u=0, v=1, w=0) {
 .kl.stats.names <- c("bestfit", "median", "mad")
 .klnew <- function(klptr, k, type="", desc="", flags=kflags(k, 'par')) {
   stopifnot(! is.nullptr(klptr))
+  # Column-major storage makes the statistics below faster
+  KL_to_columns(klptr)
   np <- KL_getNplanets(klptr)
   size <- KL_getSize(klptr)
   cols <- np * ALL_ELEMENTS_SIZE + PARAMS_SIZE + 3
@@ -2407,6 +2903,9 @@ kx2el <- function(mu = 1, x=1, y=0, z=0, u=0, v=1, w=0) {
   .els <- kallels(k)
   .els.med <- .gsl_matrix_to_R(KL_getElementsStats(klptr, K_STAT_MEDIAN), free = TRUE)
   .els.mad <- .gsl_matrix_to_R(KL_getElementsStats(klptr, K_STAT_MAD), free = TRUE)
+  # Integrated autocorrelation times (samples with the same tag are treated as a chain)
+  .els.iat <- .gsl_matrix_to_R(KL_getElementsStats(klptr, K_STAT_IAT), free = TRUE)
+  .pars.iat <- .gsl_vector_to_R(KL_getParsStats(klptr, K_STAT_IAT), free = TRUE)
   
   stats <- list()
   if (np > 0) {
@@ -2448,6 +2947,11 @@ kx2el <- function(mu = 1, x=1, y=0, z=0, u=0, v=1, w=0) {
   rownames(b$params.stats) <- .params	
   colnames(b$params.stats) <- .kl.stats.names
   
+  b$iat <- list(elements = .els.iat[-1, , drop = FALSE], params = .pars.iat[1:PARAMS_SIZE])
+  colnames(b$iat$elements) <- .allelements
+  names(b$iat$params) <- .params
+  b$ess <- lapply(b$iat, function(tau) pmin(size / tau, size))
+  
   b$chi2 <- m[, ncol(m)-2]
   b$merit <- m[, ncol(m)-2]
   b$prior <- m[, ncol(m)-1]
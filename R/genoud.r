@@ -34,6 +34,8 @@ in.domain <- function(x, Domain, indices) all(x >= Domain[,1] & x <= Domain[,2])
 
 
 kminimize.genoud <- function(k, minimize.function='default', log.period=TRUE, log.mass=TRUE, max.generations=100, ...) {
+    # Note: kminimize(k, algo=GA) runs a native, parallel genetic algorithm
+    # without going through R for each evaluation of the merit function.
     .require.library('rgenoud')
     .check_kernel(k)
     stopifnot(k$nplanets > 0)
@@ -1,5 +1,9 @@
+#include "string.h"
 #include "bootstrap.h"
 #include "kernel.h"
+#include "integration.h"
+#include "rng.h"
+#include "sketch.h"
 #include <gsl/gsl_randist.h>
 
 #ifndef JAVASCRIPT
@@ -8,105 +12,269 @@
 #include "omp_shim.h"
 #endif
 
-ok_list* K_bootstrap(ok_kernel* k, int trials, int warmup, int malgo, int miter, double mparams[]) {
+/*
+ * Per-thread workspace of the bootstrap: a private copy of the kernel (see
+ * K_cloneWorkspace) that is reused by all the trials of the thread. rows holds the
+ * data points of the copy sorted by time; rank maps the index of a point in the order
+ * of the datasets (the order in which K_compileData resamples them) to its index in rows.
+ */
+typedef struct ok_bootstrap_ws {
+    ok_kernel* k;
+    double** rows;
+    int* rank;
+    int* count;
+} ok_bootstrap_ws;
+
+static ok_bootstrap_ws* ok_bootstrap_ws_alloc(ok_kernel* k) {
+    ok_bootstrap_ws* ws = (ok_bootstrap_ws*) malloc(sizeof (ok_bootstrap_ws));
+    ws->k = K_cloneWorkspace(k);
+    ws->k->progress = NULL;
+
+    const int ndata = ws->k->ndata;
+    ws->rows = (double**) malloc(sizeof (double*) * ndata);
+    memcpy(ws->rows, ws->k->compiled, sizeof (double*) * ndata);
+    ws->rank = (int*) malloc(sizeof (int) * ndata);
+    ws->count = (int*) malloc(sizeof (int) * ndata);
+
+    int offset[ws->k->nsets + 1];
+    offset[0] = 0;
+    for (int s = 0; s < ws->k->nsets; s++)
+        offset[s + 1] = offset[s] + MROWS(ws->k->datasets[s]);
+    for (int i = 0; i < ndata; i++) {
+        int set = (int) ws->rows[i][T_SET];
+        int row = (int) ((ws->rows[i] - ws->k->datasets[set]->data) / ws->k->datasets[set]->tda);
+        ws->rank[offset[set] + row] = i;
+    }
+    return ws;
+}
+
+static void ok_bootstrap_ws_free(ok_bootstrap_ws* ws) {
+    K_free(ws->k);
+    free(ws->rows);
+    free(ws->rank);
+    free(ws->count);
+    free(ws);
+}
+
+/*
+ * Prepares the workspace for a trial: restores the best fit of the parent kernel,
+ * perturbs it by dev (if not NULL), then resamples the data points with replacement.
+ * The random numbers are drawn in the same order as by a clone of the kernel with
+ * BOOTSTRAP_DATA set; the resampled points are sorted by counting, since the
+ * points of the workspace are already sorted.
+ */
+static void ok_bootstrap_ws_trial(ok_bootstrap_ws* ws, ok_kernel* parent, const gsl_matrix* dev,
+                                  const unsigned long int seed, const int trial) {
+    ok_kernel* k = ws->k;
+    const int ndata = k->ndata;
+    K_setRngStream(k, seed, trial);
+    ok_copy_system_to(parent->system, k->system);
+    gsl_vector_memcpy(k->params, parent->params);
+
+    if (dev != NULL) {
+        for (int i = 1; i <= k->system->nplanets; i++) {
+            for (int j = 0; j < ELEMENTS_SIZE; j++)
+                if (MIGET(k->plFlags, i, j) & MINIMIZE) {
+                    double pert = gsl_ran_gaussian(k->rng, MGET(dev, i, j));
+                    MINC(k->system->elements, i, j, pert * MGET(k->system->elements, i, j));
+                }
+        }
+    }
+
+    memset(ws->count, 0, sizeof (int) * ndata);
+    for (int i = 0; i < ndata; i++)
+        ws->count[ws->rank[gsl_rng_uniform_int(k->rng, ndata)]]++;
+
+    int n = 0;
+    for (int i = 0; i < ndata; i++)
+        for (int c = 0; c < ws->count[i]; c++) {
+            k->compiled[n] = ws->rows[i];
+            VSET(k->times, n, ws->rows[i][T_TIME]);
+            n++;
+        }
+    k->flags |= NEEDS_SETUP;
+}
+
+/*
+ * Runs n trials in parallel (with dynamic scheduling, since the minimizations can take
+ * very different times). The results are stored in kl, if not NULL, otherwise in the
+ * summary of the thread (sums[t]). If times is not NULL, the row of each trial receives
+ * its total duration and the time spent in the minimizer (in seconds).
+ */
+static void ok_bootstrap_trials(ok_kernel* k, const int n, const unsigned long int seed, const gsl_matrix* dev,
+                                int malgo, int miter, double mparams[], ok_list* kl, ok_summary** sums,
+                                gsl_matrix* times, const char* name, bool* invalid) {
+    ok_progress prog = k->progress;
+    int nthreads = omp_get_max_threads();
+
+    ok_bootstrap_ws* wss[nthreads];
+    for (int t = 0; t < nthreads; t++)
+        wss[t] = ok_bootstrap_ws_alloc(k);
+
+    #pragma omp parallel
+    {
+        ok_bootstrap_ws* ws = wss[omp_get_thread_num()];
+
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < n; i++) {
+            if (*invalid || K_checkBudget(k, INVALID_NUMBER) != BUDGET_OK)
+                continue;
+
+            double start = omp_get_wtime();
+            ok_bootstrap_ws_trial(ws, k, dev, seed, i);
+            // The minimizers expect the merit of the starting point to be computed
+            K_calculate(ws->k);
+
+            double mstart = omp_get_wtime();
+            K_minimize(ws->k, malgo, miter, mparams);
+            double mtime = omp_get_wtime() - mstart;
+
+            if (kl != NULL)
+                KL_set(kl, i, K_getAllElements(ws->k), ok_vector_copy(ws->k->params), ws->k->minfunc(ws->k), 0);
+            else {
+                // Only the statistics of the trial are kept
+                gsl_matrix* els = K_getAllElements(ws->k);
+                KS_add(sums[omp_get_thread_num()], els, ws->k->params, ws->k->minfunc(ws->k));
+                gsl_matrix_free(els);
+            }
+
+            if (times != NULL) {
+                MSET(times, i, 0, omp_get_wtime() - start);
+                MSET(times, i, 1, mtime);
+            }
+
+            if (prog != NULL && omp_get_thread_num() == 0) {
+                int ret = prog(i * nthreads, n, ws->k, name);
+                if (ret == PROGRESS_STOP) {
+                    *invalid = true;
+                }
+            }
+        }
+    }
+
+    for (int t = 0; t < nthreads; t++)
+        ok_bootstrap_ws_free(wss[t]);
+}
+
+/*
+ * Runs the bootstrap trials. The results are stored in a new list (*kl) if kl is not
+ * NULL, otherwise in summaries of 'size' (see KS_alloc), one for each thread (sums[t]).
+ * Returns false if the run was stopped by the progress callback.
+ */
+static bool ok_bootstrap_run(ok_kernel* k, int trials, int warmup, int malgo, int miter, double mparams[],
+                             ok_list** kl, ok_summary** sums, const int size, gsl_matrix* times) {
     ok_progress prog = k->progress;
     gsl_matrix* dev = NULL;
-    
+
     int nthreads = omp_get_max_threads();
     bool invalid = false;
-    
+
     if (prog != NULL) {
         int ret = prog(0, (int)((double) trials / (double) nthreads), k,
                 "K_bootstrap");
         if (ret == PROGRESS_STOP) {
-            return NULL;
+            return false;
         }
     }
-    
+
+    ok_budget_start(k->budget);
     K_minimize(k, malgo, trials, mparams);
-    ok_kernel* k0 = K_clone(k);
-    
-    ok_list* kl = KL_alloc(trials, k0);
-    
+
+    // Streams keyed by the trial index
+    unsigned long int seed_wu = gsl_rng_get(k->rng);
+    unsigned long int seed = gsl_rng_get(k->rng);
+
+    if (kl != NULL)
+        *kl = KL_alloc(trials, K_clone(k));
+    else
+        for (int t = 0; t < nthreads; t++)
+            sums[t] = KS_alloc(k->system->nplanets + 1, ALL_ELEMENTS_SIZE, PARAMS_SIZE, size);
+    if (times != NULL)
+        gsl_matrix_set_all(times, INVALID_NUMBER);
+
     ok_list* wu = NULL;
-    
+
     if (warmup > 0) {
         wu = KL_alloc(warmup, K_clone(k));
-        
-        #pragma omp parallel for
-        for (int i = 0; i < warmup; i++) {
-            if (invalid)
-                continue;
-            
-            ok_kernel* k2 = K_cloneFlags(k, SHARE_FLAGS | SHARE_STEPS | SHARE_RANGES);
-            k2->flags |= NEEDS_COMPILE | BOOTSTRAP_DATA;
-            k2->progress = NULL;
-            K_calculate(k2);
-            
-            K_minimize(k2, malgo, miter, mparams);
-            KL_set(wu, i, k2->system->elements, k2->params, k2->minfunc(k2), 0);
-            
-            if (prog != NULL && omp_get_thread_num() == 0) {
-                int ret = prog(i * nthreads, warmup, k2,
-                    "K_bootstrap_warmup");
-                if (ret == PROGRESS_STOP) {
-                    invalid = true;
-                }
-            }
-            
-            K_free(k2);
-        }
-        
-        dev = KL_getElementsStats(wu, STAT_STDDEV);
-    }
-    
-    
-    
-    #pragma omp parallel for
-    for (int i = 0; i < trials; i++) {
-        if (invalid)
-            continue;
-       
-        ok_kernel * k2 = K_cloneFlags(k, SHARE_FLAGS | SHARE_STEPS | SHARE_RANGES);
-        k2->flags |= NEEDS_COMPILE | BOOTSTRAP_DATA;
-        k2->progress = NULL;
-        
-        if (warmup > 0) {
-            for (int i = 1; i <= k2->system->nplanets; i++) {
-                for (int j = 0; j < ELEMENTS_SIZE; j++) 
-                    if (MIGET(k2->plFlags, i, j) & MINIMIZE) {
-                        double pert = gsl_ran_gaussian(k->rng, MGET(dev, i, j));
-                        MINC(k2->system->elements, i, j, pert * MGET(k2->system->elements, i, j));
-                    }
-            }
-        }
-        
-        
-        K_calculate(k2);
-        
-        K_minimize(k2, malgo, miter, mparams);
-        
-        KL_set(kl, i, K_getAllElements(k2), ok_vector_copy(k2->params), k2->minfunc(k2), 0);
-        
-        if (prog != NULL && omp_get_thread_num() == 0) {
-            int ret = prog(i * nthreads, trials, k2,
-                    "K_bootstrap");
-            if (ret == PROGRESS_STOP) {
-                invalid = true;
-            }
-        }
-        
-        K_free(k2);
+        ok_bootstrap_trials(k, warmup, seed_wu, NULL, malgo, miter, mparams, wu, NULL, NULL,
+                            "K_bootstrap_warmup", &invalid);
+
+        KL_compact(wu);
+        if (wu->size > 1)
+            dev = KL_getElementsStats(wu, STAT_STDDEV);
     }
-    
-    if (invalid) {
-        if (wu != NULL)
-            KL_free(wu);
+
+    if (!invalid)
+        ok_bootstrap_trials(k, trials, seed, dev, malgo, miter, mparams, (kl != NULL ? *kl : NULL), sums, times,
+                            "K_bootstrap", &invalid);
+
+    ok_budget_stop(k->budget);
+    gsl_matrix_free(dev);
+    KL_free(wu);
+    return !invalid;
+}
+
+ok_list* K_bootstrap(ok_kernel* k, int trials, int warmup, int malgo, int miter, double mparams[]) {
+    return K_bootstrapTimed(k, trials, warmup, malgo, miter, mparams, NULL);
+}
+
+/**
+ * Runs the bootstrap routine as K_bootstrap, and reports the duration of each trial.
+ * The trials resample the data points of a private copy of the kernel kept by each
+ * thread, and start from the best fit of k.
+ * @param k Kernel
+ * @param trials Number of trials
+ * @param warmup Number of warmup trials, used to perturb the starting points
+ * @param malgo Minimization algorithm
+ * @param miter Maximum number of iterations of each minimization
+ * @param mparams Parameters of the minimization algorithm
+ * @param times A matrix of trials x 2 (or NULL): row i receives the total duration of
+ * trial i and the time spent in the minimizer (in seconds), or INVALID_NUMBER if the trial
+ * was skipped because the budget was exhausted
+ * @return A list of the trials, or NULL if the run was stopped
+ */
+ok_list* K_bootstrapTimed(ok_kernel* k, int trials, int warmup, int malgo, int miter, double mparams[],
+                          gsl_matrix* times) {
+    ok_list* kl = NULL;
+    if (!ok_bootstrap_run(k, trials, warmup, malgo, miter, mparams, &kl, NULL, 0, times)) {
         KL_free(kl);
         return NULL;
     }
-        
-    
-    KL_free(wu);
+    // Trials skipped because the budget was exhausted are removed
+    KL_compact(kl);
     return kl;
 }
+
+/**
+ * Runs the bootstrap routine as K_bootstrap, but keeps only the statistics of the
+ * trials (see ok_summary): the memory used does not depend on the number of trials.
+ * Each thread fills its own summary; the summaries are merged at the end.
+ * @param k Kernel
+ * @param trials Number of trials
+ * @param warmup Number of warmup trials, used to perturb the starting points
+ * @param malgo Minimization algorithm
+ * @param miter Maximum number of iterations of each minimization
+ * @param mparams Parameters of the minimization algorithm
+ * @param size Size of the quantile sketches (see KS_alloc; 0 for the default)
+ * @return A summary of the trials, or NULL if the run was stopped. Quantiles are
+ * approximate, and can differ slightly with the number of threads.
+ */
+ok_summary* K_bootstrapSummary(ok_kernel* k, int trials, int warmup, int malgo, int miter, double mparams[],
+                               int size) {
+    int nthreads = omp_get_max_threads();
+    ok_summary* sums[nthreads];
+    for (int t = 0; t < nthreads; t++)
+        sums[t] = NULL;
+
+    bool ok = ok_bootstrap_run(k, trials, warmup, malgo, miter, mparams, NULL, sums, size, NULL);
+    for (int t = 1; t < nthreads; t++) {
+        if (ok && sums[t] != NULL)
+            KS_merge(sums[0], sums[t]);
+        KS_free(sums[t]);
+    }
+    if (!ok) {
+        KS_free(sums[0]);
+        return NULL;
+    }
+    return sums[0];
+}
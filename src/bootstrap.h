@@ -13,8 +13,13 @@ extern "C" {
 #endif
 
 #include "kl.h"
+#include "sketch.h"
 
     ok_list* K_bootstrap(ok_kernel* k, int trials, int warmup, int malgo, int miter, double mparams[]);
+    ok_list* K_bootstrapTimed(ok_kernel* k, int trials, int warmup, int malgo, int miter, double mparams[],
+                              gsl_matrix* times);
+    ok_summary* K_bootstrapSummary(ok_kernel* k, int trials, int warmup, int malgo, int miter, double mparams[],
+                                   int size);
     
 #ifdef	__cplusplus
 }
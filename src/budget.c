@@ -0,0 +1,152 @@
+#ifndef JAVASCRIPT
+#include "omp.h"
+#else
+#include "omp_shim.h"
+#endif
+
+#include "math.h"
+#include "budget.h"
+
+/**
+ * Allocates a new budget with no limits.
+ * @return A new budget, with a reference count of 1
+ */
+ok_budget* ok_budget_alloc() {
+    ok_budget* b = (ok_budget*) calloc(1, sizeof (ok_budget));
+    b->target = INVALID_NUMBER;
+    b->refs = 1;
+    return b;
+}
+
+ok_budget* ok_budget_retain(ok_budget* b) {
+    #pragma omp atomic
+    b->refs++;
+    return b;
+}
+
+/**
+ * Releases a reference to the budget, freeing it when it is no longer used
+ * by any kernel.
+ * @param b The budget
+ */
+void ok_budget_free(ok_budget* b) {
+    if (b == NULL)
+        return;
+    int refs;
+    #pragma omp atomic capture
+    refs = --b->refs;
+    if (refs == 0)
+        free(b);
+}
+
+/**
+ * Marks the beginning of a run. Runs can be nested (e.g. the minimizations
+ * done by K_bootstrap); only the outermost run resets the used budget.
+ * @param b The budget
+ */
+void ok_budget_start(ok_budget* b) {
+    if (b == NULL)
+        return;
+    int depth;
+    #pragma omp atomic capture
+    depth = b->depth++;
+    if (depth == 0) {
+        b->evals = 0;
+        b->elapsed = 0.;
+        b->status = BUDGET_OK;
+        b->start = omp_get_wtime();
+    }
+}
+
+/**
+ * Marks the end of a run started with ok_budget_start.
+ * @param b The budget
+ */
+void ok_budget_stop(ok_budget* b) {
+    if (b == NULL)
+        return;
+    int depth;
+    #pragma omp atomic capture
+    depth = --b->depth;
+    if (depth == 0)
+        b->elapsed = omp_get_wtime() - b->start;
+}
+
+void ok_budget_count(ok_budget* b, unsigned long int evals) {
+    if (b == NULL)
+        return;
+    #pragma omp atomic
+    b->evals += evals;
+}
+
+/**
+ * Checks whether any of the limits of the budget has been reached by the
+ * current run. Once a limit is reached, the budget stays exhausted until the
+ * next run is started.
+ * @param b The budget
+ * @param merit The current (or best) value of the merit function, checked against
+ * the target; pass INVALID_NUMBER if not available
+ * @return BUDGET_OK, or the BUDGET_* code of the limit that was reached
+ */
+int ok_budget_check(ok_budget* b, double merit) {
+    if (b == NULL || b->depth == 0)
+        return BUDGET_OK;
+    if (b->status != BUDGET_OK)
+        return b->status;
+
+    int status = BUDGET_OK;
+    if (b->max_evals > 0 && b->evals >= b->max_evals)
+        status = BUDGET_EVALS;
+    else if (b->max_time > 0 && omp_get_wtime() - b->start >= b->max_time)
+        status = BUDGET_TIME;
+    else if (!IS_NOT_FINITE(b->target) && !IS_NOT_FINITE(merit) && merit <= b->target)
+        status = BUDGET_TARGET;
+
+    if (status != BUDGET_OK)
+        b->status = status;
+    return status;
+}
+
+/**
+ * Sets the limits of the budget (see K_setBudget).
+ * @param b The budget
+ * @param maxEvals Maximum number of evaluations of the model (0 = no limit)
+ * @param maxTime Maximum wall-clock time, in seconds (0 = no limit)
+ * @param target Target value of the merit function (INVALID_NUMBER = no target)
+ */
+void ok_budget_set(ok_budget* b, unsigned long int maxEvals, double maxTime, double target) {
+    b->max_evals = maxEvals;
+    b->max_time = maxTime;
+    b->target = target;
+}
+
+void K_setBudget(ok_kernel* k, unsigned long int maxEvals, double maxTime, double target) {
+    ok_budget_set(k->budget, maxEvals, maxTime, target);
+}
+
+ok_budget* K_getBudget(ok_kernel* k) {
+    return k->budget;
+}
+
+unsigned long int K_getBudgetEvals(ok_kernel* k) {
+    return k->budget->evals;
+}
+
+double K_getBudgetElapsed(ok_kernel* k) {
+    return k->budget->elapsed;
+}
+
+int K_getBudgetStatus(ok_kernel* k) {
+    return k->budget->status;
+}
+
+int K_checkBudget(ok_kernel* k, double merit) {
+    return ok_budget_check(k->budget, merit);
+}
+
+void K_shareBudget(ok_kernel* k, ok_kernel* src) {
+    if (k->budget == src->budget)
+        return;
+    ok_budget_free(k->budget);
+    k->budget = ok_budget_retain(src->budget);
+}
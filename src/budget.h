@@ -0,0 +1,56 @@
+/*
+ * File:   budget.h
+ */
+
+#ifndef BUDGET_H
+#define	BUDGET_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "systemic.h"
+
+    ok_budget* ok_budget_alloc();
+    ok_budget* ok_budget_retain(ok_budget* b);
+    void ok_budget_free(ok_budget* b);
+    void ok_budget_set(ok_budget* b, unsigned long int maxEvals, double maxTime, double target);
+
+    void ok_budget_start(ok_budget* b);
+    void ok_budget_stop(ok_budget* b);
+    void ok_budget_count(ok_budget* b, unsigned long int evals);
+    int ok_budget_check(ok_budget* b, double merit);
+
+    /**
+     * Sets the computational budget of the kernel, honored by K_minimize,
+     * K_mcmc_mult, K_bootstrap and the periodogram routines. The budget is
+     * shared by the copies of the kernel used internally by these routines,
+     * so that the limits apply to the run as a whole.
+     *
+     * @param k The kernel
+     * @param maxEvals Maximum number of evaluations of the model (0 = no limit)
+     * @param maxTime Maximum wall-clock time, in seconds (0 = no limit)
+     * @param target The run is stopped once the merit function reaches a value
+     * smaller or equal than target (INVALID_NUMBER = no target)
+     */
+    void K_setBudget(ok_kernel* k, unsigned long int maxEvals, double maxTime, double target);
+    // Budget of the kernel, e.g. to limit ok_periodogram_boot
+    ok_budget* K_getBudget(ok_kernel* k);
+    // Number of evaluations of the model used by the last run
+    unsigned long int K_getBudgetEvals(ok_kernel* k);
+    // Wall-clock time (in seconds) used by the last run
+    double K_getBudgetElapsed(ok_kernel* k);
+    // BUDGET_* code of the limit that stopped the last run, or BUDGET_OK
+    int K_getBudgetStatus(ok_kernel* k);
+    // Returns a non-zero BUDGET_* code if the budget of the current run is
+    // exhausted; merit (if not INVALID_NUMBER) is checked against the target
+    int K_checkBudget(ok_kernel* k, double merit);
+    // Makes k use the same budget of src
+    void K_shareBudget(ok_kernel* k, ok_kernel* src);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* BUDGET_H */
+
@@ -0,0 +1,501 @@
+#include <gsl/gsl_randist.h>
+
+#ifndef JAVASCRIPT
+#include "omp.h"
+#else
+#include "omp_shim.h"
+#endif
+
+#include "math.h"
+#include "utils.h"
+#include "kernel.h"
+#include "cmaes.h"
+
+#define IS_ANGLE(b) ((b) == MA || (b) == LOP || (b) == INC || (b) == NODE)
+#define IS_LOG(b) ((b) == MASS || (b) == PER)
+
+#define CMAES_RESAMPLE 10
+#define CMAES_TOLX 1e-12
+#define CMAES_MAX_COND 1e14
+#define CMAES_MAX_SIGMA 1e3
+
+typedef struct {
+    double f;
+    int idx;
+} ok_cmaes_rank;
+
+typedef struct {
+    int n;
+    int lambda;
+    int mu;
+    double* w;
+    double mueff;
+    double cc, cs, c1, cmu, damps, chiN;
+
+    double sigma;
+    double* xmean;
+    double* xold;
+    double* pc;
+    double* ps;
+    // covariance matrix, its eigenvectors (by column) and the square root of its eigenvalues
+    double* C;
+    double* B;
+    double* D;
+    double* invsqrtC;
+    // scratch space for the eigendecomposition
+    double* tmp;
+
+    // sampled points (in normalized coordinates) and their merit
+    double* arx;
+    double* fit;
+    ok_cmaes_rank* rank;
+
+    int gen;
+    int eigengen;
+} ok_cmaes_state;
+
+static int ok_cmaes_rank_cmp(const void* a, const void* b) {
+    double fa = ((ok_cmaes_rank*) a)->f;
+    double fb = ((ok_cmaes_rank*) b)->f;
+    return (fa < fb ? -1 : (fa > fb ? 1 : 0));
+}
+
+/**
+ * Eigendecomposition of the symmetric n x n matrix C (row-major) using cyclic
+ * Jacobi rotations.
+ * @param C The matrix to decompose (not modified)
+ * @param B On exit, contains the eigenvectors (stored by column)
+ * @param ev On exit, contains the eigenvalues
+ * @param A Scratch space of n x n doubles
+ */
+static void ok_cmaes_eigen(const double* C, double* B, double* ev, double* A, const int n) {
+    memcpy(A, C, sizeof (double) * n * n);
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < n; j++)
+            B[i * n + j] = (i == j ? 1. : 0.);
+
+    for (int sweep = 0; sweep < 100; sweep++) {
+        double off = 0., diag = 0.;
+        for (int p = 0; p < n; p++) {
+            diag += SQR(A[p * n + p]);
+            for (int q = p + 1; q < n; q++)
+                off += SQR(A[p * n + q]);
+        }
+        if (off <= 1e-30 * diag || off == 0.)
+            break;
+
+        for (int p = 0; p < n - 1; p++)
+            for (int q = p + 1; q < n; q++) {
+                double apq = A[p * n + q];
+                if (apq == 0.)
+                    continue;
+                double theta = (A[q * n + q] - A[p * n + p]) / (2. * apq);
+                double t = (theta >= 0 ? 1. : -1.) / (fabs(theta) + sqrt(theta * theta + 1.));
+                double c = 1. / sqrt(t * t + 1.);
+                double s = t * c;
+
+                for (int r = 0; r < n; r++) {
+                    double arp = A[r * n + p];
+                    double arq = A[r * n + q];
+                    A[r * n + p] = c * arp - s * arq;
+                    A[r * n + q] = s * arp + c * arq;
+                }
+                for (int r = 0; r < n; r++) {
+                    double apr = A[p * n + r];
+                    double aqr = A[q * n + r];
+                    A[p * n + r] = c * apr - s * aqr;
+                    A[q * n + r] = s * apr + c * aqr;
+                }
+                for (int r = 0; r < n; r++) {
+                    double brp = B[r * n + p];
+                    double brq = B[r * n + q];
+                    B[r * n + p] = c * brp - s * brq;
+                    B[r * n + q] = s * brp + c * brq;
+                }
+            }
+    }
+
+    for (int i = 0; i < n; i++)
+        ev[i] = A[i * n + i];
+}
+
+static void ok_cmaes_init(ok_cmaes_state* st, const int n, const int lambda, const double sigma) {
+    st->n = n;
+    st->lambda = lambda;
+    st->mu = lambda / 2;
+    st->sigma = sigma;
+    st->gen = 0;
+    st->eigengen = 0;
+
+    int mu = st->mu;
+    st->w = (double*) malloc(sizeof (double) * mu);
+    double sw = 0., sw2 = 0.;
+    for (int i = 0; i < mu; i++) {
+        st->w[i] = log(mu + 0.5) - log(i + 1.);
+        sw += st->w[i];
+    }
+    for (int i = 0; i < mu; i++) {
+        st->w[i] /= sw;
+        sw2 += SQR(st->w[i]);
+    }
+    st->mueff = 1. / sw2;
+
+    double mueff = st->mueff;
+    st->cc = (4. + mueff / n) / (n + 4. + 2. * mueff / n);
+    st->cs = (mueff + 2.) / (n + mueff + 5.);
+    st->c1 = 2. / (SQR(n + 1.3) + mueff);
+    st->cmu = MIN(1. - st->c1, 2. * (mueff - 2. + 1. / mueff) / (SQR(n + 2.) + mueff));
+    st->damps = 1. + 2. * MAX(0., sqrt((mueff - 1.) / (n + 1.)) - 1.) + st->cs;
+    st->chiN = sqrt(n) * (1. - 1. / (4. * n) + 1. / (21. * n * n));
+
+    st->xmean = (double*) calloc(n, sizeof (double));
+    st->xold = (double*) calloc(n, sizeof (double));
+    st->pc = (double*) calloc(n, sizeof (double));
+    st->ps = (double*) calloc(n, sizeof (double));
+    st->D = (double*) malloc(sizeof (double) * n);
+    st->tmp = (double*) malloc(sizeof (double) * n * n);
+    st->C = (double*) calloc(n * n, sizeof (double));
+    st->B = (double*) calloc(n * n, sizeof (double));
+    st->invsqrtC = (double*) calloc(n * n, sizeof (double));
+    for (int i = 0; i < n; i++) {
+        st->C[i * n + i] = st->B[i * n + i] = st->invsqrtC[i * n + i] = 1.;
+        st->D[i] = 1.;
+    }
+
+    st->arx = (double*) malloc(sizeof (double) * n * lambda);
+    st->fit = (double*) malloc(sizeof (double) * lambda);
+    st->rank = (ok_cmaes_rank*) malloc(sizeof (ok_cmaes_rank) * lambda);
+}
+
+static void ok_cmaes_free(ok_cmaes_state* st) {
+    free(st->w);
+    free(st->xmean);
+    free(st->xold);
+    free(st->pc);
+    free(st->ps);
+    free(st->D);
+    free(st->tmp);
+    free(st->C);
+    free(st->B);
+    free(st->invsqrtC);
+    free(st->arx);
+    free(st->fit);
+    free(st->rank);
+}
+
+/**
+ * Updates the mean, evolution paths, covariance matrix and step size after
+ * the merit of the current population (st->fit) has been computed.
+ */
+static void ok_cmaes_update(ok_cmaes_state* st) {
+    const int n = st->n;
+    const int mu = st->mu;
+
+    for (int i = 0; i < st->lambda; i++) {
+        st->rank[i].f = st->fit[i];
+        st->rank[i].idx = i;
+    }
+    qsort(st->rank, st->lambda, sizeof (ok_cmaes_rank), ok_cmaes_rank_cmp);
+
+    memcpy(st->xold, st->xmean, sizeof (double) * n);
+    for (int j = 0; j < n; j++) {
+        st->xmean[j] = 0.;
+        for (int i = 0; i < mu; i++)
+            st->xmean[j] += st->w[i] * st->arx[st->rank[i].idx * n + j];
+    }
+
+    st->gen++;
+
+    // Step-size evolution path
+    double cs_fac = sqrt(st->cs * (2. - st->cs) * st->mueff) / st->sigma;
+    double psnorm = 0.;
+    for (int i = 0; i < n; i++) {
+        double s = 0.;
+        for (int j = 0; j < n; j++)
+            s += st->invsqrtC[i * n + j] * (st->xmean[j] - st->xold[j]);
+        st->ps[i] = (1. - st->cs) * st->ps[i] + cs_fac * s;
+        psnorm += SQR(st->ps[i]);
+    }
+    psnorm = sqrt(psnorm);
+
+    bool hsig = psnorm / sqrt(1. - pow(1. - st->cs, 2. * st->gen)) / st->chiN < 1.4 + 2. / (n + 1.);
+
+    double cc_fac = sqrt(st->cc * (2. - st->cc) * st->mueff) / st->sigma;
+    for (int i = 0; i < n; i++)
+        st->pc[i] = (1. - st->cc) * st->pc[i] + (hsig ? cc_fac * (st->xmean[i] - st->xold[i]) : 0.);
+
+    // Rank-one and rank-mu update of the covariance matrix
+    double c1a = st->c1 * (1. - (hsig ? 0. : st->cc * (2. - st->cc)));
+    for (int a = 0; a < n; a++)
+        for (int b = 0; b <= a; b++) {
+            double rmu = 0.;
+            for (int i = 0; i < mu; i++) {
+                const double* xi = st->arx + st->rank[i].idx * n;
+                rmu += st->w[i] * (xi[a] - st->xold[a]) * (xi[b] - st->xold[b]);
+            }
+            rmu /= SQR(st->sigma);
+            double c = (1. - c1a - st->cmu) * st->C[a * n + b] + st->c1 * st->pc[a] * st->pc[b] + st->cmu * rmu;
+            st->C[a * n + b] = st->C[b * n + a] = c;
+        }
+
+    st->sigma *= exp((st->cs / st->damps) * (psnorm / st->chiN - 1.));
+
+    // Lazy update of the eigendecomposition
+    if ((st->gen - st->eigengen) * (st->c1 + st->cmu) * n * 10. >= 1.) {
+        st->eigengen = st->gen;
+        ok_cmaes_eigen(st->C, st->B, st->D, st->tmp, n);
+        for (int i = 0; i < n; i++)
+            st->D[i] = sqrt(MAX(st->D[i], 1e-300));
+
+        for (int a = 0; a < n; a++)
+            for (int b = 0; b < n; b++) {
+                double s = 0.;
+                for (int i = 0; i < n; i++)
+                    s += st->B[a * n + i] * st->B[b * n + i] / st->D[i];
+                st->invsqrtC[a * n + b] = s;
+            }
+    }
+}
+
+// Transforms between normalized coordinates and kernel parameters
+static inline double ok_cmaes_to_par(double y, int j, const int* type, const double* t0, const double* width) {
+    double t = t0[j] + y * width[j];
+    return (IS_LOG(type[j]) ? exp(t) : t);
+}
+
+static inline double ok_cmaes_to_y(double x, int j, const int* type, const double* t0, const double* width) {
+    return ((IS_LOG(type[j]) ? log(x) : x) - t0[j]) / width[j];
+}
+
+int K_minimize_cmaes(ok_kernel* k, int maxiter, double params[]) {
+    int status = PROGRESS_CONTINUE;
+    int lambda0 = 0;
+    double sigma0 = 0.3;
+    int max_restarts = 9;
+    bool bipop = false;
+    double tolfun = 1e-8;
+    int verbose = 0;
+
+    int idx = 0;
+    while (params != NULL) {
+        if (params[idx] == DONE)
+            break;
+        else if (params[idx] == OPT_CMAES_POPSIZE)
+            lambda0 = (int) params[idx + 1];
+        else if (params[idx] == OPT_CMAES_SIGMA)
+            sigma0 = params[idx + 1];
+        else if (params[idx] == OPT_CMAES_RESTARTS)
+            max_restarts = (int) params[idx + 1];
+        else if (params[idx] == OPT_CMAES_BIPOP)
+            bipop = (((int) params[idx + 1]) != 0);
+        else if (params[idx] == OPT_CMAES_TOLFUN)
+            tolfun = params[idx + 1];
+        else if (params[idx] == OPT_VERBOSE_DIAGS)
+            verbose = (int) params[idx + 1];
+        idx += 2;
+    }
+
+    K_calculate(k);
+    ok_kernel_minimizer_pars mpars = K_getMinimizedVariables(k);
+    const int n = mpars.npars;
+
+    if (n == 0) {
+        FREE_MINIMIZER_PARS(mpars);
+        return status;
+    }
+
+    if (lambda0 < 4)
+        lambda0 = 4 + (int) (3. * log(n));
+
+    // Normalized coordinates: y = (t(x) - t(x0)) / width, with t = log for
+    // periods and masses
+    int* type = mpars.type;
+    double t0[n], width[n], ymin[n], ymax[n];
+    for (int j = 0; j < n; j++) {
+        double x0 = *(mpars.pars[j]);
+        bool bounded = (mpars.min[j] > -DBL_MAX && mpars.max[j] < DBL_MAX);
+        if (IS_LOG(type[j]) && (x0 <= 0 || (mpars.min[j] > -DBL_MAX && mpars.min[j] <= 0)))
+            type[j] = -1;
+
+        t0[j] = (IS_LOG(type[j]) ? log(x0) : x0);
+        if (bounded)
+            width[j] = (IS_LOG(type[j]) ? log(mpars.max[j]) - log(mpars.min[j]) : mpars.max[j] - mpars.min[j]);
+        else if (IS_ANGLE(type[j]))
+            width[j] = 360.;
+        else
+            // The step is in linear units; on the log scale it is relative to x0
+            width[j] = 100. * mpars.steps[j] / (IS_LOG(type[j]) ? x0 : 1.);
+        if (!(width[j] > 0) || IS_NOT_FINITE(width[j]))
+            width[j] = MAX(fabs(x0), 1.);
+
+        ymin[j] = (mpars.min[j] > -DBL_MAX ? ok_cmaes_to_y(mpars.min[j], j, type, t0, width) : -DBL_MAX);
+        ymax[j] = (mpars.max[j] < DBL_MAX ? ok_cmaes_to_y(mpars.max[j], j, type, t0, width) : DBL_MAX);
+    }
+
+    // Per-thread workspaces used to evaluate the population
+    const int threads = (omp_in_parallel() ? 1 : omp_get_max_threads());
+    ok_kernel* k_t[threads];
+    ok_kernel_minimizer_pars mpars_t[threads];
+    for (int i = 0; i < threads; i++) {
+        k_t[i] = K_cloneWorkspace(k);
+        k_t[i]->progress = NULL;
+        mpars_t[i] = K_getMinimizedVariables(k_t[i]);
+    }
+
+    double best_f = k->minfunc(k);
+    if (IS_NOT_FINITE(best_f))
+        best_f = DBL_MAX;
+    double best_y[n];
+    for (int j = 0; j < n; j++)
+        best_y[j] = 0.;
+
+    int gen_total = 0;
+    int evals_large = 0, evals_small = 0;
+    int lambda_large = lambda0;
+    double z[n];
+
+    for (int restart = 0; restart <= max_restarts && gen_total < maxiter; restart++) {
+        int lambda = lambda0;
+        double sigma = sigma0;
+        bool small = false;
+
+        if (restart > 0) {
+            if (bipop && evals_small < evals_large) {
+                double u = gsl_rng_uniform(k->rng);
+                lambda = MAX((int) (lambda0 * pow(0.5 * lambda_large / lambda0, u * u)), lambda0);
+                sigma = sigma0 * pow(10., -2. * gsl_rng_uniform(k->rng));
+                small = true;
+            } else {
+                lambda_large *= 2;
+                lambda = lambda_large;
+            }
+        }
+
+        ok_cmaes_state st;
+        ok_cmaes_init(&st, n, lambda, sigma);
+
+        const int hist_len = 10 + (int) ceil(30. * n / lambda);
+        double hist[hist_len];
+        int nhist = 0;
+
+        if (verbose)
+            fprintf(stderr, "%s: run %d, lambda = %d, sigma = %e, %s\n", __func__, restart, lambda,
+                sigma, (small ? "small" : "large"));
+
+        bool stop_run = false;
+        while (!stop_run && gen_total < maxiter) {
+            // Sample the population (serially, so that the sequence of random
+            // numbers only depends on the seed of the kernel rng)
+            for (int i = 0; i < lambda; i++) {
+                double* y = st.arx + i * n;
+                bool feasible = false;
+                for (int r = 0; r < CMAES_RESAMPLE && !feasible; r++) {
+                    for (int j = 0; j < n; j++)
+                        z[j] = st.D[j] * gsl_ran_gaussian(k->rng, 1.);
+                    feasible = true;
+                    for (int a = 0; a < n; a++) {
+                        double s = 0.;
+                        for (int b = 0; b < n; b++)
+                            s += st.B[a * n + b] * z[b];
+                        y[a] = st.xmean[a] + st.sigma * s;
+                        feasible = feasible && y[a] >= ymin[a] && y[a] <= ymax[a];
+                    }
+                }
+                for (int a = 0; a < n; a++)
+                    y[a] = RANGE(y[a], ymin[a], ymax[a]);
+            }
+
+            #pragma omp parallel for schedule(dynamic) num_threads(threads)
+            for (int i = 0; i < lambda; i++) {
+                int th = omp_get_thread_num();
+                const double* y = st.arx + i * n;
+                for (int j = 0; j < n; j++)
+                    *(mpars_t[th].pars[j]) = ok_cmaes_to_par(y[j], j, type, t0, width);
+
+                k_t[th]->flags |= NEEDS_SETUP;
+                K_calculate(k_t[th]);
+                double f = k->minfunc(k_t[th]);
+                st.fit[i] = (IS_NOT_FINITE(f) ? DBL_MAX : f);
+            }
+
+            if (small)
+                evals_small += lambda;
+            else
+                evals_large += lambda;
+            gen_total++;
+
+            ok_cmaes_update(&st);
+
+            double gen_best = st.rank[0].f;
+            double gen_worst = st.rank[lambda - 1].f;
+            if (gen_best < best_f) {
+                best_f = gen_best;
+                memcpy(best_y, st.arx + st.rank[0].idx * n, sizeof (double) * n);
+            }
+
+            // Termination criteria for the current run
+            hist[nhist % hist_len] = gen_best;
+            nhist++;
+            if (nhist >= hist_len) {
+                double hmin = hist[0], hmax = hist[0];
+                for (int i = 1; i < hist_len; i++) {
+                    hmin = MIN(hmin, hist[i]);
+                    hmax = MAX(hmax, hist[i]);
+                }
+                if (MAX(hmax, gen_worst) - MIN(hmin, gen_best) < tolfun)
+                    stop_run = true;
+            }
+
+            double dmin = st.D[0], dmax = st.D[0];
+            for (int j = 1; j < n; j++) {
+                dmin = MIN(dmin, st.D[j]);
+                dmax = MAX(dmax, st.D[j]);
+            }
+            bool tolx = true;
+            for (int j = 0; j < n; j++)
+                tolx = tolx && (st.sigma * sqrt(st.C[j * n + j]) < CMAES_TOLX) && (st.sigma * st.pc[j] < CMAES_TOLX);
+            if (tolx || SQR(dmax / dmin) > CMAES_MAX_COND || st.sigma * dmax > CMAES_MAX_SIGMA)
+                stop_run = true;
+
+            if (verbose > 1)
+                fprintf(stderr, "%s: gen = %d, best = %e, sigma = %e, cond = %e\n", __func__,
+                    gen_total, gen_best, st.sigma, SQR(dmax / dmin));
+
+            if (K_checkBudget(k, best_f) != BUDGET_OK) {
+                status = PROGRESS_STOP;
+                stop_run = true;
+            }
+
+            if (k->progress != NULL) {
+                char msg[200];
+                for (int j = 0; j < n; j++)
+                    *(mpars.pars[j]) = ok_cmaes_to_par(best_y[j], j, type, t0, width);
+                k->flags |= NEEDS_SETUP;
+                K_calculate(k);
+                sprintf(msg, "%s [run = %d, lambda = %d, best = %e, sigma = %.2e]", __func__,
+                        restart, lambda, best_f, st.sigma);
+                if (k->progress(gen_total, maxiter, k, msg) != PROGRESS_CONTINUE) {
+                    status = PROGRESS_STOP;
+                    stop_run = true;
+                }
+            }
+        }
+
+        ok_cmaes_free(&st);
+        if (status == PROGRESS_STOP)
+            break;
+    }
+
+    for (int j = 0; j < n; j++)
+        *(mpars.pars[j]) = ok_cmaes_to_par(best_y[j], j, type, t0, width);
+    k->flags |= NEEDS_SETUP;
+    K_calculate(k);
+
+    for (int i = 0; i < threads; i++) {
+        FREE_MINIMIZER_PARS(mpars_t[i]);
+        K_free(k_t[i]);
+    }
+    FREE_MINIMIZER_PARS(mpars);
+
+    return status;
+}
@@ -0,0 +1,48 @@
+/*
+ * File:   cmaes.h
+ */
+
+#ifndef CMAES_H
+#define	CMAES_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "kernel.h"
+#include "systemic.h"
+
+    /**
+     * Attempts to find the global minimum of the kernel k using the Covariance
+     * Matrix Adaptation Evolution Strategy (CMA-ES), with IPOP or BIPOP restarts.
+     * The population of each generation is evaluated in parallel, each thread working on
+     * its own copy of the kernel. Periods and masses are sampled in log-space.
+     * Candidates falling outside the ranges of the parameters (plRanges and
+     * parRanges) are resampled, and eventually clamped to the allowed range.
+     * The initial distribution is centered on the current state of the kernel,
+     * with a width proportional to the allowed range of each parameter (or to
+     * 360 degrees for angles, or 100 times the step of the parameter if no
+     * range is set, relative to its value for periods and masses).
+     *
+     * @param k The kernel object containing the state of the system.
+     * @param maxiter Maximum number of generations (summed over all restarts)
+     * @param params Array of options, terminated by DONE: OPT_CMAES_POPSIZE (initial
+     * population size, default 4 + 3 log(N)), OPT_CMAES_SIGMA (initial step size,
+     * as a fraction of the width of each parameter, default 0.3), OPT_CMAES_RESTARTS (maximum
+     * number of restarts, default 9), OPT_CMAES_BIPOP (if non-zero, alternates large and small
+     * population restarts (BIPOP), otherwise doubles the population at each restart (IPOP);
+     * default 0),
+     * OPT_CMAES_TOLFUN (stops a run when the range of the merit function over
+     * recent generations is smaller than this value, default 1e-8).
+     * @return PROGRESS_STOP if the progress callback interrupted the minimization,
+     * PROGRESS_CONTINUE otherwise.
+     */
+    int K_minimize_cmaes(ok_kernel* k, int maxiter, double params[]);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* CMAES_H */
+
@@ -10,6 +10,8 @@
 #include "math.h"
 #include "utils.h"
 #include "kernel.h"
+#include "rng.h"
+#include "de.h"
 
 #define DISTINCT(a, b, c, x) (a != b && a != c && b != c && a != x)
 #define IS_ANGLE(b) ((b) == MA || (b) == LOP || (b) == INC || (b) == NODE)
@@ -151,8 +153,11 @@ int K_minimize_de(ok_kernel* k, int trials, double params[]) {
     ok_kernel_minimizer_pars mpars_t[threads];
     
     
+    // Streams keyed by the generation and the index of the candidate
+    unsigned long int seed = gsl_rng_get(k->rng);
     for (int i = 0; i < threads; i++) {
-        k_t[i] = K_clone(k);
+        k_t[i] = K_cloneFlags(k, SHARE_BUDGET);
+        K_setRngStream(k_t[i], seed, 0);
         mpars_t[i] = K_getMinimizedVariables(k_t[i]);
     }
     
@@ -188,6 +193,7 @@ int K_minimize_de(ok_kernel* k, int trials, double params[]) {
             ok_kernel* kd = k_t[nt];
             ok_kernel_minimizer_pars mp = mpars_t[nt];
             double** parsd = mp.pars;
+            ok_rng_stream_set(kd->rng, seed, (unsigned long int) tr * ncand + x);
 
             int R = gsl_rng_uniform_int(kd->rng, npars);
             int a = 0, b = 0, c = 0;
@@ -251,6 +257,11 @@ int K_minimize_de(ok_kernel* k, int trials, double params[]) {
             
             chi2 += cand[x].chi;
         }
+
+        if (K_checkBudget(k, min_chi_new) != BUDGET_OK) {
+            status = PROGRESS_STOP;
+            break;
+        }
        
        
         
@@ -12,6 +12,12 @@
 extern "C" {
 #endif
 
+#include "systemic.h"
+
+// Default search domain for the elements without a range (also used by GA)
+extern const double ok_de_min[ELEMENTS_SIZE];
+extern const double ok_de_max[ELEMENTS_SIZE];
+
 int K_minimize_de(ok_kernel* k, int trials, double params[]);
 
 
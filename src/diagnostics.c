@@ -0,0 +1,220 @@
+#include "math.h"
+#include "string.h"
+#include "utils.h"
+#include "diagnostics.h"
+
+#define ANGLE_DIFF(a, b) ((a) - (b) - 360. * round(((a) - (b)) / 360.))
+
+/**
+ * Allocates the accumulators for a set of chains.
+ * @param nchains Number of chains
+ * @param npars Number of parameters of each sample
+ * @param angle Array of npars flags, true for parameters that are angles (in degrees);
+ * can be NULL
+ * @return A new diagnostics object, with no samples
+ */
+ok_diag* ok_diag_alloc(const int nchains, const int npars, const bool* angle) {
+    ok_diag* d = (ok_diag*) calloc(1, sizeof (ok_diag));
+    d->nchains = nchains;
+    d->npars = npars;
+    d->angle = (bool*) calloc(npars, sizeof (bool));
+    if (angle != NULL)
+        memcpy(d->angle, angle, sizeof (bool) * npars);
+
+    d->n = (double*) malloc(sizeof (double) * nchains);
+    d->batch = (int*) malloc(sizeof (int) * nchains);
+    d->nb = (int*) malloc(sizeof (int) * nchains);
+    d->fill = (int*) malloc(sizeof (int) * nchains);
+    d->mean = (double*) malloc(sizeof (double) * nchains * npars);
+    d->m2 = (double*) malloc(sizeof (double) * nchains * npars);
+    d->bsum = (double*) malloc(sizeof (double) * nchains * npars);
+    d->bmeans = (double*) malloc(sizeof (double) * nchains * npars * OK_DIAG_BATCHES);
+    ok_diag_reset(d);
+    return d;
+}
+
+void ok_diag_free(ok_diag* d) {
+    if (d == NULL)
+        return;
+    free(d->angle);
+    free(d->n);
+    free(d->batch);
+    free(d->nb);
+    free(d->fill);
+    free(d->mean);
+    free(d->m2);
+    free(d->bsum);
+    free(d->bmeans);
+    free(d);
+}
+
+/**
+ * Removes all the samples from the accumulators.
+ * @param d Diagnostics
+ */
+void ok_diag_reset(ok_diag* d) {
+    for (int c = 0; c < d->nchains; c++) {
+        d->n[c] = 0.;
+        d->batch[c] = 1;
+        d->nb[c] = 0;
+        d->fill[c] = 0;
+    }
+    memset(d->mean, 0, sizeof (double) * d->nchains * d->npars);
+    memset(d->m2, 0, sizeof (double) * d->nchains * d->npars);
+    memset(d->bsum, 0, sizeof (double) * d->nchains * d->npars);
+}
+
+void ok_diag_add(ok_diag* d, const int chain, const double* x) {
+    const int np = d->npars;
+    double* mean = d->mean + chain * np;
+    double* m2 = d->m2 + chain * np;
+    double* bsum = d->bsum + chain * np;
+
+    d->n[chain] += 1.;
+    const double n = d->n[chain];
+
+    for (int p = 0; p < np; p++) {
+        // Angles are unwrapped around the running mean of the chain
+        double v = (d->angle[p] && n > 1 ? mean[p] + ANGLE_DIFF(x[p], mean[p]) : x[p]);
+        double delta = v - mean[p];
+        mean[p] += delta / n;
+        m2[p] += delta * (v - mean[p]);
+        bsum[p] += v;
+    }
+
+    if (++d->fill[chain] < d->batch[chain])
+        return;
+
+    // Batch completed; when the batches are full, merge them pairwise and double their size
+    const int nb = d->nb[chain];
+    for (int p = 0; p < np; p++) {
+        d->bmeans[(chain * np + p) * OK_DIAG_BATCHES + nb] = bsum[p] / d->batch[chain];
+        bsum[p] = 0.;
+    }
+    d->fill[chain] = 0;
+    d->nb[chain]++;
+
+    if (d->nb[chain] == OK_DIAG_BATCHES) {
+        for (int p = 0; p < np; p++) {
+            double* bm = d->bmeans + (chain * np + p) * OK_DIAG_BATCHES;
+            for (int i = 0; i < OK_DIAG_BATCHES / 2; i++)
+                bm[i] = 0.5 * (bm[2 * i] + bm[2 * i + 1]);
+        }
+        d->nb[chain] = OK_DIAG_BATCHES / 2;
+        d->batch[chain] *= 2;
+    }
+}
+
+bool ok_diag_save_bin(const ok_diag* d, FILE* out) {
+    const int nc = d->nchains;
+    const int ncp = d->nchains * d->npars;
+    int hdr[2] = {d->nchains, d->npars};
+    fwrite(hdr, sizeof (int), 2, out);
+    fwrite(d->n, sizeof (double), nc, out);
+    fwrite(d->batch, sizeof (int), nc, out);
+    fwrite(d->nb, sizeof (int), nc, out);
+    fwrite(d->fill, sizeof (int), nc, out);
+    fwrite(d->mean, sizeof (double), ncp, out);
+    fwrite(d->m2, sizeof (double), ncp, out);
+    fwrite(d->bsum, sizeof (double), ncp, out);
+    fwrite(d->bmeans, sizeof (double), ncp * OK_DIAG_BATCHES, out);
+    return !ferror(out);
+}
+
+bool ok_diag_load_bin(ok_diag* d, FILE* fid) {
+    const int nc = d->nchains;
+    const int ncp = d->nchains * d->npars;
+    int hdr[2];
+    if (fread(hdr, sizeof (int), 2, fid) != 2 || hdr[0] != d->nchains || hdr[1] != d->npars)
+        return false;
+    return (fread(d->n, sizeof (double), nc, fid) == nc &&
+            fread(d->batch, sizeof (int), nc, fid) == nc &&
+            fread(d->nb, sizeof (int), nc, fid) == nc &&
+            fread(d->fill, sizeof (int), nc, fid) == nc &&
+            fread(d->mean, sizeof (double), ncp, fid) == ncp &&
+            fread(d->m2, sizeof (double), ncp, fid) == ncp &&
+            fread(d->bsum, sizeof (double), ncp, fid) == ncp &&
+            fread(d->bmeans, sizeof (double), ncp * OK_DIAG_BATCHES, fid) == ncp * OK_DIAG_BATCHES);
+}
+
+double ok_diag_count(const ok_diag* d, const int chain) {
+    return d->n[chain];
+}
+
+double ok_diag_mean(const ok_diag* d, const int chain, const int par) {
+    double m = d->mean[chain * d->npars + par];
+    return (d->angle[par] ? DEGRANGE(m) : m);
+}
+
+double ok_diag_sd(const ok_diag* d, const int chain, const int par) {
+    double n = d->n[chain];
+    return (n > 1 ? sqrt(d->m2[chain * d->npars + par] / (n - 1.)) : INVALID_NUMBER);
+}
+
+double ok_diag_rhat(const ok_diag* d, const int par) {
+    int m = 0;
+    double ref = 0., nbar = 0., W = 0., mm = 0., mm2 = 0.;
+
+    for (int c = 0; c < d->nchains; c++) {
+        double n = d->n[c];
+        if (n < 2)
+            continue;
+        double mean = d->mean[c * d->npars + par];
+        if (m == 0)
+            ref = mean;
+        if (d->angle[par])
+            mean = ref + ANGLE_DIFF(mean, ref);
+
+        m++;
+        nbar += n;
+        W += d->m2[c * d->npars + par] / (n - 1.);
+        double delta = mean - mm;
+        mm += delta / m;
+        mm2 += delta * (mean - mm);
+    }
+
+    if (m < 2)
+        return INVALID_NUMBER;
+
+    nbar /= m;
+    W /= m;
+    double Bn = mm2 / (m - 1.);
+    if (!(W > 0))
+        return INVALID_NUMBER;
+    return sqrt(((nbar - 1.) / nbar * W + Bn) / W);
+}
+
+double ok_diag_iat(const ok_diag* d, const int chain, const int par) {
+    const int nb = d->nb[chain];
+    double var = ok_diag_sd(d, chain, par);
+    if (nb < 4 || IS_INVALID(var) || !(var > 0))
+        return INVALID_NUMBER;
+    var *= var;
+
+    const double* bm = d->bmeans + (chain * d->npars + par) * OK_DIAG_BATCHES;
+    double mb = 0., vb = 0.;
+    for (int i = 0; i < nb; i++) {
+        double delta = bm[i] - mb;
+        mb += delta / (i + 1);
+        vb += delta * (bm[i] - mb);
+    }
+    vb /= (nb - 1.);
+
+    return d->batch[chain] * vb / var;
+}
+
+double ok_diag_ess(const ok_diag* d, const int chain, const int par) {
+    if (chain >= 0) {
+        double tau = ok_diag_iat(d, chain, par);
+        return (IS_INVALID(tau) ? INVALID_NUMBER : MIN(d->n[chain] / tau, d->n[chain]));
+    }
+
+    double ess = 0.;
+    for (int c = 0; c < d->nchains; c++) {
+        double e = ok_diag_ess(d, c, par);
+        if (IS_INVALID(e))
+            return INVALID_NUMBER;
+        ess += e;
+    }
+    return ess;
+}
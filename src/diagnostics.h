@@ -0,0 +1,108 @@
+/*
+ * File:   diagnostics.h
+ */
+
+#ifndef DIAGNOSTICS_H
+#define	DIAGNOSTICS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "systemic.h"
+
+    /*
+     * Streaming convergence diagnostics for a set of chains. Each sample is
+     * added in O(npars) time; the accumulators are a running (Welford) mean and
+     * variance per chain and parameter, and batch means of adaptive size (the
+     * batches are merged pairwise when their number reaches OK_DIAG_BATCHES)
+     * used to estimate the integrated autocorrelation time.
+     */
+#define OK_DIAG_BATCHES 64
+
+    typedef struct {
+        int nchains;
+        int npars;
+        // parameters that are angles (in degrees), averaged along the shortest arc
+        bool* angle;
+
+        // per chain
+        double* n;
+        int* batch;
+        int* nb;
+        int* fill;
+
+        // per chain and parameter (index chain * npars + par)
+        double* mean;
+        double* m2;
+        double* bsum;
+        // per chain, parameter and batch (index (chain * npars + par) * OK_DIAG_BATCHES + batch)
+        double* bmeans;
+    } ok_diag;
+
+    ok_diag* ok_diag_alloc(const int nchains, const int npars, const bool* angle);
+    void ok_diag_free(ok_diag* d);
+    void ok_diag_reset(ok_diag* d);
+
+    /**
+     * Adds a sample to a chain.
+     * @param d Diagnostics
+     * @param chain Index of the chain
+     * @param x Value of the npars parameters
+     */
+    void ok_diag_add(ok_diag* d, const int chain, const double* x);
+
+    /**
+     * Writes the accumulators to a binary stream, to be restored by ok_diag_load_bin.
+     * @param d Diagnostics
+     * @param out File handle (already opened for writing)
+     * @return true on success
+     */
+    bool ok_diag_save_bin(const ok_diag* d, FILE* out);
+    /**
+     * Restores the accumulators saved by ok_diag_save_bin into d, which must have
+     * been allocated with the same number of chains and parameters.
+     * @return true on success
+     */
+    bool ok_diag_load_bin(ok_diag* d, FILE* fid);
+
+    // Number of samples, mean and standard deviation of a parameter of a chain
+    double ok_diag_count(const ok_diag* d, const int chain);
+    double ok_diag_mean(const ok_diag* d, const int chain, const int par);
+    double ok_diag_sd(const ok_diag* d, const int chain, const int par);
+
+    /**
+     * Returns the Gelman-Rubin potential scale reduction factor of a parameter,
+     * computed from the means and variances of the chains (O(nchains)).
+     * @param d Diagnostics
+     * @param par Index of the parameter
+     * @return R-hat, or INVALID_NUMBER if there are less than 2 chains with at least 2 samples
+     */
+    double ok_diag_rhat(const ok_diag* d, const int par);
+
+    /**
+     * Returns the integrated autocorrelation time of a parameter of a chain,
+     * estimated with the method of batch means.
+     * @param d Diagnostics
+     * @param chain Index of the chain
+     * @param par Index of the parameter
+     * @return The autocorrelation time (in samples), or INVALID_NUMBER if the
+     * chain is too short
+     */
+    double ok_diag_iat(const ok_diag* d, const int chain, const int par);
+
+    /**
+     * Returns the effective sample size of a parameter.
+     * @param d Diagnostics
+     * @param chain Index of the chain, or -1 for the sum over all the chains
+     * @param par Index of the parameter
+     * @return The effective sample size, or INVALID_NUMBER if the chains are too short
+     */
+    double ok_diag_ess(const ok_diag* d, const int chain, const int par);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* DIAGNOSTICS_H */
+
@@ -0,0 +1,299 @@
+#include <gsl/gsl_randist.h>
+
+#ifndef JAVASCRIPT
+#include "omp.h"
+#else
+#include "omp_shim.h"
+#endif
+
+#include "math.h"
+#include "utils.h"
+#include "kernel.h"
+#include "mcmc.h"
+#include "diagnostics.h"
+#include "ensemble.h"
+
+#define IS_ANGLE(b) ((b) == MA || (b) == LOP || (b) == INC || (b) == NODE)
+
+/*
+ * Walkers move in the space of the minimized parameters. Angles are not wrapped
+ * (the posterior is periodic in them, so the moves stay affine-invariant);
+ * they are only brought back to [0, 360) when copied into a kernel.
+ */
+typedef struct {
+    int n;
+    const int* type;
+    const double* min;
+    const double* max;
+    const bool* noise;
+} ok_ensemble_space;
+
+static bool ok_ensemble_valid(const ok_ensemble_space* sp, const double* x) {
+    for (int j = 0; j < sp->n; j++) {
+        int type = sp->type[j];
+        double v = (IS_ANGLE(type) ? DEGRANGE(x[j]) : x[j]);
+        if (IS_NOT_FINITE(v) || v < sp->min[j] || v > sp->max[j])
+            return false;
+        if ((type == PER || type == MASS) && v <= 0.)
+            return false;
+        if (type == ECC && (v < 0. || v >= 1.))
+            return false;
+        if (sp->noise[j] && v < 0.)
+            return false;
+    }
+    return true;
+}
+
+static void ok_ensemble_set(const ok_ensemble_space* sp, ok_kernel_minimizer_pars* mp, const double* x) {
+    for (int j = 0; j < sp->n; j++)
+        *(mp->pars[j]) = (IS_ANGLE(sp->type[j]) ? DEGRANGE(x[j]) : x[j]);
+}
+
+static void ok_ensemble_evaluate(ok_kernel** k_t, ok_kernel_minimizer_pars* mp_t, const int threads,
+        const ok_ensemble_space* sp, const double* pos, const bool* valid, double* li, double* pr,
+        const int from, const int to, ok_callback2 merit_function) {
+    const int n = sp->n;
+
+    #pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for (int i = from; i < to; i++) {
+        li[i] = -INFINITY;
+        pr[i] = 0.;
+        if (!valid[i])
+            continue;
+
+        int th = omp_get_thread_num();
+        double m[2];
+        ok_ensemble_set(sp, &mp_t[th], pos + (size_t) i * n);
+        k_t[th]->flags |= NEEDS_SETUP;
+        (merit_function == NULL ? K_mcmc_likelihood_and_prior_default(k_t[th], m) : merit_function(k_t[th], m));
+        if (!IS_NOT_FINITE(m[0]) && !IS_NOT_FINITE(m[1])) {
+            li[i] = m[0];
+            pr[i] = m[1];
+        }
+    }
+}
+
+static void ok_ensemble_record(ok_list* kl, const int from, ok_kernel** k_t, ok_kernel_minimizer_pars* mp_t,
+        const int threads, const ok_ensemble_space* sp, const double* pos, const double* li, const double* pr,
+        const int nwalkers) {
+    const int n = sp->n;
+
+    #pragma omp parallel for num_threads(threads)
+    for (int w = 0; w < nwalkers; w++) {
+        int th = omp_get_thread_num();
+        ok_ensemble_set(sp, &mp_t[th], pos + (size_t) w * n);
+        k_t[th]->flags |= NEEDS_SETUP;
+        ok_list_item* it = KL_set(kl, from + w, K_getAllElements(k_t[th]), ok_vector_copy(k_t[th]->params),
+                                  li[w] + pr[w], w);
+        it->merit_li = li[w];
+        it->merit_pr = pr[w];
+    }
+}
+
+ok_list* K_mcmc_ensemble(ok_kernel* k, unsigned int nwalkers, unsigned int nsteps, unsigned int skip, unsigned int discard,
+                         const double params[], ok_callback2 merit_function) {
+    double a = 2.;
+    double de_frac = 0.;
+    double init = 1.;
+    double beta = 1.;
+    int verbose = 0;
+
+    int idx = 0;
+    while (params != NULL) {
+        if (params[idx] == DONE)
+            break;
+        else if (params[idx] == OPT_ENSEMBLE_A)
+            a = MAX(params[idx + 1], 1. + 1e-6);
+        else if (params[idx] == OPT_ENSEMBLE_DE)
+            de_frac = RANGE(params[idx + 1], 0., 1.);
+        else if (params[idx] == OPT_ENSEMBLE_INIT)
+            init = params[idx + 1];
+        else if (params[idx] == OPT_MCMC_BETA)
+            beta = params[idx + 1];
+        else if (params[idx] == OPT_MCMC_VERBOSE_DIAGS)
+            verbose = (int) params[idx + 1];
+        idx += 2;
+    }
+
+    discard = MAX(discard, 1);
+
+    K_calculate(k);
+    ok_kernel_minimizer_pars mpars = K_getMinimizedVariables(k);
+    const int n = mpars.npars;
+
+    nwalkers = MAX(nwalkers, MAX(2 * n, 4));
+    nwalkers += nwalkers % 2;
+    const int W = nwalkers;
+    const int half = W / 2;
+
+    bool noise[MAX(n, 1)];
+    for (int j = 0; j < n; j++) {
+        int par = (int) (mpars.pars[j] - k->params->data);
+        noise[j] = (mpars.type[j] < 0 && par >= P_DATA_NOISE1 && par <= P_DATA_NOISE10);
+    }
+    ok_ensemble_space sp = {n, mpars.type, mpars.min, mpars.max, noise};
+
+    // With verbose output, each walker is tracked as a chain to report the autocorrelation times
+    ok_diag* diag = NULL;
+    if (verbose) {
+        bool angle[MAX(n, 1)];
+        for (int j = 0; j < n; j++)
+            angle[j] = IS_ANGLE(mpars.type[j]);
+        diag = ok_diag_alloc(W, n, angle);
+    }
+
+    const int nrec = MAX((nsteps + discard - 1) / discard, 1);
+    ok_list* kl = KL_alloc(nrec * W, K_clone(k));
+    int recorded = 0;
+
+    double* pos = (double*) malloc(sizeof (double) * W * MAX(n, 1));
+    double* prop = (double*) malloc(sizeof (double) * W * MAX(n, 1));
+    double* li = (double*) malloc(sizeof (double) * W);
+    double* pr = (double*) malloc(sizeof (double) * W);
+    double* li_y = (double*) malloc(sizeof (double) * W);
+    double* pr_y = (double*) malloc(sizeof (double) * W);
+    double* lz = (double*) malloc(sizeof (double) * W);
+    bool* valid = (bool*) malloc(sizeof (bool) * W);
+
+    // Per-thread workspaces used to evaluate each half of the ensemble
+    const int threads = (omp_in_parallel() ? 1 : MAX(MIN(omp_get_max_threads(), half), 1));
+    ok_kernel* k_t[threads];
+    ok_kernel_minimizer_pars mp_t[threads];
+    for (int i = 0; i < threads; i++) {
+        k_t[i] = K_cloneWorkspace(k);
+        k_t[i]->progress = NULL;
+        mp_t[i] = K_getMinimizedVariables(k_t[i]);
+    }
+
+    ok_budget_start(k->budget);
+
+    // Initial ensemble: the current state, and a gaussian ball around it
+    for (int j = 0; j < n; j++) {
+        pos[j] = *(mpars.pars[j]);
+        if (!(mpars.steps[j] > 0))
+            mpars.steps[j] = MAX(1e-3 * fabs(pos[j]), 1e-6);
+    }
+    valid[0] = ok_ensemble_valid(&sp, pos);
+    for (int w = 1; w < W; w++) {
+        double* x = pos + (size_t) w * n;
+        for (int t = 0; t < 1000; t++) {
+            for (int j = 0; j < n; j++)
+                x[j] = pos[j] + gsl_ran_gaussian(k->rng, init * mpars.steps[j]);
+            if (ok_ensemble_valid(&sp, x))
+                break;
+        }
+        valid[w] = ok_ensemble_valid(&sp, x);
+    }
+    ok_ensemble_evaluate(k_t, mp_t, threads, &sp, pos, valid, li, pr, 0, W, merit_function);
+
+    const double gamma0 = 2.38 / sqrt(2. * MAX(n, 1));
+    double acc = 0., tried = 0.;
+    ok_progress progress = k->progress;
+
+    for (unsigned int step = 0; step < skip + nsteps; step++) {
+        for (int h = 0; h < 2; h++) {
+            const int from = h * half;
+            const int other = (1 - h) * half;
+
+            // Proposals are drawn serially from k->rng, in the order of the walkers
+            for (int w = from; w < from + half; w++) {
+                const double* x = pos + (size_t) w * n;
+                double* y = prop + (size_t) w * n;
+
+                if (de_frac > 0. && gsl_rng_uniform(k->rng) < de_frac) {
+                    int c1 = other + gsl_rng_uniform_int(k->rng, half);
+                    int c2 = other + gsl_rng_uniform_int(k->rng, half - 1);
+                    if (c2 >= c1)
+                        c2++;
+                    // Occasionally jump by the full separation, to hop between modes
+                    double g = (gsl_rng_uniform(k->rng) < 0.1 ? 1. :
+                                gamma0 * (1. + 1e-5 * gsl_ran_gaussian(k->rng, 1.)));
+                    for (int j = 0; j < n; j++)
+                        y[j] = x[j] + g * (pos[(size_t) c1 * n + j] - pos[(size_t) c2 * n + j]);
+                    lz[w] = 0.;
+                } else {
+                    int c = other + gsl_rng_uniform_int(k->rng, half);
+                    double z = SQR((a - 1.) * gsl_rng_uniform(k->rng) + 1.) / a;
+                    for (int j = 0; j < n; j++)
+                        y[j] = pos[(size_t) c * n + j] + z * (x[j] - pos[(size_t) c * n + j]);
+                    lz[w] = (n - 1) * log(z);
+                }
+                valid[w] = ok_ensemble_valid(&sp, y);
+            }
+
+            ok_ensemble_evaluate(k_t, mp_t, threads, &sp, prop, valid, li_y, pr_y, from, from + half, merit_function);
+
+            for (int w = from; w < from + half; w++) {
+                double u = gsl_rng_uniform(k->rng);
+                double lp_x = pr[w] + beta * li[w];
+                double lp_y = pr_y[w] + beta * li_y[w];
+                tried += 1.;
+
+                if (!IS_NOT_FINITE(lp_y) && (IS_NOT_FINITE(lp_x) || log(u) < lz[w] + lp_y - lp_x)) {
+                    memcpy(pos + (size_t) w * n, prop + (size_t) w * n, sizeof (double) * n);
+                    li[w] = li_y[w];
+                    pr[w] = pr_y[w];
+                    acc += 1.;
+                }
+            }
+        }
+
+        if (step >= skip && (step - skip) % discard == 0 && recorded < nrec) {
+            ok_ensemble_record(kl, recorded * W, k_t, mp_t, threads, &sp, pos, li, pr, W);
+            recorded++;
+            for (int w = 0; w < W && diag != NULL; w++)
+                ok_diag_add(diag, w, pos + (size_t) w * n);
+        }
+
+        if (verbose && (step + 1) % 100 == 0)
+            fprintf(stderr, "%s: step = %u, acc = %.3f\n", __func__, step + 1, acc / tried);
+
+        bool stop = (K_checkBudget(k, INVALID_NUMBER) != BUDGET_OK);
+        if (!stop && progress != NULL) {
+            char msg[200];
+            sprintf(msg, "%s [acc = %.3f, walkers = %d%s]", __func__, acc / tried, W,
+                    (step < skip ? ", burn-in" : ""));
+            stop = (progress(step, skip + nsteps, NULL, msg) == PROGRESS_STOP);
+        }
+
+        // Stopping early returns the samples retained so far
+        if (stop)
+            break;
+    }
+
+    if (recorded == 0) {
+        ok_ensemble_record(kl, 0, k_t, mp_t, threads, &sp, pos, li, pr, W);
+        recorded = 1;
+    }
+    kl->size = recorded * W;
+
+    if (verbose) {
+        fprintf(stderr, "%s: acceptance rate = %.3f\n", __func__, acc / MAX(tried, 1.));
+        for (int j = 0; j < n; j++) {
+            double iat = 0.;
+            for (int w = 0; w < W; w++)
+                iat += ok_diag_iat(diag, w, j) / W;
+            fprintf(stderr, "%s: par %d, R = %.4f, IAT = %.1f samples, ESS = %.0f\n", __func__, j,
+                    ok_diag_rhat(diag, j), iat, ok_diag_ess(diag, -1, j));
+        }
+        ok_diag_free(diag);
+    }
+
+    ok_budget_stop(k->budget);
+
+    for (int i = 0; i < threads; i++) {
+        FREE_MINIMIZER_PARS(mp_t[i]);
+        K_free(k_t[i]);
+    }
+    FREE_MINIMIZER_PARS(mpars);
+    free(pos);
+    free(prop);
+    free(li);
+    free(pr);
+    free(li_y);
+    free(pr_y);
+    free(lz);
+    free(valid);
+
+    return kl;
+}
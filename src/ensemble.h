@@ -0,0 +1,51 @@
+/*
+ * File:   ensemble.h
+ */
+
+#ifndef ENSEMBLE_H
+#define	ENSEMBLE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "systemic.h"
+#include "kernel.h"
+#include "kl.h"
+
+    /**
+     * Samples the posterior with an affine-invariant ensemble sampler (Goodman & Weare 2010).
+     * The walkers are split in two halves; each walker of a half is moved using the walkers
+     * of the other half, either with a stretch move or with a differential-evolution move
+     * (ter Braak 2006), so that each half can be evaluated in parallel (each thread working on
+     * its own copy of the kernel). Unlike K_mcmc_mult, no step sizes need to be tuned: the steps
+     * of the kernel are only used to scatter the initial walkers around the current state.
+     * Proposals outside the ranges of the parameters, with non-positive periods or masses,
+     * eccentricities outside [0, 1) or negative noise parameters are rejected.
+     * If the budget of k (see K_setBudget) is exhausted or the progress callback stops the run,
+     * the samples retained so far are returned.
+     *
+     * @param k Kernel to be used as the starting point. Set minimization flag to MINIMIZE to decide what parameters to vary.
+     * @param nwalkers Number of walkers; raised to at least twice the number of parameters (and to an even number)
+     * @param nsteps Number of steps of the ensemble after the first 'skip' steps
+     * @param skip Number of steps of the ensemble discarded as burn-in
+     * @param discard Only retain every 'discard'-th step of the ensemble
+     * @param params Array of options, terminated by DONE: OPT_ENSEMBLE_A (scale parameter a of
+     * the stretch move, default 2), OPT_ENSEMBLE_DE (fraction of differential-evolution moves,
+     * default 0), OPT_ENSEMBLE_INIT (width of the initial ball of walkers, in units of the
+     * steps of the parameters, default 1), OPT_MCMC_BETA (inverse temperature of the likelihood,
+     * default 1), OPT_MCMC_VERBOSE_DIAGS.
+     * @param merit_function A function that returns the log-likelihood and log-prior of the
+     * current state (see K_mcmc_mult); set to NULL for the default.
+     * @return A list of (nsteps / discard) x nwalkers samples, ordered by step; the tag of each
+     * sample is the index of its walker.
+     */
+    ok_list* K_mcmc_ensemble(ok_kernel* k, unsigned int nwalkers, unsigned int nsteps, unsigned int skip, unsigned int discard,
+                             const double params[], ok_callback2 merit_function);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* ENSEMBLE_H */
+
@@ -0,0 +1,317 @@
+#include <gsl/gsl_randist.h>
+
+#ifndef JAVASCRIPT
+#include "omp.h"
+#else
+#include "omp_shim.h"
+#endif
+
+#include "math.h"
+#include "utils.h"
+#include "kernel.h"
+#include "simplex.h"
+#include "de.h"
+#include "ga.h"
+
+#define IS_ANGLE(b) ((b) == MA || (b) == LOP || (b) == INC || (b) == NODE)
+#define IS_LOG(b) ((b) == MASS || (b) == PER)
+
+typedef struct {
+    double f;
+    int idx;
+} ok_ga_rank;
+
+static int ok_ga_rank_cmp(const void* a, const void* b) {
+    double fa = ((const ok_ga_rank*) a)->f;
+    double fb = ((const ok_ga_rank*) b)->f;
+    return (fa < fb ? -1 : (fa > fb ? 1 : 0));
+}
+
+/*
+ * Each individual is a vector of genes g, with g = log(x) for periods and masses
+ * and g = x otherwise. Angles without an explicit range are wrapped around
+ * instead of being clamped to the domain.
+ */
+typedef struct {
+    int n;
+    bool* logg;
+    bool* wrap;
+    double* lo;
+    double* hi;
+    // width of a mutation of unit scale (one step)
+    double* sg;
+} ok_ga_genome;
+
+static void ok_ga_repair(const ok_ga_genome* gn, double* g) {
+    for (int j = 0; j < gn->n; j++) {
+        if (gn->wrap[j])
+            g[j] = DEGRANGE(g[j]);
+        else
+            g[j] = RANGE(g[j], gn->lo[j], gn->hi[j]);
+    }
+}
+
+static void ok_ga_evaluate(ok_kernel* k, ok_kernel** k_t, ok_kernel_minimizer_pars* mp_t, const int threads,
+        const ok_ga_genome* gn, const double* pop, double* fit, const int from, const int to) {
+    const int n = gn->n;
+
+    #pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for (int i = from; i < to; i++) {
+        int th = omp_get_thread_num();
+        const double* g = pop + (size_t) i * n;
+        for (int j = 0; j < n; j++)
+            *(mp_t[th].pars[j]) = (gn->logg[j] ? exp(g[j]) : g[j]);
+
+        k_t[th]->flags |= NEEDS_SETUP;
+        K_calculate(k_t[th]);
+        double f = k->minfunc(k_t[th]);
+        fit[i] = (IS_NOT_FINITE(f) ? DBL_MAX : f);
+    }
+}
+
+static int ok_ga_tournament(gsl_rng* r, const double* fit, const int popsize, const int size) {
+    int best = gsl_rng_uniform_int(r, popsize);
+    for (int t = 1; t < size; t++) {
+        int c = gsl_rng_uniform_int(r, popsize);
+        if (fit[c] < fit[best])
+            best = c;
+    }
+    return best;
+}
+
+int K_minimize_ga(ok_kernel* k, int maxiter, double params[]) {
+    int status = PROGRESS_CONTINUE;
+    int popsize = 0;
+    int tsize = 3;
+    double pc = 0.9;
+    double alpha = 0.5;
+    double pm = -1;
+    double mscale = 100.;
+    int elite = 2;
+    int stall = 50;
+    int polish = 5000;
+    int verbose = 0;
+
+    int idx = 0;
+    while (params != NULL) {
+        if (params[idx] == DONE)
+            break;
+        else if (params[idx] == OPT_GA_POPSIZE)
+            popsize = (int) params[idx + 1];
+        else if (params[idx] == OPT_GA_TOURNAMENT)
+            tsize = MAX((int) params[idx + 1], 1);
+        else if (params[idx] == OPT_GA_CROSSOVER)
+            pc = params[idx + 1];
+        else if (params[idx] == OPT_GA_BLEND)
+            alpha = params[idx + 1];
+        else if (params[idx] == OPT_GA_MUTATION)
+            pm = params[idx + 1];
+        else if (params[idx] == OPT_GA_MUTATION_SCALE)
+            mscale = MAX(params[idx + 1], 1.);
+        else if (params[idx] == OPT_GA_ELITE)
+            elite = MAX((int) params[idx + 1], 0);
+        else if (params[idx] == OPT_GA_STALL)
+            stall = (int) params[idx + 1];
+        else if (params[idx] == OPT_GA_POLISH)
+            polish = (int) params[idx + 1];
+        else if (params[idx] == OPT_VERBOSE_DIAGS)
+            verbose = (int) params[idx + 1];
+        idx += 2;
+    }
+
+    K_calculate(k);
+    ok_kernel_minimizer_pars mpars = K_getMinimizedVariables(k);
+    const int n = mpars.npars;
+
+    if (n == 0) {
+        FREE_MINIMIZER_PARS(mpars);
+        return status;
+    }
+
+    if (popsize < 4)
+        popsize = MAX(10 * n, 30);
+    if (pm < 0)
+        pm = MAX(1. / n, 0.1);
+    elite = MIN(elite, popsize - 1);
+
+    bool logg[n], wrap[n];
+    double lo[n], hi[n], sg[n];
+    ok_ga_genome gn = {n, logg, wrap, lo, hi, sg};
+
+    for (int j = 0; j < n; j++) {
+        int type = mpars.type[j];
+        double x0 = *(mpars.pars[j]);
+        double step = mpars.steps[j];
+        double min = mpars.min[j];
+        double max = mpars.max[j];
+
+        wrap[j] = (IS_ANGLE(type) && min == -DBL_MAX && max == DBL_MAX);
+        if (type >= 0 && ok_de_max[type] > ok_de_min[type]) {
+            min = (min > -DBL_MAX ? min : MIN(ok_de_min[type], x0));
+            max = (max < DBL_MAX ? max : MAX(ok_de_max[type], x0));
+        } else {
+            min = (min > -DBL_MAX ? min : x0 - 100. * step);
+            max = (max < DBL_MAX ? max : x0 + 100. * step);
+        }
+
+        logg[j] = (IS_LOG(type) && x0 > 0 && min > 0);
+        if (logg[j]) {
+            step = MAX(step, step * x0);
+            lo[j] = log(min);
+            hi[j] = log(max);
+            sg[j] = step / x0;
+        } else {
+            lo[j] = min;
+            hi[j] = max;
+            sg[j] = step;
+        }
+        if (!(sg[j] > 0) || IS_NOT_FINITE(sg[j]))
+            sg[j] = 1e-3 * MAX(hi[j] - lo[j], 1e-10);
+    }
+
+    double* pop = (double*) malloc(sizeof (double) * popsize * n);
+    double* next = (double*) malloc(sizeof (double) * popsize * n);
+    double* fit = (double*) malloc(sizeof (double) * popsize);
+    double* nfit = (double*) malloc(sizeof (double) * popsize);
+    ok_ga_rank* rank = (ok_ga_rank*) malloc(sizeof (ok_ga_rank) * popsize);
+
+    // Initial population: the current state, half of the individuals spread
+    // over the whole domain, the rest around the current state
+    for (int j = 0; j < n; j++)
+        pop[j] = (logg[j] ? log(*(mpars.pars[j])) : *(mpars.pars[j]));
+    for (int i = 1; i < popsize; i++) {
+        double* g = pop + (size_t) i * n;
+        for (int j = 0; j < n; j++) {
+            if (i % 2 == 0)
+                g[j] = lo[j] + (hi[j] - lo[j]) * gsl_rng_uniform(k->rng);
+            else
+                g[j] = pop[j] + gsl_ran_gaussian(k->rng, mscale * sg[j]);
+        }
+        ok_ga_repair(&gn, g);
+    }
+
+    // Per-thread workspaces used to evaluate each generation
+    const int threads = (omp_in_parallel() ? 1 : MAX(MIN(omp_get_max_threads(), popsize), 1));
+    ok_kernel* k_t[threads];
+    ok_kernel_minimizer_pars mp_t[threads];
+    for (int i = 0; i < threads; i++) {
+        k_t[i] = K_cloneWorkspace(k);
+        k_t[i]->progress = NULL;
+        mp_t[i] = K_getMinimizedVariables(k_t[i]);
+    }
+
+    ok_ga_evaluate(k, k_t, mp_t, threads, &gn, pop, fit, 0, popsize);
+
+    double best_f = DBL_MAX;
+    double best_g[n];
+    memcpy(best_g, pop, sizeof (double) * n);
+    int last_improved = 0;
+
+    for (int gen = 0; gen < maxiter; gen++) {
+        for (int i = 0; i < popsize; i++) {
+            rank[i].f = fit[i];
+            rank[i].idx = i;
+        }
+        qsort(rank, popsize, sizeof (ok_ga_rank), ok_ga_rank_cmp);
+
+        if (rank[0].f < best_f) {
+            if (best_f - rank[0].f > 1e-10 * MAX(fabs(rank[0].f), 1.))
+                last_improved = gen;
+            best_f = rank[0].f;
+            memcpy(best_g, pop + (size_t) rank[0].idx * n, sizeof (double) * n);
+        }
+
+        if (verbose)
+            fprintf(stderr, "%s: gen = %d, best = %e, median = %e\n", __func__, gen, best_f,
+                    rank[popsize / 2].f);
+
+        if (K_checkBudget(k, best_f) != BUDGET_OK) {
+            status = PROGRESS_STOP;
+            break;
+        }
+
+        if (k->progress != NULL) {
+            char msg[200];
+            for (int j = 0; j < n; j++)
+                *(mpars.pars[j]) = (logg[j] ? exp(best_g[j]) : best_g[j]);
+            k->flags |= NEEDS_SETUP;
+            K_calculate(k);
+            sprintf(msg, "%s [best = %e, median = %e]", __func__, best_f, rank[popsize / 2].f);
+            if (k->progress(gen, maxiter, k, msg) != PROGRESS_CONTINUE) {
+                status = PROGRESS_STOP;
+                break;
+            }
+        }
+
+        if (stall > 0 && gen - last_improved >= stall)
+            break;
+
+        // Width of the mutations, decreasing geometrically from mscale to 1 step
+        double scale = mscale * pow(1. / mscale, (double) gen / (double) MAX(maxiter - 1, 1));
+
+        for (int i = 0; i < elite; i++) {
+            memcpy(next + (size_t) i * n, pop + (size_t) rank[i].idx * n, sizeof (double) * n);
+            nfit[i] = rank[i].f;
+        }
+
+        for (int i = elite; i < popsize; i++) {
+            double* c = next + (size_t) i * n;
+            const double* p1 = pop + (size_t) ok_ga_tournament(k->rng, fit, popsize, tsize) * n;
+            const double* p2 = pop + (size_t) ok_ga_tournament(k->rng, fit, popsize, tsize) * n;
+
+            if (gsl_rng_uniform(k->rng) < pc) {
+                // Blend crossover (BLX-alpha); angles are blended along the shortest arc
+                for (int j = 0; j < n; j++) {
+                    double d = p2[j] - p1[j];
+                    if (wrap[j])
+                        d -= 360. * round(d / 360.);
+                    double u = -alpha + (1. + 2. * alpha) * gsl_rng_uniform(k->rng);
+                    c[j] = p1[j] + u * d;
+                }
+            } else
+                memcpy(c, p1, sizeof (double) * n);
+
+            for (int j = 0; j < n; j++)
+                if (gsl_rng_uniform(k->rng) < pm)
+                    c[j] += gsl_ran_gaussian(k->rng, scale * sg[j]);
+
+            ok_ga_repair(&gn, c);
+        }
+
+        ok_ga_evaluate(k, k_t, mp_t, threads, &gn, next, nfit, elite, popsize);
+
+        double* tmp = pop;
+        pop = next;
+        next = tmp;
+        tmp = fit;
+        fit = nfit;
+        nfit = tmp;
+    }
+
+    for (int i = 0; i < popsize; i++)
+        if (fit[i] < best_f) {
+            best_f = fit[i];
+            memcpy(best_g, pop + (size_t) i * n, sizeof (double) * n);
+        }
+
+    for (int j = 0; j < n; j++)
+        *(mpars.pars[j]) = (logg[j] ? exp(best_g[j]) : best_g[j]);
+    k->flags |= NEEDS_SETUP;
+    K_calculate(k);
+
+    for (int i = 0; i < threads; i++) {
+        FREE_MINIMIZER_PARS(mp_t[i]);
+        K_free(k_t[i]);
+    }
+    FREE_MINIMIZER_PARS(mpars);
+    free(pop);
+    free(next);
+    free(fit);
+    free(nfit);
+    free(rank);
+
+    if (status == PROGRESS_CONTINUE && polish > 0)
+        K_minimize_simplex(k, polish, NULL);
+
+    return status;
+}
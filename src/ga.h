@@ -0,0 +1,50 @@
+/*
+ * File:   ga.h
+ */
+
+#ifndef GA_H
+#define	GA_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "kernel.h"
+#include "systemic.h"
+
+    /**
+     * Attempts to find the global minimum of the kernel k using a genetic algorithm
+     * (tournament selection, blend crossover and gaussian mutation scaled by the
+     * steps of the parameters), followed by a polishing run of the simplex minimizer.
+     * Periods and masses are crossed over in log-space. The search domain is given by the
+     * ranges of the parameters (plRanges and parRanges) or, where no range is set,
+     * by default bounds for each element (100 times the step around the current value
+     * for data parameters). Each generation is evaluated in parallel, each thread working
+     * on its own copy of the kernel. The current state of the kernel is part of
+     * the initial population, and the best individuals are always carried
+     * over to the next generation.
+     *
+     * @param k The kernel object containing the state of the system.
+     * @param maxiter Maximum number of generations
+     * @param params Array of options, terminated by DONE: OPT_GA_POPSIZE (population size,
+     * default 10 times the number of parameters, at least 30), OPT_GA_TOURNAMENT (tournament
+     * size, default 3), OPT_GA_CROSSOVER (crossover probability, default 0.9), OPT_GA_BLEND
+     * (alpha parameter of the blend crossover, default 0.5), OPT_GA_MUTATION (mutation
+     * probability of each parameter, default MAX(1/N, 0.1)), OPT_GA_MUTATION_SCALE (width
+     * of the mutations in units of the parameter steps at the first generation, decreasing to 1 at
+     * the last one, default 100), OPT_GA_ELITE (number of individuals carried over to the next
+     * generation, default 2), OPT_GA_STALL (stops after this many generations without
+     * improvement, default 50), OPT_GA_POLISH (maximum number of iterations of the final simplex
+     * run, 0 to skip it, default 5000).
+     * @return PROGRESS_STOP if the progress callback (or the budget of the kernel)
+     * interrupted the minimization, PROGRESS_CONTINUE otherwise.
+     */
+    int K_minimize_ga(ok_kernel* k, int maxiter, double params[]);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* GA_H */
+
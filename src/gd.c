@@ -92,6 +92,10 @@ int K_minimize_gd(ok_kernel* k, int maxiter, double params[]) {
 
     for (int i = 0; i < maxiter; i++) {
 
+        if (K_checkBudget(k, L) != BUDGET_OK) {
+            user_status = PROGRESS_STOP;
+            break;
+        }
         if (k->progress != NULL) {
             k->chi2 = L;
             if (k->progress(i, maxiter, k, __func__) != PROGRESS_CONTINUE) {
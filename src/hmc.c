@@ -0,0 +1,891 @@
+#include <gsl/gsl_randist.h>
+
+#ifndef JAVASCRIPT
+#include "omp.h"
+#else
+#include "omp_shim.h"
+#endif
+
+#include "math.h"
+#include "string.h"
+#include "utils.h"
+#include "kernel.h"
+#include "mcmc.h"
+#include "diagnostics.h"
+#include "hmc.h"
+#include "rng.h"
+
+#define IS_ANGLE(b) ((b) == MA || (b) == LOP || (b) == INC || (b) == NODE)
+#define LOGADDEXP(a, b) ((a) > (b) ? (a) + log1p(exp((b) - (a))) : (b) + log1p(exp((a) - (b))))
+
+// Energy error that marks a trajectory as divergent
+#define NUTS_MAX_DELTA_H 1000.
+// Dual averaging constants (Hoffman & Gelman 2014)
+#define NUTS_DA_GAMMA 0.05
+#define NUTS_DA_T0 10.
+#define NUTS_DA_KAPPA 0.75
+
+#define NUTS_FREE 0
+#define NUTS_LOWER 1
+#define NUTS_UPPER 2
+#define NUTS_INTERVAL 3
+
+/*
+ * Chains move in unconstrained coordinates, as in Stan: parameters bounded from
+ * below (by their range, or because periods, masses and noise parameters are
+ * positive) are mapped as x = lo + exp(y), parameters bounded from above as
+ * x = hi - exp(y), and parameters bounded on both sides (such as eccentricities)
+ * through the logistic function; the log-Jacobian of the map is added to the
+ * log-posterior, so that trajectories never hit a hard wall. Angles are periodic
+ * and are not transformed nor wrapped; they are only brought back to [0, 360) when
+ * copied into a kernel. The coordinates are scaled as u = y / scale, where scale is
+ * the step of each parameter (relative for periods and masses, as in
+ * K_minimize_lbfgsb) mapped to y at the starting point.
+ * The inverse mass matrix is the covariance of u estimated during the warm-up, stored
+ * as its Cholesky factor L (diagonal unless OPT_NUTS_DENSE is set).
+ */
+typedef struct {
+    int n;
+    const int* type;
+    const double* min;
+    const double* max;
+    const bool* noise;
+    const double* scale;
+    const int* kind;
+    const double* lo;
+    const double* hi;
+    // components of the gradient of the log-prior, for the components of the gradient function
+    const double* pmin;
+    // true if the gradient function of the kernel is used
+    bool analytic;
+} ok_nuts_space;
+
+typedef struct {
+    double* u;
+    double* p;
+    double* g;
+    double lp;
+    double li;
+    double pr;
+} ok_nuts_state;
+
+typedef struct {
+    const ok_nuts_space* sp;
+    ok_kernel* k;
+    ok_kernel_minimizer_pars* mp;
+    ok_callback2 merit_function;
+    const double* L;
+    double fd;
+    gsl_rng* rng;
+
+    double H0;
+    double alpha;
+    int nalpha;
+    bool divergent;
+    long evals;
+    // temporary states for each level of the tree
+    ok_nuts_state* pool;
+    double* v;
+    double* w;
+} ok_nuts_ctx;
+
+typedef struct {
+    gsl_rng* rng;
+    ok_nuts_state s;
+    ok_nuts_state* pool;
+    double eps;
+    // dual averaging state
+    double mu;
+    double hbar;
+    double xbar;
+    int m;
+
+    double alpha;
+    int depth;
+    int divergences;
+    long evals;
+} ok_nuts_chain;
+
+static bool ok_nuts_valid(const ok_nuts_space* sp, const double* x) {
+    for (int j = 0; j < sp->n; j++) {
+        int type = sp->type[j];
+        double v = (IS_ANGLE(type) ? DEGRANGE(x[j]) : x[j]);
+        if (IS_NOT_FINITE(v) || v < sp->min[j] || v > sp->max[j])
+            return false;
+        if ((type == PER || type == MASS) && v <= 0.)
+            return false;
+        if (type == ECC && (v < 0. || v >= 1.))
+            return false;
+        if (sp->noise[j] && v < 0.)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Maps the coordinate u of a parameter to its value x.
+ * @param sp Space of the parameters
+ * @param j Index of the parameter
+ * @param u Scaled unconstrained coordinate
+ * @param logj If not NULL, receives the log-Jacobian log(dx/dy)
+ * @param dlogj If not NULL, receives the derivative of the log-Jacobian with respect to y
+ * @return The value of the parameter
+ */
+static double ok_nuts_x(const ok_nuts_space* sp, const int j, const double u, double* logj, double* dlogj) {
+    const double y = u * sp->scale[j];
+    double x = y, lj = 0., dlj = 0.;
+    switch (sp->kind[j]) {
+        case NUTS_LOWER:
+            x = sp->lo[j] + exp(y);
+            lj = y;
+            dlj = 1.;
+            break;
+        case NUTS_UPPER:
+            x = sp->hi[j] - exp(y);
+            lj = y;
+            dlj = 1.;
+            break;
+        case NUTS_INTERVAL:
+        {
+            double e = 1. / (1. + exp(-y));
+            x = sp->lo[j] + (sp->hi[j] - sp->lo[j]) * e;
+            lj = log(sp->hi[j] - sp->lo[j]) - fabs(y) - 2. * log1p(exp(-fabs(y)));
+            dlj = 1. - 2. * e;
+            break;
+        }
+    }
+    if (logj != NULL)
+        *logj = lj;
+    if (dlogj != NULL)
+        *dlogj = dlj;
+    return x;
+}
+
+// Inverse of ok_nuts_x; values on a bound are moved slightly inside
+static double ok_nuts_u(const ok_nuts_space* sp, const int j, double x, const double step) {
+    const double lo = sp->lo[j], hi = sp->hi[j];
+    double y = x;
+    switch (sp->kind[j]) {
+        case NUTS_LOWER:
+            y = log(MAX(x - lo, 1e-3 * step));
+            break;
+        case NUTS_UPPER:
+            y = log(MAX(hi - x, 1e-3 * step));
+            break;
+        case NUTS_INTERVAL:
+        {
+            double e = RANGE((x - lo) / (hi - lo), 1e-6, 1. - 1e-6);
+            y = log(e / (1. - e));
+            break;
+        }
+    }
+    return y / sp->scale[j];
+}
+
+// Log-posterior at u (including the log-Jacobian of the map); li and pr can be NULL
+static double ok_nuts_lp(ok_nuts_ctx* c, const double* u, double* li, double* pr) {
+    const ok_nuts_space* sp = c->sp;
+    const int n = sp->n;
+    double x[MAX(n, 1)];
+    x[0] = 0.;
+    double logj = 0.;
+    for (int j = 0; j < n; j++) {
+        double lj;
+        x[j] = ok_nuts_x(sp, j, u[j], &lj, NULL);
+        logj += lj;
+    }
+    if (!ok_nuts_valid(sp, x))
+        return -INFINITY;
+
+    for (int j = 0; j < n; j++)
+        *(c->mp->pars[j]) = (IS_ANGLE(sp->type[j]) ? DEGRANGE(x[j]) : x[j]);
+    c->k->flags |= NEEDS_SETUP;
+    double m[2];
+    (c->merit_function == NULL ? K_mcmc_likelihood_and_prior_default(c->k, m) : c->merit_function(c->k, m));
+    c->evals++;
+    if (IS_NOT_FINITE(m[0]) || IS_NOT_FINITE(m[1]))
+        return -INFINITY;
+    if (li != NULL) {
+        *li = m[0];
+        *pr = m[1];
+    }
+    return m[0] + m[1] + logj;
+}
+
+/**
+ * Evaluates the log-posterior of s and its gradient with respect to u. With the default
+ * merit function, the components returned by the gradient function of the kernel are
+ * used, together with the derivatives of the default prior; the others are computed by
+ * central differences (one-sided next to the boundaries of the valid region).
+ */
+static void ok_nuts_eval(ok_nuts_ctx* c, ok_nuts_state* s) {
+    const ok_nuts_space* sp = c->sp;
+    const int n = sp->n;
+
+    s->lp = ok_nuts_lp(c, s->u, &s->li, &s->pr);
+    if (IS_NOT_FINITE(s->lp))
+        return;
+
+    for (int j = 0; j < n; j++)
+        s->g[j] = INVALID_NUMBER;
+    if (sp->analytic) {
+        c->k->gradfunc(c->k, s->g);
+        for (int j = 0; j < n; j++) {
+            if (IS_NOT_FINITE(s->g[j]))
+                continue;
+            // Gradient of the negative log-likelihood, plus the default prior and the log-Jacobian
+            double x = *(c->mp->pars[j]);
+            double dpr = 0.;
+            if (sp->type[j] == PER || sp->type[j] == MASS)
+                dpr = -1. / (x + sp->pmin[j]);
+            else if (sp->noise[j])
+                dpr = -1. / (fabs(x) + 0.3);
+            double dlogj, dxdy = 1.;
+            ok_nuts_x(sp, j, s->u[j], NULL, &dlogj);
+            if (sp->kind[j] == NUTS_LOWER || sp->kind[j] == NUTS_UPPER)
+                dxdy = (sp->kind[j] == NUTS_LOWER ? x - sp->lo[j] : -(sp->hi[j] - x));
+            else if (sp->kind[j] == NUTS_INTERVAL)
+                dxdy = (x - sp->lo[j]) * (sp->hi[j] - x) / (sp->hi[j] - sp->lo[j]);
+            s->g[j] = ((-s->g[j] + dpr) * dxdy + dlogj) * sp->scale[j];
+        }
+    }
+
+    double u[MAX(n, 1)];
+    memcpy(u, s->u, sizeof (double) * n);
+    for (int j = 0; j < n; j++) {
+        if (!IS_NOT_FINITE(s->g[j]))
+            continue;
+        u[j] = s->u[j] + c->fd;
+        double fp = ok_nuts_lp(c, u, NULL, NULL);
+        u[j] = s->u[j] - c->fd;
+        double fm = ok_nuts_lp(c, u, NULL, NULL);
+        u[j] = s->u[j];
+
+        if (!IS_NOT_FINITE(fp) && !IS_NOT_FINITE(fm))
+            s->g[j] = (fp - fm) / (2. * c->fd);
+        else if (!IS_NOT_FINITE(fp))
+            s->g[j] = (fp - s->lp) / c->fd;
+        else if (!IS_NOT_FINITE(fm))
+            s->g[j] = (s->lp - fm) / c->fd;
+        else
+            s->g[j] = 0.;
+    }
+}
+
+static void ok_nuts_copy(const int n, ok_nuts_state* dst, const ok_nuts_state* src) {
+    memcpy(dst->u, src->u, sizeof (double) * n);
+    memcpy(dst->p, src->p, sizeof (double) * n);
+    memcpy(dst->g, src->g, sizeof (double) * n);
+    dst->lp = src->lp;
+    dst->li = src->li;
+    dst->pr = src->pr;
+}
+
+// w = L^T p
+static void ok_nuts_lt(const int n, const double* L, const double* p, double* w) {
+    for (int i = 0; i < n; i++) {
+        w[i] = 0.;
+        for (int j = i; j < n; j++)
+            w[i] += L[j * n + i] * p[j];
+    }
+}
+
+// Velocity v = L L^T p
+static void ok_nuts_velocity(ok_nuts_ctx* c, const double* p, double* v) {
+    const int n = c->sp->n;
+    ok_nuts_lt(n, c->L, p, c->w);
+    for (int i = 0; i < n; i++) {
+        v[i] = 0.;
+        for (int j = 0; j <= i; j++)
+            v[i] += c->L[i * n + j] * c->w[j];
+    }
+}
+
+static double ok_nuts_energy(ok_nuts_ctx* c, const ok_nuts_state* s) {
+    const int n = c->sp->n;
+    if (IS_NOT_FINITE(s->lp))
+        return INFINITY;
+    ok_nuts_lt(n, c->L, s->p, c->w);
+    double k = 0.;
+    for (int i = 0; i < n; i++)
+        k += c->w[i] * c->w[i];
+    return -s->lp + 0.5 * k;
+}
+
+static void ok_nuts_leapfrog(ok_nuts_ctx* c, ok_nuts_state* s, const double eps) {
+    const int n = c->sp->n;
+    for (int i = 0; i < n; i++)
+        s->p[i] += 0.5 * eps * s->g[i];
+    ok_nuts_velocity(c, s->p, c->v);
+    for (int i = 0; i < n; i++)
+        s->u[i] += eps * c->v[i];
+    ok_nuts_eval(c, s);
+    if (IS_NOT_FINITE(s->lp))
+        return;
+    for (int i = 0; i < n; i++)
+        s->p[i] += 0.5 * eps * s->g[i];
+}
+
+// No-U-turn criterion between the two ends of a trajectory
+static bool ok_nuts_no_uturn(ok_nuts_ctx* c, const ok_nuts_state* minus, const ok_nuts_state* plus) {
+    const int n = c->sp->n;
+    double a = 0., b = 0.;
+    ok_nuts_velocity(c, minus->p, c->v);
+    for (int i = 0; i < n; i++)
+        a += (plus->u[i] - minus->u[i]) * c->v[i];
+    ok_nuts_velocity(c, plus->p, c->v);
+    for (int i = 0; i < n; i++)
+        b += (plus->u[i] - minus->u[i]) * c->v[i];
+    return (a >= 0. && b >= 0.);
+}
+
+/**
+ * Builds a subtree of 2^depth leapfrog steps starting from 'from' in direction dir,
+ * returning its two ends, a point drawn from it with multinomial weights and the log
+ * of the sum of the weights. Returns false if the subtree makes a U-turn or diverges.
+ */
+static bool ok_nuts_build(ok_nuts_ctx* c, const ok_nuts_state* from, const int dir, const int depth,
+                          const double eps, ok_nuts_state* minus, ok_nuts_state* plus, ok_nuts_state* prop,
+                          double* logw) {
+    const int n = c->sp->n;
+
+    if (depth == 0) {
+        ok_nuts_copy(n, prop, from);
+        ok_nuts_leapfrog(c, prop, dir * eps);
+        double dH = ok_nuts_energy(c, prop) - c->H0;
+        if (IS_NOT_FINITE(dH) || dH > NUTS_MAX_DELTA_H) {
+            c->divergent = true;
+            c->nalpha++;
+            return false;
+        }
+        c->alpha += MIN(1., exp(-dH));
+        c->nalpha++;
+        *logw = -dH;
+        ok_nuts_copy(n, minus, prop);
+        ok_nuts_copy(n, plus, prop);
+        return true;
+    }
+
+    // First half, written directly into the outputs
+    if (!ok_nuts_build(c, from, dir, depth - 1, eps, minus, plus, prop, logw))
+        return false;
+
+    // Second half, from the outer end of the first one
+    ok_nuts_state* t = c->pool + 3 * depth;
+    double logw2;
+    if (!ok_nuts_build(c, (dir > 0 ? plus : minus), dir, depth - 1, eps, &t[0], &t[1], &t[2], &logw2))
+        return false;
+
+    double lw = LOGADDEXP(*logw, logw2);
+    if (gsl_rng_uniform(c->rng) < exp(logw2 - lw))
+        ok_nuts_copy(n, prop, &t[2]);
+    *logw = lw;
+    if (dir > 0)
+        ok_nuts_copy(n, plus, &t[1]);
+    else
+        ok_nuts_copy(n, minus, &t[0]);
+
+    return ok_nuts_no_uturn(c, minus, plus);
+}
+
+// Draws a momentum p ~ N(0, M), with M^-1 = L L^T, by solving L^T p = z
+static void ok_nuts_momentum(ok_nuts_ctx* c, double* p) {
+    const int n = c->sp->n;
+    double z[MAX(n, 1)];
+    for (int i = 0; i < n; i++)
+        z[i] = gsl_ran_gaussian(c->rng, 1.);
+    for (int i = n - 1; i >= 0; i--) {
+        double v = z[i];
+        for (int j = i + 1; j < n; j++)
+            v -= c->L[j * n + i] * p[j];
+        p[i] = v / c->L[i * n + i];
+    }
+}
+
+/**
+ * One NUTS transition (multinomial sampling with biased progressive sampling between
+ * subtrees, as in Betancourt 2017). Returns the depth of the tree.
+ */
+static int ok_nuts_transition(ok_nuts_ctx* c, ok_nuts_state* s, const double eps, const int max_depth) {
+    const int n = c->sp->n;
+    ok_nuts_state* top = c->pool;
+
+    ok_nuts_momentum(c, s->p);
+    c->H0 = ok_nuts_energy(c, s);
+    c->alpha = 0.;
+    c->nalpha = 0;
+    c->divergent = false;
+
+    ok_nuts_state* minus = &top[0];
+    ok_nuts_state* plus = &top[1];
+    ok_nuts_state* prop = &top[2];
+    ok_nuts_copy(n, minus, s);
+    ok_nuts_copy(n, plus, s);
+    ok_nuts_copy(n, prop, s);
+    double logw = 0.;
+
+    int depth = 0;
+    // Temporary states for the new subtree are kept after the ones of the deepest level
+    ok_nuts_state* t = c->pool + 3 * (max_depth + 1);
+    for (; depth < max_depth; depth++) {
+        int dir = (gsl_rng_uniform(c->rng) < 0.5 ? -1 : 1);
+        double logw2;
+        if (!ok_nuts_build(c, (dir > 0 ? plus : minus), dir, depth, eps, &t[0], &t[1], &t[2], &logw2))
+            break;
+
+        if (gsl_rng_uniform(c->rng) < exp(logw2 - logw))
+            ok_nuts_copy(n, prop, &t[2]);
+        logw = LOGADDEXP(logw, logw2);
+        if (dir > 0)
+            ok_nuts_copy(n, plus, &t[1]);
+        else
+            ok_nuts_copy(n, minus, &t[0]);
+
+        if (!ok_nuts_no_uturn(c, minus, plus)) {
+            depth++;
+            break;
+        }
+    }
+
+    ok_nuts_copy(n, s, prop);
+    c->alpha = (c->nalpha > 0 ? c->alpha / c->nalpha : 0.);
+    return depth;
+}
+
+// Heuristic initial step size (Hoffman & Gelman 2014, algorithm 4)
+static double ok_nuts_init_eps(ok_nuts_ctx* c, const ok_nuts_state* s, double eps) {
+    const int n = c->sp->n;
+    ok_nuts_state* t = c->pool;
+    ok_nuts_state* s0 = c->pool + 1;
+    ok_nuts_copy(n, s0, s);
+    ok_nuts_momentum(c, s0->p);
+    double H0 = ok_nuts_energy(c, s0);
+
+    int dir = 0;
+    for (int it = 0; it < 50; it++) {
+        ok_nuts_copy(n, t, s0);
+        ok_nuts_leapfrog(c, t, eps);
+        double dH = H0 - ok_nuts_energy(c, t);
+        dH = (IS_NOT_FINITE(dH) ? -INFINITY : dH);
+        if (dir == 0)
+            dir = (dH > -M_LN2 ? 1 : -1);
+        else if ((dir > 0 && dH <= -M_LN2) || (dir < 0 && dH > -M_LN2))
+            break;
+        eps = (dir > 0 ? eps * 2. : eps / 2.);
+    }
+    return eps;
+}
+
+/*
+ * Regularized Cholesky factor of the covariance of the warm-up samples (Stan's
+ * shrinkage towards a small multiple of the identity).
+ */
+static void ok_nuts_metric(const int n, const double nsamples, const double* cov, const bool dense, double* L) {
+    double C[MAX(n * n, 1)];
+    const double a = nsamples / (nsamples + 5.);
+    const double b = 1e-3 * 5. / (nsamples + 5.);
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < n; j++)
+            C[i * n + j] = (dense || i == j ? a * cov[i * n + j] : 0.) + (i == j ? b : 0.);
+
+    memset(L, 0, sizeof (double) * n * n);
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j <= i; j++) {
+            double v = C[i * n + j];
+            for (int l = 0; l < j; l++)
+                v -= L[i * n + l] * L[j * n + l];
+            if (i == j) {
+                if (!(v > 0)) {
+                    // Not positive definite: fall back to the diagonal
+                    memset(L, 0, sizeof (double) * n * n);
+                    for (int l = 0; l < n; l++)
+                        L[l * n + l] = sqrt(MAX(C[l * n + l], b));
+                    return;
+                }
+                L[i * n + i] = sqrt(v);
+            } else
+                L[i * n + j] = v / L[j * n + j];
+        }
+}
+
+static void ok_nuts_da_reset(ok_nuts_chain* ch) {
+    ch->mu = log(10. * ch->eps);
+    ch->hbar = 0.;
+    ch->xbar = 0.;
+    ch->m = 0;
+}
+
+static void ok_nuts_da_update(ok_nuts_chain* ch, const double delta) {
+    ch->m++;
+    const double m = ch->m;
+    ch->hbar = (1. - 1. / (m + NUTS_DA_T0)) * ch->hbar + (delta - ch->alpha) / (m + NUTS_DA_T0);
+    double logeps = ch->mu - sqrt(m) / NUTS_DA_GAMMA * ch->hbar;
+    double eta = pow(m, -NUTS_DA_KAPPA);
+    ch->xbar = eta * logeps + (1. - eta) * ch->xbar;
+    ch->eps = exp(logeps);
+}
+
+static void ok_nuts_state_alloc(ok_nuts_state* s, double* buf, const int n) {
+    s->u = buf;
+    s->p = buf + n;
+    s->g = buf + 2 * n;
+    s->lp = -INFINITY;
+    s->li = s->pr = 0.;
+}
+
+static void ok_nuts_record(ok_list* kl, const int from, ok_kernel** k_t, ok_kernel_minimizer_pars* mp_t,
+                           const int threads, const ok_nuts_space* sp, ok_nuts_chain* ch, const int nchains) {
+    const int n = sp->n;
+
+    #pragma omp parallel for num_threads(threads)
+    for (int c = 0; c < nchains; c++) {
+        int th = omp_get_thread_num();
+        for (int j = 0; j < n; j++) {
+            double x = ok_nuts_x(sp, j, ch[c].s.u[j], NULL, NULL);
+            *(mp_t[th].pars[j]) = (IS_ANGLE(sp->type[j]) ? DEGRANGE(x) : x);
+        }
+        k_t[th]->flags |= NEEDS_SETUP;
+        ok_list_item* it = KL_set(kl, from + c, K_getAllElements(k_t[th]), ok_vector_copy(k_t[th]->params),
+                                  ch[c].s.li + ch[c].s.pr, c);
+        it->merit_li = ch[c].s.li;
+        it->merit_pr = ch[c].s.pr;
+    }
+}
+
+ok_list* K_mcmc_nuts(ok_kernel* k, unsigned int nchains, unsigned int nsteps, unsigned int skip, unsigned int discard,
+                     const double params[], ok_callback2 merit_function) {
+    double delta = 0.8;
+    int max_depth = 10;
+    bool dense = false;
+    double fd = 1e-4;
+    double init = 1.;
+    int verbose = 0;
+
+    int idx = 0;
+    while (params != NULL) {
+        if (params[idx] == DONE)
+            break;
+        else if (params[idx] == OPT_NUTS_TARGET_ACCEPT)
+            delta = RANGE(params[idx + 1], 0.05, 0.995);
+        else if (params[idx] == OPT_NUTS_MAX_DEPTH)
+            max_depth = RANGE((int) params[idx + 1], 1, 20);
+        else if (params[idx] == OPT_NUTS_DENSE)
+            dense = ((int) params[idx + 1]) != 0;
+        else if (params[idx] == OPT_NUTS_FD_STEP)
+            fd = params[idx + 1];
+        else if (params[idx] == OPT_NUTS_INIT)
+            init = params[idx + 1];
+        else if (params[idx] == OPT_MCMC_VERBOSE_DIAGS)
+            verbose = (int) params[idx + 1];
+        idx += 2;
+    }
+
+    discard = MAX(discard, 1);
+    nchains = MAX(nchains, 1);
+    const int C = nchains;
+
+    K_calculate(k);
+    ok_kernel_minimizer_pars mpars = K_getMinimizedVariables(k);
+    const int n = mpars.npars;
+
+    double scale[MAX(n, 1)], pmin[MAX(n, 1)], step[MAX(n, 1)], lo[MAX(n, 1)], hi[MAX(n, 1)];
+    int kind[MAX(n, 1)];
+    bool noise[MAX(n, 1)];
+    for (int j = 0; j < n; j++) {
+        int type = mpars.type[j];
+        int par = (int) (mpars.pars[j] - k->params->data);
+        noise[j] = (type < 0 && par >= P_DATA_NOISE1 && par <= P_DATA_NOISE10);
+
+        double x = *(mpars.pars[j]);
+        step[j] = mpars.steps[j];
+        if (type == PER || type == MASS)
+            step[j] = MAX(step[j], step[j] * fabs(x));
+        step[j] = (step[j] > 0 && !IS_NOT_FINITE(step[j]) ? step[j] : MAX(fabs(x), 1.));
+
+        lo[j] = mpars.min[j];
+        hi[j] = mpars.max[j];
+        if (type == PER || type == MASS || type == ECC || noise[j])
+            lo[j] = MAX(lo[j], 0.);
+        if (type == ECC)
+            hi[j] = MIN(hi[j], 1.);
+        kind[j] = NUTS_FREE;
+        if (!IS_ANGLE(type))
+            kind[j] = (lo[j] > -DBL_MAX ? (hi[j] < DBL_MAX ? NUTS_INTERVAL : NUTS_LOWER) :
+                       (hi[j] < DBL_MAX ? NUTS_UPPER : NUTS_FREE));
+
+        // Step mapped to the unconstrained coordinate
+        double d = 1.;
+        if (kind[j] == NUTS_LOWER)
+            d = MAX(x - lo[j], step[j]);
+        else if (kind[j] == NUTS_UPPER)
+            d = MAX(hi[j] - x, step[j]);
+        else if (kind[j] == NUTS_INTERVAL)
+            d = MAX((x - lo[j]) * (hi[j] - x) / (hi[j] - lo[j]), MIN(step[j], 0.25 * (hi[j] - lo[j])));
+        scale[j] = step[j] / d;
+
+        // Lower end of the default prior of periods and masses (see K_default_prior)
+        pmin[j] = (mpars.min[j] > -DBL_MAX ? mpars.min[j] : (mpars.type[j] == PER ? 0.2 : 1e-5));
+    }
+
+    // The gradient function of the kernel is the gradient of its merit function: it is
+    // used with the default log-likelihood, when the merit function of the kernel is (or
+    // is set in the workspaces to) the negative log-likelihood
+    bool analytic = (merit_function == NULL && k->gradfunc != NULL &&
+                     (k->gradfunc == K_default_gradient || k->minfunc == K_getLoglik));
+    ok_nuts_space sp = {n, mpars.type, mpars.min, mpars.max, noise, scale, kind, lo, hi, pmin, analytic};
+
+    // With verbose output, each chain is tracked to report the autocorrelation times
+    ok_diag* diag = NULL;
+    if (verbose) {
+        bool angle[MAX(n, 1)];
+        for (int j = 0; j < n; j++)
+            angle[j] = IS_ANGLE(mpars.type[j]);
+        diag = ok_diag_alloc(C, n, angle);
+    }
+
+    const int nrec = MAX((nsteps + discard - 1) / discard, 1);
+    ok_list* kl = KL_alloc(nrec * C, K_clone(k));
+    int recorded = 0;
+
+    // Per-thread workspaces; random number streams keyed by the chain index
+    const int threads = (omp_in_parallel() ? 1 : MAX(MIN(omp_get_max_threads(), C), 1));
+    ok_kernel* k_t[threads];
+    ok_kernel_minimizer_pars mp_t[threads];
+    for (int i = 0; i < threads; i++) {
+        k_t[i] = K_cloneWorkspace(k);
+        k_t[i]->progress = NULL;
+        if (analytic)
+            k_t[i]->minfunc = K_getLoglik;
+        mp_t[i] = K_getMinimizedVariables(k_t[i]);
+    }
+
+    // Three states for each level of the trees, plus the ones of the new subtrees
+    const int nstates = 3 * (max_depth + 2);
+    const int N = MAX(n, 1);
+    double* buf = (double*) malloc(sizeof (double) * 3 * N * (size_t) C * (nstates + 1));
+    ok_nuts_state* states = (ok_nuts_state*) malloc(sizeof (ok_nuts_state) * C * nstates);
+    ok_nuts_chain* ch = (ok_nuts_chain*) calloc(C, sizeof (ok_nuts_chain));
+    unsigned long int seed = gsl_rng_get(k->rng);
+    for (int c = 0; c < C; c++) {
+        double* b = buf + (size_t) 3 * N * c * (nstates + 1);
+        ok_nuts_state_alloc(&ch[c].s, b, N);
+        ch[c].pool = states + c * nstates;
+        for (int i = 0; i < nstates; i++)
+            ok_nuts_state_alloc(&ch[c].pool[i], b + (size_t) 3 * N * (i + 1), N);
+        ch[c].rng = ok_rng_stream_alloc(seed, c);
+    }
+
+    double L[MAX(n * n, 1)];
+    memset(L, 0, sizeof (double) * N * N);
+    for (int i = 0; i < n; i++)
+        L[i * n + i] = 1.;
+
+    ok_budget_start(k->budget);
+
+    // Initial states: the current state, and a gaussian ball around it
+    for (int j = 0; j < n; j++)
+        ch[0].s.u[j] = ok_nuts_u(&sp, j, *(mpars.pars[j]), step[j]);
+    for (int c = 1; c < C; c++) {
+        double x[N];
+        for (int t = 0; t < 1000; t++) {
+            for (int j = 0; j < n; j++) {
+                ch[c].s.u[j] = ch[0].s.u[j] + gsl_ran_gaussian(k->rng, init);
+                x[j] = ok_nuts_x(&sp, j, ch[c].s.u[j], NULL, NULL);
+            }
+            if (ok_nuts_valid(&sp, x))
+                break;
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for (int c = 0; c < C; c++) {
+        int th = omp_get_thread_num();
+        ok_nuts_ctx ctx = {&sp, k_t[th], &mp_t[th], merit_function, L, fd, ch[c].rng};
+        double v[N], w[N];
+        ctx.pool = ch[c].pool;
+        ctx.v = v;
+        ctx.w = w;
+        ok_nuts_eval(&ctx, &ch[c].s);
+        if (!IS_NOT_FINITE(ch[c].s.lp))
+            ch[c].eps = ok_nuts_init_eps(&ctx, &ch[c].s, 1.);
+        else
+            ch[c].eps = 1.;
+        ok_nuts_da_reset(&ch[c]);
+        ch[c].evals = ctx.evals;
+    }
+
+    // Warm-up windows for the mass matrix (Stan): a fast initial buffer, slow windows of
+    // doubling length where the covariance of the chains is accumulated, and a terminal
+    // buffer where only the step size is adapted
+    int init_buf = 75, term_buf = 50, win = 25;
+    if (skip < 150) {
+        init_buf = (int) (0.15 * skip);
+        term_buf = (int) (0.1 * skip);
+        win = skip - init_buf - term_buf;
+    }
+    int win_end = init_buf + win;
+    if (win_end + 2 * win > (int) skip - term_buf)
+        win_end = skip - term_buf;
+    double wn = 0.;
+    double wmean[N], wm2[MAX(n * n, 1)];
+    memset(wmean, 0, sizeof (double) * N);
+    memset(wm2, 0, sizeof (double) * N * N);
+
+    ok_progress progress = k->progress;
+    double acc = 0.;
+    int divergences = 0;
+    long evals = 0;
+
+    for (unsigned int step = 0; step < skip + nsteps; step++) {
+        #pragma omp parallel for schedule(dynamic) num_threads(threads)
+        for (int c = 0; c < C; c++) {
+            int th = omp_get_thread_num();
+            ok_nuts_ctx ctx = {&sp, k_t[th], &mp_t[th], merit_function, L, fd, ch[c].rng};
+            double v[N], w[N];
+            ctx.pool = ch[c].pool;
+            ctx.v = v;
+            ctx.w = w;
+            if (IS_NOT_FINITE(ch[c].s.lp)) {
+                ch[c].alpha = 0.;
+                continue;
+            }
+            ch[c].depth = ok_nuts_transition(&ctx, &ch[c].s, ch[c].eps, max_depth);
+            ch[c].alpha = ctx.alpha;
+            ch[c].divergences += (ctx.divergent ? 1 : 0);
+            ch[c].evals += ctx.evals;
+        }
+
+        double acc_step = 0.;
+        for (int c = 0; c < C; c++) {
+            acc_step += ch[c].alpha / C;
+            if (step >= skip)
+                divergences += (ch[c].divergences > 0 ? 1 : 0);
+            ch[c].divergences = 0;
+        }
+
+        if (step < skip) {
+            for (int c = 0; c < C; c++)
+                ok_nuts_da_update(&ch[c], delta);
+
+            if ((int) step >= init_buf && (int) step < win_end) {
+                // Pooled covariance of the chains in the current window
+                for (int c = 0; c < C; c++) {
+                    wn += 1.;
+                    double d[N];
+                    for (int i = 0; i < n; i++) {
+                        d[i] = ch[c].s.u[i] - wmean[i];
+                        wmean[i] += d[i] / wn;
+                    }
+                    for (int i = 0; i < n; i++)
+                        for (int j = 0; j < n; j++)
+                            wm2[i * n + j] += d[i] * (ch[c].s.u[j] - wmean[j]);
+                }
+            }
+
+            if ((int) step + 1 == win_end && wn > 2) {
+                for (int i = 0; i < n * n; i++)
+                    wm2[i] /= (wn - 1.);
+                ok_nuts_metric(n, wn, wm2, dense, L);
+                if (verbose)
+                    fprintf(stderr, "%s: step = %u, mass matrix updated from %.0f samples\n", __func__, step + 1, wn);
+                wn = 0.;
+                memset(wmean, 0, sizeof (double) * N);
+                memset(wm2, 0, sizeof (double) * N * N);
+
+                win *= 2;
+                win_end = step + 1 + win;
+                if (win_end + 2 * win > (int) skip - term_buf)
+                    win_end = skip - term_buf;
+
+                #pragma omp parallel for schedule(dynamic) num_threads(threads)
+                for (int c = 0; c < C; c++) {
+                    if (IS_NOT_FINITE(ch[c].s.lp))
+                        continue;
+                    int th = omp_get_thread_num();
+                    ok_nuts_ctx ctx = {&sp, k_t[th], &mp_t[th], merit_function, L, fd, ch[c].rng};
+                    double v[N], w[N];
+                    ctx.pool = ch[c].pool;
+                    ctx.v = v;
+                    ctx.w = w;
+                    ch[c].eps = ok_nuts_init_eps(&ctx, &ch[c].s, ch[c].eps);
+                    ok_nuts_da_reset(&ch[c]);
+                    ch[c].evals += ctx.evals;
+                }
+            }
+
+            if (step + 1 == skip)
+                for (int c = 0; c < C; c++)
+                    ch[c].eps = exp(ch[c].xbar);
+        } else
+            acc += acc_step;
+
+        if (step >= skip && (step - skip) % discard == 0 && recorded < nrec) {
+            ok_nuts_record(kl, recorded * C, k_t, mp_t, threads, &sp, ch, C);
+            recorded++;
+            for (int c = 0; c < C && diag != NULL; c++) {
+                double x[N];
+                for (int j = 0; j < n; j++)
+                    x[j] = ok_nuts_x(&sp, j, ch[c].s.u[j], NULL, NULL);
+                ok_diag_add(diag, c, x);
+            }
+        }
+
+        if (verbose && (step + 1) % 100 == 0) {
+            evals = 0;
+            for (int c = 0; c < C; c++)
+                evals += ch[c].evals;
+            fprintf(stderr, "%s: step = %u, acc = %.3f, eps[0] = %e, depth[0] = %d, evals = %ld\n", __func__,
+                    step + 1, acc_step, ch[0].eps, ch[0].depth, evals);
+        }
+
+        bool stop = (K_checkBudget(k, INVALID_NUMBER) != BUDGET_OK);
+        if (!stop && progress != NULL) {
+            char msg[200];
+            sprintf(msg, "%s [acc = %.3f, eps = %.3e, depth = %d%s]", __func__, acc_step, ch[0].eps, ch[0].depth,
+                    (step < skip ? ", warm-up" : ""));
+            stop = (progress(step, skip + nsteps, NULL, msg) == PROGRESS_STOP);
+        }
+
+        // Stopping early returns the samples retained so far
+        if (stop)
+            break;
+    }
+
+    if (recorded == 0) {
+        ok_nuts_record(kl, 0, k_t, mp_t, threads, &sp, ch, C);
+        recorded = 1;
+    }
+    kl->size = recorded * C;
+
+    if (verbose) {
+        evals = 0;
+        for (int c = 0; c < C; c++)
+            evals += ch[c].evals;
+        fprintf(stderr, "%s: mean acceptance = %.3f, divergent transitions = %d, %ld evaluations%s\n", __func__,
+                acc / MAX(nsteps, 1), divergences, evals, (analytic ? "" : " (numerical gradients)"));
+        for (int j = 0; j < n; j++) {
+            double iat = 0.;
+            for (int c = 0; c < C; c++)
+                iat += ok_diag_iat(diag, c, j) / C;
+            double ess = ok_diag_ess(diag, -1, j);
+            fprintf(stderr, "%s: par %d, R = %.4f, IAT = %.1f samples, ESS = %.0f, ESS/eval = %.2e\n", __func__, j,
+                    ok_diag_rhat(diag, j), iat, ess, ess / MAX(evals, 1));
+        }
+        ok_diag_free(diag);
+    }
+
+    ok_budget_stop(k->budget);
+
+    for (int i = 0; i < threads; i++) {
+        FREE_MINIMIZER_PARS(mp_t[i]);
+        K_free(k_t[i]);
+    }
+    for (int c = 0; c < C; c++)
+        gsl_rng_free(ch[c].rng);
+    FREE_MINIMIZER_PARS(mpars);
+    free(buf);
+    free(states);
+    free(ch);
+
+    return kl;
+}
@@ -0,0 +1,60 @@
+/*
+ * File:   hmc.h
+ */
+
+#ifndef HMC_H
+#define	HMC_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "systemic.h"
+#include "kernel.h"
+#include "kl.h"
+
+    /**
+     * Samples the posterior with the No-U-Turn sampler (Hoffman & Gelman 2014), a
+     * Hamiltonian Monte Carlo method that chooses the length of each trajectory
+     * automatically (multinomial variant, Betancourt 2017). During the first 'skip'
+     * steps (warm-up), the step size of each chain is adapted by dual averaging and the
+     * mass matrix is estimated from the pooled chains in windows of doubling length, as in
+     * Stan. The chains are advanced in parallel, each thread working on its own copy of the
+     * kernel; each chain has its own random number stream (see ok_rng_stream_set).
+     * With the default merit function, the components of the gradient provided by the
+     * gradient function of the kernel (see K_setGradFunc; by default the data set offsets,
+     * trends and jitters, and the orbital elements with the KEPLER integrator) are used
+     * analytically; the others are computed by central differences (2 evaluations of
+     * the merit function per component).
+     * States outside the ranges of the parameters, with non-positive periods or masses,
+     * eccentricities outside [0, 1) or negative noise parameters have zero probability.
+     * If the budget of k (see K_setBudget) is exhausted or the progress callback stops the run,
+     * the samples retained so far are returned.
+     *
+     * @param k Kernel to be used as the starting point. Set minimization flag to MINIMIZE to decide what parameters to vary.
+     * @param nchains Number of chains; the first starts from the current state, the others
+     * from a gaussian ball around it
+     * @param nsteps Number of steps of each chain after the warm-up
+     * @param skip Number of warm-up steps (discarded)
+     * @param discard Only retain every 'discard'-th step of each chain
+     * @param params Array of options, terminated by DONE: OPT_NUTS_TARGET_ACCEPT (target
+     * acceptance statistic of the step size adaptation, default 0.8), OPT_NUTS_MAX_DEPTH
+     * (maximum depth of the trees, i.e. at most 2^depth leapfrog steps, default 10),
+     * OPT_NUTS_DENSE (if 1, estimate a dense mass matrix instead of a diagonal one),
+     * OPT_NUTS_FD_STEP (step of the finite differences, in units of the steps of the parameters,
+     * default 1e-4), OPT_NUTS_INIT (width of the initial ball of chains, in units of the steps of
+     * the parameters, default 1), OPT_MCMC_VERBOSE_DIAGS.
+     * @param merit_function A function that returns the log-likelihood and log-prior of the
+     * current state (see K_mcmc_mult); set to NULL for the default.
+     * @return A list of (nsteps / discard) x nchains samples, ordered by step; the tag of each
+     * sample is the index of its chain.
+     */
+    ok_list* K_mcmc_nuts(ok_kernel* k, unsigned int nchains, unsigned int nsteps, unsigned int skip, unsigned int discard,
+                         const double params[], ok_callback2 merit_function);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HMC_H */
+
@@ -34,6 +34,9 @@ void ok_free_systems(ok_system** system, unsigned int len);
 /// Returns a deep copy of the given system
 ok_system* ok_copy_system(const ok_system* orig);
 
+/// Copies the given system into dest, which must have the same number of planets
+void ok_copy_system_to(const ok_system* orig, ok_system* dest);
+
 /// Returns a resized copy of the given system
 void ok_resize_system(ok_system* system, int npnew);
 
@@ -183,6 +183,7 @@ double K_getPeriodogramAt(ok_kernel* k, int row, int col) {
         p->buf = NULL;
         p->per = NULL;
         p->calc_z_fap = true;
+        p->tol = 0.;
     }
     if (row == JS_PS_GET_TOP_PERIODS) {
         return top[col];
@@ -253,26 +254,14 @@ double K_getPeriodogramAt(ok_kernel* k, int row, int col) {
     }
 }
 
-time_t mtime;
-int timeout;
-int failed;
-
-int progressWithTimeout(int current, int max, void* state, const char* function) {
-    if (difftime(time(NULL), mtime) > timeout) {
-        failed = timeout;
-        return PROGRESS_STOP;
-    }
-    failed = 0;
-    return PROGRESS_CONTINUE;
-}
-
 int K_minimizeWithTimeout(ok_kernel* k, int to) {
-    mtime = time(NULL);
-    timeout = to;
-    failed = 0;
-    k->progress = progressWithTimeout;
+    // The timeout is the only limit of this run; the budget of the caller is restored afterwards
+    ok_budget* b = K_getBudget(k);
+    ok_budget prev = *b;
+    ok_budget_set(b, 0, to, INVALID_NUMBER);
     K_minimize(k, SIMPLEX, 5000, NULL);
-    k->progress = NULL;
+    int failed = (K_getBudgetStatus(k) == BUDGET_TIME ? to : 0);
+    ok_budget_set(b, prev.max_evals, prev.max_time, prev.target);
     return failed;
 }
 
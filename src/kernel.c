@@ -26,11 +26,16 @@
 #include "sa.h"
 #include "de.h"
 #include "gd.h"
+#include "cmaes.h"
+#include "lbfgsb.h"
+#include "ga.h"
+#include "budget.h"
+#include "rng.h"
 #include "time.h"
 #include <libgen.h>
 
 
-ok_minimizer ok_minimizers[] = {K_minimize_simplex, K_minimize_lm, K_minimize_de, K_minimize_sa, K_minimize_gd, NULL, NULL, NULL};
+ok_minimizer ok_minimizers[MINIMIZERS_SIZE] = {K_minimize_simplex, K_minimize_lm, K_minimize_de, K_minimize_sa, K_minimize_gd, K_minimize_cmaes, K_minimize_lbfgsb, K_minimize_ga, NULL};
 char * ok_orb_labels[ELEMENTS_SIZE] = {"P", "M", "MA", "E", "LOP", "I", "NODE", "RADIUS", "ORD",
     "UNUSED1_", "UNUSED2_", "UNUSED3_", "UNUSED4_"};
 char * ok_all_orb_labels[ALL_ELEMENTS_SIZE] = {"P", "M", "MA", "E", "LOP", "I", "NODE", "RADIUS", "ORD",
@@ -115,6 +120,8 @@ ok_kernel* K_alloc() {
 
     k->progress = NULL;
     k->model_function = NULL;
+    k->gradfunc = K_default_gradient;
+    k->budget = ok_budget_alloc();
 
     k->rng = gsl_rng_alloc(gsl_rng_default);
     gsl_rng_set(k->rng, clock());
@@ -174,6 +181,7 @@ void K_free(ok_kernel* k) {
     ok_free_system(k->system);
     gsl_vector_free(k->params);
     gsl_rng_free(k->rng);
+    ok_budget_free(k->budget);
     k->flags = FREED;
     free(k->intOptions);
     free(k);
@@ -488,6 +496,7 @@ void K_addPlanet(ok_kernel* k, const double elements[]) {
 }
 
 void K_register_minimizer(int minimizerId, ok_minimizer f) {
+    assert(minimizerId >= 0 && minimizerId < MINIMIZERS_SIZE);
     ok_minimizers[minimizerId] = f;
 }
 
@@ -958,6 +967,8 @@ void K_calculate(ok_kernel* k) {
     if (k->ndata <= 0)
         return;
 
+    ok_budget_count(k->budget, 1);
+
     if ((!integrate && k->integration != NULL) || ((k->integration != NULL) && (k->times->size != k->integrationSamples ||
             MROWS(k->integration[0]->elements) != MROWS(k->system->elements)))) {
         for (int i = 0; i < k->integrationSamples; i++)
@@ -1175,6 +1186,200 @@ double K_getMinValue(ok_kernel* k) {
     return k->minfunc(k);
 };
 
+void K_setGradFunc(ok_kernel* k, ok_callback2 f) {
+    if (f == NULL)
+        k->gradfunc = K_default_gradient;
+    else
+        k->gradfunc = f;
+}
+
+ok_callback2 K_getGradFunc(ok_kernel* k) {
+    return k->gradfunc;
+}
+
+/**
+ * Returns true if the radial velocities of the kernel are sums of Keplerians
+ * computed in astrocentric coordinates, so that their derivatives with respect
+ * to the orbital elements can be computed in closed form (K_keplerRVGradient).
+ * @param k The kernel
+ */
+static bool K_keplerGradientValid(ok_kernel* k) {
+    if (k->intMethod != KEPLER || (k->system->flag & JACOBI) || k->model_function != NULL ||
+            k->integration == NULL)
+        return false;
+    for (int i = 1; i < k->system->nplanets + 1; i++) {
+        double e = MGET(k->system->elements, i, ECC);
+        if (!(e >= 0. && e < 1.) || MGET(k->system->elements, i, PRECESSION_RATE) != 0.)
+            return false;
+    }
+    for (int i = 0; i < k->ndata; i++)
+        if ((int) k->compiled[i][T_FLAG] == T_TIMING && k->compiled[i][T_ERR] >= 0)
+            return false;
+    return true;
+}
+
+/**
+ * Computes the derivatives of the radial velocity of the star (m/s) at time t
+ * with respect to the orbital elements of each planet, in the units of the
+ * elements matrix (days, Mjup, degrees). The velocity is
+ * rv = sum_i m_i w_i / M, with w_i = sin(i) (2 pi mu_i / P)^(1/3) h(E, e, g) the
+ * astrocentric velocity of planet i along the line of sight; E depends on the
+ * mean anomaly and eccentricity through Kepler's equation, dE/dM = 1/(1 - e cos E)
+ * and dE/de = sin E/(1 - e cos E).
+ * @param k The kernel (KEPLER integrator, see K_keplerGradientValid)
+ * @param t Time of the observation
+ * @param drv An (nplanets + 1) x ELEMENTS_SIZE array that receives the derivatives;
+ * only the PER, MASS, MA, ECC, LOP, INC and NODE columns are set
+ */
+static void K_keplerRVGradient(ok_kernel* k, const double t, double drv[][ELEMENTS_SIZE]) {
+    const int np = k->system->nplanets;
+    const double epoch = k->system->epoch;
+    const double C = AUPDAY_TO_MPS(1.);
+    const double Mstar = MSUN_TO_INT(MGET(k->system->elements, 0, MASS));
+
+    double m[np + 1], w[np + 1];
+    double Mtot = Mstar;
+    double S = 0.;
+
+    for (int i = 1; i <= np; i++) {
+        double P = MGET(k->system->elements, i, PER);
+        double e = MGET(k->system->elements, i, ECC);
+        double inc = TO_RAD(MGET(k->system->elements, i, INC));
+        double g = TO_RAD(MGET(k->system->elements, i, LOP)) - TO_RAD(MGET(k->system->elements, i, NODE));
+        double M = TO_RAD(MGET(k->system->elements, i, MA)) + 2. * M_PI / P * (t - epoch);
+
+        m[i] = MJUP_TO_INT(MGET(k->system->elements, i, MASS));
+        double mu = Mstar + m[i];
+        Mtot += m[i];
+
+        double E = mco_kep__(e, RADRANGE(M));
+        double sE = sin(E), cE = cos(E);
+        double sg = sin(g), cg = cos(g);
+        double r = sqrt(1. - e * e);
+        double D = 1. - e * cE;
+
+        double num = r * cg * cE - sg * sE;
+        double h = num / D;
+        double dhdE = ((-r * cg * sE - sg * cE) * D - num * e * sE) / (D * D);
+        double dhde = ((-e / r) * cg * cE * D + num * cE) / (D * D) + dhdE * sE / D;
+        double dhdg = (-r * sg * cE - cg * sE) / D;
+        double dhdM = dhdE / D;
+
+        double v = cbrt(2. * M_PI * mu / P);
+        double A = sin(inc) * v;
+        w[i] = A * h;
+        S += m[i] * w[i];
+
+        // Derivatives of w_i; the mass is handled below, as it also enters M
+        drv[i][PER] = -w[i] / (3. * P) - A * dhdM * 2. * M_PI * (t - epoch) / (P * P);
+        drv[i][MASS] = w[i] / (3. * mu);
+        drv[i][MA] = A * dhdM * M_PI / 180.;
+        drv[i][ECC] = A * dhde;
+        drv[i][LOP] = A * dhdg * M_PI / 180.;
+        drv[i][NODE] = -drv[i][LOP];
+        drv[i][INC] = cos(inc) * v * h * M_PI / 180.;
+    }
+
+    for (int i = 1; i <= np; i++) {
+        double c = C * m[i] / Mtot;
+        drv[i][PER] *= c;
+        drv[i][MA] *= c;
+        drv[i][ECC] *= c;
+        drv[i][LOP] *= c;
+        drv[i][NODE] *= c;
+        drv[i][INC] *= c;
+        drv[i][MASS] = C * ((w[i] + m[i] * drv[i][MASS]) / Mtot - S / (Mtot * Mtot)) * MJUP_TO_INT(1.);
+    }
+}
+
+/**
+ * Default gradient function. Computes the analytic derivatives of the merit
+ * function with respect to the parameters that enter the model linearly (the
+ * data set offsets and RV trends) and the jitter parameters, if the merit 
+ * function is the reduced chi^2 (K_getChi2) or the negative log-likelihood
+ * (K_getLoglik). With the KEPLER integrator (astrocentric coordinates, no 
+ * custom model function, no precession and no transit timing data), the 
+ * derivatives with respect to the period, mass, mean anomaly, eccentricity,
+ * longitude of pericenter, inclination and node of each planet are also 
+ * computed in closed form. All other components are set to NAN, and should be 
+ * computed numerically. The kernel is assumed to be up to date (K_calculate).
+ * @param k The kernel
+ * @param grad A vector that will receive the gradient, in the order returned by
+ * K_getMinimizedVariables
+ */
+void K_default_gradient(ok_kernel* k, double* grad) {
+    ok_kernel_minimizer_pars mp = K_getMinimizedVariables(k);
+    bool chi2 = (k->minfunc == K_getChi2);
+    bool loglik = (k->minfunc == K_getLoglik);
+
+    double dpar[PARAMS_SIZE];
+    for (int i = 0; i < PARAMS_SIZE; i++)
+        dpar[i] = 0.;
+
+    const int np = k->system->nplanets;
+    bool kepler = (chi2 || loglik) && np > 0 && K_keplerGradientValid(k);
+    double del[np + 1][ELEMENTS_SIZE];
+    double drv[np + 1][ELEMENTS_SIZE];
+    for (int i = 0; i <= np; i++)
+        for (int j = 0; j < ELEMENTS_SIZE; j++)
+            del[i][j] = 0.;
+
+    if (chi2 || loglik) {
+        double epoch = k->system->epoch;
+        for (int i = 0; i < k->ndata; i++) {
+            const double* row = k->compiled[i];
+            double s = row[T_ERR];
+            if (s < 0)
+                continue;
+            int set = (int) row[T_SET];
+            double n = VGET(k->params, set + DATA_SETS_SIZE);
+            double w = s * s + n * n;
+            int type = (int) row[T_FLAG];
+
+            if (loglik)
+                dpar[set + DATA_SETS_SIZE] += n / w;
+            if (type == T_DUMMY)
+                continue;
+
+            double diff = row[T_SVAL] - row[T_PRED];
+            double f = (chi2 ? 1. / k->nrpars : 0.5);
+            dpar[set + DATA_SETS_SIZE] -= f * 2. * n * diff * diff / (w * w);
+
+            if (type == T_RV) {
+                double dt = row[T_TIME] - epoch;
+                dpar[set] -= f * 2. * diff / w;
+                dpar[P_RV_TREND] -= f * 2. * diff / w * dt;
+                dpar[P_RV_TREND_QUADRATIC] -= f * 2. * diff / w * dt * dt;
+
+                if (kepler) {
+                    K_keplerRVGradient(k, row[T_TIME], drv);
+                    for (int p = 1; p <= np; p++)
+                        for (int j = 0; j <= NODE; j++)
+                            del[p][j] -= f * 2. * diff / w * drv[p][j];
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < mp.npars; i++) {
+        grad[i] = INVALID_NUMBER;
+        if (mp.type[i] != -1) {
+            int j = mp.type[i];
+            if (kepler && (j == PER || j == MASS || j == MA || j == ECC || j == LOP || j == INC || j == NODE))
+                grad[i] = del[mp.planet[i]][j];
+            continue;
+        }
+        if (!(chi2 || loglik))
+            continue;
+        int idx = (int) (mp.pars[i] - k->params->data);
+        if (idx < k->nsets || idx == P_RV_TREND || idx == P_RV_TREND_QUADRATIC ||
+                (idx >= DATA_SETS_SIZE && idx < DATA_SETS_SIZE + k->nsets))
+            grad[i] = dpar[idx];
+    }
+
+    FREE_MINIMIZER_PARS(mp);
+}
+
 K_GET_C(minfunc, MinFunc, ok_callback)
 K_GETSET_C(intMethod, IntMethod, int)
 K_GETSET_C(intOptions, IntOptions, ok_integrator_options*)
@@ -1352,6 +1557,12 @@ ok_kernel* K_cloneFlags(ok_kernel* k, unsigned int flags) {
     k2->flags |= flags;
     k2->progress = k->progress;
     k2->model_function = k->model_function;
+    if (flags & SHARE_BUDGET)
+        ok_budget_retain(k->budget);
+    else {
+        k2->budget = ok_budget_alloc();
+        K_setBudget(k2, k->budget->max_evals, k->budget->max_time, k->budget->target);
+    }
     k2->intOptions = (ok_integrator_options*) malloc(sizeof (ok_integrator_options));
     memcpy(k2->intOptions, k->intOptions, sizeof (ok_integrator_options));
     k2->intOptions->buffer = NULL;
@@ -1360,8 +1571,41 @@ ok_kernel* K_cloneFlags(ok_kernel* k, unsigned int flags) {
     return k2;
 }
 
+/**
+ * Returns a copy of the kernel that can be used as a private workspace (e.g. by
+ * a thread evaluating the merit function in parallel with other threads). Unlike
+ * K_clone, the copy keeps the compiled data of the original kernel,
+ * including the order and duplication of data points introduced by
+ * BOOTSTRAP_DATA, while owning its own copy of the datasets (so that predicted
+ * values can be written concurrently).
+ * @param k The kernel to copy
+ * @return A new kernel (that you manage)
+ */
+ok_kernel* K_cloneWorkspace(ok_kernel* k) {
+    if (k->flags & NEEDS_COMPILE)
+        K_compileData(k);
+
+    ok_kernel* k2 = K_cloneFlags(k, SHARE_BUDGET);
+
+    if (k->compiled != NULL && k->ndata > 0) {
+        k2->compiled = (double**) malloc(sizeof (double*) * k->ndata);
+        for (int i = 0; i < k->ndata; i++) {
+            int set = (int) k->compiled[i][T_SET];
+            size_t row = (k->compiled[i] - k->datasets[set]->data) / k->datasets[set]->tda;
+            k2->compiled[i] = gsl_matrix_ptr(k2->datasets[set], row, 0);
+        }
+        k2->times = ok_vector_copy(k->times);
+        k2->flags &= ~(NEEDS_COMPILE | BOOTSTRAP_DATA);
+    }
+    k2->flags |= NEEDS_SETUP;
+    return k2;
+}
+
 int K_minimize(ok_kernel* k, int algo, int maxiter, double params[]) {
-    int ret = ok_minimizers[algo](k, maxiter, params);
+    ok_budget_start(k->budget);
+    int ret = (K_checkBudget(k, INVALID_NUMBER) == BUDGET_OK ?
+               ok_minimizers[algo](k, maxiter, params) : PROGRESS_STOP);
+    ok_budget_stop(k->budget);
 
     for (int i = 1; i < k->system->elements->size1; i++) {
         MSET(k->system->elements, i, MA, DEGRANGE(MGET(k->system->elements, i, MA)));
@@ -1836,6 +2080,22 @@ void K_setSeed(ok_kernel* k, unsigned long int seed) {
     gsl_rng_set(k->rng, seed);
 }
 
+/**
+ * Replaces the random number generator of the kernel with the stream 'stream' of a
+ * counter-based generator keyed by 'seed' (see ok_rng_stream_set).
+ * @param k Kernel
+ * @param seed Seed shared by all the streams of a run
+ * @param stream Index of the stream
+ */
+void K_setRngStream(ok_kernel* k, unsigned long int seed, unsigned long int stream) {
+    if (k->rng == NULL || k->rng->type != ok_rng_philox) {
+        if (k->rng != NULL)
+            gsl_rng_free(k->rng);
+        k->rng = gsl_rng_alloc(ok_rng_philox);
+    }
+    ok_rng_stream_set(k->rng, seed, stream);
+}
+
 unsigned int K_getNplanets(ok_kernel* k) {
     return k->system->nplanets;
 }
@@ -7,6 +7,7 @@
 
 #include "systemic.h"
 #include "utils.h"
+#include "budget.h"
 
 #define MV_VALUE 0
 #define MV_MIN 1
@@ -55,6 +56,8 @@ void K_free(ok_kernel* k);
 ok_kernel* K_clone(ok_kernel* k);
 // Returns a new copy of the current kernel (that you manage), with data sharing options
 ok_kernel* K_cloneFlags(ok_kernel* k, unsigned int shareFlags);
+// Returns a new copy of the current kernel (that you manage), keeping the compiled (e.g. bootstrapped) data
+ok_kernel* K_cloneWorkspace(ok_kernel* k);
 
 // RV MANAGEMENT
 // add a new rv from an ASCII file; returns NULL on error
@@ -128,6 +131,9 @@ K_GET_H(rms_tts, Rms_tts, double)
 
 K_GETSET_H(flags, Flags, unsigned int)
 K_GETSET_H(minfunc, MinFunc, ok_callback)
+void K_setGradFunc(ok_kernel* k, ok_callback2 f);
+ok_callback2 K_getGradFunc(ok_kernel* k);
+void K_default_gradient(ok_kernel* k, double* grad);
 K_GETSET_H(plSteps, ElementSteps, gsl_matrix*)
 K_GETSET_H(parSteps, ParSteps, gsl_vector*)
 K_GETSET_H(plFlags, ElementFlags, gsl_matrix_int*)
@@ -192,6 +198,7 @@ bool K_infoExists(ok_kernel* k, const char * tag);
 void K_print(ok_kernel* k, FILE* f);
 void K_save_old(ok_kernel* k, const char* stem);
 void K_setSeed(ok_kernel* k, unsigned long int seed);
+void K_setRngStream(ok_kernel* k, unsigned long int seed, unsigned long int stream);
 
 // BRIDGE UTILITIES
 void* ok_bridge_kernel_buf(void* buf, int n, ok_kernel* k);
@@ -1,3 +1,5 @@
+// mmap (KL_map)
+#define _POSIX_C_SOURCE 200809L
 
 #include "kl.h"
 #include "kernel.h"
@@ -5,6 +7,13 @@
 #include "gsl/gsl_vector.h"
 #include "gsl/gsl_statistics.h"
 #include "gsl/gsl_sort_vector.h"
+#include "stdint.h"
+#ifndef JAVASCRIPT
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 /*
  * ok_list is an object containing a list of orbital elements and 
  * parameters. It is conceptually similar to an array of ok_kernel* 
@@ -31,10 +40,55 @@ ok_list* KL_alloc(const int size, ok_kernel* prototype) {
     kl->kernels = (ok_list_item**) calloc(size, sizeof (ok_list_item*));
     kl->size = size;
     kl->diags = NULL;
+    kl->type = 0;
+    kl->columns = NULL;
 
     return kl;
 }
 
+/*
+ * Accessors of an entry of a list, either stored as items or as columns
+ */
+static inline const double* ok_kl_column(const ok_list* kl, const int c) {
+    return kl->columns->data + (size_t) c * kl->size;
+}
+
+static inline double ok_kl_get_element(const ok_list* kl, const int n, const int i, const int j) {
+    if (kl->columns != NULL)
+        return ok_kl_column(kl, i * kl->columns->cols + j)[n];
+    return MGET(kl->kernels[n]->elements, i, j);
+}
+
+static inline double ok_kl_get_par(const ok_list* kl, const int n, const int j) {
+    if (kl->columns != NULL)
+        return ok_kl_column(kl, kl->columns->rows * kl->columns->cols + j)[n];
+    return VGET(kl->kernels[n]->params, j);
+}
+
+static inline double ok_kl_get_merit(const ok_list* kl, const int n, const int which) {
+    if (kl->columns != NULL)
+        return ok_kl_column(kl, kl->columns->rows * kl->columns->cols + kl->columns->npars + which)[n];
+    return (which == OK_KL_MERIT ? kl->kernels[n]->merit :
+            (which == OK_KL_MERIT_PR ? kl->kernels[n]->merit_pr : kl->kernels[n]->merit_li));
+}
+
+static inline int ok_kl_get_tag(const ok_list* kl, const int n) {
+    return (kl->columns != NULL ? kl->columns->tags[n] : kl->kernels[n]->tag);
+}
+
+// Sizes of the element matrices and of the parameter vectors of a (non-empty) list
+static void ok_kl_dims(const ok_list* kl, int* rows, int* cols, int* npars) {
+    if (kl->columns != NULL) {
+        *rows = kl->columns->rows;
+        *cols = kl->columns->cols;
+        *npars = kl->columns->npars;
+    } else {
+        *rows = MROWS(kl->kernels[0]->elements);
+        *cols = MCOLS(kl->kernels[0]->elements);
+        *npars = kl->kernels[0]->params->size;
+    }
+}
+
 /**
  * Appends two lists together (the src list to the end of the dest list).
  * The src list is subsequently freed.
@@ -44,6 +98,7 @@ ok_list* KL_alloc(const int size, ok_kernel* prototype) {
  */
 
 void KL_append(ok_list* dest, ok_list* src) {
+    assert(dest->columns == NULL && src->columns == NULL);
     if (dest->prototype != src->prototype)
         K_free(src->prototype);
 
@@ -59,10 +114,31 @@ void KL_append(ok_list* dest, ok_list* src) {
 
     dest->size = size;
 
+    if (src->diags != NULL)
+        gsl_matrix_free((gsl_matrix*) src->diags);
     free(src->kernels);
     free(src);
 }
 
+/**
+ * Removes the empty (unset) entries of a list, e.g. the trials that were
+ * skipped by an interrupted run. The order of the other entries is preserved.
+ * 
+ * @param kl list to compact
+ */
+void KL_compact(ok_list* kl) {
+    assert(kl->columns == NULL);
+    int n = 0;
+    for (int i = 0; i < kl->size; i++)
+        if (kl->kernels[i] != NULL) {
+            kl->kernels[n] = kl->kernels[i];
+            if (n != i)
+                kl->kernels[i] = NULL;
+            n++;
+        }
+    kl->size = n;
+}
+
 /**
  * Frees a list.
  * 
@@ -72,14 +148,25 @@ void KL_free(ok_list* kl) {
     if (kl == NULL)
         return;
 
-    for (int i = 0; i < kl->size; i++) {
+    for (int i = 0; i < kl->size && kl->kernels != NULL; i++) {
         free(kl->kernels[i]);
     }
 
+    if (kl->columns != NULL) {
+#ifndef JAVASCRIPT
+        if (kl->columns->mapped)
+            munmap(kl->columns->base, kl->columns->length);
+        else
+#endif
+            free(kl->columns->base);
+        free(kl->columns);
+    }
     if (kl->prototype != NULL)
         K_free(kl->prototype);
     if (kl->kernels != NULL)
         free(kl->kernels);
+    if (kl->diags != NULL)
+        gsl_matrix_free((gsl_matrix*) kl->diags);
 
     free(kl);
 }
@@ -181,8 +268,8 @@ ok_list* KL_load(FILE* fid, int skip) {
                 fscanf(fid, "%le", &merit);
 
                 ok_list_item* it = KL_set(kl, tr, elements, pars, merit, 0);
-                fscanf(fid, "%le", &it->merit_li);
                 fscanf(fid, "%le", &it->merit_pr);
+                fscanf(fid, "%le", &it->merit_li);
                 double tag;
                 fscanf(fid, "%le", &tag);
                 it->tag = (int) tag;
@@ -207,7 +294,7 @@ ok_list* KL_load(FILE* fid, int skip) {
  * @return The item just modified
  */
 ok_list_item* KL_set(ok_list* kl, const int idx, gsl_matrix* elements, gsl_vector* pars, double merit, int tag) {
-    assert(idx < kl->size);
+    assert(idx < kl->size && kl->columns == NULL);
     if (kl->kernels[idx] != NULL) {
         gsl_matrix_free(kl->kernels[idx]->elements);
         gsl_vector_free(kl->kernels[idx]->params);
@@ -235,18 +322,18 @@ gsl_vector* KL_getElements(const ok_list* kl, const int pl, const int el) {
     gsl_vector* v = gsl_vector_alloc(kl->size);
 
     for (int i = 0; i < kl->size; i++)
-        VSET(v, i, MGET(kl->kernels[i]->elements, pl, el));
+        VSET(v, i, ok_kl_get_element(kl, i, pl, el));
     return v;
 }
 
 double KL_getElement(const ok_list* kl, const int index, const int pl, const int el) {
 
-    return MGET(kl->kernels[index]->elements, pl, el);
+    return ok_kl_get_element(kl, index, pl, el);
 }
 
 double KL_getPar(const ok_list* kl, const int index, const int what) {
 
-    return VGET(kl->kernels[index]->params, what);
+    return ok_kl_get_par(kl, index, what);
 }
 
 /**
@@ -261,77 +348,331 @@ gsl_vector* KL_getPars(const ok_list* kl, const int vo) {
     gsl_vector* v = gsl_vector_alloc(kl->size);
 
     for (int i = 0; i < kl->size; i++)
-        VSET(v, i, VGET(kl->kernels[i]->params, vo));
+        VSET(v, i, ok_kl_get_par(kl, i, vo));
 
     return v;
 }
 
+/*
+ * Integrated autocorrelation time of the columns of a list. The samples are
+ * grouped in chains by their tag (keeping their order within each chain); the
+ * autocovariance of each chain is computed with an FFT in O(n log n) and the
+ * autocovariances are averaged over the chains, weighted by their length. The sum
+ * of the autocorrelations is truncated with the automatic window of Sokal (M >= 5 tau).
+ */
+typedef struct {
+    int n;
+    int nchains;
+    int maxlen;
+    int nfft;
+    // indices of the samples, sorted by chain
+    int* order;
+    // first sample (in order) of each chain, plus the end of the last chain
+    int* start;
+    double* re;
+    double* im;
+    double* acov;
+    double* weight;
+} ok_kl_acf;
+
+typedef struct {
+    int tag;
+    int idx;
+} ok_kl_tag;
+
+static int ok_kl_tag_cmp(const void* a, const void* b) {
+    const ok_kl_tag* ta = (const ok_kl_tag*) a;
+    const ok_kl_tag* tb = (const ok_kl_tag*) b;
+    if (ta->tag != tb->tag)
+        return (ta->tag < tb->tag ? -1 : 1);
+    return (ta->idx < tb->idx ? -1 : (ta->idx > tb->idx ? 1 : 0));
+}
+
+static ok_kl_acf* ok_kl_acf_alloc(const ok_list* kl) {
+    ok_kl_acf* w = (ok_kl_acf*) calloc(1, sizeof (ok_kl_acf));
+    const int n = kl->size;
+    w->n = n;
+    w->order = (int*) malloc(sizeof (int) * MAX(n, 1));
+    w->start = (int*) malloc(sizeof (int) * (n + 1));
+
+    ok_kl_tag* tags = (ok_kl_tag*) malloc(sizeof (ok_kl_tag) * MAX(n, 1));
+    for (int i = 0; i < n; i++) {
+        tags[i].tag = ok_kl_get_tag(kl, i);
+        tags[i].idx = i;
+    }
+    qsort(tags, n, sizeof (ok_kl_tag), ok_kl_tag_cmp);
+
+    for (int i = 0; i < n; i++) {
+        w->order[i] = tags[i].idx;
+        if (i == 0 || tags[i].tag != tags[i - 1].tag)
+            w->start[w->nchains++] = i;
+    }
+    w->start[w->nchains] = n;
+    free(tags);
+
+    for (int c = 0; c < w->nchains; c++)
+        w->maxlen = MAX(w->maxlen, w->start[c + 1] - w->start[c]);
+
+    w->nfft = 1;
+    while (w->nfft < 2 * w->maxlen)
+        w->nfft *= 2;
+    w->re = (double*) malloc(sizeof (double) * w->nfft);
+    w->im = (double*) malloc(sizeof (double) * w->nfft);
+    w->acov = (double*) malloc(sizeof (double) * MAX(w->maxlen, 1));
+    w->weight = (double*) malloc(sizeof (double) * MAX(w->maxlen, 1));
+    return w;
+}
+
+static void ok_kl_acf_free(ok_kl_acf* w) {
+    free(w->order);
+    free(w->start);
+    free(w->re);
+    free(w->im);
+    free(w->acov);
+    free(w->weight);
+    free(w);
+}
+
+/*
+ * Returns the integrated autocorrelation time of the samples v (in the order
+ * of the list), or INVALID_NUMBER if no chain has at least 2 samples or the
+ * samples have no variance; angles (in degrees) are unwrapped around their mean.
+ */
+static double ok_kl_iat(ok_kl_acf* w, const double* v, const bool angle) {
+    // Constant columns (e.g. parameters that were not varied) are skipped
+    bool constant = true;
+    for (int i = 1; i < w->n && constant; i++)
+        constant = (v[i] == v[0]);
+    if (constant)
+        return INVALID_NUMBER;
+
+    for (int t = 0; t < w->maxlen; t++)
+        w->acov[t] = w->weight[t] = 0.;
+
+    for (int c = 0; c < w->nchains; c++) {
+        const int m = w->start[c + 1] - w->start[c];
+        if (m < 2)
+            continue;
+        const int* idx = w->order + w->start[c];
+
+        double mean = 0.;
+        if (angle) {
+            for (int i = 0; i < m; i++)
+                w->re[i] = v[idx[i]];
+            double ref = ok_average_angle(w->re, m, false);
+            for (int i = 0; i < m; i++)
+                w->re[i] = ref + DEGRANGE(w->re[i] - ref + 180.) - 180.;
+        } else
+            for (int i = 0; i < m; i++)
+                w->re[i] = v[idx[i]];
+
+        for (int i = 0; i < m; i++)
+            mean += w->re[i] / m;
+        for (int i = 0; i < w->nfft; i++) {
+            w->re[i] = (i < m ? w->re[i] - mean : 0.);
+            w->im[i] = 0.;
+        }
+
+        ok_fft(w->re, w->im, w->nfft, false);
+        for (int i = 0; i < w->nfft; i++) {
+            w->re[i] = SQR(w->re[i]) + SQR(w->im[i]);
+            w->im[i] = 0.;
+        }
+        ok_fft(w->re, w->im, w->nfft, true);
+
+        // re[t] / nfft is the sum of the lag-t products; the autocovariance is
+        // averaged over the chains with weight m
+        for (int t = 0; t < m; t++) {
+            w->acov[t] += w->re[t] / w->nfft;
+            w->weight[t] += m;
+        }
+    }
+
+    if (!(w->weight[0] > 0) || !(w->acov[0] > 0))
+        return INVALID_NUMBER;
+
+    double c0 = w->acov[0] / w->weight[0];
+    double tau = 1.;
+    for (int t = 1; t < w->maxlen && w->weight[t] > 0; t++) {
+        tau += 2. * (w->acov[t] / w->weight[t]) / c0;
+        if (t >= 5. * tau)
+            break;
+    }
+    return tau;
+}
+
+static double ok_kl_iat_stat(ok_kl_acf* w, const double* v, const bool angle, const int what) {
+    double tau = ok_kl_iat(w, v, angle);
+    if (what == STAT_IAT || IS_INVALID(tau))
+        return tau;
+    return MIN(w->n / tau, w->n);
+}
+
+/*
+ * Column-major copy of the entries of a list (the layout of ok_list_columns), followed
+ * by the tags if requested: each item is read once, and its values are scattered to the
+ * columns in blocks of items.
+ */
+static double* ok_kl_transpose(const ok_list* kl, const bool with_tags) {
+    int rows, cols, npars;
+    ok_kl_dims(kl, &rows, &cols, &npars);
+    const size_t n = kl->size;
+    const int nel = rows * cols;
+    double* data = (double*) malloc(sizeof (double) * n * (nel + npars + 3) + (with_tags ? sizeof (int) * n : 0));
+
+    const int block = 64;
+    #pragma omp parallel for
+    for (int b = 0; b < (int) n; b += block)
+        for (int m = b; m < MIN(b + block, (int) n); m++) {
+            const ok_list_item* it = kl->kernels[m];
+            for (int i = 0; i < rows; i++)
+                for (int j = 0; j < cols; j++)
+                    data[(i * cols + j) * n + m] = MGET(it->elements, i, j);
+            for (int j = 0; j < npars; j++)
+                data[(nel + j) * n + m] = VGET(it->params, j);
+            data[(nel + npars + OK_KL_MERIT) * n + m] = it->merit;
+            data[(nel + npars + OK_KL_MERIT_PR) * n + m] = it->merit_pr;
+            data[(nel + npars + OK_KL_MERIT_LI) * n + m] = it->merit_li;
+        }
+
+    if (with_tags) {
+        int* tags = (int*) (data + n * (nel + npars + 3));
+        for (int m = 0; m < (int) n; m++)
+            tags[m] = kl->kernels[m]->tag;
+    }
+    return data;
+}
+
+/**
+ * Converts a list to column-major storage (see ok_list_columns): the values of
+ * each element, parameter and merit are stored contiguously, which makes the
+ * statistics of the list faster. The items of the list are freed, and the list
+ * becomes read-only (as a list opened with KL_map).
+ * @param kl List (not empty)
+ */
+void KL_to_columns(ok_list* kl) {
+    if (kl->columns != NULL || kl->size == 0)
+        return;
+
+    ok_list_columns* c = (ok_list_columns*) malloc(sizeof (ok_list_columns));
+    ok_kl_dims(kl, &(c->rows), &(c->cols), &(c->npars));
+    size_t ncols = (size_t) c->rows * c->cols + c->npars + 3;
+    c->base = ok_kl_transpose(kl, true);
+    c->length = sizeof (double) * ncols * kl->size + sizeof (int) * kl->size;
+    c->mapped = false;
+    c->data = (const double*) c->base;
+    c->tags = (const int*) (c->data + ncols * kl->size);
+
+    for (int i = 0; i < kl->size; i++) {
+        gsl_matrix_free(kl->kernels[i]->elements);
+        gsl_vector_free(kl->kernels[i]->params);
+        free(kl->kernels[i]);
+    }
+    free(kl->kernels);
+    kl->kernels = NULL;
+    kl->columns = c;
+}
+
+/*
+ * Statistic 'what' (see KL_getElementsStats) of the n values x; v is a scratch buffer
+ * of n values, used by the order statistics (computed by selection, without sorting)
+ */
+static double ok_kl_stat(const double* x, double* v, const int n, const int what, const bool angle,
+                         ok_kl_acf* acf) {
+    switch (what) {
+        case STAT_MEAN:
+            return (angle ? ok_average_angle(x, n, false) : gsl_stats_mean(x, 1, n));
+        case STAT_STDDEV:
+            return (angle ? ok_stddev_angle(x, n, false) : gsl_stats_sd(x, 1, n));
+        case STAT_MEDIAN:
+            if (angle)
+                return ok_median_angle(x, n, false);
+            memcpy(v, x, sizeof (double) * n);
+            return ok_median(v, n);
+        case STAT_MAD:
+            if (angle) {
+                double med = ok_median_angle(x, n, false);
+                memcpy(v, x, sizeof (double) * n);
+                return 1.4826 * ok_mad_angle(v, n, med, false);
+            } else {
+                memcpy(v, x, sizeof (double) * n);
+                double med = ok_median(v, n);
+                return 1.4826 * ok_mad(v, n, med);
+            }
+        case STAT_IAT:
+        case STAT_ESS:
+            return ok_kl_iat_stat(acf, x, angle, what);
+        default:
+        {
+            // percentiles
+            double q = (double) (what) / 100.;
+            double ret;
+            memcpy(v, x, sizeof (double) * n);
+            ok_quantiles(v, n, &q, 1, &ret);
+            return ret;
+        }
+    };
+}
+
+/*
+ * Computes the statistic 'what' of the columns [first, first + count) of the list
+ * (see ok_list_columns) in parallel, one column at a time; angle[c] marks the columns
+ * holding angles. The columns of a list stored as items are copied once for all.
+ */
+static void ok_kl_columns_stat(const ok_list* kl, const int first, const int count, const bool* angle,
+                               const int what, double* ret) {
+    const int n = kl->size;
+    double* owned = NULL;
+    const double* data;
+    if (kl->columns != NULL)
+        data = kl->columns->data;
+    else
+        data = owned = ok_kl_transpose(kl, false);
+
+    #pragma omp parallel
+    {
+        double* v = (double*) malloc(sizeof (double) * MAX(n, 1));
+        ok_kl_acf* acf = (what == STAT_IAT || what == STAT_ESS ? ok_kl_acf_alloc(kl) : NULL);
+
+        #pragma omp for schedule(dynamic)
+        for (int c = 0; c < count; c++)
+            ret[c] = ok_kl_stat(data + (size_t) (first + c) * n, v, n, what, angle[c], acf);
+
+        free(v);
+        if (acf != NULL)
+            ok_kl_acf_free(acf);
+    }
+    free(owned);
+}
+
 /**
  * Get a summary statistic for the orbital elements; for instance,
  * the median value calculated over all the elements of the list.
  * @param kl List
- * @param what Can be one of: STAT_MEAN, STAT_MEDIAN, STAT_STDDEV, STAT_MAD. 
- *      Summary statistic is calculated correctly for angle parameters.
+ * @param what Can be one of: STAT_MEAN, STAT_MEDIAN, STAT_STDDEV, STAT_MAD,
+ *      STAT_IAT (integrated autocorrelation time, in samples) or STAT_ESS (effective
+ *      sample size), or a percentile (0-100). Summary statistic is calculated correctly for angle parameters.
+ *      For STAT_IAT and STAT_ESS, the samples with the same tag are treated as a chain.
+ *      Medians, MADs and percentiles are computed by selection, in linear time.
  * @return A matrix whose entries are the summary statistic for the 
  * corresponding orbital element.
  */
 gsl_matrix* KL_getElementsStats(const ok_list* kl, const int what) {
-
-    int npl = MROWS(kl->kernels[0]->elements);
+    if (kl->size == 0)
+        return NULL;
+    int npl, cols, npars;
+    ok_kl_dims(kl, &npl, &cols, &npars);
     if (npl == 0)
         return NULL;
 
-    gsl_vector* v = gsl_vector_alloc(kl->size);
-
-    gsl_matrix* m = gsl_matrix_alloc(npl, ALL_ELEMENTS_SIZE);
-    gsl_matrix_set_all(m, 0.);
-
-
-    for (int i = 0; i < npl; i++)
-        for (int j = 0; j < ALL_ELEMENTS_SIZE; j++) {
-            for (int n = 0; n < kl->size; n++) {
-                VSET(v, n, MGET(kl->kernels[n]->elements, i, j));
-            }
+    bool angle[npl * cols];
+    for (int c = 0; c < npl * cols; c++) {
+        int j = c % cols;
+        angle[c] = (j == MA || j == LOP || j == INC || j == NODE || j == TRUEANOMALY);
+    }
 
-            switch (what) {
-                case STAT_MEAN:
-                    if (j == MA || j == LOP || j == INC || j == NODE || j == TRUEANOMALY)
-                        MSET(m, i, j, ok_average_angle(v->data, v->size, false));
-                    else
-                        MSET(m, i, j, gsl_stats_mean(v->data, 1, v->size));
-                    break;
-                case STAT_STDDEV:
-                    if (j == MA || j == LOP || j == INC || j == NODE || j == TRUEANOMALY) {
-                        MSET(m, i, j, ok_stddev_angle(v->data, v->size, false));
-                    } else
-                        MSET(m, i, j, gsl_stats_sd(v->data, 1, v->size));
-                    break;
-                case STAT_MEDIAN:
-                    if (j == MA || j == LOP || j == INC || j == NODE || j == TRUEANOMALY)
-                        MSET(m, i, j, ok_median_angle(v->data, v->size, false));
-                    else {
-                        gsl_sort_vector(v);
-                        MSET(m, i, j, gsl_stats_median_from_sorted_data(v->data, 1, v->size));
-                    }
-                    break;
-                case STAT_MAD:
-                    if (j == MA || j == LOP || j == INC || j == NODE || j == TRUEANOMALY) {
-                        double med = ok_median_angle(v->data, v->size, false);
-                        MSET(m, i, j, 1.4826 * ok_mad_angle(v->data, v->size, med, false));
-                    } else {
-                        gsl_sort_vector(v);
-                        double med = gsl_stats_median_from_sorted_data(v->data, 1, v->size);
-
-                        MSET(m, i, j, 1.4826 * ok_mad(v->data, v->size, med));
-                    }
-                    break;
-                default:
-                    // percentiles
-                    gsl_sort_vector(v);
-                    MSET(m, i, j, gsl_stats_quantile_from_sorted_data(v->data, 1, v->size, (double) (what) / 100.));
-            };
-        }
-    gsl_vector_free(v);
+    gsl_matrix* m = gsl_matrix_alloc(npl, cols);
+    ok_kl_columns_stat(kl, 0, npl * cols, angle, what, m->data);
     return m;
 }
 
@@ -339,61 +680,78 @@ gsl_matrix* KL_getElementsStats(const ok_list* kl, const int what) {
  * Get a summary statistic for the parameters; for instance,
  * the median value calculated over all the elements of the list.
  * @param kl List
- * @param what Can be one of: STAT_MEAN, STAT_MEDIAN, STAT_STDDEV, STAT_MAD. 
+ * @param what Can be one of: STAT_MEAN, STAT_MEDIAN, STAT_STDDEV, STAT_MAD,
+ * STAT_IAT, STAT_ESS or a percentile (see KL_getElementsStats).
  * @return A vector whose entries are the summary statistic for the 
- * corresponding orbital parameter.
+ * corresponding orbital parameter, followed by the one of the merit.
  */
 gsl_vector* KL_getParsStats(const ok_list* kl, const int what) {
-
-    gsl_vector* v = gsl_vector_alloc(kl->size);
     gsl_vector* ret = gsl_vector_calloc(PARAMS_SIZE + 1);
-
-
-    for (int j = 0; j < PARAMS_SIZE + 1; j++) {
-        if (j == PARAMS_SIZE)
-            for (int n = 0; n < kl->size; n++) {
-                VSET(v, n, kl->kernels[n]->merit);
-            } else
-            for (int n = 0; n < kl->size; n++) {
-                VSET(v, n, VGET(kl->kernels[n]->params, j));
-            }
-
-        switch (what) {
-            case STAT_MEAN:
-                VSET(ret, j, gsl_stats_mean(v->data, 1, v->size));
-                break;
-            case STAT_STDDEV:
-                VSET(ret, j, gsl_stats_sd(v->data, 1, v->size));
-                break;
-            case STAT_MEDIAN:
-                gsl_sort_vector(v);
-                VSET(ret, j, gsl_stats_median_from_sorted_data(v->data, 1, v->size));
-                break;
-            case STAT_MAD:
-                gsl_sort_vector(v);
-                double med = gsl_stats_median_from_sorted_data(v->data, 1, v->size);
-                VSET(ret, j, 1.4826 * ok_mad(v->data, v->size, med));
-                break;
-            default:
-                // percentiles
-                gsl_sort_vector(v);
-                VSET(v, j, gsl_stats_quantile_from_sorted_data(v->data, 1, v->size, (double) (what) / 100.));
-        };
-    };
-
-    gsl_vector_free(v);
+    if (kl->size == 0)
+        return ret;
+    int npl, cols, npars;
+    ok_kl_dims(kl, &npl, &cols, &npars);
+    assert(npars == PARAMS_SIZE);
+
+    bool angle[PARAMS_SIZE + 1];
+    for (int j = 0; j < PARAMS_SIZE + 1; j++)
+        angle[j] = false;
+    // The merit column follows the parameters
+    ok_kl_columns_stat(kl, npl * cols, PARAMS_SIZE + 1, angle, what, ret->data);
     return ret;
 }
 
+/**
+ * Computes several quantiles of each column of the list at once (by selection, in
+ * linear time), in parallel over the columns.
+ * @param kl List (not empty)
+ * @param q Quantiles to compute (between 0 and 1)
+ * @param nq Number of quantiles
+ * @return A matrix with a row for each column of the list, in the order of
+ * ok_list_columns (the rows x cols orbital elements, the parameters, the merit, the
+ * prior and the likelihood), and a column for each quantile. Angles are not
+ * treated specially.
+ */
+gsl_matrix* KL_getQuantiles(const ok_list* kl, const double* q, const int nq) {
+    int rows, cols, npars;
+    ok_kl_dims(kl, &rows, &cols, &npars);
+    const int ncols = rows * cols + npars + 3;
+    const int n = kl->size;
+
+    double* owned = NULL;
+    const double* data;
+    if (kl->columns != NULL)
+        data = kl->columns->data;
+    else
+        data = owned = ok_kl_transpose(kl, false);
+
+    gsl_matrix* m = gsl_matrix_alloc(ncols, nq);
+    #pragma omp parallel
+    {
+        double* v = (double*) malloc(sizeof (double) * MAX(n, 1));
+        #pragma omp for schedule(dynamic)
+        for (int c = 0; c < ncols; c++) {
+            memcpy(v, data + (size_t) c * n, sizeof (double) * n);
+            ok_quantiles(v, n, q, nq, m->data + c * m->tda);
+        }
+        free(v);
+    }
+    free(owned);
+    return m;
+}
+
 int KL_getSize(const ok_list* kl) {
     return kl->size;
 }
 
 int KL_getNplanets(const ok_list* kl) {
+    if (kl->columns != NULL)
+        return kl->columns->rows - 1;
     return MROWS(kl->kernels[0]->elements) - 1;
 }
 
 void KL_removeAtIndex(ok_list* kl, const int idx) {
+    assert(kl->columns == NULL);
     gsl_matrix_free(kl->kernels[idx]->elements);
     gsl_vector_free(kl->kernels[idx]->params);
     free(kl->kernels[idx]);
@@ -406,7 +764,7 @@ void KL_removeAtIndex(ok_list* kl, const int idx) {
 void KL_fprintf(const ok_list* kl, FILE* out, const char* fmt, const char* lfmt) {
     lfmt = (lfmt != NULL ? lfmt : "%10s%d");
 
-    int np = MROWS(kl->kernels[0]->elements) - 1;
+    int np = KL_getNplanets(kl);
     int vo = PARAMS_SIZE;
 
     fprintf(out, "# Planets = %d\n", np);
@@ -428,24 +786,155 @@ void KL_fprintf(const ok_list* kl, FILE* out, const char* fmt, const char* lfmt)
 
     for (int m = 0; m < kl->size; m++) {
 
-        gsl_matrix* ae = kl->kernels[m]->elements;
         for (int i = 0; i < ALL_ELEMENTS_SIZE; i++)
             for (int j = 1; j <= np; j++)
-                fprintf(out, fmt, MGET(ae, j, i));
+                fprintf(out, fmt, ok_kl_get_element(kl, m, j, i));
 
         for (int i = 0; i < vo; i++)
-            fprintf(out, fmt, VGET(kl->kernels[m]->params, i));
+            fprintf(out, fmt, ok_kl_get_par(kl, m, i));
 
-        fprintf(out, fmt, kl->kernels[m]->merit);
-        fprintf(out, fmt, kl->kernels[m]->merit_pr);
-        fprintf(out, fmt, kl->kernels[m]->merit_li);
-        fprintf(out, fmt, kl->kernels[m]->tag);
+        fprintf(out, fmt, ok_kl_get_merit(kl, m, OK_KL_MERIT));
+        fprintf(out, fmt, ok_kl_get_merit(kl, m, OK_KL_MERIT_PR));
+        fprintf(out, fmt, ok_kl_get_merit(kl, m, OK_KL_MERIT_LI));
+        fprintf(out, fmt, (double) ok_kl_get_tag(kl, m));
         fprintf(out, " \n");
 
     }
 
 }
 
+/**
+ * Returns the statistics of the temperatures of a list returned by K_mcmc_mult with more
+ * than one temperature: a matrix with a row for each temperature j, with columns
+ * beta_j (final inverse temperature); swaps between j and j + 1 attempted, accepted and mean
+ * swap probability; and, if OPT_MCMC_EVIDENCE was set, mean log-likelihood of the samples of
+ * temperature j and its standard error, log(Z(beta_j) / Z(beta_j+1)) estimated from the samples
+ * of temperature j + 1 (stepping stone) and its standard error, variance of the log-likelihood of
+ * the samples of temperature j. Missing values are INVALID_NUMBER.
+ * The matrix is owned by the list.
+ * @param kl List
+ * @return The statistics, or NULL
+ */
+gsl_matrix* KL_getTempStats(const ok_list* kl) {
+    return (gsl_matrix*) kl->diags;
+}
+
+/**
+ * Returns the log-evidence of a list returned by K_mcmc_mult with OPT_MCMC_EVIDENCE set,
+ * computed from the statistics of the temperatures (see KL_getTempStats). The estimates refer to the
+ * prior sampled by the hottest chain, which K_mcmc_mult only accepts if all the minimized parameters
+ * are bounded.
+ * @param kl List
+ * @param ret Array of 4 doubles: log(Z) estimated by thermodynamic integration and its standard
+ * error (trapezoidal rule over the ladder, corrected with the variances of the log-likelihood,
+ * i.e. the derivatives of the integrand, as in Friel et al. 2014); log(Z) estimated by the stepping-stone method and its
+ * standard error. The difference between the two estimates is a measure of the error due to the
+ * spacing of the ladder.
+ * @return true if the evidence is available
+ */
+bool KL_getEvidence(const ok_list* kl, double* ret) {
+    gsl_matrix* m = KL_getTempStats(kl);
+    for (int i = 0; i < 4; i++)
+        ret[i] = INVALID_NUMBER;
+    if (m == NULL || MROWS(m) < 2 || MGET(m, MROWS(m) - 1, 0) != 0.)
+        return false;
+
+    const int nt = MROWS(m);
+    double ti = 0., ti_var = 0., ss = 0., ss_var = 0.;
+    for (int j = 0; j < nt; j++) {
+        if (IS_INVALID(MGET(m, j, 4)) || IS_INVALID(MGET(m, j, 5)) || IS_INVALID(MGET(m, j, 8)))
+            return false;
+        // Weight of temperature j in the trapezoidal rule
+        double w = 0.5 * ((j > 0 ? MGET(m, j - 1, 0) : MGET(m, j, 0)) -
+                          (j < nt - 1 ? MGET(m, j + 1, 0) : MGET(m, j, 0)));
+        ti += w * MGET(m, j, 4);
+        ti_var += w * w * MGET(m, j, 5) * MGET(m, j, 5);
+
+        if (j < nt - 1) {
+            double db = MGET(m, j, 0) - MGET(m, j + 1, 0);
+            ti -= db * db / 12. * (MGET(m, j, 8) - MGET(m, j + 1, 8));
+
+            if (IS_INVALID(MGET(m, j, 6)) || IS_INVALID(MGET(m, j, 7)))
+                return false;
+            ss += MGET(m, j, 6);
+            ss_var += MGET(m, j, 7) * MGET(m, j, 7);
+        }
+    }
+
+    ret[0] = ti;
+    ret[1] = sqrt(ti_var);
+    ret[2] = ss;
+    ret[3] = sqrt(ss_var);
+    return true;
+}
+
+/**
+ * Writes the list to a binary stream (native byte order and doubles), so that
+ * it can be read back exactly with KL_load_bin. The prototype is not saved.
+ * @param kl List
+ * @param out File handle (already opened for writing)
+ * @return true on success
+ */
+bool KL_save_bin(const ok_list* kl, FILE* out) {
+    assert(kl->columns == NULL);
+    int hdr[4] = {kl->size, 0, 0, 0};
+    if (kl->size > 0) {
+        hdr[1] = MROWS(kl->kernels[0]->elements);
+        hdr[2] = MCOLS(kl->kernels[0]->elements);
+        hdr[3] = kl->kernels[0]->params->size;
+    }
+    fwrite(hdr, sizeof (int), 4, out);
+
+    for (int i = 0; i < kl->size; i++) {
+        ok_list_item* it = kl->kernels[i];
+        double merits[3] = {it->merit, it->merit_pr, it->merit_li};
+        fwrite(&(it->tag), sizeof (int), 1, out);
+        fwrite(merits, sizeof (double), 3, out);
+        gsl_matrix_fwrite(out, it->elements);
+        gsl_vector_fwrite(out, it->params);
+    }
+    return !ferror(out);
+}
+
+/**
+ * Reads a list written by KL_save_bin.
+ * @param fid File handle (already opened for reading)
+ * @param prototype Prototype kernel of the new list (can be NULL)
+ * @return A new list, or NULL if the stream could not be read
+ */
+ok_list* KL_load_bin(FILE* fid, ok_kernel* prototype) {
+    int hdr[4];
+    if (fread(hdr, sizeof (int), 4, fid) != 4 || hdr[0] < 0)
+        return NULL;
+
+    ok_list* kl = KL_alloc(hdr[0], prototype);
+    for (int i = 0; i < hdr[0]; i++) {
+        int tag;
+        double merits[3];
+        gsl_matrix* elements = gsl_matrix_alloc(hdr[1], hdr[2]);
+        gsl_vector* params = gsl_vector_alloc(hdr[3]);
+
+        if (fread(&tag, sizeof (int), 1, fid) != 1 || fread(merits, sizeof (double), 3, fid) != 3 ||
+                gsl_matrix_fread(fid, elements) != 0 || gsl_vector_fread(fid, params) != 0) {
+            gsl_matrix_free(elements);
+            gsl_vector_free(params);
+            for (int j = 0; j < i; j++) {
+                gsl_matrix_free(kl->kernels[j]->elements);
+                gsl_vector_free(kl->kernels[j]->params);
+            }
+            kl->size = i;
+            kl->prototype = NULL;
+            KL_free(kl);
+            return NULL;
+        }
+
+        ok_list_item* it = KL_set(kl, i, elements, params, merits[0], tag);
+        it->merit_pr = merits[1];
+        it->merit_li = merits[2];
+    }
+    return kl;
+}
+
 /**
  * Save list to a file
  * @param kl List
@@ -469,16 +958,229 @@ void KL_to_ptr(const ok_list* kl, double* out) {
     for (int row = 0; row < kl->size; row++) {
         for (int i = 1; i <= np; i++) {
             for (int j = 0; j < ALL_ELEMENTS_SIZE; j++)
-                out[idx++] = MGET(kl->kernels[row]->elements, i, j);
+                out[idx++] = ok_kl_get_element(kl, row, i, j);
         }
 
 
         for (int i = 0; i < PARAMS_SIZE; i++)
-            out[idx++] = VGET(kl->kernels[row]->params, i);
+            out[idx++] = ok_kl_get_par(kl, row, i);
+
+        out[idx++] = ok_kl_get_merit(kl, row, OK_KL_MERIT);
+        out[idx++] = ok_kl_get_merit(kl, row, OK_KL_MERIT_PR);
+        out[idx++] = ok_kl_get_merit(kl, row, OK_KL_MERIT_LI);
+    }
+}
+
+
+/*
+ * Columnar format (KL_save_columns, KL_map): a 64-byte header, then the columns of
+ * ok_list_columns (size doubles each), then the tags (size ints). Values are stored
+ * in native byte order; 'order' is used to reject files written on a machine with a
+ * different one.
+ */
+#define OK_KL_COLUMNS_MAGIC "OKLCOLS"
+#define OK_KL_COLUMNS_VERSION 1
+#define OK_KL_COLUMNS_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    int32_t version;
+    int32_t order;
+    int32_t size;
+    int32_t rows;
+    int32_t cols;
+    int32_t npars;
+    int32_t type;
+    int32_t reserved;
+    double mstar;
+    double epoch;
+    char padding[8];
+} ok_kl_columns_header;
 
-        out[idx++] = kl->kernels[row]->merit;
-        out[idx++] = kl->kernels[row]->merit_pr;
-        out[idx++] = kl->kernels[row]->merit_li;
+/**
+ * Writes the list to a binary stream in a versioned column-major format, which
+ * can be memory-mapped with KL_map. The mass of the star and the epoch of the
+ * prototype (if any) are saved as well.
+ * @param kl List (not empty)
+ * @param out File handle (already opened for writing)
+ * @return true on success
+ */
+bool KL_save_columns(const ok_list* kl, FILE* out) {
+    if (kl->size == 0)
+        return false;
+
+    ok_kl_columns_header hdr;
+    memset(&hdr, 0, sizeof (ok_kl_columns_header));
+    strcpy(hdr.magic, OK_KL_COLUMNS_MAGIC);
+    hdr.version = OK_KL_COLUMNS_VERSION;
+    hdr.order = OK_KL_COLUMNS_ORDER;
+    hdr.size = kl->size;
+    hdr.type = kl->type;
+    ok_kl_dims(kl, &hdr.rows, &hdr.cols, &hdr.npars);
+    hdr.mstar = (kl->prototype != NULL ? K_getMstar(kl->prototype) : 0.);
+    hdr.epoch = (kl->prototype != NULL ? K_getEpoch(kl->prototype) : 0.);
+
+    bool ok = (fwrite(&hdr, sizeof (ok_kl_columns_header), 1, out) == 1);
+
+    const int n = kl->size;
+    double* v = (double*) malloc(sizeof (double) * n);
+    for (int i = 0; i < hdr.rows && ok; i++)
+        for (int j = 0; j < hdr.cols && ok; j++) {
+            for (int m = 0; m < n; m++)
+                v[m] = ok_kl_get_element(kl, m, i, j);
+            ok = (fwrite(v, sizeof (double), n, out) == n);
+        }
+    for (int j = 0; j < hdr.npars && ok; j++) {
+        for (int m = 0; m < n; m++)
+            v[m] = ok_kl_get_par(kl, m, j);
+        ok = (fwrite(v, sizeof (double), n, out) == n);
     }
+    for (int j = OK_KL_MERIT; j <= OK_KL_MERIT_LI && ok; j++) {
+        for (int m = 0; m < n; m++)
+            v[m] = ok_kl_get_merit(kl, m, j);
+        ok = (fwrite(v, sizeof (double), n, out) == n);
+    }
+    free(v);
+
+    int* tags = (int*) malloc(sizeof (int) * n);
+    for (int m = 0; m < n; m++)
+        tags[m] = ok_kl_get_tag(kl, m);
+    ok = ok && (fwrite(tags, sizeof (int), n, out) == n);
+    free(tags);
+
+    return ok && !ferror(out);
 }
 
+/**
+ * Opens a list written by KL_save_columns. The file is memory-mapped and read
+ * in place (it is read into memory if mapping is not available): the list is
+ * read-only and has no items (kernels is NULL), but can be used with the
+ * accessors and statistics of the lists (KL_getElement, KL_getPar,
+ * KL_getElementsStats, KL_getParsStats, KL_to_ptr, KL_save...). The file is
+ * unmapped by KL_free.
+ * @param file Name of the file
+ * @return A new list, or NULL if the file could not be read
+ */
+ok_list* KL_map(const char* file) {
+    void* base = NULL;
+    size_t length = 0;
+    bool mapped = false;
+
+#ifndef JAVASCRIPT
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof (ok_kl_columns_header)) {
+        length = st.st_size;
+        base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED)
+            base = NULL;
+        mapped = (base != NULL);
+    }
+    close(fd);
+#else
+    FILE* fid = fopen(file, "rb");
+    if (fid == NULL)
+        return NULL;
+    if (fseek(fid, 0, SEEK_END) == 0 && ftell(fid) >= (long) sizeof (ok_kl_columns_header)) {
+        length = ftell(fid);
+        base = malloc(length);
+        rewind(fid);
+        if (fread(base, 1, length, fid) != length) {
+            free(base);
+            base = NULL;
+        }
+    }
+    fclose(fid);
+#endif
+    if (base == NULL)
+        return NULL;
+
+    const ok_kl_columns_header* hdr = (const ok_kl_columns_header*) base;
+    size_t ncols = (size_t) hdr->rows * hdr->cols + hdr->npars + 3;
+    bool valid = strncmp(hdr->magic, OK_KL_COLUMNS_MAGIC, 8) == 0 && hdr->version == OK_KL_COLUMNS_VERSION &&
+            hdr->order == OK_KL_COLUMNS_ORDER && hdr->size > 0 && hdr->rows > 0 && hdr->cols > 0 &&
+            hdr->npars >= 0 && length == sizeof (ok_kl_columns_header) +
+            ncols * hdr->size * sizeof (double) + hdr->size * sizeof (int);
+    if (!valid) {
+#ifndef JAVASCRIPT
+        munmap(base, length);
+#else
+        free(base);
+#endif
+        return NULL;
+    }
+
+    ok_list* kl = KL_alloc(0, NULL);
+    free(kl->kernels);
+    kl->kernels = NULL;
+    kl->size = hdr->size;
+    kl->type = hdr->type;
+    kl->prototype = K_alloc();
+    K_setMstar(kl->prototype, hdr->mstar);
+    K_setEpoch(kl->prototype, hdr->epoch);
+
+    ok_list_columns* c = (ok_list_columns*) malloc(sizeof (ok_list_columns));
+    c->rows = hdr->rows;
+    c->cols = hdr->cols;
+    c->npars = hdr->npars;
+    c->data = (const double*) ((const char*) base + sizeof (ok_kl_columns_header));
+    c->tags = (const int*) (c->data + ncols * hdr->size);
+    c->base = base;
+    c->length = length;
+    c->mapped = mapped;
+    kl->columns = c;
+    return kl;
+}
+
+/**
+ * Converts a list saved with KL_save (text) to the columnar format of KL_save_columns.
+ * @param text Name of the text file
+ * @param columns Name of the columnar file to write
+ * @return true on success
+ */
+bool KL_text_to_columns(const char* text, const char* columns) {
+    FILE* in = fopen(text, "r");
+    if (in == NULL)
+        return false;
+    ok_list* kl = KL_load(in, 0);
+    fclose(in);
+    if (kl == NULL)
+        return false;
+
+    bool ok = false;
+    FILE* out = fopen(columns, "wb");
+    if (out != NULL) {
+        ok = KL_save_columns(kl, out);
+        ok = (fclose(out) == 0) && ok;
+    }
+    for (int i = 0; i < kl->size; i++) {
+        gsl_matrix_free(kl->kernels[i]->elements);
+        gsl_vector_free(kl->kernels[i]->params);
+    }
+    KL_free(kl);
+    return ok;
+}
+
+/**
+ * Converts a list saved with KL_save_columns to the text format of KL_save.
+ * @param columns Name of the columnar file
+ * @param text Name of the text file to write
+ * @return true on success
+ */
+bool KL_columns_to_text(const char* columns, const char* text) {
+    ok_list* kl = KL_map(columns);
+    if (kl == NULL)
+        return false;
+
+    bool ok = false;
+    FILE* out = fopen(text, "w");
+    if (out != NULL) {
+        KL_save(kl, out);
+        ok = !ferror(out);
+        ok = (fclose(out) == 0) && ok;
+    }
+    KL_free(kl);
+    return ok;
+}
@@ -17,11 +17,22 @@ extern "C" {
     void KL_free(ok_list* list);
     ok_list* KL_load(FILE* fid, int skip);
     void KL_save(const ok_list* kl, FILE* out);
+    bool KL_save_bin(const ok_list* kl, FILE* out);
+    ok_list* KL_load_bin(FILE* fid, ok_kernel* prototype);
+    bool KL_save_columns(const ok_list* kl, FILE* out);
+    ok_list* KL_map(const char* file);
+    bool KL_text_to_columns(const char* text, const char* columns);
+    bool KL_columns_to_text(const char* columns, const char* text);
+    gsl_matrix* KL_getTempStats(const ok_list* kl);
+    bool KL_getEvidence(const ok_list* kl, double* ret);
     void KL_append(ok_list* dest, ok_list* src);
+    void KL_compact(ok_list* kl);
     gsl_vector* KL_getParsStats(const ok_list* kl, const int what);
     gsl_vector* KL_getElements(const ok_list* kl, const int pl, const int el);
     gsl_vector* KL_getPars(const ok_list* kl, const int vo);
     gsl_matrix* KL_getElementsStats(const ok_list* kl, const int what);
+    gsl_matrix* KL_getQuantiles(const ok_list* kl, const double* q, const int nq);
+    void KL_to_columns(ok_list* kl);
     ok_list_item* KL_set(ok_list* kl, const int idx, gsl_matrix* elements, gsl_vector* pars, double merit, int tag);
     int KL_getSize(const ok_list* kl);
     void KL_removeAtIndex(ok_list* kl, const int idx);
@@ -0,0 +1,348 @@
+#ifndef JAVASCRIPT
+#include "omp.h"
+#else
+#include "omp_shim.h"
+#endif
+
+#include "math.h"
+#include "utils.h"
+#include "kernel.h"
+#include "lbfgsb.h"
+
+// Finite-difference step, as a fraction of the minimization step
+#define LBFGS_FD_FRACTION 1e-2
+#define LBFGS_ARMIJO 1e-4
+#define LBFGS_MAX_BACKTRACK 30
+
+/*
+ * The minimizer works in scaled coordinates u = x / scale, where scale is the
+ * step of each parameter (relative for periods and masses, as in the simplex
+ * minimizer), so that the problem is reasonably well conditioned.
+ */
+typedef struct {
+    ok_kernel* k;
+    ok_kernel_minimizer_pars mp;
+    ok_kernel** k_t;
+    ok_kernel_minimizer_pars* mp_t;
+    int threads;
+    double* scale;
+    double* lo;
+    double* hi;
+    double* h;
+    bool central;
+    int nevals;
+} ok_lbfgs_problem;
+
+static double K_lbfgs_f(ok_kernel* k, ok_kernel_minimizer_pars* mp, const double* u, const double* scale) {
+    for (int j = 0; j < mp->npars; j++)
+        *(mp->pars[j]) = u[j] * scale[j];
+    k->flags |= NEEDS_SETUP;
+    K_calculate(k);
+    double f = k->minfunc(k);
+    return (IS_NOT_FINITE(f) ? INVALID_NUMBER : f);
+}
+
+/**
+ * Computes the gradient of the merit function with respect to the scaled
+ * coordinates. The kernel must have been last evaluated at u, where the
+ * merit function has value f. Components provided by the gradient function
+ * of the kernel are used as-is; the others are computed by finite differences in 
+ * parallel.
+ */
+static void K_lbfgs_grad(ok_lbfgs_problem* p, const double* u, const double f, double* g) {
+    const int n = p->mp.npars;
+
+    for (int j = 0; j < n; j++)
+        g[j] = INVALID_NUMBER;
+    if (p->k->gradfunc != NULL) {
+        p->k->gradfunc(p->k, g);
+        for (int j = 0; j < n; j++)
+            g[j] *= p->scale[j];
+    }
+
+    int nfd = 0;
+    for (int j = 0; j < n; j++)
+        nfd += (IS_NOT_FINITE(g[j]) ? 1 : 0);
+
+    #pragma omp parallel for schedule(dynamic) num_threads(p->threads)
+    for (int j = 0; j < n; j++) {
+        if (!IS_NOT_FINITE(g[j]))
+            continue;
+        int th = omp_get_thread_num();
+        double uj[n];
+        memcpy(uj, u, sizeof (double) * n);
+
+        double hj = p->h[j];
+        if (u[j] + hj > p->hi[j])
+            hj = -hj;
+
+        uj[j] = u[j] + hj;
+        double fp = K_lbfgs_f(p->k_t[th], &(p->mp_t[th]), uj, p->scale);
+
+        if (p->central && u[j] - hj >= p->lo[j] && u[j] - hj <= p->hi[j]) {
+            uj[j] = u[j] - hj;
+            double fm = K_lbfgs_f(p->k_t[th], &(p->mp_t[th]), uj, p->scale);
+            g[j] = (fp - fm) / (2. * hj);
+        } else
+            g[j] = (fp - f) / hj;
+
+        // The parameter is held fixed for this iteration
+        if (IS_NOT_FINITE(g[j]))
+            g[j] = 0.;
+    }
+    p->nevals += nfd * (p->central ? 2 : 1);
+}
+
+// Projected gradient: components that would push a variable at its bound
+// outside the box are zeroed
+static double ok_lbfgs_pgnorm(const double* u, const double* g, const double* lo, const double* hi, const int n) {
+    double m = 0.;
+    for (int j = 0; j < n; j++) {
+        double pg = RANGE(u[j] - g[j], lo[j], hi[j]) - u[j];
+        m = MAX(m, fabs(pg));
+    }
+    return m;
+}
+
+int K_minimize_lbfgsb(ok_kernel* k, int maxiter, double params[]) {
+    int m = 8;
+    double pgtol = 1e-5;
+    double ftol = 1e-10;
+    bool central = false;
+    int verbose = 0;
+
+    int idx = 0;
+    while (params != NULL) {
+        if (params[idx] == DONE)
+            break;
+        else if (params[idx] == OPT_LBFGS_MEMORY)
+            m = MAX((int) params[idx + 1], 1);
+        else if (params[idx] == OPT_LBFGS_PGTOL)
+            pgtol = params[idx + 1];
+        else if (params[idx] == OPT_LBFGS_FTOL)
+            ftol = params[idx + 1];
+        else if (params[idx] == OPT_LBFGS_CENTRAL)
+            central = (((int) params[idx + 1]) != 0);
+        else if (params[idx] == OPT_VERBOSE_DIAGS)
+            verbose = (int) params[idx + 1];
+        idx += 2;
+    }
+
+    K_calculate(k);
+
+    ok_lbfgs_problem p;
+    p.k = k;
+    p.mp = K_getMinimizedVariables(k);
+    p.central = central;
+    p.nevals = 0;
+    const int n = p.mp.npars;
+
+    if (n == 0) {
+        FREE_MINIMIZER_PARS(p.mp);
+        return PROGRESS_CONTINUE;
+    }
+
+    double scale[n], lo[n], hi[n], h[n];
+    double u[n], g[n], d[n], ut[n], gt[n];
+    double Smem[m][n], Ymem[m][n], rho[m], alpha_h[m];
+
+    p.scale = scale;
+    p.lo = lo;
+    p.hi = hi;
+    p.h = h;
+
+    for (int j = 0; j < n; j++) {
+        double x = *(p.mp.pars[j]);
+        double step = p.mp.steps[j];
+        if (p.mp.type[j] == PER || p.mp.type[j] == MASS)
+            step = MAX(step, step * fabs(x));
+        scale[j] = (step > 0 && !IS_NOT_FINITE(step) ? step : MAX(fabs(x), 1.));
+        u[j] = x / scale[j];
+        lo[j] = (p.mp.min[j] > -DBL_MAX ? p.mp.min[j] / scale[j] : -DBL_MAX);
+        hi[j] = (p.mp.max[j] < DBL_MAX ? p.mp.max[j] / scale[j] : DBL_MAX);
+        u[j] = RANGE(u[j], lo[j], hi[j]);
+        h[j] = LBFGS_FD_FRACTION;
+    }
+
+    // Per-thread workspaces used to compute the gradient
+    p.threads = (omp_in_parallel() ? 1 : MAX(MIN(omp_get_max_threads(), n), 1));
+    ok_kernel* k_t[p.threads];
+    ok_kernel_minimizer_pars mp_t[p.threads];
+    for (int i = 0; i < p.threads; i++) {
+        k_t[i] = K_cloneWorkspace(k);
+        k_t[i]->progress = NULL;
+        mp_t[i] = K_getMinimizedVariables(k_t[i]);
+    }
+    p.k_t = k_t;
+    p.mp_t = mp_t;
+
+    int status = PROGRESS_CONTINUE;
+    double f = K_lbfgs_f(k, &(p.mp), u, scale);
+    p.nevals++;
+
+    if (IS_NOT_FINITE(f)) {
+        fprintf(stderr, "Non-finite value encountered by minimizer [%s].\n", __func__);
+    } else {
+        K_lbfgs_grad(&p, u, f, g);
+        int nmem = 0, head = 0;
+
+        for (int iter = 0; iter < maxiter; iter++) {
+            if (ok_lbfgs_pgnorm(u, g, lo, hi, n) < pgtol)
+                break;
+
+            // Variables at a bound, with the gradient pointing outside the box,
+            // are held fixed for this iteration
+            bool fixed[n];
+            for (int j = 0; j < n; j++)
+                fixed[j] = (u[j] <= lo[j] && g[j] > 0) || (u[j] >= hi[j] && g[j] < 0);
+
+            // Two-loop recursion on the free variables
+            for (int j = 0; j < n; j++)
+                d[j] = (fixed[j] ? 0. : -g[j]);
+
+            for (int l = 0; l < nmem; l++) {
+                int i = (head - 1 - l + m) % m;
+                double a = 0.;
+                for (int j = 0; j < n; j++)
+                    a += (fixed[j] ? 0. : Smem[i][j] * d[j]);
+                alpha_h[i] = rho[i] * a;
+                for (int j = 0; j < n; j++)
+                    if (!fixed[j])
+                        d[j] -= alpha_h[i] * Ymem[i][j];
+            }
+            if (nmem > 0) {
+                int i = (head - 1 + m) % m;
+                double sy = 0., yy = 0.;
+                for (int j = 0; j < n; j++) {
+                    sy += Smem[i][j] * Ymem[i][j];
+                    yy += Ymem[i][j] * Ymem[i][j];
+                }
+                double gamma = sy / yy;
+                for (int j = 0; j < n; j++)
+                    d[j] *= gamma;
+            }
+            for (int l = nmem - 1; l >= 0; l--) {
+                int i = (head - 1 - l + m) % m;
+                double b = 0.;
+                for (int j = 0; j < n; j++)
+                    b += (fixed[j] ? 0. : Ymem[i][j] * d[j]);
+                b *= rho[i];
+                for (int j = 0; j < n; j++)
+                    if (!fixed[j])
+                        d[j] += Smem[i][j] * (alpha_h[i] - b);
+            }
+
+            double gd = 0.;
+            for (int j = 0; j < n; j++)
+                gd += g[j] * d[j];
+            if (!(gd < 0)) {
+                // Not a descent direction: reset the memory
+                nmem = 0;
+                gd = 0.;
+                for (int j = 0; j < n; j++) {
+                    d[j] = (fixed[j] ? 0. : -g[j]);
+                    gd += g[j] * d[j];
+                }
+            }
+
+            // Projected backtracking line search; the first step of a
+            // steepest descent iteration is limited to one unit (i.e. one step)
+            double t = 1.;
+            if (nmem == 0) {
+                double dn = 0.;
+                for (int j = 0; j < n; j++)
+                    dn = MAX(dn, fabs(d[j]));
+                t = MIN(1., 1. / dn);
+            }
+
+            bool accepted = false;
+            double ft = f;
+            for (int ls = 0; ls < LBFGS_MAX_BACKTRACK; ls++) {
+                double dec = 0.;
+                for (int j = 0; j < n; j++) {
+                    ut[j] = RANGE(u[j] + t * d[j], lo[j], hi[j]);
+                    dec += g[j] * (ut[j] - u[j]);
+                }
+                ft = K_lbfgs_f(k, &(p.mp), ut, scale);
+                p.nevals++;
+                if (!IS_NOT_FINITE(ft) && ft <= f + LBFGS_ARMIJO * dec) {
+                    accepted = true;
+                    break;
+                }
+                t *= 0.5;
+            }
+
+            if (!accepted) {
+                if (nmem > 0) {
+                    // Retry with steepest descent
+                    nmem = 0;
+                    continue;
+                } else if (!p.central) {
+                    // Forward differences are not accurate enough close to the
+                    // minimum: switch to central differences
+                    p.central = true;
+                    K_lbfgs_f(k, &(p.mp), u, scale);
+                    K_lbfgs_grad(&p, u, f, g);
+                    continue;
+                } else
+                    break;
+            }
+
+            K_lbfgs_grad(&p, ut, ft, gt);
+
+            double sy = 0.;
+            for (int j = 0; j < n; j++) {
+                Smem[head][j] = ut[j] - u[j];
+                Ymem[head][j] = gt[j] - g[j];
+                sy += Smem[head][j] * Ymem[head][j];
+            }
+            // Only keep pairs that preserve positive-definiteness
+            if (sy > 1e-10) {
+                rho[head] = 1. / sy;
+                head = (head + 1) % m;
+                nmem = MIN(nmem + 1, m);
+            }
+
+            double df = f - ft;
+            memcpy(u, ut, sizeof (double) * n);
+            memcpy(g, gt, sizeof (double) * n);
+            f = ft;
+
+            if (verbose)
+                fprintf(stderr, "%s: iter = %d, f = %e, df = %e, |pg| = %e, evals = %d\n",
+                        __func__, iter, f, df, ok_lbfgs_pgnorm(u, g, lo, hi, n), p.nevals);
+
+            if (K_checkBudget(k, f) != BUDGET_OK) {
+                status = PROGRESS_STOP;
+                break;
+            }
+
+            if (k->progress != NULL) {
+                char msg[200];
+                K_lbfgs_f(k, &(p.mp), u, scale);
+                k->chi2 = k->minfunc(k);
+                sprintf(msg, "%s [f = %e, df = %e, evals = %d]", __func__, f, df, p.nevals);
+                if (k->progress(iter, maxiter, k, msg) != PROGRESS_CONTINUE) {
+                    status = PROGRESS_STOP;
+                    break;
+                }
+            }
+
+            if (df <= ftol * MAX(MAX(fabs(f), fabs(f + df)), 1.))
+                break;
+        }
+    }
+
+    for (int j = 0; j < n; j++)
+        *(p.mp.pars[j]) = u[j] * scale[j];
+    k->flags |= NEEDS_SETUP;
+    K_calculate(k);
+
+    for (int i = 0; i < p.threads; i++) {
+        FREE_MINIMIZER_PARS(mp_t[i]);
+        K_free(k_t[i]);
+    }
+    FREE_MINIMIZER_PARS(p.mp);
+
+    return status;
+}
@@ -0,0 +1,42 @@
+/*
+ * File:   lbfgsb.h
+ */
+
+#ifndef LBFGSB_H
+#define	LBFGSB_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "kernel.h"
+#include "systemic.h"
+
+    /**
+     * Attempts to converge to a local minimum of the kernel k using a limited-memory
+     * quasi-Newton method with box constraints (L-BFGS-B, with a projected
+     * line search). The ranges of the parameters (plRanges and parRanges) are 
+     * used as bounds. The gradient is obtained from the gradient function of the kernel 
+     * (K_setGradFunc) where available; the remaining components are computed by
+     * finite differences in parallel, each thread working on its own copy of the kernel.
+     * 
+     * @param k The kernel object containing the state of the system.
+     * @param maxiter Maximum number of iterations
+     * @param params Array of options, terminated by DONE: OPT_LBFGS_MEMORY (number of
+     * correction pairs kept, default 8), OPT_LBFGS_PGTOL (stops when the largest component of
+     * the projected gradient, in units of the parameter steps, is smaller than this value, default 1e-5), 
+     * OPT_LBFGS_FTOL (stops when the relative decrease of the merit function is smaller than this
+     * value, default 1e-10), OPT_LBFGS_CENTRAL (if non-zero, use central differences from the
+     * start; otherwise, forward differences are used until the line search fails).
+     * @return PROGRESS_STOP if the progress callback interrupted the minimization,
+     * PROGRESS_CONTINUE otherwise.
+     */
+    int K_minimize_lbfgsb(ok_kernel* k, int maxiter, double params[]);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* LBFGSB_H */
+
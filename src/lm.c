@@ -1,5 +1,3 @@
-#include <gsl/gsl_multifit_nlin.h>
-
 #include "math.h"
 #ifndef JAVASCRIPT
 #include "omp.h"
@@ -10,143 +8,305 @@
 #include "utils.h"
 
 #include "kernel.h"
+#include "lm.h"
 
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_vector_int.h>
 
-static inline void K_lm_calc(ok_kernel* k, double* f) {
+// Finite-difference step, as a fraction of the minimization step
+#define LM_FD_FRACTION 1e-2
+#define LM_LAMBDA_MIN 1e-12
+#define LM_LAMBDA_MAX 1e16
+
+/**
+ * Computes the vector of residuals for the kernel k. The first ndata entries
+ * are the normalized residuals of the fit; the second ndata entries are chosen
+ * so that their squares sum to the normalization term of the likelihood (up to a
+ * constant), so that the jitter parameters can be fit as well.
+ * @param k The kernel
+ * @param f A 2*ndata vector that will receive the residuals
+ * @return true if all the residuals are finite
+ */
+static bool K_lm_calc(ok_kernel* k, double* f) {
     k->flags |= NEEDS_SETUP;
     K_calculate(k);
     double** compiled = k->compiled;
-
+    bool finite = true;
 
     for (int i = 0; i < k->ndata; i++) {
         const double* comprow = compiled[i];
+        double s = comprow[T_ERR];
+
+        if ((int) comprow[T_FLAG] == T_DUMMY || s <= 0) {
+            f[i] = f[i + k->ndata] = 0.;
+            continue;
+        }
+
         int set = (int) comprow[T_SET];
         double n = K_getPar(k, set + DATA_SETS_SIZE);
 
         double diff = (comprow[T_PRED] - comprow[T_SVAL]);
-        double s = comprow[T_ERR];
 
         f[i] = diff / sqrt(s * s + n * n);
-        f[i + k->ndata] = sqrt(fabs(log(n * n + s * s))) * SIGN(log(n * n + s * s));
+        f[i + k->ndata] = sqrt(log1p(n * n / (s * s)) + 1.);
+        finite = finite && !IS_NOT_FINITE(f[i]) && !IS_NOT_FINITE(f[i + k->ndata]);
     }
 
-
+    return finite;
 }
 
-int K_lm_f(const gsl_vector* x, void* params, gsl_vector* f) {
-    ok_kernel_minimizer_pars* sp = (ok_kernel_minimizer_pars*) params;
-
-    ok_kernel* k = sp->kernel;
-
-    double** pars = sp->pars;
-
-    for (int i = 0; i < x->size; i++)
-        *(pars[i]) = x->data[i] * sp->steps[i];
-
-    K_lm_calc(k, f->data);
-    printf("%e\n", K_getLoglik(k));
-    for (int i = 0; i < x->size; i++)
-        printf("%e ", i, x->data[i]);
-    printf("\n");
-    if (IS_NOT_FINITE(K_getLoglik(k))) {
-
+static inline void K_lm_set(ok_kernel_minimizer_pars* mp, const double* x) {
+    for (int i = 0; i < mp->npars; i++)
+        *(mp->pars[i]) = x[i];
+}
 
-        exit(0);
+/**
+ * Solves (A) x = b in place for a symmetric positive-definite matrix A (n x n,
+ * row-major), using a Cholesky decomposition. A is overwritten with its factor,
+ * b with the solution.
+ * @return false if A is not positive-definite
+ */
+static bool ok_lm_cholesky_solve(double* A, double* b, const int n) {
+    for (int j = 0; j < n; j++) {
+        double d = A[j * n + j];
+        for (int l = 0; l < j; l++)
+            d -= SQR(A[j * n + l]);
+        if (d <= 0 || IS_NOT_FINITE(d))
+            return false;
+        A[j * n + j] = sqrt(d);
+        for (int i = j + 1; i < n; i++) {
+            double s = A[i * n + j];
+            for (int l = 0; l < j; l++)
+                s -= A[i * n + l] * A[j * n + l];
+            A[i * n + j] = s / A[j * n + j];
+        }
     }
 
-    return GSL_SUCCESS;
+    for (int i = 0; i < n; i++) {
+        double s = b[i];
+        for (int l = 0; l < i; l++)
+            s -= A[i * n + l] * b[l];
+        b[i] = s / A[i * n + i];
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        double s = b[i];
+        for (int l = i + 1; l < n; l++)
+            s -= A[l * n + i] * b[l];
+        b[i] = s / A[i * n + i];
+    }
+    return true;
 }
 
 int K_minimize_lm(ok_kernel* k, int maxiter, double params[]) {
-    K_calculate(k);
-
-    double prev_chi2 = K_getLoglik(k);
+    double min_dchi = 1e-6;
+    bool central = false;
+    int max_iter_at_scale = 10;
+    double lambda = 1e-3;
     int verbose = 0;
 
-    if (params != NULL) {
-        int i = 0;
-        while (true) {
-            if (params[i] == DONE)
-                break;
-            if (params[i] == OPT_VERBOSE_DIAGS)
-                verbose = (int) params[i + 1];
-            i += 2;
-        }
+    int idx = 0;
+    while (params != NULL) {
+        if (params[idx] == DONE)
+            break;
+        else if (params[idx] == OPT_LM_MINCHI_PAR)
+            min_dchi = params[idx + 1];
+        else if (params[idx] == OPT_LM_HIGH_DF)
+            central = (((int) params[idx + 1]) != 0);
+        else if (params[idx] == OPT_LM_MAX_ITER_AT_SCALE)
+            max_iter_at_scale = MAX((int) params[idx + 1], 1);
+        else if (params[idx] == OPT_LM_INITIAL_SCALE)
+            lambda = params[idx + 1];
+        else if (params[idx] == OPT_VERBOSE_DIAGS)
+            verbose = (int) params[idx + 1];
+        idx += 2;
     }
 
+    K_calculate(k);
+    ok_kernel_minimizer_pars mpars = K_getMinimizedVariables(k);
+    const int npars = mpars.npars;
+    const int nd = k->ndata;
+    const int nx = 2 * nd;
+
+    if (npars == 0 || nd == 0) {
+        FREE_MINIMIZER_PARS(mpars);
+        return PROGRESS_CONTINUE;
+    }
 
+    double* x = (double*) malloc(sizeof (double) * npars);
+    double* xt = (double*) malloc(sizeof (double) * npars);
+    double* h = (double*) malloc(sizeof (double) * npars);
+    double* g = (double*) malloc(sizeof (double) * npars);
+    double* delta = (double*) malloc(sizeof (double) * npars);
+    double* JtJ = (double*) malloc(sizeof (double) * npars * npars);
+    double* A = (double*) malloc(sizeof (double) * npars * npars);
+    double* f = (double*) malloc(sizeof (double) * nx);
+    double* ft = (double*) malloc(sizeof (double) * nx);
+    // Jacobian, stored by columns so that each column can be filled by a different thread
+    double* J = (double*) malloc(sizeof (double) * nx * npars);
+
+    for (int j = 0; j < npars; j++) {
+        x[j] = *(mpars.pars[j]);
+        double step = mpars.steps[j];
+        if (mpars.type[j] == PER || mpars.type[j] == MASS)
+            step = MAX(step, step * fabs(x[j]));
+        h[j] = (step > 0 && !IS_NOT_FINITE(step) ? LM_FD_FRACTION * step :
+                sqrt(GSL_DBL_EPSILON) * MAX(fabs(x[j]), 1.));
+    }
 
-    ok_kernel_minimizer_pars sp = K_getMinimizedVariables(k);
-    int npars = sp.npars;
-    int nx = 2 * k->ndata;
+    int status = PROGRESS_CONTINUE;
+    bool finite = K_lm_calc(k, f);
+    if (!finite) {
+        fprintf(stderr, "Non-finite value encountered by minimizer [%s].\n", __func__);
+        free(x); free(xt); free(h); free(g); free(delta);
+        free(JtJ); free(A); free(f); free(ft); free(J);
+        FREE_MINIMIZER_PARS(mpars);
+        return status;
+    }
+    double chi = ok_ptr_sum_2(f, nx);
+
+    // Per-thread workspaces used to compute the columns of the Jacobian (a
+    // single one if we are already running inside a parallel region, e.g. K_bootstrap)
+    const int threads = (omp_in_parallel() ? 1 : MAX(MIN(omp_get_max_threads(), npars), 1));
+    ok_kernel* k_t[threads];
+    ok_kernel_minimizer_pars mpars_t[threads];
+    double* fp_t[threads];
+    double* fm_t[threads];
+
+    for (int i = 0; i < threads; i++) {
+        k_t[i] = K_cloneWorkspace(k);
+        k_t[i]->progress = NULL;
+        mpars_t[i] = K_getMinimizedVariables(k_t[i]);
+        fp_t[i] = (double*) malloc(sizeof (double) * nx);
+        fm_t[i] = (double*) malloc(sizeof (double) * nx);
+    }
 
-    double L = K_getLoglik(k);
-    double epsilon = sqrt(GSL_DBL_EPSILON);
-    double target_DL = 10;
+    ok_progress pr = k->progress;
+
+    for (int iter = 0; iter < maxiter; iter++) {
+        #pragma omp parallel for schedule(dynamic) num_threads(threads)
+        for (int j = 0; j < npars; j++) {
+            int th = omp_get_thread_num();
+            ok_kernel_minimizer_pars* mp = &(mpars_t[th]);
+            double* Jj = J + (size_t) j * nx;
+
+            K_lm_set(mp, x);
+            double hj = h[j];
+            if (x[j] + hj > mpars.max[j])
+                hj = -hj;
+
+            *(mp->pars[j]) = x[j] + hj;
+            bool ok = K_lm_calc(k_t[th], fp_t[th]);
+
+            if (ok && central && x[j] - hj >= mpars.min[j] && x[j] - hj <= mpars.max[j]) {
+                *(mp->pars[j]) = x[j] - hj;
+                ok = K_lm_calc(k_t[th], fm_t[th]);
+                for (int i = 0; i < nx; i++)
+                    Jj[i] = (fp_t[th][i] - fm_t[th][i]) / (2. * hj);
+            } else
+                for (int i = 0; i < nx; i++)
+                    Jj[i] = (fp_t[th][i] - f[i]) / hj;
+
+            // The parameter is held fixed for this iteration
+            if (!ok)
+                for (int i = 0; i < nx; i++)
+                    Jj[i] = 0.;
+        }
 
-    /*
-    for (int i = 0; i < npars; i++) {
-        for (int j = 0; j < 10; j++) {
-            double v = *(sp.pars[i]);
+        for (int a = 0; a < npars; a++) {
+            const double* Ja = J + (size_t) a * nx;
+            g[a] = 0;
+            for (int i = 0; i < nx; i++)
+                g[a] += Ja[i] * f[i];
+            for (int b = 0; b <= a; b++) {
+                const double* Jb = J + (size_t) b * nx;
+                double s = 0;
+                for (int i = 0; i < nx; i++)
+                    s += Ja[i] * Jb[i];
+                JtJ[a * npars + b] = JtJ[b * npars + a] = s;
+            }
+        }
 
-     *(sp.pars[i]) = v + sp.steps[i];
+        bool accepted = false;
+        double dchi = 0.;
+
+        for (int t = 0; t < max_iter_at_scale; t++) {
+            memcpy(A, JtJ, sizeof (double) * npars * npars);
+            for (int j = 0; j < npars; j++) {
+                A[j * npars + j] += lambda * MAX(JtJ[j * npars + j], 1e-12);
+                delta[j] = -g[j];
+            }
+
+            if (!ok_lm_cholesky_solve(A, delta, npars)) {
+                lambda = MIN(lambda * 10., LM_LAMBDA_MAX);
+                continue;
+            }
+
+            bool moved = false;
+            for (int j = 0; j < npars; j++) {
+                xt[j] = RANGE(x[j] + delta[j], mpars.min[j], mpars.max[j]);
+                moved = moved || (xt[j] != x[j]);
+            }
+            if (!moved)
+                break;
 
-            k->flags |= NEEDS_SETUP;
-            K_calculate(k);
-            double dL = fabs(K_getLoglik(k) - L);
+            K_lm_set(&mpars, xt);
+            double chi_t = (K_lm_calc(k, ft) ? ok_ptr_sum_2(ft, nx) : INVALID_NUMBER);
+
+            if (!IS_NOT_FINITE(chi_t) && chi_t < chi) {
+                dchi = chi - chi_t;
+                chi = chi_t;
+                memcpy(x, xt, sizeof (double) * npars);
+                memcpy(f, ft, sizeof (double) * nx);
+                lambda = MAX(lambda / 10., LM_LAMBDA_MIN);
+                accepted = true;
+                break;
+            }
 
-     *(sp.pars[i]) = v;
-            sp.steps[i] = 0.5 * sp.steps[i] * MAX(MIN(1 + target_DL / dL,
-                    10), 0.1);
+            lambda = MIN(lambda * 10., LM_LAMBDA_MAX);
         }
-    }
-     */
-    for (int i = 0; i < npars; i++)
-        if (sp.type[i] == MA || sp.type == INC || sp.type == LOP || sp.type == NODE)
-            sp.steps[i] = 180;
-        else if (sp.type[i] == ECC)
-            sp.steps[i] = 0.1;
-        else if (sp.type[i] == -1)
-            sp.steps[i] = 1.;
-        else
-            sp.steps[i] = *(sp.pars[i]);
-
-    gsl_multifit_fdfsolver * s
-            = gsl_multifit_fdfsolver_alloc(gsl_multifit_fdfsolver_lmder, nx, npars);
-
-    gsl_multifit_function_fdf fdf;
-    fdf.f = &K_lm_f;
-    fdf.df = NULL;
-    fdf.fdf = NULL;
-    fdf.n = nx;
-    fdf.p = npars;
-    fdf.params = &sp;
-
-    gsl_vector* x = gsl_vector_alloc(npars);
-    for (int i = 0; i < npars; i++) {
-        VSET(x, i, *(sp.pars[i]) / sp.steps[i]);
-        printf("%e %e\n", *(sp.pars[i]), x->data[i]);
-    }
 
-    gsl_multifit_fdfsolver_set(s, &fdf, x);
+        // If the step was accepted, the kernel was last evaluated at x
+        if (K_checkBudget(k, (accepted ? k->minfunc(k) : INVALID_NUMBER)) != BUDGET_OK) {
+            status = PROGRESS_STOP;
+            break;
+        }
 
-    double loglik = ok_vector_sum_2(s->f);
+        K_lm_set(&mpars, x);
+        k->flags |= NEEDS_SETUP;
 
+        if (verbose)
+            fprintf(stderr, "%s: iter = %d, ssr = %e, dssr = %e, lambda = %e\n",
+                    __func__, iter, chi, dchi, lambda);
 
-    int status = 0;
-    int user_status = PROGRESS_CONTINUE;
+        if (pr != NULL) {
+            char msg[200];
+            K_calculate(k);
+            k->chi2 = k->minfunc(k);
+            sprintf(msg, "%s [ssr = %e, dssr = %e, lambda = %.2e]", __func__, chi, dchi, lambda);
+            if (pr(iter, maxiter, k, msg) != PROGRESS_CONTINUE) {
+                status = PROGRESS_STOP;
+                break;
+            }
+        }
 
-    for (int i = 0; i < maxiter; i++) {
-        int status = gsl_multifit_fdfsolver_iterate(s);
-        double loglik = ok_vector_sum_2(s->f);
-        printf("%d %e %s\n", i, loglik, gsl_strerror(status));
+        if (!accepted || dchi < min_dchi)
+            break;
     }
 
-
+    K_lm_set(&mpars, x);
     k->flags |= NEEDS_SETUP;
     K_calculate(k);
 
-    return user_status;
+    for (int i = 0; i < threads; i++) {
+        FREE_MINIMIZER_PARS(mpars_t[i]);
+        K_free(k_t[i]);
+        free(fp_t[i]);
+        free(fm_t[i]);
+    }
+
+    free(x); free(xt); free(h); free(g); free(delta);
+    free(JtJ); free(A); free(f); free(ft); free(J);
+    FREE_MINIMIZER_PARS(mpars);
+
+    return status;
 }
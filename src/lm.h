@@ -10,22 +10,28 @@
 #include "utils.h"
 
 /**
- * Attempts to converge to a local minimum of the kernel k, using the lev-mar
- * library. Many of the algorithm settings are determined by the kernel object:
- * minimization flags (whether a parameter is held fixed or varied; through K_setFlags
- * and K_setVFlags to MINIMIZE), the initial vector of parameters (the state of the system; set
- * by loading the data and the orbital parameters) the step of parameters and elements (giving
- * the initial step in the simplex algorithm) and finally the merit function (through 
- * K_setMinFunc; by default, the reduced Chi^2 of the system). The state of the kernel
- * object is modified; at the end of the routine, it contains the parameters 
- * corresponding to the local minimum. 
+ * Attempts to converge to a local minimum of the kernel k, using a
+ * Levenberg-Marquardt algorithm on the normalized residuals of the fit (plus 
+ * a term accounting for the jitter parameters). The columns of the Jacobian are
+ * computed by finite differences in parallel, each thread working on its own copy of
+ * the kernel. The minimization flags and steps are determined by the kernel object
+ * (the finite difference step is a fraction of the step of each parameter), and the
+ * parameters are kept within the ranges set through plRanges and parRanges. 
+ * Non-finite residuals never abort the process: the offending step is rejected and 
+ * the damping increased. The state of the kernel object is modified; at the end of 
+ * the routine, it contains the parameters corresponding to the local minimum.
+ * Iteration statistics (sum of squared residuals, its last decrease and the damping factor) are reported
+ * through the progress callback of the kernel.
  * 
  * @param k The kernel object containing the state of the system.
- * @param step A N-elements vector containing the initial step size used by 
- * the simplex algorithm, where N is total number of parameters being minimized. For
- * instance, if there are S planets, T velocity offsets and 5 parameters to minimize per
- * planet, N = 5S + T. 
- * @return 
+ * @param maxiter Maximum number of iterations
+ * @param params Array of options, terminated by DONE: OPT_LM_MINCHI_PAR (stop when
+ * the decrease in the sum of squared residuals is smaller than this value, default 1e-6), OPT_LM_HIGH_DF (if
+ * non-zero, use central differences), OPT_LM_MAX_ITER_AT_SCALE (maximum number of damping
+ * increases per iteration, default 10), OPT_LM_INITIAL_SCALE (initial damping factor,
+ * default 1e-3).
+ * @return PROGRESS_STOP if the progress callback interrupted the minimization,
+ * PROGRESS_CONTINUE otherwise.
  */
 
 int K_minimize_lm(ok_kernel* k, int maxiter, double params[]);
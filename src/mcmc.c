@@ -1,6 +1,10 @@
+// open_memstream (checkpoints)
+#define _POSIX_C_SOURCE 200809L
+
 #include <gsl/gsl_statistics_double.h>
 #ifndef JAVASCRIPT
 #include "omp.h"
+#include <pthread.h>
 #else
 #include "omp_shim.h"
 #endif
@@ -12,6 +16,10 @@
 #include "math.h"
 #include "assert.h"
 #include "kl.h"
+#include "diagnostics.h"
+#include "string.h"
+#include "rng.h"
+#include "sink.h"
 
 #define ASSERTDO(x, action) if (!(x)) { action; assert((x)); } 
 
@@ -110,22 +118,716 @@ void K_mcmc_likelihood_and_prior_default(ok_kernel* k, double* ret) {
 #define STATE_MAIN 1
 #define STATE_SKIP 2
 
+#define AM_TARGET_ACC 0.234
+#define AM_DIAG_FRAC 0.05
+
+/*
+ * State of the adaptive Metropolis proposal (Haario et al. 2001): weighted running
+ * mean and covariance of the chain, the Cholesky factor of the covariance and a
+ * global scale, adapted with a vanishing step toward the optimal acceptance rate
+ * of joint moves.
+ */
+typedef struct {
+    int n;
+    double w;
+    double* mean;
+    double* m2;
+    double* L;
+    double loglambda;
+    int nadapt;
+    int nfactor;
+    bool factored;
+} ok_mcmc_am;
+
+static ok_mcmc_am* ok_mcmc_am_alloc(const int n) {
+    ok_mcmc_am* am = (ok_mcmc_am*) calloc(1, sizeof (ok_mcmc_am));
+    am->n = n;
+    am->mean = (double*) calloc(n, sizeof (double));
+    am->m2 = (double*) calloc(n * n, sizeof (double));
+    am->L = (double*) calloc(n * n, sizeof (double));
+    return am;
+}
+
+static void ok_mcmc_am_free(ok_mcmc_am* am) {
+    free(am->mean);
+    free(am->m2);
+    free(am->L);
+    free(am);
+}
+
+// Adds the state x (with weight wx) to the running mean and covariance; differences
+// of angles are taken along the shortest arc
+static void ok_mcmc_am_add(ok_mcmc_am* am, const double* x, const bool* angle, const double wx) {
+    const int n = am->n;
+    double d[n];
+
+    am->w += wx;
+    for (int i = 0; i < n; i++) {
+        d[i] = x[i] - am->mean[i];
+        if (angle[i])
+            d[i] -= 360. * round(d[i] / 360.);
+        am->mean[i] += d[i] * wx / am->w;
+    }
+    double f = wx * (1. - wx / am->w);
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j <= i; j++)
+            am->m2[i * n + j] += f * d[i] * d[j];
+}
+
+// Cholesky factor of the covariance, regularized by a small multiple of the squared
+// steps; returns false if the covariance is not yet available
+static bool ok_mcmc_am_factor(ok_mcmc_am* am, double** steps) {
+    const int n = am->n;
+    if (am->w <= n + 1)
+        return false;
+
+    for (double ridge = 1e-10; ridge < 1.; ridge *= 100.) {
+        bool ok = true;
+        for (int i = 0; i < n && ok; i++)
+            for (int j = 0; j <= i; j++) {
+                double v = am->m2[i * n + j] / (am->w - 1.) + (i == j ? ridge * SQR(*steps[i]) : 0.);
+                for (int l = 0; l < j; l++)
+                    v -= am->L[i * n + l] * am->L[j * n + l];
+                if (i == j) {
+                    if (!(v > 0)) {
+                        ok = false;
+                        break;
+                    }
+                    am->L[i * n + i] = sqrt(v);
+                } else
+                    am->L[i * n + j] = v / am->L[j * n + j];
+            }
+        if (ok) {
+            am->factored = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Draws a joint move from N(0, lambda * 2.38^2 / n * C)
+static void ok_mcmc_am_propose(ok_mcmc_am* am, gsl_rng* rng, double* jump) {
+    const int n = am->n;
+    double z[n];
+    double scale = exp(0.5 * am->loglambda) * 2.38 / sqrt(n);
+    for (int i = 0; i < n; i++)
+        z[i] = gsl_ran_gaussian(rng, 1.);
+    for (int i = 0; i < n; i++) {
+        jump[i] = 0.;
+        for (int j = 0; j <= i; j++)
+            jump[i] += am->L[i * n + j] * z[j];
+        jump[i] *= scale;
+    }
+}
+
+// Updates the adaptive proposal after a step: x is the current state of the chain,
+// al the acceptance probability of the move (if it was a joint move)
+static void ok_mcmc_am_step(ok_mcmc_am* am, const double* x, const bool* angle, const bool joint, const double al) {
+    if (joint) {
+        am->nadapt++;
+        am->loglambda += pow(am->nadapt, -0.6) * (al - AM_TARGET_ACC);
+        am->loglambda = RANGE(am->loglambda, -20., 20.);
+    }
+    ok_mcmc_am_add(am, x, angle, 1.);
+    am->nfactor++;
+}
+
+// Copies the minimized parameters of els and pars into x, in the same order of the steps
+static void ok_mcmc_state(const gsl_matrix_int* plFlags, const gsl_vector_int* parFlags, const gsl_matrix* els,
+        const gsl_vector* pars, double* x) {
+    int par = 0;
+    for (int pl = 1; pl < MROWS(plFlags); pl++)
+        for (int j = 0; j < ELEMENTS_SIZE; j++)
+            if (MIGET(plFlags, pl, j) & MINIMIZE)
+                x[par++] = MGET(els, pl, j);
+    for (int j = 0; j < PARAMS_SIZE; j++)
+        if (parFlags->data[j] & MINIMIZE)
+            x[par++] = pars->data[j];
+}
+
+// Adds the samples of a chain from *fed to to (excluded) to the given chain of the diagnostics.
+// Indices count from the start of the chain: kl holds the samples from offset on, the
+// earlier ones are read back from the sink
+static void ok_mcmc_diag_feed(ok_diag* d, const int chain, const ok_list* kl, const int offset, ok_sink* sink,
+                              int* fed, const int to, ok_kernel* k) {
+    double x[MAX(d->npars, 1)];
+    gsl_matrix* els = NULL;
+    gsl_vector* pars = NULL;
+    for (; *fed < to; (*fed)++) {
+        if (*fed >= offset)
+            ok_mcmc_state(k->plFlags, k->parFlags, kl->kernels[*fed - offset]->elements,
+                          kl->kernels[*fed - offset]->params, x);
+        else {
+            if (els == NULL) {
+                els = gsl_matrix_alloc(MROWS(kl->kernels[0]->elements), MCOLS(kl->kernels[0]->elements));
+                pars = gsl_vector_alloc(kl->kernels[0]->params->size);
+            }
+            if (!ok_sink_read(sink, chain, *fed, els, pars))
+                break;
+            ok_mcmc_state(k->plFlags, k->parFlags, els, pars, x);
+        }
+        ok_diag_add(d, chain, x);
+    }
+    if (els != NULL) {
+        gsl_matrix_free(els);
+        gsl_vector_free(pars);
+    }
+}
+
+// Frees the oldest samples of kl, keeping the last 'keep'; returns the number of samples freed
+static int ok_mcmc_trim(ok_list* kl, const int keep) {
+    int drop = kl->size - keep;
+    if (drop <= 0)
+        return 0;
+    for (int i = 0; i < drop; i++) {
+        gsl_matrix_free(kl->kernels[i]->elements);
+        gsl_vector_free(kl->kernels[i]->params);
+        free(kl->kernels[i]);
+    }
+    memmove(kl->kernels, kl->kernels + drop, sizeof (ok_list_item*) * keep);
+    kl->size = keep;
+    return drop;
+}
+
+
+/*
+ * Parallel tempering: swap statistics of each pair of adjacent temperatures (j, j + 1),
+ * and state of the adaptation of the ladder. The ladder is adapted in log(T), keeping
+ * the coldest and hottest temperatures fixed: the gap between two temperatures is
+ * widened when their swap rate is above the average of the ladder, and narrowed
+ * otherwise, with a gain decaying as adapt / (adapt + batch) (Vousden et al. 2016).
+ * A temperature with beta = 0 (used for the evidence) is left out of the adaptation.
+ *
+ * If the evidence is computed, the log-likelihood of the samples of each temperature is
+ * accumulated as well (li, one "chain" of the diagnostics for each chain and temperature),
+ * together with the sums of exp((beta_j - beta_j+1) * L) over the samples of temperature j + 1,
+ * scaled by exp(-ss_max[j]), for the stepping-stone estimate (Xie et al. 2011).
+ */
+typedef struct {
+    int nchains;
+    int ntemps;
+    // number of swap batches so far
+    int batch;
+    // lag of the adaptation (in batches), 0 if the ladder is fixed
+    int adapt;
+    // per pair: swaps attempted and accepted, sum of the swap probabilities
+    double* attempts;
+    double* accepted;
+    double* prob;
+
+    bool evidence;
+    ok_diag* li;
+    // per chain and temperature (index chain * ntemps + temp): samples added to li
+    int* fed;
+    // per pair
+    double* ss_max;
+    double* ss_n;
+    double* ss_sum;
+    double* ss_sum2;
+} ok_mcmc_pt;
+
+static ok_mcmc_pt* ok_mcmc_pt_alloc(const int nchains, const int ntemps, const int adapt, const bool evidence) {
+    ok_mcmc_pt* pt = (ok_mcmc_pt*) calloc(1, sizeof (ok_mcmc_pt));
+    pt->nchains = nchains;
+    pt->ntemps = ntemps;
+    pt->adapt = adapt;
+    pt->attempts = (double*) calloc(ntemps, sizeof (double));
+    pt->accepted = (double*) calloc(ntemps, sizeof (double));
+    pt->prob = (double*) calloc(ntemps, sizeof (double));
+
+    pt->evidence = evidence;
+    if (evidence) {
+        pt->li = ok_diag_alloc(nchains * ntemps, 1, NULL);
+        pt->fed = (int*) calloc(nchains * ntemps, sizeof (int));
+        pt->ss_max = (double*) malloc(sizeof (double) * ntemps);
+        pt->ss_n = (double*) calloc(ntemps, sizeof (double));
+        pt->ss_sum = (double*) calloc(ntemps, sizeof (double));
+        pt->ss_sum2 = (double*) calloc(ntemps, sizeof (double));
+        for (int j = 0; j < ntemps; j++)
+            pt->ss_max[j] = -DBL_MAX;
+    }
+    return pt;
+}
+
+static void ok_mcmc_pt_free(ok_mcmc_pt* pt) {
+    free(pt->attempts);
+    free(pt->accepted);
+    free(pt->prob);
+    if (pt->evidence) {
+        ok_diag_free(pt->li);
+        free(pt->fed);
+        free(pt->ss_max);
+        free(pt->ss_n);
+        free(pt->ss_sum);
+        free(pt->ss_sum2);
+    }
+    free(pt);
+}
+
+// Moves the inverse temperatures glOpts[j][1] towards equal swap probabilities A[j]
+static void ok_mcmc_pt_adapt(ok_mcmc_pt* pt, double glOpts[][15], const double* A) {
+    int nt = pt->ntemps;
+    const double kappa = (double) pt->adapt / (pt->adapt + pt->batch);
+    if (glOpts[nt - 1][1] == 0.)
+        nt--;
+    if (nt < 3 || !(glOpts[nt - 1][1] > 0))
+        return;
+
+    double Abar = 0.;
+    for (int j = 0; j < nt - 1; j++)
+        Abar += A[j] / (nt - 1);
+
+    double gap[nt - 1];
+    double span = 0., sum = 0.;
+    for (int j = 0; j < nt - 1; j++) {
+        double d = log(glOpts[j][1] / glOpts[j + 1][1]);
+        span += d;
+        gap[j] = MAX(d, 1e-10) * exp(kappa * (A[j] - Abar));
+        sum += gap[j];
+    }
+
+    double x = -log(glOpts[0][1]);
+    for (int j = 0; j < nt - 2; j++) {
+        x += gap[j] * span / sum;
+        glOpts[j + 1][1] = exp(-x);
+    }
+}
+
+/*
+ * Adds the log-likelihoods of the samples of each chain and temperature added since the
+ * last call to the evidence accumulators; if burn is true, the samples are skipped instead.
+ */
+static void ok_mcmc_pt_feed(ok_mcmc_pt* pt, const int nchains, const int ntemps, ok_list* kls[][ntemps],
+                            double glOpts[][15], const bool burn) {
+    for (int n = 0; n < nchains; n++)
+        for (int j = 0; j < ntemps; j++) {
+            ok_list* kl = kls[n][j];
+            int* fed = &(pt->fed[n * ntemps + j]);
+            for (; !burn && *fed < kl->size; (*fed)++) {
+                double L = kl->kernels[*fed]->merit_li;
+                ok_diag_add(pt->li, n * ntemps + j, &L);
+
+                if (j == 0)
+                    continue;
+                // Stepping stone between j - 1 and j, from the samples of j
+                double v = (glOpts[j - 1][1] - glOpts[j][1]) * L;
+                if (v > pt->ss_max[j - 1]) {
+                    double f = exp(pt->ss_max[j - 1] - v);
+                    pt->ss_sum[j - 1] *= f;
+                    pt->ss_sum2[j - 1] *= f * f;
+                    pt->ss_max[j - 1] = v;
+                }
+                double w = exp(v - pt->ss_max[j - 1]);
+                pt->ss_n[j - 1] += 1.;
+                pt->ss_sum[j - 1] += w;
+                pt->ss_sum2[j - 1] += w * w;
+            }
+            *fed = kl->size;
+        }
+}
+
+/*
+ * Proposes to swap the last states of each pair of adjacent temperatures of each chain,
+ * sweeping the even pairs first and the odd pairs then. If adapt is true, the ladder is adapted.
+ */
+static void ok_mcmc_pt_swap(ok_mcmc_pt* pt, gsl_rng* rng, const int nchains, const int ntemps,
+                            ok_list* kls[][ntemps], double glOpts[][15], const bool adapt) {
+    double A[ntemps];
+    for (int j = 0; j < ntemps; j++)
+        A[j] = 0.;
+
+    for (int parity = 0; parity < 2; parity++)
+        for (int j = parity; j < ntemps - 1; j += 2)
+            for (int n = 0; n < nchains; n++) {
+                ok_list_item** it_j = &(kls[n][j]->kernels[kls[n][j]->size - 1]);
+                ok_list_item** it_j1 = &(kls[n][j + 1]->kernels[kls[n][j + 1]->size - 1]);
+
+                double r = (glOpts[j][1] - glOpts[j + 1][1]) * ((*it_j1)->merit_li - (*it_j)->merit_li);
+                assert(!isnan(r));
+                double p = MIN(exp(r), 1.);
+
+                A[j] += p / nchains;
+                pt->prob[j] += p;
+                pt->attempts[j] += 1.;
+
+                if ((r > 0) || (gsl_rng_uniform(rng) < p)) {
+                    ok_list_item* it = *it_j;
+                    *it_j = *it_j1;
+                    *it_j1 = it;
+                    pt->accepted[j] += 1.;
+                }
+            }
+
+    pt->batch++;
+    if (adapt && pt->adapt > 0)
+        ok_mcmc_pt_adapt(pt, glOpts, A);
+}
+
+// Mean log-likelihood of a temperature (over all the chains), its standard error, its variance
+// and the mean autocorrelation time
+static void ok_mcmc_pt_li(const ok_mcmc_pt* pt, const int j, double* mean, double* err, double* var, double* tau) {
+    double N = 0., m = 0., v = 0., ev = 0., t = 0.;
+    for (int n = 0; n < pt->nchains; n++)
+        if (ok_diag_count(pt->li, n * pt->ntemps + j) > 1)
+            N += ok_diag_count(pt->li, n * pt->ntemps + j);
+
+    *mean = *err = *var = *tau = INVALID_NUMBER;
+    if (N < 2)
+        return;
+
+    for (int n = 0; n < pt->nchains; n++) {
+        int c = n * pt->ntemps + j;
+        double nc = ok_diag_count(pt->li, c);
+        if (nc < 2)
+            continue;
+        double sd = ok_diag_sd(pt->li, c, 0);
+        double iat = ok_diag_iat(pt->li, c, 0);
+        iat = (IS_INVALID(iat) ? 1. : MAX(iat, 1.));
+        m += nc / N * ok_diag_mean(pt->li, c, 0);
+        ev += (nc / N) * (nc / N) * sd * sd * iat / nc;
+        t += nc / N * iat;
+    }
+    for (int n = 0; n < pt->nchains; n++) {
+        int c = n * pt->ntemps + j;
+        double nc = ok_diag_count(pt->li, c);
+        if (nc < 2)
+            continue;
+        double sd = ok_diag_sd(pt->li, c, 0);
+        double d = ok_diag_mean(pt->li, c, 0) - m;
+        v += ((nc - 1.) * sd * sd + nc * d * d) / N;
+    }
+    *mean = m;
+    *err = sqrt(ev);
+    *var = v;
+    *tau = t;
+}
+
+/*
+ * Returns a matrix with a row for each temperature j: beta_j, swaps with j + 1 attempted and
+ * accepted, mean swap probability; mean log-likelihood and its standard error; log of the
+ * stepping-stone ratio Z(beta_j) / Z(beta_j+1) and its standard error; variance of the
+ * log-likelihood (see KL_getTempStats).
+ */
+static gsl_matrix* ok_mcmc_pt_stats(const ok_mcmc_pt* pt, double glOpts[][15]) {
+    const int nt = pt->ntemps;
+    gsl_matrix* m = gsl_matrix_alloc(nt, 9);
+    gsl_matrix_set_all(m, INVALID_NUMBER);
+
+    for (int j = 0; j < nt; j++) {
+        MSET(m, j, 0, glOpts[j][1]);
+        if (j < nt - 1) {
+            MSET(m, j, 1, pt->attempts[j]);
+            MSET(m, j, 2, pt->accepted[j]);
+            MSET(m, j, 3, (pt->attempts[j] > 0 ? pt->prob[j] / pt->attempts[j] : INVALID_NUMBER));
+        }
+        if (!pt->evidence)
+            continue;
+
+        double mean, err, var, tau;
+        ok_mcmc_pt_li(pt, j, &mean, &err, &var, &tau);
+        MSET(m, j, 4, mean);
+        MSET(m, j, 5, err);
+        MSET(m, j, 8, var);
+
+        if (j < nt - 1 && pt->ss_n[j] > 1 && pt->ss_sum[j] > 0) {
+            double n = pt->ss_n[j];
+            double w = pt->ss_sum[j] / n;
+            double wvar = MAX(pt->ss_sum2[j] / n - w * w, 0.);
+            ok_mcmc_pt_li(pt, j + 1, &mean, &err, &var, &tau);
+            tau = (IS_INVALID(tau) ? 1. : tau);
+            MSET(m, j, 6, pt->ss_max[j] + log(w));
+            MSET(m, j, 7, sqrt(wvar * tau / n) / w);
+        }
+    }
+    return m;
+}
+
+static void ok_mcmc_pt_print(const ok_mcmc_pt* pt, double glOpts[][15]) {
+    for (int j = 0; j < pt->ntemps - 1; j++)
+        printf("Swaps %d <-> %d [beta = %.3e, %.3e]: %.0f/%.0f accepted (%.1f%%)\n", j, j + 1,
+               glOpts[j][1], glOpts[j + 1][1], pt->accepted[j], pt->attempts[j],
+               (pt->attempts[j] > 0 ? 100. * pt->accepted[j] / pt->attempts[j] : 0.));
+}
+
+// The chain at beta = 0 samples the prior, which is only proper if every minimized parameter
+// is bounded: angles wrap around, noise parameters are bounded below by 0, the others need a range
+static bool ok_mcmc_pt_bounded(ok_kernel* k) {
+    bool ok = true;
+    double min, max;
+    for (int i = 1; i < k->system->nplanets + 1; i++)
+        for (int j = 0; j < ELEMENTS_SIZE; j++)
+            if ((K_getElementFlag(k, i, j) & MINIMIZE) && j != MA && j != LOP && j != INC && j != NODE) {
+                K_getElementRange(k, i, j, &min, &max);
+                if (IS_INVALID(min) || IS_INVALID(max)) {
+                    printf("Evidence: %s of planet %d needs a finite range\n", ok_orb_labels[j], i);
+                    ok = false;
+                }
+            }
+    for (int i = 0; i < PARAMS_SIZE; i++)
+        if (K_getParFlag(k, i) & MINIMIZE) {
+            K_getParRange(k, i, &min, &max);
+            if ((IS_INVALID(min) && !(i >= P_DATA_NOISE1 && i <= P_DATA_NOISE10)) || IS_INVALID(max)) {
+                printf("Evidence: parameter %d needs a finite range\n", i);
+                ok = false;
+            }
+        }
+    return ok;
+}
+
+#define OK_MCMC_CHECKPOINT_MAGIC 0x4b43434d
+#define OK_MCMC_CHECKPOINT_VERSION 5
+
+static void ok_mcmc_rng_write(const gsl_rng* r, FILE* out) {
+    int size = (int) gsl_rng_size(r);
+    fwrite(&size, sizeof (int), 1, out);
+    fwrite(gsl_rng_state(r), 1, size, out);
+}
+
+static bool ok_mcmc_rng_read(gsl_rng* r, FILE* fid) {
+    int size;
+    return (fread(&size, sizeof (int), 1, fid) == 1 && size == (int) gsl_rng_size(r) &&
+            fread(gsl_rng_state(r), 1, size, fid) == size);
+}
+
+static void ok_mcmc_am_write(const ok_mcmc_am* am, FILE* out) {
+    int hdr[3] = {am->nadapt, am->nfactor, am->factored};
+    fwrite(hdr, sizeof (int), 3, out);
+    fwrite(&(am->w), sizeof (double), 1, out);
+    fwrite(&(am->loglambda), sizeof (double), 1, out);
+    fwrite(am->mean, sizeof (double), am->n, out);
+    fwrite(am->m2, sizeof (double), am->n * am->n, out);
+    fwrite(am->L, sizeof (double), am->n * am->n, out);
+}
+
+static bool ok_mcmc_am_read(ok_mcmc_am* am, FILE* fid) {
+    int hdr[3];
+    if (fread(hdr, sizeof (int), 3, fid) != 3)
+        return false;
+    am->nadapt = hdr[0];
+    am->nfactor = hdr[1];
+    am->factored = (hdr[2] != 0);
+    return (fread(&(am->w), sizeof (double), 1, fid) == 1 &&
+            fread(&(am->loglambda), sizeof (double), 1, fid) == 1 &&
+            fread(am->mean, sizeof (double), am->n, fid) == am->n &&
+            fread(am->m2, sizeof (double), am->n * am->n, fid) == am->n * am->n &&
+            fread(am->L, sizeof (double), am->n * am->n, fid) == am->n * am->n);
+}
+
+/*
+ * Writes the state of K_mcmc_mult at the end of a round: the header (the first six
+ * ints are read by K_mcmc_resume), the inverse temperatures, the random number generators,
+ * the step sizes and adaptive proposals of each chain and temperature, the chains, the convergence
+ * diagnostics and the swap and evidence statistics.
+ */
+static bool ok_mcmc_checkpoint_write(FILE* out, ok_kernel* k, const int nchains, const int ntemps,
+                                     ok_list* kls[][ntemps], ok_mcmc_am* ams[][ntemps], double glOpts[][15],
+                                     const int skip, const int discard, const int npars,
+                                     const int iter, const int save, const int Nsteps,
+                                     ok_diag* diags[3], int* fed[3], const ok_mcmc_pt* pt) {
+    int hdr[11] = {OK_MCMC_CHECKPOINT_MAGIC, OK_MCMC_CHECKPOINT_VERSION, nchains, ntemps, skip, discard,
+        npars, MROWS(kls[0][0]->prototype->plSteps), iter, save, Nsteps};
+    fwrite(hdr, sizeof (int), 11, out);
+    for (int j = 0; j < ntemps; j++)
+        fwrite(&(glOpts[j][1]), sizeof (double), 1, out);
+    ok_mcmc_rng_write(k->rng, out);
+
+    for (int n = 0; n < nchains; n++)
+        for (int j = 0; j < ntemps; j++) {
+            ok_kernel* k2 = kls[n][j]->prototype;
+            ok_mcmc_rng_write(k2->rng, out);
+            gsl_matrix_fwrite(out, k2->plSteps);
+            gsl_vector_fwrite(out, k2->parSteps);
+        }
+
+    int adaptive = (ams[0][0] != NULL);
+    fwrite(&adaptive, sizeof (int), 1, out);
+    for (int n = 0; n < nchains && adaptive; n++)
+        for (int j = 0; j < ntemps; j++)
+            ok_mcmc_am_write(ams[n][j], out);
+
+    for (int n = 0; n < nchains; n++)
+        for (int j = 0; j < ntemps; j++)
+            KL_save_bin(kls[n][j], out);
+
+    for (int i = 0; i < 3; i++) {
+        ok_diag_save_bin(diags[i], out);
+        fwrite(fed[i], sizeof (int), nchains, out);
+    }
+
+    fwrite(&(pt->batch), sizeof (int), 1, out);
+    fwrite(pt->attempts, sizeof (double), ntemps, out);
+    fwrite(pt->accepted, sizeof (double), ntemps, out);
+    fwrite(pt->prob, sizeof (double), ntemps, out);
+    int evidence = pt->evidence;
+    fwrite(&evidence, sizeof (int), 1, out);
+    if (pt->evidence) {
+        ok_diag_save_bin(pt->li, out);
+        fwrite(pt->fed, sizeof (int), nchains * ntemps, out);
+        fwrite(pt->ss_max, sizeof (double), ntemps, out);
+        fwrite(pt->ss_n, sizeof (double), ntemps, out);
+        fwrite(pt->ss_sum, sizeof (double), ntemps, out);
+        fwrite(pt->ss_sum2, sizeof (double), ntemps, out);
+    }
+    return !ferror(out);
+}
+
+/*
+ * Restores the state written by ok_mcmc_checkpoint_write (after the first six ints of
+ * the header) into the kernels of each chain and temperature, protos, and into the lists kls.
+ */
+static bool ok_mcmc_checkpoint_read(FILE* fid, ok_kernel* k, const int nchains, const int ntemps,
+                                    ok_kernel* protos[][ntemps], ok_list* kls[][ntemps], ok_mcmc_am* ams[][ntemps],
+                                    double glOpts[][15],
+                                    const int npars, int* iter, int* save, int* Nsteps,
+                                    ok_diag* diags[3], int* fed[3], ok_mcmc_pt* pt) {
+    int hdr[5];
+    if (fread(hdr, sizeof (int), 5, fid) != 5 || hdr[0] != npars || hdr[1] != MROWS(protos[0][0]->plSteps))
+        return false;
+    *iter = hdr[2];
+    *save = hdr[3];
+    *Nsteps = hdr[4];
+
+    for (int j = 0; j < ntemps; j++)
+        if (fread(&(glOpts[j][1]), sizeof (double), 1, fid) != 1)
+            return false;
+    if (!ok_mcmc_rng_read(k->rng, fid))
+        return false;
+
+    for (int n = 0; n < nchains; n++)
+        for (int j = 0; j < ntemps; j++)
+            if (!ok_mcmc_rng_read(protos[n][j]->rng, fid) || gsl_matrix_fread(fid, protos[n][j]->plSteps) != 0 ||
+                    gsl_vector_fread(fid, protos[n][j]->parSteps) != 0)
+                return false;
+
+    int adaptive;
+    if (fread(&adaptive, sizeof (int), 1, fid) != 1 || adaptive != (ams[0][0] != NULL))
+        return false;
+    for (int n = 0; n < nchains && adaptive; n++)
+        for (int j = 0; j < ntemps; j++)
+            if (!ok_mcmc_am_read(ams[n][j], fid))
+                return false;
+
+    for (int n = 0; n < nchains; n++)
+        for (int j = 0; j < ntemps; j++) {
+            kls[n][j] = KL_load_bin(fid, protos[n][j]);
+            if (kls[n][j] == NULL || kls[n][j]->size == 0)
+                return false;
+        }
+
+    for (int i = 0; i < 3; i++)
+        if (!ok_diag_load_bin(diags[i], fid) || fread(fed[i], sizeof (int), nchains, fid) != nchains)
+            return false;
+
+    if (fread(&(pt->batch), sizeof (int), 1, fid) != 1 ||
+            fread(pt->attempts, sizeof (double), ntemps, fid) != ntemps ||
+            fread(pt->accepted, sizeof (double), ntemps, fid) != ntemps ||
+            fread(pt->prob, sizeof (double), ntemps, fid) != ntemps)
+        return false;
+    int evidence;
+    if (fread(&evidence, sizeof (int), 1, fid) != 1 || evidence != pt->evidence)
+        return false;
+    return (!pt->evidence || (ok_diag_load_bin(pt->li, fid) &&
+                              fread(pt->fed, sizeof (int), nchains * ntemps, fid) == nchains * ntemps &&
+                              fread(pt->ss_max, sizeof (double), ntemps, fid) == ntemps &&
+                              fread(pt->ss_n, sizeof (double), ntemps, fid) == ntemps &&
+                              fread(pt->ss_sum, sizeof (double), ntemps, fid) == ntemps &&
+                              fread(pt->ss_sum2, sizeof (double), ntemps, fid) == ntemps));
+}
+
+typedef struct {
+    char* buf;
+    size_t size;
+    char path[1024];
+} ok_mcmc_checkpoint_job;
+
+// Writes a serialized checkpoint to a temporary file, then renames it over the previous one
+static void* ok_mcmc_checkpoint_flush(void* arg) {
+    ok_mcmc_checkpoint_job* job = (ok_mcmc_checkpoint_job*) arg;
+    char tmp[1040];
+    sprintf(tmp, "%s.tmp", job->path);
+
+    FILE* fid = fopen(tmp, "wb");
+    if (fid != NULL) {
+        bool ok = (fwrite(job->buf, 1, job->size, fid) == job->size);
+        ok = (fclose(fid) == 0) && ok;
+        if (ok)
+            rename(tmp, job->path);
+    }
+    free(job->buf);
+    job->buf = NULL;
+    return NULL;
+}
+
 /**
  * Launches multiple parallel MCMC chains until convergence is achieved; returns a kernel list. The steps are automatically
  * derived by the routine to have a 44% acceptance rate on each minimized parameter. 
+ * If the budget of k[0] (see K_setBudget) is exhausted, the routine returns the chains computed so far. 
  * 
  * @param k Kernel to be used as the starting point. Set minimization flag to MINIMIZE to decide what parameters to vary.
  * @param nchains Number of chains to run in parallel. The ensemble of chains is used to determine convergence
- * @param ntemps Number of temperatures to run in parallel. 
+ * @param ntemps Number of temperatures (parallel tempering); only the coldest chains are returned, with the
+ * statistics of the temperatures attached (see KL_getTempStats)
  * @param skip Skip the first 'skip' elements of the chain
  * @param discard Only retain every 'discard'-th element of the chain; the others will be discarded
- * @param params Additional parameters 
+ * @param params Additional parameters, including:
+ * OPT_MCMC_SWAP_EVERY: steps between swaps of adjacent temperatures (default 50 x discard);
+ * OPT_MCMC_ADAPT_TEMPS: number of swap batches over which the ladder is adapted to equal swap rates (default 100, 0 = fixed);
+ * OPT_MCMC_EVIDENCE: if non-zero, the hottest chain samples the prior and the evidence is estimated (see KL_getEvidence);
+ * the prior must be proper, so every minimized parameter but the angles (and the lower end of the noise parameters)
+ * needs a finite range, otherwise the routine returns NULL;
+ * OPT_MCMC_ADAPTIVE: if non-zero, switches to adaptive Metropolis after MAX(value, 10 x number of parameters) steps;
+ * OPT_MCMC_CHECKPOINT_EVERY: writes OK_MCMC_CHECKPOINT_FILE every 'value' convergence checks, to be continued with
+ * K_mcmc_resume; the state is serialized on the sampling thread, and only written to disk in the background
+ * (not with OPT_MCMC_STREAM);
+ * OPT_MCMC_SURROGATE: delayed acceptance with a cheaper model, SURROGATE_KEPLER or SURROGATE_LOOSE (tolerances
+ * loosened by OPT_MCMC_SURROGATE_ACC, default 100); the chains still sample the exact posterior;
+ * OPT_MCMC_STREAM: streams the cold chains to OK_MCMC_STREAM_FILE files, keeping only the last 'value' samples in memory;
+ * no checkpoints are written then, and OPT_MCMC_CHECKPOINT_EVERY is ignored with a warning.
  * @param Rstop Chains are considered converged when R < Rstop (usually < 1.2)
  * @param merit_function A function that returns the log of the merit of a given step; set to NULL for default. The default merit function
  * returns log(1/sqrt(A)) - 0.5*chi^2 + log(prior). 
  * @return A chain of systems 
  */
+static ok_list* ok_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, unsigned int skip, unsigned int discard, const double params[], double Rstop, ok_callback2 merit_function,
+                             FILE* resume);
+static ok_list* ok_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, unsigned int discard, const double dparams[], ok_list* cont, ok_callback2 merit_function, int tag,
+                               int* flag, ok_mcmc_am* am_state);
+
 ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, unsigned int skip, unsigned int discard, const double params[], double Rstop, ok_callback2 merit_function) {
+    return ok_mcmc_mult(k, nchains, ntemps, skip, discard, params, Rstop, merit_function, NULL);
+}
+
+/**
+ * Continues a run of K_mcmc_mult from a checkpoint written with OPT_MCMC_CHECKPOINT_EVERY. The number
+ * of chains and temperatures, skip and discard are read from the checkpoint; the kernel must be set up as
+ * in the interrupted run (same data, parameters to minimize and ranges). The random number generators are
+ * restored as well, so that the resumed run produces the same chains as an uninterrupted one.
+ * 
+ * @param k Kernel used by the interrupted run (k[0] in K_mcmc_mult)
+ * @param file Checkpoint file
+ * @param params Additional parameters, as in K_mcmc_mult
+ * @param Rstop Chains are considered converged when R < Rstop
+ * @param merit_function A function that returns the log of the merit of a given step; set to NULL for default
+ * @return A chain of systems, or NULL if the checkpoint could not be read
+ */
+ok_list* K_mcmc_resume(ok_kernel* k, const char* file, const double params[], double Rstop, ok_callback2 merit_function) {
+    FILE* fid = fopen(file, "rb");
+    if (fid == NULL)
+        return NULL;
+
+    int hdr[6];
+    ok_list* kl = NULL;
+    if (fread(hdr, sizeof (int), 6, fid) == 6 && hdr[0] == OK_MCMC_CHECKPOINT_MAGIC &&
+            hdr[1] == OK_MCMC_CHECKPOINT_VERSION && hdr[2] >= 1 && hdr[3] >= 1)
+        kl = ok_mcmc_mult(&k, hdr[2], hdr[3], hdr[4], hdr[5], params, Rstop, merit_function, fid);
+    fclose(fid);
+    return kl;
+}
+
+// Runs K_mcmc_mult; if resume is not NULL, the state of the chains is read from a checkpoint
+// instead of being initialized from k (which then only needs to contain k[0])
+static ok_list* ok_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, unsigned int skip, unsigned int discard, const double params[], double Rstop, ok_callback2 merit_function,
+                             FILE* resume) {
     int Nsteps = 40000;
     int Nmin = 5000;
 
@@ -146,6 +848,15 @@ ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, u
     bool return_all = true;
     double acc_ratio = 0.44;
     int save_every = -1;
+    int adaptive = 0;
+    int checkpoint_every = -1;
+    int swap_every = 50 * discard;
+    int adapt_temps = 100;
+    bool evidence = false;
+    bool tempfac_set = false;
+    int surrogate = SURROGATE_NONE;
+    double surrogate_acc = 100.;
+    int stream = 0;
 
     bool skip_steps = false;
 
@@ -164,6 +875,7 @@ ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, u
             Nmin = params[optIdx + 1];
         } else if (params[optIdx] == OPT_MCMC_TEMPFAC) {
             tempfac = params[optIdx + 1];
+            tempfac_set = true;
         } else if (params[optIdx] == OPT_MCMC_VERBOSE_DIAGS) {
             verbose = (int) params[optIdx + 1];
         } else if (params[optIdx] == OPT_MCMC_ACCRATIO) {
@@ -172,42 +884,85 @@ ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, u
             skip_steps = ((int) params[optIdx + 1]) != 0;
         } else if (params[optIdx] == OPT_MCMC_SAVE_EVERY) {
             save_every = (int) params[optIdx + 1];
+        } else if (params[optIdx] == OPT_MCMC_ADAPTIVE) {
+            adaptive = (int) params[optIdx + 1];
+        } else if (params[optIdx] == OPT_MCMC_CHECKPOINT_EVERY) {
+            checkpoint_every = (int) params[optIdx + 1];
+        } else if (params[optIdx] == OPT_MCMC_SWAP_EVERY) {
+            swap_every = (int) params[optIdx + 1];
+        } else if (params[optIdx] == OPT_MCMC_ADAPT_TEMPS) {
+            adapt_temps = (int) params[optIdx + 1];
+        } else if (params[optIdx] == OPT_MCMC_EVIDENCE) {
+            evidence = ((int) params[optIdx + 1]) != 0;
+        } else if (params[optIdx] == OPT_MCMC_SURROGATE) {
+            surrogate = (int) params[optIdx + 1];
+        } else if (params[optIdx] == OPT_MCMC_SURROGATE_ACC) {
+            surrogate_acc = params[optIdx + 1];
+        } else if (params[optIdx] == OPT_MCMC_STREAM) {
+            stream = (int) params[optIdx + 1];
         }
         optIdx += 2;
     }
 
 
-    double glOpts[ntemps][9];
-    glOpts[0][0] = OPT_MCMC_BETA;
-    glOpts[0][1] = 1.;
-    glOpts[0][2] = OPT_MCMC_VERBOSE_DIAGS;
-    glOpts[0][3] = verbose;
-    glOpts[0][4] = OPT_MCMC_ACCRATIO;
-    glOpts[0][5] = acc_ratio;
-    glOpts[0][6] = OPT_MCMC_SKIP_STEPS;
-    glOpts[0][7] = (skip_steps ? 1 : 0);
-    glOpts[0][8] = DONE;
-
-    for (int i = 1; i < ntemps; i++) {
+    double glOpts[ntemps][15];
+    for (int i = 0; i < ntemps; i++) {
         glOpts[i][0] = OPT_MCMC_BETA;
-        glOpts[i][1] = glOpts[i - 1][1] - tempfac;
+        glOpts[i][1] = (i == 0 ? 1. : glOpts[i - 1][1] - tempfac);
         glOpts[i][2] = OPT_MCMC_VERBOSE_DIAGS;
         glOpts[i][3] = verbose;
         glOpts[i][4] = OPT_MCMC_ACCRATIO;
         glOpts[i][5] = acc_ratio;
-        glOpts[0][6] = OPT_MCMC_SKIP_STEPS;
-        glOpts[0][7] = (skip_steps ? 1 : 0);
-        glOpts[i][8] = DONE;
-    };
-    bool stopped = false;
+        glOpts[i][6] = OPT_MCMC_SKIP_STEPS;
+        glOpts[i][7] = (skip_steps ? 1 : 0);
+        glOpts[i][8] = OPT_MCMC_ADAPTIVE;
+        glOpts[i][9] = adaptive;
+        glOpts[i][10] = OPT_MCMC_SURROGATE;
+        glOpts[i][11] = surrogate;
+        glOpts[i][12] = OPT_MCMC_SURROGATE_ACC;
+        glOpts[i][13] = surrogate_acc;
+        glOpts[i][14] = DONE;
+    }
 
-    #pragma omp parallel for
-    for (int n = 0; n < nchains; n++) {
-        ok_kernel* k2 = K_clone(k[n]);
+    // For the evidence, the hottest temperature samples the prior (beta = 0); unless
+    // OPT_MCMC_TEMPFAC is given, the ladder starts as beta_j = (1 - j / (ntemps - 1))^(1 / 0.3)
+    evidence = evidence && ntemps > 1;
+    if (evidence && !ok_mcmc_pt_bounded(k[0]))
+        return NULL;
+    if (evidence) {
+        for (int i = 0; i < ntemps && !tempfac_set; i++)
+            glOpts[i][1] = pow(1. - (double) i / (ntemps - 1), 1. / 0.3);
+        glOpts[ntemps - 1][1] = 0.;
+    }
+    // Swaps between temperatures are proposed every swap_every steps (a multiple of discard)
+    swap_every = MAX((swap_every + discard - 1) / discard, 1) * discard;
+    ok_mcmc_pt* pt = ok_mcmc_pt_alloc(nchains, ntemps, MAX(adapt_temps, 0), evidence);
 
-        K_calculate(k2);
-        int flag;
+    bool stopped = false;
+    ok_budget_start(k[0]->budget);
+
+    // Each temperature of each chain has its own kernel (and step sizes), so that all of them
+    // can run concurrently, and its own random number stream, keyed by the index of the chain
+    // and temperature. When resuming, the chains and the state of the streams are restored
+    // from the checkpoint below
+    ok_kernel * protos[nchains][ntemps];
+    unsigned long int seed = gsl_rng_get(k[0]->rng);
+    for (int n = 0; n < nchains; n++)
         for (int j = 0; j < ntemps; j++) {
+            protos[n][j] = K_clone(k[resume == NULL ? n : 0]);
+            K_shareBudget(protos[n][j], k[0]);
+            K_setRngStream(protos[n][j], seed, (unsigned long int) n * ntemps + j);
+        }
+
+    if (resume == NULL) {
+        #pragma omp parallel for
+        for (int nt = 0; nt < nchains * ntemps; nt++) {
+            int n = nt / ntemps;
+            int j = nt % ntemps;
+            ok_kernel* k2 = protos[n][j];
+
+            K_calculate(k2);
+            int flag;
             kls[n][j] = K_mcmc_single(k2, 1, 0, discard, glOpts[j], NULL, merit_function, n,
                                       &flag);
             kls[n][j]->prototype = k2;
@@ -217,10 +972,13 @@ ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, u
             if (flag == PROGRESS_STOP)
                 stopped = true;
         }
-    }
 
-    if (stopped)
-        return NULL;
+        if (stopped) {
+            ok_budget_stop(k[0]->budget);
+            ok_mcmc_pt_free(pt);
+            return NULL;
+        }
+    }
 
     bool conv = false;
     bool conv_single = false;
@@ -283,124 +1041,197 @@ ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, u
         }
 
 
+    ok_diag* diag = ok_diag_alloc(nchains, npars, isAngle);
+    ok_diag* diag_90 = ok_diag_alloc(nchains, npars, isAngle);
+    ok_diag* diag_2 = ok_diag_alloc(nchains, npars, isAngle);
+    int fed[nchains], fed_90[nchains], fed_2[nchains];
+    for (int n = 0; n < nchains; n++)
+        fed[n] = fed_90[n] = fed_2[n] = 0;
+
+    ok_diag* diags[3] = {diag, diag_90, diag_2};
+    int* feds[3] = {fed, fed_90, fed_2};
+
+    // With adaptive Metropolis, the proposal of each chain and temperature lives across the
+    // batches, so that its adaptation vanishes over the whole run and only new steps are added
+    ok_mcmc_am* ams[nchains][ntemps];
+    for (int n = 0; n < nchains; n++)
+        for (int j = 0; j < ntemps; j++)
+            ams[n][j] = (adaptive > 0 && npars > 0 ? ok_mcmc_am_alloc(npars) : NULL);
+
+    int resumed_iter = -1;
+    if (resume != NULL) {
+        for (int n = 0; n < nchains; n++)
+            for (int j = 0; j < ntemps; j++) {
+                K_calculate(protos[n][j]);
+                kls[n][j] = NULL;
+            }
+
+        if (!ok_mcmc_checkpoint_read(resume, k[0], nchains, ntemps, protos, kls, ams, glOpts, npars,
+                                     &iter, &save, &Nsteps, diags, feds, pt)) {
+            for (int n = 0; n < nchains; n++)
+                for (int j = 0; j < ntemps; j++) {
+                    if (kls[n][j] != NULL) {
+                        kls[n][j]->prototype = NULL;
+                        KL_free(kls[n][j]);
+                    }
+                    K_free(protos[n][j]);
+                    if (ams[n][j] != NULL)
+                        ok_mcmc_am_free(ams[n][j]);
+                }
+            ok_diag_free(diag);
+            ok_diag_free(diag_90);
+            ok_diag_free(diag_2);
+            ok_mcmc_pt_free(pt);
+            ok_budget_stop(k[0]->budget);
+            return NULL;
+        }
+        resumed_iter = iter;
+    }
+
+#ifndef JAVASCRIPT
+    pthread_t writer;
+    bool writing = false;
+#endif
+    ok_mcmc_checkpoint_job job;
+    job.buf = NULL;
+    sprintf(job.path, "%s", OK_MCMC_CHECKPOINT_FILE);
+
+    // When streaming, the cold chains are written to the sink as they grow and only their last
+    // 'stream' samples are kept in memory; offset[n] is the index of the first sample in memory
+    ok_sink* sink = NULL;
+    int offset[nchains];
+    for (int n = 0; n < nchains; n++)
+        offset[n] = 0;
+    if (stream > 0) {
+        stream = MAX(stream, 2);
+        ok_list_item* it = kls[0][0]->kernels[0];
+        sink = ok_sink_open(OK_MCMC_STREAM_FILE, nchains, MROWS(it->elements), MCOLS(it->elements),
+                            it->params->size, nchains * stream);
+        if (sink == NULL) {
+            if (verbose > 0)
+                printf("Could not open %s_*.bin, the chains are kept in memory\n", OK_MCMC_STREAM_FILE);
+            stream = 0;
+        } else {
+            if (checkpoint_every > 0)
+                printf("Warning: OPT_MCMC_CHECKPOINT_EVERY is ignored with OPT_MCMC_STREAM, no checkpoints are written\n");
+            checkpoint_every = -1;
+        }
+    }
+
     double Rmax = 0;
     double Rmax_90 = 0;
     double Rsingle_max = 0;
-    while ((!(conv || conv_single)) || (Nmin > kls[0][0]->size)) {
+    double ess_min = INVALID_NUMBER;
+    while ((!(conv || conv_single)) || (Nmin > offset[0] + kls[0][0]->size)) {
 
         bool stopped = false;
 
-
-
-        #pragma omp parallel for 
-        for (int n = 0; n < nchains * ntemps; n++) {
-
-            int ntem = n % ntemps;
-            int ncha = n - (n % ntemps);
-            int flag;
-            ok_list* kl = K_mcmc_single(kls[ncha][0]->prototype, Nsteps, (iter == 0 ? skip : 0),
-                                        discard, glOpts[ntem], kls[ncha][ntem], merit_function, ncha, &flag);
-
-            if (flag == PROGRESS_STOP)
-                stopped = true;
-            KL_append(kls[ncha][ntem], kl);
+        // The checkpoint is only written once it is known that the run continues (a resumed run
+        // starts from here), and not again right after resuming
+        if (checkpoint_every > 0 && iter > 0 && iter % checkpoint_every == 0 &&
+                iter != resumed_iter) {
+#ifndef JAVASCRIPT
+            if (writing)
+                pthread_join(writer, NULL);
+            writing = false;
+            FILE* out = open_memstream(&(job.buf), &(job.size));
+            bool ok = ok_mcmc_checkpoint_write(out, k[0], nchains, ntemps, kls, ams, glOpts, skip, discard, npars,
+                                               iter, save, Nsteps, diags, feds, pt);
+            ok = (fclose(out) == 0) && ok;
+            if (!ok)
+                free(job.buf);
+            else if (pthread_create(&writer, NULL, ok_mcmc_checkpoint_flush, &job) == 0)
+                writing = true;
+            else
+                ok_mcmc_checkpoint_flush(&job);
+#else
+            char tmp[1040];
+            sprintf(tmp, "%s.tmp", job.path);
+            FILE* out = fopen(tmp, "wb");
+            if (out != NULL) {
+                bool ok = ok_mcmc_checkpoint_write(out, k[0], nchains, ntemps, kls, ams, glOpts, skip, discard, npars,
+                                                   iter, save, Nsteps, diags, feds, pt);
+                if ((fclose(out) == 0) && ok)
+                    rename(tmp, job.path);
+            }
+#endif
         }
 
 
 
-        #pragma omp parallel for
-        for (int n = 0; n < nchains; n++) {
-            int size = kls[n][0]->size;
+        // With more than one temperature, the round is split in batches of swap_every steps; all
+        // the tempered chains run concurrently within a batch, and swaps are proposed between batches
+        int nbatches = (ntemps > 1 ? MAX((Nsteps + swap_every - 1) / swap_every, 1) : 1);
+        for (int b = 0; b < nbatches; b++) {
+            int nsteps = (ntemps > 1 ? MIN(swap_every, Nsteps - b * swap_every) : Nsteps);
 
-            gsl_matrix* dev = KL_getElementsStats(kls[n][0], STAT_STDDEV);
-            gsl_vector* dev_p = KL_getParsStats(kls[n][0], STAT_STDDEV);
-            gsl_matrix* avg = KL_getElementsStats(kls[n][0], STAT_MEAN);
-            gsl_vector* avg_p = KL_getParsStats(kls[n][0], STAT_MEAN);
+            #pragma omp parallel for
+            for (int n = 0; n < nchains * ntemps; n++) {
 
-            int np = 0;
-            for (int i = 1; i < k[0]->system->nplanets + 1; i++)
-                for (int j = 0; j < ELEMENTS_SIZE; j++)
-                    if (K_getElementFlag(k[0], i, j) & MINIMIZE) {
-                        devs[np][n] = MGET(dev, i, j);
-                        avgs[np][n] = MGET(avg, i, j);
-
-                        np++;
-                    }
-            for (int i = 0; i < PARAMS_SIZE; i++)
-                if (K_getParFlag(k[0], i) & MINIMIZE) {
-                    devs[np][n] = VGET(dev_p, i);
-                    avgs[np][n] = VGET(avg_p, i);
-
-                    np++;
-                }
+                int ntem = n % ntemps;
+                int ncha = n / ntemps;
+                int flag;
+                ok_list* kl = ok_mcmc_single(kls[ncha][ntem]->prototype, nsteps, (iter == 0 && b == 0 ? skip : 0),
+                                             discard, glOpts[ntem], kls[ncha][ntem], merit_function, ncha, &flag,
+                                             ams[ncha][ntem]);
 
-            kls[n][0]->size = (int) (0.9 * size);
-
-            gsl_matrix* dev_90 = KL_getElementsStats(kls[n][0], STAT_STDDEV);
-            gsl_vector* dev_90_p = KL_getParsStats(kls[n][0], STAT_STDDEV);
-            gsl_matrix* avg_90 = KL_getElementsStats(kls[n][0], STAT_MEAN);
-            gsl_vector* avg_90_p = KL_getParsStats(kls[n][0], STAT_MEAN);
-
-            np = 0;
-            for (int i = 1; i < k[0]->system->nplanets + 1; i++)
-                for (int j = 0; j < ELEMENTS_SIZE; j++)
-                    if (K_getElementFlag(k[0], i, j) & MINIMIZE) {
-                        devs_90[np][n] = MGET(dev_90, i, j);
-                        avgs_90[np][n] = MGET(avg_90, i, j);
-                        vals[np][n] = KL_getElement(kls[n][0], size - 1, i, j);
-
-                        np++;
-
-                    }
-            for (int i = 0; i < PARAMS_SIZE; i++)
-                if (K_getParFlag(k[0], i) & MINIMIZE) {
-                    devs_90[np][n] = VGET(dev_90_p, i);
-                    avgs_90[np][n] = VGET(avg_90_p, i);
-                    vals[np][n] = KL_getPar(kls[n][0], size - 1, i);
-                    np++;
-                }
-
-            kls[n][0]->size = (int) (0.5 * size);
-
-            gsl_matrix* dev_2 = KL_getElementsStats(kls[n][0], STAT_STDDEV);
-            gsl_vector* dev_p_2 = KL_getParsStats(kls[n][0], STAT_STDDEV);
-            gsl_matrix* avg_2 = KL_getElementsStats(kls[n][0], STAT_MEAN);
-            gsl_vector* avg_p_2 = KL_getParsStats(kls[n][0], STAT_MEAN);
+                if (flag == PROGRESS_STOP)
+                    stopped = true;
+                KL_append(kls[ncha][ntem], kl);
+            }
 
+            // With the evidence, the ladder is frozen after the first round, whose samples are skipped
+            if (evidence)
+                ok_mcmc_pt_feed(pt, nchains, ntemps, kls, glOpts, iter == 0);
+            if (ntemps > 1)
+                ok_mcmc_pt_swap(pt, k[0]->rng, nchains, ntemps, kls, glOpts, !evidence || iter == 0);
 
-            np = 0;
-            for (int i = 1; i < k[0]->system->nplanets + 1; i++)
-                for (int j = 0; j < ELEMENTS_SIZE; j++)
-                    if (K_getElementFlag(k[0], i, j) & MINIMIZE) {
-                        devs_2[np][n] = MGET(dev_2, i, j);
-                        avgs_2[np][n] = MGET(avg_2, i, j);
-                        np++;
-                    }
-            for (int i = 0; i < PARAMS_SIZE; i++)
-                if (K_getParFlag(k[0], i) & MINIMIZE) {
-                    devs_2[np][n] = VGET(dev_p_2, i);
-                    avgs_2[np][n] = VGET(avg_p_2, i);
-                    np++;
-                }
+            if (stopped || K_checkBudget(k[0], INVALID_NUMBER) != BUDGET_OK)
+                break;
+        }
 
-            kls[n][0]->size = size;
 
-            gsl_matrix_free(dev);
-            gsl_vector_free(dev_p);
-            gsl_matrix_free(avg);
-            gsl_vector_free(avg_p);
 
-            gsl_matrix_free(dev_2);
-            gsl_vector_free(dev_p_2);
-            gsl_matrix_free(avg_2);
-            gsl_vector_free(avg_p_2);
+        for (int n = 0; n < nchains && sink != NULL; n++)
+            for (int i = ok_sink_count(sink, n) - offset[n]; i < kls[n][0]->size; i++)
+                ok_sink_push(sink, n, kls[n][0]->kernels[i]);
 
-            gsl_matrix_free(dev_90);
-            gsl_vector_free(dev_90_p);
-            gsl_matrix_free(avg_90);
-            gsl_vector_free(avg_90_p);
+        // The diagnostics are updated with the samples added since the last check; the
+        // statistics of the first 90% and 50% of each chain are kept by accumulators
+        // lagging behind the full ones
+        #pragma omp parallel for
+        for (int n = 0; n < nchains; n++) {
+            int size = offset[n] + kls[n][0]->size;
+
+            ok_mcmc_diag_feed(diag, n, kls[n][0], offset[n], sink, &(fed[n]), size, k[0]);
+            ok_mcmc_diag_feed(diag_90, n, kls[n][0], offset[n], sink, &(fed_90[n]), (int) (0.9 * size), k[0]);
+            ok_mcmc_diag_feed(diag_2, n, kls[n][0], offset[n], sink, &(fed_2[n]), (int) (0.5 * size), k[0]);
+
+            double last[npars];
+            ok_list_item* it = kls[n][0]->kernels[kls[n][0]->size - 1];
+            ok_mcmc_state(k[0]->plFlags, k[0]->parFlags, it->elements, it->params, last);
+
+            for (int np = 0; np < npars; np++) {
+                devs[np][n] = ok_diag_sd(diag, n, np);
+                avgs[np][n] = ok_diag_mean(diag, n, np);
+                devs_90[np][n] = ok_diag_sd(diag_90, n, np);
+                avgs_90[np][n] = ok_diag_mean(diag_90, n, np);
+                devs_2[np][n] = ok_diag_sd(diag_2, n, np);
+                avgs_2[np][n] = ok_diag_mean(diag_2, n, np);
+                vals[np][n] = last[np];
+            }
         }
 
+        for (int n = 0; n < nchains && sink != NULL; n++)
+            for (int j = 0; j < ntemps; j++) {
+                int drop = ok_mcmc_trim(kls[n][j], stream);
+                if (j == 0)
+                    offset[n] += drop;
+                if (evidence)
+                    pt->fed[n * ntemps + j] -= drop;
+            }
+        int length = offset[0] + kls[0][0]->size;
+
         Nsteps = discard * 500;
         conv = true;
         conv_single = (R_single < 0 ? false : true);
@@ -412,6 +1243,7 @@ ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, u
         Rmax = 0.;
         Rmax_90 = 0.;
         Rsingle_max = 0.;
+        ess_min = INVALID_NUMBER;
         for (int np = 0; np < npars; np++) {
             if (isAngle[np]) {
                 W[np] = ok_average_angle(devs[np], nchains, false);
@@ -450,6 +1282,10 @@ ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, u
             }
 
             conv = conv && (R[np] < Rstop) && (R_90[np] < Rstop);
+
+            double ess = ok_diag_ess(diag, -1, np);
+            if (!IS_INVALID(ess))
+                ess_min = (IS_INVALID(ess_min) ? ess : MIN(ess_min, ess));
         }
 
         if (R_single > 0)
@@ -458,7 +1294,7 @@ ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, u
         if (progress != NULL) {
             char prog[400];
             sprintf(prog, "[%d] R[%d] = %.2e [1/2 = %.2e], Rsing_max = %.2e [par = %d, chain = %d, v = %e], Rstop = %.2e, size = %d [%d]",
-                    kls[0][0]->size, Rmax_param, Rmax, Rmax_90, Rsingle_max, conv_single_param, conv_single_chain, vals[conv_single_param][conv_single_chain], Rstop, kls[0][0]->size, Nstop);
+                    length, Rmax_param, Rmax, Rmax_90, Rsingle_max, conv_single_param, conv_single_chain, vals[conv_single_param][conv_single_chain], Rstop, length, Nstop);
 
             double p = 100. * (1 - fabs(Rmax - Rstop) / Rstop);
 
@@ -491,12 +1327,13 @@ ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, u
         if (save_every > 0 && save == save_every) {
             save = 0;
             FILE* fid = fopen("mcmc_stats.txt", "w");
-            fprintf(fid, "size = %d\n", kls[0][0]->size);
+            fprintf(fid, "size = %d\n", length);
             fprintf(fid, "R = %e\n", Rmax);
             fprintf(fid, "R_90 = %e\n", Rmax_90);
             fclose(fid);
 
-            for (int i = 0; i < nchains; i++) {
+            // When streaming, the chains are already on disk
+            for (int i = 0; i < nchains && sink == NULL; i++) {
                 char fn[80];
                 sprintf(fn, "mcmc_%d.txt", i);
                 fid = fopen(fn, "w");
@@ -506,51 +1343,55 @@ ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, u
         }
 
         if (verbose > 1) {
-            printf("Rmax = %e [Rmax_90 = %e], Rsingle_max = %e, Chain length = %d\n", Rmax, Rmax_90, Rsingle_max, kls[0][0]->size);
+            printf("Rmax = %e [Rmax_90 = %e], Rsingle_max = %e, ESS_min = %.0f, Chain length = %d\n", Rmax, Rmax_90, Rsingle_max, ess_min, length);
         }
 
-        if (kls[0][0]->size > Nstop && Nstop > 0) {
+        if (length > Nstop && Nstop > 0) {
             conv = true;
         }
 
-        if (ntemps > 1) {
-            for (int n = 0; n < nchains; n++) {
-                int j = gsl_rng_uniform_int(k[0]->rng, ntemps - 1);
-
-                double beta_j = glOpts[j][1];
-                double beta_j1 = glOpts[j + 1][1];
-
-                double li_j = kls[n][j]->kernels[kls[n][j]->size - 1]->merit_li;
-                double li_j1 = kls[n][j + 1]->kernels[kls[n][j + 1]->size - 1]->merit_li;
-
-                double r = (beta_j * li_j1 + beta_j1 * li_j - beta_j * li_j - beta_j1 * li_j1);
-
-                assert(!isnan(r));
-
-                static int iter = 0;
-                if (j == 0) iter++;
-
-
-                if ((r > 0) || (gsl_rng_uniform(k[0]->rng) < MIN(exp(r), 1))) {
-                    ok_list_item* it = kls[n][j]->kernels[kls[n][j]->size - 1];
-
-                    kls[n][j]->kernels[kls[n][j]->size - 1] = kls[n][j + 1]->kernels[kls[n][j + 1]->size - 1];
-                    kls[n][j + 1]->kernels[kls[n][j + 1]->size - 1] = it;
-                }
-            }
-        }
-
+        if (ntemps > 1 && verbose > 1)
+            ok_mcmc_pt_print(pt, glOpts);
 
         iter++;
-        if (stopped)
+        if (stopped || K_checkBudget(k[0], INVALID_NUMBER) != BUDGET_OK)
             break;
     }
+    ok_budget_stop(k[0]->budget);
+#ifndef JAVASCRIPT
+    if (writing)
+        pthread_join(writer, NULL);
+#endif
+    if (!ok_sink_close(sink) && verbose > 0)
+        printf("Error writing %s_*.bin\n", OK_MCMC_STREAM_FILE);
 
     if (verbose > 0) {
-        printf("Final length: %d, final R_max = %e, final Rsingle_max = %e\n",
-               kls[0][0]->size, Rmax, Rsingle_max);
+        printf("Final length: %d, final R_max = %e, final Rsingle_max = %e, ESS_min = %.0f\n",
+               offset[0] + kls[0][0]->size, Rmax, Rsingle_max, ess_min);
+        if (ntemps > 1)
+            ok_mcmc_pt_print(pt, glOpts);
+    }
+
+    if (ntemps > 1)
+        kls[0][0]->diags = ok_mcmc_pt_stats(pt, glOpts);
+    if (evidence && verbose > 0) {
+        double logZ[4];
+        KL_getEvidence(kls[0][0], logZ);
+        printf("log(Z) = %e +- %e [stepping stone: %e +- %e]\n", logZ[0], logZ[1], logZ[2], logZ[3]);
     }
 
+    ok_diag_free(diag);
+    ok_diag_free(diag_90);
+    ok_diag_free(diag_2);
+
+    ok_mcmc_pt_free(pt);
+    for (int n = 0; n < nchains; n++)
+        for (int j = 0; j < ntemps; j++)
+            if (ams[n][j] != NULL)
+                ok_mcmc_am_free(ams[n][j]);
+    for (int j = 1; j < ntemps; j++)
+        KL_free(kls[0][j]);
+
     if (return_all) {
         for (int i = 1; i < nchains; i++) {
             KL_append(kls[0][0], kls[i][0]);
@@ -566,8 +1407,39 @@ ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, u
     return kls[0][0];
 }
 
+// Evaluates the merit of the current state of k with the surrogate model of delayed acceptance
+// (the Keplerian model, or the integrator of k with loosened accuracy), then restores the model
+static void ok_mcmc_surrogate_merit(ok_kernel* k, const int surrogate, const double acc, ok_callback2 merit_function,
+                                    double* ret) {
+    int method = k->intMethod;
+    double abs_acc = k->intOptions->abs_acc;
+    double rel_acc = k->intOptions->rel_acc;
+
+    if (surrogate == SURROGATE_KEPLER)
+        k->intMethod = KEPLER;
+    else {
+        k->intOptions->abs_acc = abs_acc * acc;
+        k->intOptions->rel_acc = rel_acc * acc;
+    }
+
+    k->flags |= NEEDS_SETUP;
+    (merit_function == NULL ? K_mcmc_likelihood_and_prior_default(k, ret) : merit_function(k, ret));
+
+    k->intMethod = method;
+    k->intOptions->abs_acc = abs_acc;
+    k->intOptions->rel_acc = rel_acc;
+    k->flags |= NEEDS_SETUP;
+}
+
 ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, unsigned int discard, const double dparams[], ok_list* cont, ok_callback2 merit_function, int tag,
                        int* flag) {
+    return ok_mcmc_single(k2, nsteps, skip, discard, dparams, cont, merit_function, tag, flag, NULL);
+}
+
+// Runs K_mcmc_single; if am_state is not NULL, it holds the adaptive proposal of the chain and is
+// updated with the new steps only, otherwise the proposal is rebuilt from the samples of cont
+static ok_list* ok_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, unsigned int discard, const double dparams[], ok_list* cont, ok_callback2 merit_function, int tag,
+                               int* flag, ok_mcmc_am* am_state) {
 
 
     gsl_matrix* plSteps = k2->plSteps;
@@ -597,6 +1469,9 @@ ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, un
     double beta = 1.;
     int verbose = 2;
     double acc_ratio = 0.25;
+    int adaptive = 0;
+    int surrogate = SURROGATE_NONE;
+    double surrogate_acc = 100.;
     int progress_every = (k2->intMethod == KEPLER ? 2000 : 2);
 
     while (dparams != NULL) {
@@ -610,10 +1485,20 @@ ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, un
             verbose = dparams[optIdx + 1];
         else if (dparams[optIdx] == OPT_MCMC_ACCRATIO)
             acc_ratio = dparams[optIdx + 1];
+        else if (dparams[optIdx] == OPT_MCMC_ADAPTIVE)
+            adaptive = (int) dparams[optIdx + 1];
+        else if (dparams[optIdx] == OPT_MCMC_SURROGATE)
+            surrogate = (int) dparams[optIdx + 1];
+        else if (dparams[optIdx] == OPT_MCMC_SURROGATE_ACC)
+            surrogate_acc = dparams[optIdx + 1];
 
         optIdx += 2;
     }
 
+    // The Keplerian model is already the cheapest one
+    if (k2->intMethod == KEPLER)
+        surrogate = SURROGATE_NONE;
+
 
     int nbodies = plSteps->size1;
     int npar = 0;
@@ -653,12 +1538,49 @@ ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, un
             kpar++;
         }
 
+    // Adaptive Metropolis: after the per-parameter step tuning, the covariance of the chain
+    // (including the samples of cont, each standing for 'discard' steps, unless am_state already
+    // holds them) is used for joint moves
+    ok_mcmc_am* am = (adaptive > 0 && npar > 0 ? am_state : NULL);
+    int am_start = MAX(adaptive, 10 * npar);
+    bool am_angle[MAX(npar, 1)];
+    double am_x[MAX(npar, 1)];
+    double am_jump[MAX(npar, 1)];
+    if (adaptive > 0 && npar > 0) {
+        kpar = 0;
+        for (int j = ELEMENTS_SIZE; j < nbodies * ELEMENTS_SIZE; j++)
+            if (plFlags->data[j] & MINIMIZE) {
+                int el = j % ELEMENTS_SIZE;
+                am_angle[kpar++] = (el == MA || el == LOP || el == INC || el == NODE);
+            }
+        for (int j = 0; j < PARAMS_SIZE; j++)
+            if (parFlags->data[j] & MINIMIZE)
+                am_angle[kpar++] = false;
+
+        if (am == NULL) {
+            am = ok_mcmc_am_alloc(npar);
+            for (int i = 0; cont != NULL && i < cont->size; i++) {
+                ok_mcmc_state(plFlags, parFlags, cont->kernels[i]->elements, cont->kernels[i]->params, am_x);
+                ok_mcmc_am_add(am, am_x, am_angle, discard);
+            }
+        }
+    }
+
     double prevMerit[2];
     double merit[2];
 
 
     (merit_function == NULL ? K_mcmc_likelihood_and_prior_default(k2, prevMerit) : merit_function(k2, prevMerit));
 
+    // Merit of the surrogate model (delayed acceptance) at the current and proposed states, and
+    // number of proposals that passed the first stage
+    double prevSur[2];
+    double sur[2];
+    double passed = 0.;
+    double proposed = 0.;
+    if (surrogate != SURROGATE_NONE)
+        ok_mcmc_surrogate_merit(k2, surrogate, surrogate_acc, merit_function, prevSur);
+
     int state = ((cont == NULL && !skipStepsConvergence) ? STATE_STEPS : STATE_SKIP);
 
     ok_list_item* it = KL_set(kl, 0, K_getAllElements(k2), ok_vector_copy(oldPars), prevMerit[0] + prevMerit[1], tag);
@@ -677,6 +1599,18 @@ ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, un
             n_par[sub] += 1.;
         }
 
+        bool joint = false;
+        if (am != NULL && state != STATE_STEPS && am->w >= am_start && gsl_rng_uniform(k2->rng) >= AM_DIAG_FRAC) {
+            if (!am->factored || am->nfactor >= npar) {
+                am->nfactor = 0;
+                ok_mcmc_am_factor(am, steps);
+            }
+            if (am->factored) {
+                ok_mcmc_am_propose(am, k2->rng, am_jump);
+                joint = true;
+            }
+        }
+
         int par = 0;
         bool invalid = false;
 
@@ -685,7 +1619,7 @@ ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, un
                 if (MIGET(plFlags, pl, j) & MINIMIZE) {
 
                     if (state == STATE_MAIN || state == STATE_SKIP || (state == STATE_STEPS && par == sub))
-                        MSET(k2->system->elements, pl, j, MGET(oldEls, pl, j) + gsl_ran_gaussian(k2->rng, MGET(plSteps, pl, j)));
+                        MSET(k2->system->elements, pl, j, MGET(oldEls, pl, j) + (joint ? am_jump[par] : gsl_ran_gaussian(k2->rng, MGET(plSteps, pl, j))));
 
                     if ((j == MA) || (j == LOP) || (j == INC) || (j == NODE)) {
                         MSET(k2->system->elements, pl, j, DEGRANGE(MGET(k2->system->elements, pl, j)));
@@ -706,7 +1640,7 @@ ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, un
         for (int j = 0; j < PARAMS_SIZE; j++) {
             if (parFlags->data[j] & MINIMIZE) {
                 if (state == STATE_MAIN || state == STATE_SKIP || (state == STATE_STEPS && par == sub))
-                    k2->params->data[j] = oldPars->data[j] + gsl_ran_gaussian(k2->rng, parSteps->data[j]);
+                    k2->params->data[j] = oldPars->data[j] + (joint ? am_jump[par] : gsl_ran_gaussian(k2->rng, parSteps->data[j]));
 
                 if (j >= P_DATA_NOISE1 && j <= P_DATA_NOISE10)
                     k2->params->data[j] = fabs(k2->params->data[j]);
@@ -723,6 +1657,10 @@ ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, un
 
 
         if (invalid) {
+            if (am != NULL && state != STATE_STEPS) {
+                ok_mcmc_state(plFlags, parFlags, oldEls, oldPars, am_x);
+                ok_mcmc_am_step(am, am_x, am_angle, joint, 0.);
+            }
             if (i % discard == 0 && state == STATE_MAIN) {
                 MATRIX_MEMCPY(k2->system->elements, oldEls);
                 VECTOR_MEMCPY(k2->params, oldPars);
@@ -738,21 +1676,41 @@ ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, un
 
         k2->flags |= NEEDS_SETUP;
 
-        (merit_function == NULL ? K_mcmc_likelihood_and_prior_default(k2, merit) : merit_function(k2, merit));
-        ASSERTDO(!isnan(merit[0]), ok_fprintf_matrix(k2->system->elements, stdout, "%e "));
-        ASSERTDO(!isnan(merit[1]), ok_fprintf_matrix(k2->system->elements, stdout, "%e "));
-
-        assert(!isinf(merit[0]));
-        assert(!isinf(merit[1]));
-
-        double al = MIN(exp(merit[1] - prevMerit[1] + beta * (merit[0] - prevMerit[0])), 1.);
-        double u = gsl_rng_uniform(k2->rng);
-
+        // Delayed acceptance: a proposal rejected by the surrogate is not evaluated with the full model
+        bool screened = false;
+        if (surrogate != SURROGATE_NONE) {
+            ok_mcmc_surrogate_merit(k2, surrogate, surrogate_acc, merit_function, sur);
+            double al_sur = MIN(exp(sur[1] - prevSur[1] + beta * (sur[0] - prevSur[0])), 1.);
+            screened = (gsl_rng_uniform(k2->rng) >= al_sur);
+            proposed += 1.;
+            passed += (screened ? 0. : 1.);
+        }
 
+        double al = 0.;
+        double u = 1.;
+        if (!screened) {
+            (merit_function == NULL ? K_mcmc_likelihood_and_prior_default(k2, merit) : merit_function(k2, merit));
+            ASSERTDO(!isnan(merit[0]), ok_fprintf_matrix(k2->system->elements, stdout, "%e "));
+            ASSERTDO(!isnan(merit[1]), ok_fprintf_matrix(k2->system->elements, stdout, "%e "));
+
+            assert(!isinf(merit[0]));
+            assert(!isinf(merit[1]));
+
+            double lr = merit[1] - prevMerit[1] + beta * (merit[0] - prevMerit[0]);
+            // The second stage divides out the ratio of the surrogate, keeping the posterior exact
+            if (surrogate != SURROGATE_NONE)
+                lr -= sur[1] - prevSur[1] + beta * (sur[0] - prevSur[0]);
+            al = MIN(exp(lr), 1.);
+            u = gsl_rng_uniform(k2->rng);
+        }
 
         if (u < al) {
             prevMerit[0] = merit[0];
             prevMerit[1] = merit[1];
+            if (surrogate != SURROGATE_NONE) {
+                prevSur[0] = sur[0];
+                prevSur[1] = sur[1];
+            }
 
             MATRIX_MEMCPY(oldEls, k2->system->elements);
             VECTOR_MEMCPY(oldPars, k2->params);
@@ -771,6 +1729,11 @@ ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, un
             k2->flags |= NEEDS_SETUP;
         }
 
+        if (am != NULL && state != STATE_STEPS) {
+            ok_mcmc_state(plFlags, parFlags, oldEls, oldPars, am_x);
+            ok_mcmc_am_step(am, am_x, am_angle, joint, al);
+        }
+
         if (i % discard == 0 && state == STATE_MAIN) {
             if (it_idx >= kl->size) {
                 break;
@@ -833,6 +1796,13 @@ ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, un
             acc_par[sub] = n_par[sub] = 0.;
         }
 
+        if ((i % progress_every == 0) && K_checkBudget(k2, INVALID_NUMBER) != BUDGET_OK) {
+            // Return the part of the chain computed so far
+            kl->size = MAX(it_idx, 1);
+            *flag = PROGRESS_BREAK;
+            break;
+        }
+
         if (progress != NULL && (i % progress_every == 0) && omp_get_thread_num() == 0) {
             int ret;
             if (state == STATE_STEPS) {
@@ -857,6 +1827,16 @@ ok_list* K_mcmc_single(ok_kernel* k2, unsigned int nsteps, unsigned int skip, un
         }
     }
 
+    if (am != NULL) {
+        if (verbose > 2 && omp_get_thread_num() == 0)
+            printf("Adaptive proposal: scale = %e, samples = %.0f\n", exp(am->loglambda), am->w);
+        if (am != am_state)
+            ok_mcmc_am_free(am);
+    }
+
+    if (surrogate != SURROGATE_NONE && verbose > 2 && omp_get_thread_num() == 0)
+        printf("Delayed acceptance: %.0f of %.0f proposals passed the surrogate\n", passed, proposed);
+
     gsl_matrix_free(oldEls);
     gsl_vector_free(oldPars);
 
@@ -17,8 +17,11 @@ extern "C" {
 #include "kl.h"
 
 #define MCMC
+#define OK_MCMC_CHECKPOINT_FILE "mcmc_checkpoint.bin"
+#define OK_MCMC_STREAM_FILE "mcmc_chain"
     ok_list* K_mcmc_single(ok_kernel* k, unsigned int nsteps, unsigned int skip, unsigned int discard, const double dparams[], ok_list* cont, ok_callback2 merit_function, int tag, int* flag);
     ok_list* K_mcmc_mult(ok_kernel** k, unsigned int nchains, unsigned int ntemps, unsigned int skip, unsigned int discard, const double params[], double Rstop, ok_callback2 merit_function);
+    ok_list* K_mcmc_resume(ok_kernel* k, const char* file, const double params[], double Rstop, ok_callback2 merit_function);
     double K_default_prior(ok_kernel* k);
     void K_mcmc_likelihood_and_prior_default(ok_kernel* k, double* ret);
 
@@ -0,0 +1,531 @@
+#include <gsl/gsl_randist.h>
+
+#ifndef JAVASCRIPT
+#include "omp.h"
+#else
+#include "omp_shim.h"
+#endif
+
+#include "math.h"
+#include "string.h"
+#include "utils.h"
+#include "kernel.h"
+#include "mcmc.h"
+#include "nested.h"
+#include "rng.h"
+
+#define IS_ANGLE(b) ((b) == MA || (b) == LOP || (b) == INC || (b) == NODE)
+#define LOGADDEXP(a, b) ((a) > (b) ? (a) + log1p(exp((b) - (a))) : (b) + log1p(exp((a) - (b))))
+
+/*
+ * Live points are kept in the unit hypercube u. Each parameter is mapped to [lo, hi],
+ * either uniformly or (for periods, masses and noise parameters with lo > 0) uniformly
+ * in the logarithm; the prior returned by the merit function is then accounted for by
+ * importance weighting, sampling L(x) * prior(x) / q(x), where q is the density of the
+ * mapping. With the default merit function, q itself is the prior, since it is the one
+ * normalized over the space that is integrated. Angles are periodic in u.
+ */
+typedef struct {
+    int n;
+    const int* type;
+    double* lo;
+    double* hi;
+    bool* logu;
+    bool* noise;
+} ok_nested_space;
+
+typedef struct {
+    double* u;
+    double li;
+    double pr;
+    // log(L * prior / q)
+    double lw;
+} ok_nested_point;
+
+static double ok_nested_x(const ok_nested_space* sp, const int j, const double u) {
+    if (sp->logu[j])
+        return sp->lo[j] * exp(u * log(sp->hi[j] / sp->lo[j]));
+    return sp->lo[j] + u * (sp->hi[j] - sp->lo[j]);
+}
+
+// log of the density q of the mapping at x
+static double ok_nested_logq(const ok_nested_space* sp, const double* x) {
+    double lq = 0.;
+    for (int j = 0; j < sp->n; j++)
+        lq -= (sp->logu[j] ? log(x[j] * log(sp->hi[j] / sp->lo[j])) : log(sp->hi[j] - sp->lo[j]));
+    return lq;
+}
+
+// Evaluates a point u with the workspace kernel k; returns false if the point is not valid
+static bool ok_nested_eval(const ok_nested_space* sp, ok_kernel* k, ok_kernel_minimizer_pars* mp,
+                           const double* u, ok_callback2 merit_function, ok_nested_point* p) {
+    const int n = sp->n;
+    double x[MAX(n, 1)];
+    for (int j = 0; j < n; j++) {
+        if (u[j] < 0. || u[j] > 1.)
+            return false;
+        x[j] = ok_nested_x(sp, j, u[j]);
+        int type = sp->type[j];
+        if ((type == PER || type == MASS) && x[j] <= 0.)
+            return false;
+        if (type == ECC && (x[j] < 0. || x[j] >= 1.))
+            return false;
+        if (sp->noise[j] && x[j] < 0.)
+            return false;
+        *(mp->pars[j]) = x[j];
+    }
+
+    double m[2];
+    k->flags |= NEEDS_SETUP;
+    (merit_function == NULL ? K_mcmc_likelihood_and_prior_default(k, m) : merit_function(k, m));
+    double lq = ok_nested_logq(sp, x);
+    if (merit_function == NULL)
+        m[1] = lq;
+    if (IS_NOT_FINITE(m[0]) || IS_NOT_FINITE(m[1]))
+        return false;
+
+    memcpy(p->u, u, sizeof (double) * n);
+    p->li = m[0];
+    p->pr = m[1];
+    p->lw = m[0] + m[1] - lq;
+    return true;
+}
+
+// Cholesky factor of the covariance of the live points (in u), with a small ridge if needed
+static void ok_nested_factor(const int n, ok_nested_point* live, const int nlive, double* L) {
+    double mean[MAX(n, 1)];
+    double C[MAX(n * n, 1)];
+    for (int i = 0; i < n; i++) {
+        mean[i] = 0.;
+        for (int p = 0; p < nlive; p++)
+            mean[i] += live[p].u[i] / nlive;
+    }
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j <= i; j++) {
+            double c = 0.;
+            for (int p = 0; p < nlive; p++)
+                c += (live[p].u[i] - mean[i]) * (live[p].u[j] - mean[j]);
+            C[i * n + j] = c / (nlive - 1.);
+        }
+
+    for (double ridge = 1e-12; ridge < 1.; ridge *= 100.) {
+        bool ok = true;
+        for (int i = 0; i < n && ok; i++)
+            for (int j = 0; j <= i; j++) {
+                double v = C[i * n + j] + (i == j ? ridge : 0.);
+                for (int l = 0; l < j; l++)
+                    v -= L[i * n + l] * L[j * n + l];
+                if (i == j) {
+                    if (!(v > 0)) {
+                        ok = false;
+                        break;
+                    }
+                    L[i * n + i] = sqrt(v);
+                } else
+                    L[i * n + j] = v / L[j * n + j];
+            }
+        if (ok)
+            return;
+    }
+
+    // Degenerate live points: axis-aligned unit steps
+    memset(L, 0, sizeof (double) * n * n);
+    for (int i = 0; i < n; i++)
+        L[i * n + i] = 1e-3;
+}
+
+/*
+ * Draws a new point with lw > lmin by slice sampling (Neal 2003) along random directions,
+ * whitened by the covariance of the live points (as in PolyChord), starting from p.
+ * Returns the number of evaluations of the merit function.
+ */
+static int ok_nested_slice(const ok_nested_space* sp, ok_kernel* k, ok_kernel_minimizer_pars* mp,
+                           gsl_rng* rng, const double* L, const int nslices, const double lmin,
+                           ok_callback2 merit_function, ok_nested_point* p) {
+    const int n = sp->n;
+    double d[MAX(n, 1)], z[MAX(n, 1)], y[MAX(n, 1)];
+    double ybuf[MAX(n, 1)];
+    ok_nested_point q = {ybuf, 0., 0., 0.};
+    int evals = 0;
+
+    for (int s = 0; s < nslices; s++) {
+        double norm = 0.;
+        for (int i = 0; i < n; i++) {
+            z[i] = gsl_ran_gaussian(rng, 1.);
+            norm += z[i] * z[i];
+        }
+        norm = sqrt(norm);
+        for (int i = 0; i < n; i++) {
+            d[i] = 0.;
+            for (int j = 0; j <= i; j++)
+                d[i] += L[i * n + j] * z[j] / norm;
+        }
+
+        // Stepping out
+        double r = gsl_rng_uniform(rng);
+        double a = -r, b = 1. - r;
+        for (int t = 0; t < 50; t++) {
+            for (int i = 0; i < n; i++)
+                y[i] = p->u[i] + a * d[i];
+            for (int i = 0; i < n; i++)
+                if (IS_ANGLE(sp->type[i]))
+                    y[i] -= floor(y[i]);
+            evals++;
+            if (!ok_nested_eval(sp, k, mp, y, merit_function, &q) || q.lw <= lmin)
+                break;
+            a -= 1.;
+        }
+        for (int t = 0; t < 50; t++) {
+            for (int i = 0; i < n; i++)
+                y[i] = p->u[i] + b * d[i];
+            for (int i = 0; i < n; i++)
+                if (IS_ANGLE(sp->type[i]))
+                    y[i] -= floor(y[i]);
+            evals++;
+            if (!ok_nested_eval(sp, k, mp, y, merit_function, &q) || q.lw <= lmin)
+                break;
+            b += 1.;
+        }
+
+        // Shrinkage
+        for (int t = 0; t < 100; t++) {
+            double c = a + gsl_rng_uniform(rng) * (b - a);
+            for (int i = 0; i < n; i++)
+                y[i] = p->u[i] + c * d[i];
+            for (int i = 0; i < n; i++)
+                if (IS_ANGLE(sp->type[i]))
+                    y[i] -= floor(y[i]);
+            evals++;
+            if (ok_nested_eval(sp, k, mp, y, merit_function, &q) && q.lw > lmin) {
+                memcpy(p->u, q.u, sizeof (double) * n);
+                p->li = q.li;
+                p->pr = q.pr;
+                p->lw = q.lw;
+                break;
+            }
+            if (c < 0.)
+                a = c;
+            else
+                b = c;
+        }
+    }
+    return evals;
+}
+
+static int ok_nested_cmp(const void* a, const void* b) {
+    double la = ((const ok_nested_point*) a)->lw;
+    double lb = ((const ok_nested_point*) b)->lw;
+    return (la < lb ? -1 : (la > lb ? 1 : 0));
+}
+
+ok_list* K_nested(ok_kernel* k, unsigned int nlive, const double params[], ok_callback2 merit_function, double* ret) {
+    int nslices = -1;
+    int batch = -1;
+    double tol = 0.01;
+    bool equal = false;
+    int verbose = 0;
+
+    int idx = 0;
+    while (params != NULL) {
+        if (params[idx] == DONE)
+            break;
+        else if (params[idx] == OPT_NESTED_SLICES)
+            nslices = (int) params[idx + 1];
+        else if (params[idx] == OPT_NESTED_BATCH)
+            batch = (int) params[idx + 1];
+        else if (params[idx] == OPT_NESTED_TOL)
+            tol = params[idx + 1];
+        else if (params[idx] == OPT_NESTED_EQUAL_WEIGHTS)
+            equal = ((int) params[idx + 1]) != 0;
+        else if (params[idx] == OPT_MCMC_VERBOSE_DIAGS)
+            verbose = (int) params[idx + 1];
+        idx += 2;
+    }
+
+    K_calculate(k);
+    ok_kernel_minimizer_pars mpars = K_getMinimizedVariables(k);
+    const int n = mpars.npars;
+    const int N = MAX((int) nlive, n + 2);
+    nslices = (nslices > 0 ? nslices : MAX(3 * n, 5));
+    batch = RANGE((batch > 0 ? batch : omp_get_max_threads()), 1, MAX(N / 4, 1));
+
+    // Ranges of the parameters; unset ones default to the ranges used by K_default_prior, while
+    // angles always span the full circle
+    double lo[MAX(n, 1)], hi[MAX(n, 1)];
+    bool logu[MAX(n, 1)], noise[MAX(n, 1)];
+    for (int j = 0; j < n; j++) {
+        int type = mpars.type[j];
+        int par = (int) (mpars.pars[j] - k->params->data);
+        noise[j] = (type < 0 && par >= P_DATA_NOISE1 && par <= P_DATA_NOISE10);
+        lo[j] = mpars.min[j];
+        hi[j] = mpars.max[j];
+
+        double dlo, dhi;
+        if (type == PER) {
+            dlo = 0.2;
+            dhi = 20000.;
+        } else if (type == MASS) {
+            dlo = 1e-5;
+            dhi = 50.;
+        } else if (type == ECC) {
+            dlo = 0.;
+            dhi = 0.99;
+        } else if (IS_ANGLE(type)) {
+            dlo = 0.;
+            dhi = 360.;
+        } else if (noise[j]) {
+            dlo = 0.;
+            dhi = 100.;
+        } else if (type < 0 && par >= P_DATA1 && par <= P_DATA10) {
+            dlo = -1000.;
+            dhi = 1000.;
+        } else {
+            double s = (mpars.steps[j] > 0 ? mpars.steps[j] : MAX(1e-3 * fabs(*(mpars.pars[j])), 1e-6));
+            dlo = *(mpars.pars[j]) - 100. * s;
+            dhi = *(mpars.pars[j]) + 100. * s;
+        }
+        if (lo[j] == -DBL_MAX)
+            lo[j] = dlo;
+        if (hi[j] == DBL_MAX)
+            hi[j] = dhi;
+        if (IS_ANGLE(type)) {
+            lo[j] = 0.;
+            hi[j] = 360.;
+        }
+        logu[j] = ((type == PER || type == MASS || noise[j]) && lo[j] > 0.);
+    }
+    ok_nested_space sp = {n, mpars.type, lo, hi, logu, noise};
+
+    // Per-thread workspaces and random number generators; streams keyed by the iteration and
+    // the index of the new point in the batch
+    const int threads = (omp_in_parallel() ? 1 : MAX(MIN(omp_get_max_threads(), batch), 1));
+    ok_kernel* k_t[threads];
+    ok_kernel_minimizer_pars mp_t[threads];
+    gsl_rng* rng_t[threads];
+    for (int i = 0; i < threads; i++) {
+        k_t[i] = K_cloneWorkspace(k);
+        k_t[i]->progress = NULL;
+        mp_t[i] = K_getMinimizedVariables(k_t[i]);
+        rng_t[i] = ok_rng_stream_alloc(0, 0);
+    }
+
+    ok_budget_start(k->budget);
+
+    double* ubuf = (double*) malloc(sizeof (double) * MAX(n, 1) * (N + batch));
+    ok_nested_point* live = (ok_nested_point*) malloc(sizeof (ok_nested_point) * N);
+    ok_nested_point* fresh = (ok_nested_point*) malloc(sizeof (ok_nested_point) * batch);
+    for (int p = 0; p < N; p++)
+        live[p].u = ubuf + (size_t) p * MAX(n, 1);
+    for (int b = 0; b < batch; b++)
+        fresh[b].u = ubuf + (size_t) (N + b) * MAX(n, 1);
+
+    // Dead points: u, li, pr, unnormalized log-weight and log(L * prior / q)
+    int ndead = 0, cdead = 4 * N;
+    double* dead_u = (double*) malloc(sizeof (double) * MAX(n, 1) * cdead);
+    double* dead = (double*) malloc(sizeof (double) * 4 * cdead);
+
+    bool stop = false;
+    ok_progress progress = k->progress;
+    long evals = 0;
+
+    // Initial live points, drawn from the prior (rejecting the invalid ones)
+    bool valid[N];
+    for (int p = 0; p < N; p++)
+        valid[p] = false;
+    for (int t = 0; t < 1000 && !stop; t++) {
+        int todo = 0;
+        for (int p = 0; p < N; p++)
+            if (!valid[p]) {
+                for (int j = 0; j < n; j++)
+                    live[p].u[j] = gsl_rng_uniform(k->rng);
+                todo++;
+            }
+        if (todo == 0)
+            break;
+
+        #pragma omp parallel for schedule(dynamic) num_threads(threads)
+        for (int p = 0; p < N; p++) {
+            if (valid[p])
+                continue;
+            int th = omp_get_thread_num();
+            double u[MAX(n, 1)];
+            memcpy(u, live[p].u, sizeof (double) * n);
+            valid[p] = ok_nested_eval(&sp, k_t[th], &mp_t[th], u, merit_function, &live[p]);
+        }
+        evals += todo;
+        stop = (K_checkBudget(k, INVALID_NUMBER) != BUDGET_OK);
+    }
+    for (int p = 0; p < N; p++)
+        if (!valid[p])
+            live[p].lw = -INFINITY;
+
+    double logZ = -INFINITY;
+    double logX = 0.;
+    double L[MAX(n * n, 1)];
+    unsigned long int seed = gsl_rng_get(k->rng);
+    int iter = 0;
+
+    while (!stop) {
+        qsort(live, N, sizeof (ok_nested_point), ok_nested_cmp);
+
+        // Stop when the evidence of the live points cannot change log(Z) by more than tol
+        double lmax = live[N - 1].lw;
+        if (iter > 0 && LOGADDEXP(logZ, lmax + logX) - logZ < tol)
+            break;
+
+        // The 'batch' worst points die: removing them one at a time, with N, N - 1, ... live points,
+        // shrinks the prior volume by exp(-1/N), exp(-1/(N-1)), ...
+        if (ndead + batch > cdead) {
+            cdead *= 2;
+            dead_u = (double*) realloc(dead_u, sizeof (double) * MAX(n, 1) * cdead);
+            dead = (double*) realloc(dead, sizeof (double) * 4 * cdead);
+        }
+        for (int b = 0; b < batch; b++) {
+            double logX1 = logX - 1. / (N - b);
+            double lwt = logX + log1p(-exp(logX1 - logX)) + live[b].lw;
+            logZ = LOGADDEXP(logZ, lwt);
+            memcpy(dead_u + (size_t) ndead * MAX(n, 1), live[b].u, sizeof (double) * n);
+            dead[4 * ndead] = live[b].li;
+            dead[4 * ndead + 1] = live[b].pr;
+            dead[4 * ndead + 2] = lwt;
+            dead[4 * ndead + 3] = live[b].lw;
+            ndead++;
+            logX = logX1;
+        }
+        const double lmin = live[batch - 1].lw;
+
+        // New points: slice sampling from random surviving live points, in parallel
+        ok_nested_factor(n, live + batch, N - batch, L);
+        for (int b = 0; b < batch; b++) {
+            int from = batch + gsl_rng_uniform_int(k->rng, N - batch);
+            memcpy(fresh[b].u, live[from].u, sizeof (double) * n);
+            fresh[b].li = live[from].li;
+            fresh[b].pr = live[from].pr;
+            fresh[b].lw = live[from].lw;
+        }
+
+        long ev = 0;
+        #pragma omp parallel for schedule(dynamic) num_threads(threads) reduction(+:ev)
+        for (int b = 0; b < batch; b++) {
+            int th = omp_get_thread_num();
+            ok_rng_stream_set(rng_t[th], seed, (unsigned long int) iter * batch + b);
+            ev += ok_nested_slice(&sp, k_t[th], &mp_t[th], rng_t[th], L, nslices, lmin, merit_function, &fresh[b]);
+        }
+        evals += ev;
+
+        for (int b = 0; b < batch; b++) {
+            memcpy(live[b].u, fresh[b].u, sizeof (double) * n);
+            live[b].li = fresh[b].li;
+            live[b].pr = fresh[b].pr;
+            live[b].lw = fresh[b].lw;
+        }
+        iter++;
+
+        if (verbose && iter % 100 == 0)
+            fprintf(stderr, "%s: iter = %d, log(Z) = %e, log(X) = %e, max log(L) = %e, evals = %ld\n", __func__,
+                    iter, logZ, logX, lmax, evals);
+
+        stop = (K_checkBudget(k, INVALID_NUMBER) != BUDGET_OK);
+        if (!stop && progress != NULL) {
+            char msg[200];
+            sprintf(msg, "%s [log(Z) = %e, log(X) = %e, evals = %ld]", __func__, logZ, logX, evals);
+            // Progress is measured by the compression of the prior, in units of the information
+            stop = (progress(MIN(iter * batch, 100 * N), 100 * N, NULL, msg) == PROGRESS_STOP);
+        }
+    }
+
+    // The remaining live points share the remaining prior volume equally
+    if (ndead + N > cdead) {
+        cdead = ndead + N;
+        dead_u = (double*) realloc(dead_u, sizeof (double) * MAX(n, 1) * cdead);
+        dead = (double*) realloc(dead, sizeof (double) * 4 * cdead);
+    }
+    for (int p = 0; p < N; p++) {
+        if (IS_NOT_FINITE(live[p].lw))
+            continue;
+        double lwt = logX - log(N) + live[p].lw;
+        logZ = LOGADDEXP(logZ, lwt);
+        memcpy(dead_u + (size_t) ndead * MAX(n, 1), live[p].u, sizeof (double) * n);
+        dead[4 * ndead] = live[p].li;
+        dead[4 * ndead + 1] = live[p].pr;
+        dead[4 * ndead + 2] = lwt;
+        dead[4 * ndead + 3] = live[p].lw;
+        ndead++;
+    }
+
+    // Information (in nats) and error of log(Z) (Skilling 2006)
+    double H = 0.;
+    for (int i = 0; i < ndead; i++) {
+        double w = exp(dead[4 * i + 2] - logZ);
+        if (w > 0)
+            H += w * (dead[4 * i + 3] - logZ);
+    }
+    H = MAX(H, 0.);
+
+    if (ret != NULL) {
+        ret[0] = logZ;
+        ret[1] = sqrt(H / N);
+        ret[2] = H;
+    }
+    if (verbose)
+        fprintf(stderr, "%s: log(Z) = %e +- %e, H = %e nats, %d samples, %ld evaluations\n", __func__,
+                logZ, sqrt(H / N), H, ndead, evals);
+
+    // Samples: all the dead points with their normalized log-weights, or an equally weighted
+    // subset drawn by systematic resampling
+    int nout = ndead;
+    int* pick = NULL;
+    if (equal) {
+        double sw = 0., sw2 = 0.;
+        for (int i = 0; i < ndead; i++) {
+            double w = exp(dead[4 * i + 2] - logZ);
+            sw += w;
+            sw2 += w * w;
+        }
+        nout = MAX((int) (sw * sw / sw2), 1);
+        pick = (int*) malloc(sizeof (int) * nout);
+        double u0 = gsl_rng_uniform(k->rng), c = 0.;
+        int i = 0;
+        for (int s = 0; s < nout; s++) {
+            double target = (s + u0) / nout * sw;
+            while (i < ndead - 1 && c + exp(dead[4 * i + 2] - logZ) < target) {
+                c += exp(dead[4 * i + 2] - logZ);
+                i++;
+            }
+            pick[s] = i;
+        }
+    }
+
+    ok_list* kl = KL_alloc(nout, K_clone(k));
+    #pragma omp parallel for num_threads(threads)
+    for (int s = 0; s < nout; s++) {
+        int th = omp_get_thread_num();
+        int i = (pick != NULL ? pick[s] : s);
+        const double* u = dead_u + (size_t) i * MAX(n, 1);
+        for (int j = 0; j < n; j++)
+            *(mp_t[th].pars[j]) = ok_nested_x(&sp, j, u[j]);
+        k_t[th]->flags |= NEEDS_SETUP;
+        double li = dead[4 * i], pr = dead[4 * i + 1];
+        ok_list_item* it = KL_set(kl, s, K_getAllElements(k_t[th]), ok_vector_copy(k_t[th]->params),
+                                  (pick != NULL ? li + pr : dead[4 * i + 2] - logZ), 0);
+        it->merit_li = li;
+        it->merit_pr = pr;
+    }
+
+    ok_budget_stop(k->budget);
+
+    for (int i = 0; i < threads; i++) {
+        FREE_MINIMIZER_PARS(mp_t[i]);
+        K_free(k_t[i]);
+        gsl_rng_free(rng_t[i]);
+    }
+    FREE_MINIMIZER_PARS(mpars);
+    free(pick);
+    free(ubuf);
+    free(live);
+    free(fresh);
+    free(dead_u);
+    free(dead);
+
+    return kl;
+}
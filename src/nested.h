@@ -0,0 +1,56 @@
+/*
+ * File:   nested.h
+ */
+
+#ifndef NESTED_H
+#define	NESTED_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "systemic.h"
+#include "kernel.h"
+#include "kl.h"
+
+    /**
+     * Computes the evidence and samples the posterior in a single run with nested sampling
+     * (Skilling 2006). A set of live points is drawn from a reference distribution spanning the
+     * ranges of the parameters (log-uniform in periods, masses and noise parameters with a
+     * positive minimum, uniform otherwise; parameters without a range use the ranges of
+     * K_default_prior, and angles always span [0, 360]); at each iteration the worst points are
+     * removed and replaced by new points with a higher likelihood, generated by slice sampling
+     * along random directions whitened by the covariance
+     * of the live points (Handley et al. 2015). The replacements of an iteration are generated in
+     * parallel, each thread working on its own copy of the kernel. The log-prior returned by the
+     * merit function is taken into account by weighting each sample by prior / reference density,
+     * so that the evidence refers to the prior of the merit function, which must be normalized over
+     * the ranges. With the default merit function, the prior is the reference distribution itself
+     * (K_default_prior is not normalized over these ranges).
+     * If the budget of k (see K_setBudget) is exhausted or the progress callback stops the run,
+     * the evidence is computed from the points found so far.
+     *
+     * @param k Kernel to be used as the starting point. Set minimization flag to MINIMIZE to decide what parameters to vary.
+     * @param nlive Number of live points; raised to at least the number of parameters + 2
+     * @param params Array of options, terminated by DONE: OPT_NESTED_SLICES (slice sampling steps
+     * per new point, default max(3 x number of parameters, 5)), OPT_NESTED_BATCH (points replaced
+     * at each iteration, default the number of threads; the results depend on it, not on the
+     * number of threads), OPT_NESTED_TOL (stop when the live points can change log(Z) by less
+     * than this, default 0.01), OPT_NESTED_EQUAL_WEIGHTS (if 1, return equally weighted samples),
+     * OPT_MCMC_VERBOSE_DIAGS.
+     * @param merit_function A function that returns the log-likelihood and log-prior of the
+     * current state (see K_mcmc_mult); set to NULL for the likelihood of the default one, with
+     * the reference distribution as the prior.
+     * @param ret If not NULL, filled with log(Z), its error and the information H (in nats)
+     * @return A list of the dead points and of the final live points, where the merit of each
+     * sample is its normalized log-weight; with OPT_NESTED_EQUAL_WEIGHTS, a list of ~ESS equally
+     * weighted samples (drawn by systematic resampling), where the merit is the log-posterior.
+     */
+    ok_list* K_nested(ok_kernel* k, unsigned int nlive, const double params[], ok_callback2 merit_function, double* ret);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* NESTED_H */
+
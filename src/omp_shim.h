@@ -1,7 +1,18 @@
+#include <sys/time.h>
+
 static inline int omp_get_thread_num() {
 	return 0;
 }
 
 static inline int omp_get_max_threads() {
 	return 1;
-}
\ No newline at end of file
+}
+static inline int omp_in_parallel() {
+	return 0;
+}
+
+static inline double omp_get_wtime() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
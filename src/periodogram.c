@@ -1,5 +1,9 @@
+// posix_memalign (aligned tables)
+#define _POSIX_C_SOURCE 200112L
+
 #include "periodogram.h"
 #include "stdint.h"
+#include "string.h"
 #include "utils.h"
 #include "math.h"
 #ifndef JAVASCRIPT
@@ -9,22 +13,19 @@
 #endif
 
 #include "kernel.h"
+#include "rng.h"
 #include "gsl/gsl_statistics.h"
 #include "gsl/gsl_math.h"
 #include "gsl/gsl_sort.h"
 #include "gsl/gsl_roots.h"
+#include "gsl/gsl_randist.h"
 
-#define BUF_SDF 0
-#define BUF_CDF 1
-#define BUF_C 2
-#define BUF_S 3
-#define BUF_SIG 4
-
-#define SDF(j) (MGET(buf, j, BUF_SDF))
-#define CDF(j) (MGET(buf, j, BUF_CDF))
-#define S(j) (MGET(buf, j, BUF_S))
-#define C(j) (MGET(buf, j, BUF_C))
-#define SIG(j) (MGET(buf, j, BUF_SIG))
+// Rows of the buffer of ok_periodogram_ls (one column per data point)
+#define BUF_SIG 0
+#define BUF_WX 1
+#define BUF_CDF 2
+#define BUF_SDF 3
+#define BUF_SIZE 4
 
 double _baluev_tau(double z_1, void* params) {
     double* p = (double*) params;
@@ -52,6 +53,349 @@ double _find_z(gsl_root_fsolver* s, gsl_function* F, double target, double x_lo,
     return 0.5 * (x_lo + x_hi);
 }
 
+/*
+ * Computes the powers z_1 whose analytical FAP (for n data points) is 10%, 1% and 0.1%
+ * (p->z_fap_1, p->z_fap_2, p->z_fap_3).
+ */
+static void ok_periodogram_z_fap(ok_periodogram_workspace* p, const double z1_max, const int n, const double W) {
+    gsl_root_fsolver * s = gsl_root_fsolver_alloc(gsl_root_fsolver_brent);
+    double pars[3];
+    pars[0] = n;
+    pars[1] = W;
+    pars[2] = 0.;
+
+    gsl_function F;
+    F.function = _baluev_tau;
+    F.params = pars;
+
+    double zz = z1_max;
+    while (_baluev_tau(zz, pars) > 1e-3)
+        zz *= 2;
+
+    p->z_fap_3 = _find_z(s, &F, 1e-3, 0.1, zz);
+    p->z_fap_2 = _find_z(s, &F, 1e-2, 0.1, p->z_fap_3);
+    p->z_fap_1 = _find_z(s, &F, 1e-1, 0.1, p->z_fap_2);
+
+
+    gsl_root_fsolver_free(s);
+    p->calc_z_fap = false;
+}
+
+// Oversampling of the frequency grid by the FFT of PS_METHOD_FAST
+#define PS_FAST_OVERSAMPLING 8
+// Number of frequencies of each block of PS_METHOD_EXACT
+#define PS_BLOCK 256
+// Maximum number of values of the table of ok_periodogram_seeds
+#define PS_SEEDS_MAX (1 << 24)
+// Alignment (in bytes) of the arrays read by the vectorized loops over the data
+#define PS_ALIGN 64
+
+/*
+ * Allocates n doubles aligned to PS_ALIGN bytes (the JS build falls back to malloc);
+ * the array is released with free.
+ */
+static double* ok_periodogram_alloc(const int n) {
+#ifndef JAVASCRIPT
+    void* ptr = NULL;
+    return (posix_memalign(&ptr, PS_ALIGN, sizeof (double) * MAX(n, 1)) == 0 ? (double*) ptr : NULL);
+#else
+    return (double*) malloc(sizeof (double) * MAX(n, 1));
+#endif
+}
+
+/*
+ * Computes the sums S_k = sum_j h_j exp(2 pi i (f0 + k df) t_j), k = 0 ... m - 1, by
+ * extirpolation (Press & Rybicki, 1989): each term h_j exp(2 pi i f0 t_j) is spread on
+ * "order" points of a regular grid of nfft points spanning one period of exp(2 pi i df t),
+ * with Lagrange weights, and the sums are read from the (inverse) FFT of the grid.
+ * re, im are workspaces of nfft elements; the sums are returned in sre, sim.
+ */
+static void ok_periodogram_sums(const double* t, const double* h, const int n, const double f0, const double df,
+                                const int m, const int order, const int nfft, double* re, double* im,
+                                double* sre, double* sim) {
+    // Denominators of the Lagrange weights, (-1)^(order-1-i) i! (order-1-i)!
+    double den[order];
+    for (int i = 0; i < order; i++) {
+        den[i] = ((order - 1 - i) % 2 == 0 ? 1. : -1.);
+        for (int l = 2; l <= i; l++)
+            den[i] *= l;
+        for (int l = 2; l <= order - 1 - i; l++)
+            den[i] *= l;
+    }
+
+    memset(re, 0, sizeof (double) * nfft);
+    memset(im, 0, sizeof (double) * nfft);
+
+    for (int j = 0; j < n; j++) {
+        double gr = h[j] * cos(2. * M_PI * f0 * t[j]);
+        double gi = h[j] * sin(2. * M_PI * f0 * t[j]);
+        double u = df * t[j];
+        double x = (u - floor(u)) * nfft;
+        int p0 = (int) floor(x) - order / 2 + 1;
+
+        double prod = 1.;
+        int exact = -1;
+        for (int l = 0; l < order; l++) {
+            if (x == p0 + l)
+                exact = l;
+            prod *= x - (p0 + l);
+        }
+
+        for (int i = 0; i < order; i++) {
+            double L = (exact >= 0 ? (i == exact ? 1. : 0.) : prod / ((x - (p0 + i)) * den[i]));
+            int q = ((p0 + i) % nfft + nfft) % nfft;
+            re[q] += L * gr;
+            im[q] += L * gi;
+        }
+    }
+
+    ok_fft(re, im, nfft, true);
+    memcpy(sre, re, sizeof (double) * m);
+    memcpy(sim, im, sizeof (double) * m);
+}
+
+/*
+ * Stores the periodogram at frequency f in row samples - i - 1 of ret: z, z_1, tau, the
+ * analytical FAP of z_1 for n data points, and the power of the window function at tau
+ * from its unweighted sums c1u, s1u (at w) and c2u, s2u (at 2 w) over the ndata points.
+ */
+static void ok_periodogram_store(gsl_matrix* ret, const int samples, const int i, const double f,
+                                 const double z, const double z_1, const double tau,
+                                 const double c1u, const double s1u, const double c2u, const double s2u,
+                                 const int ndata, const int n, const double W) {
+    double w = 2 * M_PI * f;
+    double coswtau = cos(w * tau);
+    double sinwtau = sin(w * tau);
+    double cos2wtau = cos(2. * w * tau);
+    double sin2wtau = sin(2. * w * tau);
+
+    double numa_w = c1u * coswtau + s1u * sinwtau;
+    double numb_w = s1u * coswtau - c1u * sinwtau;
+    double d_w = c2u * cos2wtau + s2u * sin2wtau;
+    double dena_w = 0.5 * (ndata + d_w);
+    double denb_w = 0.5 * (ndata - d_w);
+
+    double w_1 = 0.5 * (numa_w * numa_w / dena_w + numb_w * numb_w / denb_w);
+
+    double fap_single = pow(1. - 2. * z_1 / (double) n, 0.5 * (double) (n - 3.));
+    double tau_z = W * fap_single * sqrt(z_1);
+
+    MSET(ret, samples - i - 1, PS_TIME, 1. / f);
+    MSET(ret, samples - i - 1, PS_Z, z_1);
+    MSET(ret, samples - i - 1, PS_Z_LS, z);
+    MSET(ret, samples - i - 1, PS_FAP, MIN(fap_single + tau_z, 1.));
+    MSET(ret, samples - i - 1, PS_TAU, tau);
+    MSET(ret, samples - i - 1, PS_WIN, w_1);
+}
+
+/*
+ * Computes the periodogram at frequency f from the sums c2 = sum w cos(2 w t),
+ * s2 = sum w sin(2 w t), xc = sum w x cos(w t), xs = sum w x sin(w t) and the unweighted
+ * sums of the window function c1u, s1u (at w) and c2u, s2u (at 2 w); w0 = sum w and
+ * chi2_h = sum w x^2. The results are stored in row samples - i - 1 of ret (if ret is
+ * NULL, the window sums are ignored). Returns z_1.
+ */
+static double ok_periodogram_freq(gsl_matrix* ret, const int samples, const int i, const double f,
+                                  const double c2, const double s2, const double xc, const double xs,
+                                  const double c1u, const double s1u, const double c2u, const double s2u,
+                                  const double w0, const double chi2_h, const int ndata, const double W) {
+    double w = 2 * M_PI * f;
+    double tau = atan2(s2, c2) / (2. * w);
+
+    double coswtau = cos(w * tau);
+    double sinwtau = sin(w * tau);
+    double cos2wtau = cos(2. * w * tau);
+    double sin2wtau = sin(2. * w * tau);
+
+    // sum w x cos(w (t - tau)), sum w cos^2(w (t - tau)), etc.
+    double numa = xc * coswtau + xs * sinwtau;
+    double numb = xs * coswtau - xc * sinwtau;
+    double d = c2 * cos2wtau + s2 * sin2wtau;
+    double dena = 0.5 * (w0 + d);
+    double denb = 0.5 * (w0 - d);
+
+    double z = 0.5 * (numa * numa / dena + numb * numb / denb);
+    double z_1 = z * ndata / chi2_h;
+    if (ret != NULL)
+        ok_periodogram_store(ret, samples, i, f, z, z_1, tau, c1u, s1u, c2u, s2u, ndata, ndata, W);
+    return z_1;
+}
+
+/*
+ * Returns cos(w t), sin(w t) at the first frequency of each block of PS_METHOD_EXACT
+ * (2 * ndata values per block), or NULL if the table would not fit in PS_SEEDS_MAX values.
+ */
+static double* ok_periodogram_seeds(const double* t, const int ndata, const double fmin, const double df,
+                                    const int samples) {
+    const int nblocks = (samples + PS_BLOCK - 1) / PS_BLOCK;
+    if ((double) nblocks * 2. * ndata > PS_SEEDS_MAX)
+        return NULL;
+
+    double* seeds = (double*) malloc(sizeof (double) * 2 * nblocks * ndata);
+    #pragma omp parallel for
+    for (int b = 0; b < nblocks; b++) {
+        const double w = 2 * M_PI * (fmin + df * b * PS_BLOCK);
+        for (int j = 0; j < ndata; j++) {
+            seeds[2 * b * ndata + j] = cos(w * t[j]);
+            seeds[(2 * b + 1) * ndata + j] = sin(w * t[j]);
+        }
+    }
+    return seeds;
+}
+
+/*
+ * PS_METHOD_EXACT: the frequencies are split into blocks of PS_BLOCK, computed in
+ * parallel. Each block seeds cos(w t), sin(w t) directly at its first frequency (from
+ * the table "seeds" if not NULL, see ok_periodogram_seeds), then advances them by the
+ * rotation of angle 2 pi df t (cdf, sdf); all the sums of a frequency are accumulated
+ * in a single vectorizable pass over the data. sig holds the weights, wx the weighted data.
+ */
+static double ok_periodogram_exact(const double* t, const double* sig, const double* wx, const double* cdf,
+                                   const double* sdf, const double* seeds, const int ndata,
+                                   const double fmin, const double df, const int samples,
+                                   const double w0, const double chi2_h, const double W, gsl_matrix* ret) {
+    const int nblocks = (samples + PS_BLOCK - 1) / PS_BLOCK;
+
+    double z1_max = 0.;
+    #pragma omp parallel reduction(max:z1_max)
+    {
+        double* c = ok_periodogram_alloc(ndata);
+        double* s = ok_periodogram_alloc(ndata);
+
+        #pragma omp for schedule(dynamic)
+        for (int b = 0; b < nblocks; b++) {
+            const int start = b * PS_BLOCK;
+            const int end = MIN(start + PS_BLOCK, samples);
+            if (seeds != NULL) {
+                memcpy(c, seeds + 2 * b * ndata, sizeof (double) * ndata);
+                memcpy(s, seeds + (2 * b + 1) * ndata, sizeof (double) * ndata);
+            } else {
+                const double w = 2 * M_PI * (fmin + df * start);
+                for (int j = 0; j < ndata; j++) {
+                    c[j] = cos(w * t[j]);
+                    s[j] = sin(w * t[j]);
+                }
+            }
+
+            for (int i = start; i < end; i++) {
+                double c2 = 0., s2 = 0., xc = 0., xs = 0.;
+                double c1u = 0., s1u = 0., c2u = 0., s2u = 0.;
+
+                #pragma omp simd reduction(+:c2, s2, xc, xs, c1u, s1u, c2u, s2u) aligned(c, s : PS_ALIGN)
+                for (int j = 0; j < ndata; j++) {
+                    const double cos_wt = c[j];
+                    const double sin_wt = s[j];
+                    const double cos_2wt = cos_wt * cos_wt - sin_wt * sin_wt;
+                    const double sin_2wt = 2. * sin_wt * cos_wt;
+
+                    c2 += sig[j] * cos_2wt;
+                    s2 += sig[j] * sin_2wt;
+                    xc += wx[j] * cos_wt;
+                    xs += wx[j] * sin_wt;
+                    c1u += cos_wt;
+                    s1u += sin_wt;
+                    c2u += cos_2wt;
+                    s2u += sin_2wt;
+
+                    c[j] = cos_wt * cdf[j] - sin_wt * sdf[j];
+                    s[j] = sin_wt * cdf[j] + cos_wt * sdf[j];
+                }
+
+                double z_1 = ok_periodogram_freq(ret, samples, i, fmin + df * i, c2, s2, xc, xs,
+                                                 c1u, s1u, c2u, s2u, w0, chi2_h, ndata, W);
+                z1_max = MAX(z1_max, z_1);
+            }
+        }
+
+        free(c);
+        free(s);
+    }
+    return z1_max;
+}
+
+/*
+ * Chooses the order of the extirpolation of PS_METHOD_FAST, the lowest one whose error
+ * (relative to the sum of the weights) is estimated below tol, and the size of the FFT.
+ */
+static void ok_periodogram_fast_grid(const double tol, const int samples, int* order, int* nfft) {
+    double err = 4e-5;
+    *order = 4;
+    while (*order < 16 && err > tol) {
+        *order += 2;
+        err /= 20.;
+    }
+    *nfft = 1;
+    while (*nfft < PS_FAST_OVERSAMPLING * samples)
+        *nfft *= 2;
+}
+
+/*
+ * Computes the unweighted sums of the window function of PS_METHOD_FAST, which only
+ * depend on the times: window holds c1u, s1u (at w) and c2u, s2u (at 2 w), samples
+ * values each.
+ */
+static void ok_periodogram_window(const double* t, const int ndata, const double fmin, const double df,
+                                  const int samples, const int order, const int nfft, double* window) {
+    double* h = (double*) malloc(sizeof (double) * ndata);
+    double* re = (double*) malloc(sizeof (double) * nfft);
+    double* im = (double*) malloc(sizeof (double) * nfft);
+    for (int j = 0; j < ndata; j++)
+        h[j] = 1.;
+
+    ok_periodogram_sums(t, h, ndata, fmin, df, samples, order, nfft, re, im, window, window + samples);
+    ok_periodogram_sums(t, h, ndata, 2. * fmin, 2. * df, samples, order, nfft, re, im,
+                        window + 2 * samples, window + 3 * samples);
+    free(h);
+    free(re);
+    free(im);
+}
+
+/*
+ * PS_METHOD_FAST: computes the sums of the periodogram at all frequencies with
+ * ok_periodogram_sums, in O(N log N) time (see ok_periodogram_fast_grid for order and
+ * nfft). The sums of the window function are taken from "window" if not NULL (see
+ * ok_periodogram_window); they are not needed if ret is NULL.
+ */
+static double ok_periodogram_fast(const double* t, const double* xa, const double* sig, const int ndata,
+                                  const double fmin, const double df, const int samples, const int order,
+                                  const int nfft, const double* window, const double w0, const double chi2_h,
+                                  const double W, gsl_matrix* ret) {
+    double* h = (double*) calloc(ndata, sizeof (double));
+    double* re = (double*) malloc(sizeof (double) * nfft);
+    double* im = (double*) malloc(sizeof (double) * nfft);
+    // Sums at w and 2w of the data, and of the window (if not given)
+    double* sums = (double*) malloc(sizeof (double) * (window == NULL && ret != NULL ? 8 : 4) * samples);
+    double* c2 = sums, * s2 = sums + samples;
+    double* xc = sums + 2 * samples, * xs = sums + 3 * samples;
+
+    ok_periodogram_sums(t, sig, ndata, 2. * fmin, 2. * df, samples, order, nfft, re, im, c2, s2);
+    for (int j = 0; j < ndata; j++)
+        h[j] = xa[j] * sig[j];
+    ok_periodogram_sums(t, h, ndata, fmin, df, samples, order, nfft, re, im, xc, xs);
+    if (window == NULL && ret != NULL) {
+        ok_periodogram_window(t, ndata, fmin, df, samples, order, nfft, sums + 4 * samples);
+        window = sums + 4 * samples;
+    }
+
+    // Without ret the window sums are not used (any values will do)
+    const double* win = (window != NULL ? window : sums);
+
+    double z1_max = 0.;
+    #pragma omp parallel for reduction(max:z1_max)
+    for (int i = 0; i < samples; i++) {
+        double z_1 = ok_periodogram_freq(ret, samples, i, fmin + df * i, c2[i], s2[i], xc[i], xs[i],
+                                         win[i], win[samples + i], win[2 * samples + i], win[3 * samples + i],
+                                         w0, chi2_h, ndata, W);
+        z1_max = MAX(z1_max, z_1);
+    }
+
+    free(h);
+    free(re);
+    free(im);
+    free(sums);
+    return z1_max;
+}
+
 /**
  * Computes the Lomb-Scargle periodogram of the matrix "data". "data" should contain at least three
  * columns: time, measurement and measurement error. The periodogram is calculated in "samples" intervals
@@ -68,13 +412,16 @@ double _find_z(gsl_root_fsolver* s, gsl_function* F, double target, double x_lo,
  * @param samples Number of frequencies sampled
  * @param Pmin Minimum period sampled
  * @param Pmax Maximum period sampled
- * @param method Method to compute periodogram (ignored)
+ * @param method Method to compute periodogram: PS_METHOD_EXACT (direct sums over the data, with blocks of
+ * frequencies computed in parallel), or PS_METHOD_FAST to compute the
+ * trigonometric sums at all frequencies at once by extirpolation and FFT (Press & Rybicki, 1989), in
+ * O(N log N) time, to within the tolerance p->tol (PS_FAST_TOL if p is NULL)
  * @param timecol Time column (e.g. 0) in the matrix data
  * @param valcol Value column (e.g. 1) in the matrix data
  * @param sigmacol Sigma column (e.g. 2) in the matrix data
  * @param p If not NULL, it is used to return additional info for the periodogram and reuse matrices to save space/speed. If you pass
- * a value different than NULL, you are responsible for deallocating the workspace and its fields. p->buf is an array of
- * gsl_matrix*, sized the same as the value of omp_get_max_threads().
+ * a value different than NULL, you are responsible for deallocating the workspace and its fields. p->buf holds the
+ * weights and the trigonometric tables of the data (one column per data point).
  * @return A matrix containing: {PS_TIME, PS_Z, PS_FAP, PS_Z_LS} (period, power, FAP upper limit, unnormalized
  * LS power). You are responsible for deallocating it.
  */
@@ -92,12 +439,12 @@ gsl_matrix* ok_periodogram_ls(const gsl_matrix* data, const unsigned int samples
     if (p != NULL) {
         if (p->per != NULL && MROWS(p->per) == samples && MCOLS(p->per) == PS_SIZE)
             ret = p->per;
-        if (p->buf != NULL && MROWS(p->buf) == ndata && MCOLS(p->per) == 5)
-            ret = p->buf;
+        if (p->buf != NULL && MROWS(p->buf) == BUF_SIZE && MCOLS(p->buf) == ndata)
+            buf = p->buf;
     }
 
     ret = (ret != NULL ? ret : gsl_matrix_alloc(samples, PS_SIZE));
-    buf = (buf != NULL ? buf : gsl_matrix_alloc(ndata, 5));
+    buf = (buf != NULL ? buf : gsl_matrix_alloc(BUF_SIZE, ndata));
 
     double fmin = 1. / Pmax;
     double fmax = 1. / Pmin;
@@ -109,137 +456,267 @@ gsl_matrix* ok_periodogram_ls(const gsl_matrix* data, const unsigned int samples
     gsl_matrix_get_col(bufv, data, valcol);
     double avg = gsl_stats_mean(bufv->data, 1, ndata);
     double z1_max = 0.;
-    double xa[ndata];
+    double* t = (double*) malloc(sizeof (double) * ndata);
+    double* xa = (double*) malloc(sizeof (double) * ndata);
+    double* sig = buf->data + BUF_SIG * buf->tda;
 
-    // pre-calculate cdf, sdf
+    double w0 = 0., chi2_h = 0.;
     for (int i = 0; i < ndata; i++) {
-        double t = MGET(data, i, timecol) - MGET(data, 0, timecol);
-        MSET(buf, i, BUF_CDF, cos(2 * M_PI * df * t));
-        MSET(buf, i, BUF_SDF, sin(2 * M_PI * df * t));
-        MSET(buf, i, BUF_C, cos(2 * M_PI * fmin * t));
-        MSET(buf, i, BUF_S, sin(2 * M_PI * fmin * t));
-        MSET(buf, i, BUF_SIG, 1. / (MGET(data, i, sigcol) * MGET(data, i, sigcol)));
+        t[i] = MGET(data, i, timecol) - MGET(data, 0, timecol);
+        sig[i] = 1. / (MGET(data, i, sigcol) * MGET(data, i, sigcol));
         xa[i] = MGET(data, i, valcol) - avg;
+        w0 += sig[i];
+        chi2_h += xa[i] * xa[i] * sig[i];
     }
 
-    // Calculate periodogram by looping over all angular frequencies
-    for (int i = 0; i < samples; i++) {
-        // Current frequency
-        double f = fmin + df * i;
-
-
-        double w = 2 * M_PI*f;
-
-        // Calculate tau(w)
-        double s_2wt = 0.;
-        double c_2wt = 0.;
-
-        for (int j = 0; j < ndata; j++) {
-            double cos_wt = C(j);
-            double sin_wt = S(j);
-            c_2wt += (1. - 2. * sin_wt * sin_wt) * SIG(j);
-            s_2wt += (2. * sin_wt * cos_wt) * SIG(j);
+    if (method == PS_METHOD_FAST) {
+        int order, nfft;
+        ok_periodogram_fast_grid((p != NULL && p->tol > 0 ? p->tol : PS_FAST_TOL), samples, &order, &nfft);
+        z1_max = ok_periodogram_fast(t, xa, sig, ndata, fmin, df, samples, order, nfft, NULL, w0, chi2_h, W, ret);
+    } else {
+        // pre-calculate cdf, sdf
+        for (int i = 0; i < ndata; i++) {
+            MSET(buf, BUF_WX, i, xa[i] * sig[i]);
+            MSET(buf, BUF_CDF, i, cos(2 * M_PI * df * t[i]));
+            MSET(buf, BUF_SDF, i, sin(2 * M_PI * df * t[i]));
         }
+        z1_max = ok_periodogram_exact(t, sig, buf->data + BUF_WX * buf->tda, buf->data + BUF_CDF * buf->tda,
+                                      buf->data + BUF_SDF * buf->tda, NULL, ndata, fmin, df, samples, w0, chi2_h, W, ret);
+    }
 
-        double tau = atan2(s_2wt, c_2wt) / (2. * w);
-        double numa = 0.;
-        double numb = 0.;
-        double dena = 0.;
-        double denb = 0.;
-        double numa_w = 0.;
-        double numb_w = 0.;
-        double dena_w = 0.;
-        double denb_w = 0.;
-
-        double coswtau = cos(w * tau);
-        double sinwtau = sin(w * tau);
-        double chi2_h = 0.;
-        double chi2_h_w = 0;
+    if (p != NULL && p->calc_z_fap)
+        ok_periodogram_z_fap(p, z1_max, ndata, W);
 
-        for (int j = 0; j < ndata; j++) {
-
-            double sig = SIG(j);
+    if (p == NULL) {
+        gsl_matrix_free(buf);
+    } else {
+        p->per = ret;
+        p->buf = buf;
+        p->zmax = z1_max;
+    };
 
-            const double cos_wt = C(j);
-            const double sin_wt = S(j);
+    gsl_vector_free(bufv);
+    free(t);
+    free(xa);
 
-            double cos_wdf = CDF(j);
-            double sin_wdf = SDF(j);
+    return ret;
+}
 
-            double c = cos_wt * coswtau + sin_wt * sinwtau;
-            double s = sin_wt * coswtau - cos_wt * sinwtau;
-            double x = xa[j];
+/**
+ * Computes the generalized Lomb-Scargle periodogram (Zechmeister & Kurster, 2009) of the matrix "data",
+ * extended to several datasets: at each frequency, a sinusoid is fitted together with one free offset
+ * per dataset (and optionally a linear trend) by weighted linear least squares. The offsets and the trend
+ * are solved analytically from sums over each dataset, computed once; the sums that depend on the frequency
+ * are computed as in the PS_METHOD_EXACT method of ok_periodogram_ls.
+ * 
+ * The columns of the returned matrix are as in ok_periodogram_ls: PS_Z_LS contains 
+ * z = 1/2 * (Chi^2_0 - Chi^2_SC), where Chi^2_0 is the chi^2 of the fit of the offsets (and trend) alone, 
+ * and PS_Z contains z_1 = 1/2 * N_H * z / Chi^2_0, with N_H the number of data points minus the number of 
+ * offsets (and trend), plus one (so that a single dataset is normalized as in ok_periodogram_ls). The FAP 
+ * and the window function are estimated as in ok_periodogram_ls.
+ * 
+ * @param data Input data containing the data; each row containing (t_i, x_i, sigma_i, ...)
+ * @param samples Number of frequencies sampled
+ * @param Pmin Minimum period sampled
+ * @param Pmax Maximum period sampled
+ * @param trend Whether a linear trend is fitted together with the offsets
+ * @param timecol Time column (e.g. 0) in the matrix data
+ * @param valcol Value column (e.g. 1) in the matrix data
+ * @param sigmacol Sigma column (e.g. 2) in the matrix data
+ * @param setcol Column of the dataset of each point (e.g. T_SET), or -1 to fit a single offset (floating mean)
+ * @param p If not NULL, it is used to return additional info for the periodogram (see ok_periodogram_ls)
+ * @return A matrix containing: {PS_TIME, PS_Z, PS_FAP, PS_Z_LS} (period, power, FAP upper limit, unnormalized
+ * power). You are responsible for deallocating it.
+ */
+gsl_matrix* ok_periodogram_gls(const gsl_matrix* data, const unsigned int samples, const double Pmin, const double Pmax,
+                               const bool trend, unsigned int timecol, unsigned int valcol, unsigned int sigcol,
+                               int setcol, ok_periodogram_workspace* p) {
+    const int ndata = data->size1;
+    gsl_matrix* ret = NULL;
+    if (p != NULL && p->per != NULL && MROWS(p->per) == samples && MCOLS(p->per) == PS_SIZE)
+        ret = p->per;
+    ret = (ret != NULL ? ret : gsl_matrix_alloc(samples, PS_SIZE));
 
-            MSET(buf, j, BUF_C, cos_wt * cos_wdf - sin_wt * sin_wdf);
-            MSET(buf, j, BUF_S, sin_wt * cos_wdf + cos_wt * sin_wdf);
+    // Datasets, numbered in order of appearance
+    int* set = (int*) malloc(sizeof (int) * ndata);
+    double* ids = (double*) malloc(sizeof (double) * ndata);
+    int nsets = 0;
+    for (int i = 0; i < ndata; i++) {
+        double id = (setcol >= 0 ? MGET(data, i, setcol) : 0.);
+        set[i] = 0;
+        while (set[i] < nsets && ids[set[i]] != id)
+            set[i]++;
+        if (set[i] == nsets)
+            ids[nsets++] = id;
+    }
 
-            numa += x * c * sig;
-            numb += x * s * sig;
-            dena += c * c * sig;
-            denb += s * s * sig;
-            chi2_h += x * x * sig;
+    // The points are grouped by dataset: set s spans [start[s], start[s + 1])
+    int start[nsets + 1];
+    int next[nsets];
+    memset(start, 0, sizeof (int) * (nsets + 1));
+    for (int i = 0; i < ndata; i++)
+        start[set[i] + 1]++;
+    for (int s = 0; s < nsets; s++) {
+        start[s + 1] += start[s];
+        next[s] = start[s];
+    }
 
-            numa_w += c;
-            numb_w += s;
-            dena_w += c*c;
-            denb_w += s*s;
+    double* t = (double*) malloc(sizeof (double) * ndata);
+    double* y = (double*) malloc(sizeof (double) * ndata);
+    double* w = ok_periodogram_alloc(ndata);
+    double* tr = (double*) malloc(sizeof (double) * ndata);
+    for (int i = 0; i < ndata; i++) {
+        int k = next[set[i]]++;
+        t[k] = MGET(data, i, timecol) - MGET(data, 0, timecol);
+        y[k] = MGET(data, i, valcol);
+        w[k] = 1. / (MGET(data, i, sigcol) * MGET(data, i, sigcol));
+    }
 
-            chi2_h_w += 1;
+    // Fit of the offsets (weighted means of each dataset) and of the trend. The trend is
+    // orthogonalized against the offsets (tr = t minus the weighted mean time of the dataset),
+    // so that the normal matrix of offsets and trend is diagonal (ws, t2).
+    double ws[nsets];
+    double t2 = 0., ty = 0., w0 = 0.;
+    for (int s = 0; s < nsets; s++) {
+        double sw = 0., swt = 0., swy = 0.;
+        for (int k = start[s]; k < start[s + 1]; k++) {
+            sw += w[k];
+            swt += w[k] * t[k];
+            swy += w[k] * y[k];
         }
+        ws[s] = sw;
+        w0 += sw;
+        for (int k = start[s]; k < start[s + 1]; k++) {
+            tr[k] = (trend ? t[k] - swt / sw : 0.);
+            y[k] -= swy / sw;
+            t2 += w[k] * tr[k] * tr[k];
+            ty += w[k] * tr[k] * y[k];
+        }
+    }
+    const bool fit_trend = (trend && t2 > 0.);
 
+    // Residuals of the fit (y), and weighted residuals and trend
+    double chi2_0 = 0.;
+    double* wy = ok_periodogram_alloc(ndata);
+    double* wtr = ok_periodogram_alloc(ndata);
+    double* cdf = ok_periodogram_alloc(ndata);
+    double* sdf = ok_periodogram_alloc(ndata);
 
-        double z = 0.5 * (numa * numa / dena + numb * numb / denb);
-        double z_1 = z * ndata / chi2_h;
-
-        double w_1 = 0.5 * (numa_w * numa_w / dena_w + numb_w * numb_w / denb_w) * ndata / chi2_h_w;
-
-        double fap_single = pow(1. - 2. * z_1 / (double) ndata, 0.5 * (double) (ndata - 3.));
-        double tau_z = W * fap_single * sqrt(z_1);
-
-        MSET(ret, samples - i - 1, PS_TIME, 1. / f);
-        MSET(ret, samples - i - 1, PS_Z, z_1);
-        MSET(ret, samples - i - 1, PS_Z_LS, z);
-        MSET(ret, samples - i - 1, PS_FAP, MIN(fap_single + tau_z, 1.));
-        MSET(ret, samples - i - 1, PS_TAU, tau);
-        MSET(ret, samples - i - 1, PS_WIN, w_1);
+    double fmin = 1. / Pmax;
+    double fmax = 1. / Pmin;
+    double df = (fmax - fmin) / (double) samples;
 
-        z1_max = MAX(z1_max, z_1);
+    for (int k = 0; k < ndata; k++) {
+        if (fit_trend)
+            y[k] -= ty / t2 * tr[k];
+        chi2_0 += w[k] * y[k] * y[k];
+        wy[k] = w[k] * y[k];
+        wtr[k] = (fit_trend ? w[k] * tr[k] : 0.);
+        cdf[k] = cos(2 * M_PI * df * t[k]);
+        sdf[k] = sin(2 * M_PI * df * t[k]);
     }
 
-    if (p != NULL && p->calc_z_fap) {
-        gsl_root_fsolver * s = gsl_root_fsolver_alloc(gsl_root_fsolver_brent);
-        double pars[3];
-        pars[0] = ndata;
-        pars[1] = W;
-        pars[2] = 0.;
+    // Number of data points of the equivalent ok_periodogram_ls (which fits one offset)
+    const int n = ndata - nsets - (fit_trend ? 1 : 0) + 1;
+    double W = 2. * M_PI * gsl_stats_sd(t, 1, ndata) / Pmin;
+    const int nblocks = (samples + PS_BLOCK - 1) / PS_BLOCK;
 
-        gsl_function F;
-        F.function = _baluev_tau;
-        F.params = pars;
+    double z1_max = 0.;
+    #pragma omp parallel reduction(max:z1_max)
+    {
+        double* c = ok_periodogram_alloc(ndata);
+        double* s = ok_periodogram_alloc(ndata);
+
+        #pragma omp for schedule(dynamic)
+        for (int b = 0; b < nblocks; b++) {
+            const int first = b * PS_BLOCK;
+            const int end = MIN(first + PS_BLOCK, samples);
+            const double w_first = 2 * M_PI * (fmin + df * first);
+            for (int k = 0; k < ndata; k++) {
+                c[k] = cos(w_first * t[k]);
+                s[k] = sin(w_first * t[k]);
+            }
 
-        double zz = z1_max;
-        while (_baluev_tau(zz, pars) > 1e-3)
-            zz *= 2;
+            for (int i = first; i < end; i++) {
+                double c2 = 0., s2 = 0., yc = 0., ys = 0., tc = 0., ts = 0.;
+                double c1u = 0., s1u = 0., c2u = 0., s2u = 0.;
+                // Normal matrix of the sinusoid, with offsets and trend projected out
+                double mcc = 0., mss = 0., mcs = 0.;
+
+                for (int ds = 0; ds < nsets; ds++) {
+                    double wc = 0., wsn = 0.;
+
+                    #pragma omp simd reduction(+:c2, s2, yc, ys, tc, ts, c1u, s1u, c2u, s2u, wc, wsn)
+                    for (int k = start[ds]; k < start[ds + 1]; k++) {
+                        const double cos_wt = c[k];
+                        const double sin_wt = s[k];
+                        const double cos_2wt = cos_wt * cos_wt - sin_wt * sin_wt;
+                        const double sin_2wt = 2. * sin_wt * cos_wt;
+
+                        c2 += w[k] * cos_2wt;
+                        s2 += w[k] * sin_2wt;
+                        wc += w[k] * cos_wt;
+                        wsn += w[k] * sin_wt;
+                        yc += wy[k] * cos_wt;
+                        ys += wy[k] * sin_wt;
+                        tc += wtr[k] * cos_wt;
+                        ts += wtr[k] * sin_wt;
+                        c1u += cos_wt;
+                        s1u += sin_wt;
+                        c2u += cos_2wt;
+                        s2u += sin_2wt;
+
+                        c[k] = cos_wt * cdf[k] - sin_wt * sdf[k];
+                        s[k] = sin_wt * cdf[k] + cos_wt * sdf[k];
+                    }
+
+                    mcc -= wc * wc / ws[ds];
+                    mss -= wsn * wsn / ws[ds];
+                    mcs -= wc * wsn / ws[ds];
+                }
 
-        p->z_fap_3 = _find_z(s, &F, 1e-3, 0.1, zz);
-        p->z_fap_2 = _find_z(s, &F, 1e-2, 0.1, p->z_fap_3);
-        p->z_fap_1 = _find_z(s, &F, 1e-1, 0.1, p->z_fap_2);
+                mcc += 0.5 * (w0 + c2);
+                mss += 0.5 * (w0 - c2);
+                mcs += 0.5 * s2;
+                if (fit_trend) {
+                    mcc -= tc * tc / t2;
+                    mss -= ts * ts / t2;
+                    mcs -= tc * ts / t2;
+                }
 
+                // Reduction of chi^2 by the sinusoid
+                double det = mcc * mss - mcs * mcs;
+                double z = (det > 0. ? 0.5 * (mss * yc * yc - 2. * mcs * yc * ys + mcc * ys * ys) / det : 0.);
+                double z_1 = z * n / chi2_0;
 
-        gsl_root_fsolver_free(s);
-        p->calc_z_fap = false;
+                double f = fmin + df * i;
+                double tau = atan2(s2, c2) / (4. * M_PI * f);
+                ok_periodogram_store(ret, samples, i, f, z, z_1, tau, c1u, s1u, c2u, s2u, ndata, n, W);
+                z1_max = MAX(z1_max, z_1);
+            }
+        }
+
+        free(c);
+        free(s);
     }
 
-    if (p == NULL) {
-        gsl_matrix_free(buf);
-    } else {
+    if (p != NULL && p->calc_z_fap)
+        ok_periodogram_z_fap(p, z1_max, n, W);
+    if (p != NULL) {
         p->per = ret;
-        p->buf = buf;
         p->zmax = z1_max;
-    };
-
-    gsl_vector_free(bufv);
+    }
 
+    free(set);
+    free(ids);
+    free(t);
+    free(y);
+    free(w);
+    free(tr);
+    free(wy);
+    free(wtr);
+    free(cdf);
+    free(sdf);
     return ret;
 }
 
@@ -248,7 +725,8 @@ double _kminimize(ok_kernel* k, int algo) {
 
     double chi2 = K_getChi2_nr(k);
     while (true) {
-        K_minimize(k, algo, 10000, NULL);
+        if (K_minimize(k, algo, 10000, NULL) == PROGRESS_STOP)
+            break;
 
         if (K_getChi2_nr(k) - chi2 < -0.01)
             chi2 = K_getChi2_nr(k);
@@ -259,11 +737,17 @@ double _kminimize(ok_kernel* k, int algo) {
     return K_getChi2_nr(k);
 }
 
+/**
+ * Computes a periodogram by fitting a new planet at each period with a full minimization of the kernel
+ * (with all its offsets and parameters), starting from the amplitude of the LS periodogram. This is slow; if
+ * only the offsets of the datasets (and a trend) need to be fitted at each period, use ok_periodogram_gls.
+ */
 gsl_matrix* ok_periodogram_full(ok_kernel* k, int type, int algo, bool circular, unsigned int sample,
                                 const unsigned int samples, const double Pmin, const double Pmax) {
 
-    k = K_clone(k);
+    k = K_cloneFlags(k, SHARE_BUDGET);
     K_calculate(k);
+    ok_budget_start(k->budget);
 
     // Input data for LS periodogram
     gsl_matrix* data = ok_buf_to_matrix(K_compileData(k), K_getNdata(k), DATA_SIZE);
@@ -300,10 +784,16 @@ gsl_matrix* ok_periodogram_full(ok_kernel* k, int type, int algo, bool circular,
 
     #pragma omp parallel for
     for (int r = 0; r < samples; r++) {
+        // Periods that could not be sampled within the budget
+        if (K_checkBudget(k, INVALID_NUMBER) != BUDGET_OK) {
+            MSET(ret, r, PS_Z, INVALID_NUMBER);
+            continue;
+        }
+
         double P = MGET(ret, r, PS_TIME);
         double K = sqrt(MGET(ret, r, PS_Z));
 
-        ok_kernel* k2 = K_clone(k);
+        ok_kernel* k2 = K_cloneFlags(k, SHARE_BUDGET);
         K_calculate(k2);
 
         double args[] = {PER, P, DONE};
@@ -322,75 +812,188 @@ gsl_matrix* ok_periodogram_full(ok_kernel* k, int type, int algo, bool circular,
         double z = nd * (Chi2_H - Chi2_K) / Chi2_H;
         MSET(ret, r, PS_Z, z);
         fflush(stdout);
+        K_free(k2);
     }
 
+    ok_budget_stop(k->budget);
+    gsl_matrix_free(data);
+    K_free(k);
     return ret;
 
 }
 
+/*
+ * Fits a generalized extreme-value distribution to the n sorted values of z by
+ * probability-weighted moments (Hosking, Wallis & Wood, 1985). gev receives location,
+ * scale and shape (xi > 0 for heavy tails, xi < 0 for bounded ones); returns false if the
+ * fit failed.
+ */
+static bool ok_gev_fit(const double* z, const int n, double* gev) {
+    if (n < 3)
+        return false;
+    double b0 = 0., b1 = 0., b2 = 0.;
+    for (int j = 0; j < n; j++) {
+        b0 += z[j];
+        b1 += z[j] * j / (double) (n - 1);
+        b2 += z[j] * j * (j - 1) / ((double) (n - 1) * (n - 2));
+    }
+    b0 /= n;
+    b1 /= n;
+    b2 /= n;
+
+    double c = (2. * b1 - b0) / (3. * b2 - b0) - M_LN2 / log(3.);
+    double k = 7.8590 * c + 2.9554 * c * c;
+    double scale, loc;
+    if (fabs(k) < 1e-6) {
+        // Gumbel limit
+        scale = (2. * b1 - b0) / M_LN2;
+        loc = b0 - M_EULER * scale;
+    } else {
+        double g = tgamma(1. + k);
+        scale = (2. * b1 - b0) * k / (g * (1. - pow(2., -k)));
+        loc = b0 + scale * (g - 1.) / k;
+    }
+    gev[0] = loc;
+    gev[1] = scale;
+    gev[2] = -k;
+    return isfinite(loc) && isfinite(scale) && scale > 0.;
+}
+
+/*
+ * Probability that the maximum exceeds z under the distribution fitted by ok_gev_fit.
+ */
+static double ok_gev_fap(const double z, const double* gev) {
+    double x = (z - gev[0]) / gev[1];
+    if (fabs(gev[2]) < 1e-6)
+        return -expm1(-exp(-x));
+    double y = 1. + gev[2] * x;
+    if (y <= 0.)
+        return (gev[2] > 0. ? 1. : 0.);
+    return -expm1(-pow(y, -1. / gev[2]));
+}
+
 /**
  * Estimates the FAP by Monte Carlo bootstrapping of the original data. "trials" bootstrapped data sets are
- * generated using the random number generator "rng"; for each data set, the routine ok_periodogram_ls estimates
- * z_max, which is collected into an array and returned into "zmax". Bootstrapped datasets are built by selecting
- * with replacement from the input dataset, keeping times of observation fixed. 
+ * generated from independent random number streams keyed by "seed" and the index of the trial; for
+ * each data set, z_max is computed as
+ * in ok_periodogram_ls, collected into an array and returned into "zmax". Bootstrapped datasets are built by
+ * permuting the values (and their uncertainties) of the input dataset, keeping times of observation fixed.
+ * The tables that only depend on the times are computed once and shared by all the trials, which run in parallel.
  * @param data Input matrix containing the data; each row containing (t_i, x_i, sigma_i)
  * @param trials Number of bootstrap trials
  * @param samples Number of frequencies sampled
  * @param Pmin Minimum period sampled
  * @param Pmax Maximum period sampled
- * @param method Method used to compute periodogram (ignored)
+ * @param method Method used to compute the periodograms (see ok_periodogram_ls); the tolerance of
+ * PS_METHOD_FAST is taken from p->tol, if p is not NULL
+ * @param fap Estimator of the FAP from the maxima of the trials: PS_FAP_EMPIRICAL (fraction of the
+ * trials exceeding the power), or PS_FAP_GEV (tail of a generalized extreme-value distribution fitted
+ * to the maxima, which extends below 1/trials; falls back to PS_FAP_EMPIRICAL if the fit fails)
  * @param timecol Time column (e.g. 0) in the matrix data
  * @param valcol Value column (e.g. 1) in the matrix data
  * @param sigmacol Sigma column (e.g. 2) in the matrix data
- * @param rng A pre-allocated random number generator
+ * @param seed Seed of the random number streams
+ * @param budget If not NULL, limits the number of trials (each trial counts as one evaluation) or the
+ * wall-clock time (e.g. the budget of a kernel, see K_getBudget); the FAPs are then estimated from the
+ * trials completed within the budget, whose number is returned in budget->evals
  * @param p If specified, returns additional info for the periodogram and reuses matrices to save space/speed. If you pass
  * a value different than NULL, you are responsible for deallocating the workspace and its fields. p->zm returns a sorted
- * vector of the maximum powers in each synthetic trial.
+ * vector of the maximum powers in each synthetic trial (if p->zm is not NULL, it should hold at least "trials" values). 
+ * With a budget, only the first budget->evals entries of p->zm are valid. With PS_FAP_GEV, p->gev returns the
+ * parameters of the fit.
  * @param prog An ok_progress* callback; if different from NULL, can be used to stop or report progress.
  * @return A matrix containing: {PS_TIME, PS_Z, PS_FAP, PS_Z_LS} (period, power, bootstrapped FAP, unnormalized
  * LS power). You are responsible for deallocating it.
 
  */
 gsl_matrix* ok_periodogram_boot(const gsl_matrix* data, const unsigned int trials, const unsigned int samples,
-                                const double Pmin, const double Pmax, const int method,
+                                const double Pmin, const double Pmax, const int method, const int fap,
                                 const unsigned int timecol, const unsigned int valcol, const unsigned int sigcol,
-                                const unsigned long int seed, ok_periodogram_workspace* p, ok_progress prog) {
+                                const unsigned long int seed, ok_budget* budget, ok_periodogram_workspace* p,
+                                ok_progress prog) {
 
 
     int nthreads = omp_get_max_threads();
+    const int ndata = data->size1;
 
-    ok_periodogram_workspace * w[nthreads];
-    gsl_matrix * mock[nthreads];
-    gsl_rng * rng[nthreads];
+    ok_periodogram_workspace w = {0};
+    w.tol = (p != NULL ? p->tol : 0.);
+    gsl_matrix* ret = ok_periodogram_ls(data, samples, Pmin, Pmax, method, timecol, valcol, sigcol, &w);
+    gsl_matrix_free(w.buf);
 
-    rng[0] = gsl_rng_alloc(gsl_rng_default);
-    gsl_rng_set(rng[0], seed);
+    // Tables shared by all the trials; w0, chi2_h and W do not change under permutations
+    double fmin = 1. / Pmax;
+    double df = (1. / Pmin - fmin) / (double) samples;
+    double* t = (double*) malloc(sizeof (double) * ndata);
+    double* x = (double*) malloc(sizeof (double) * ndata);
+    double* sig = (double*) malloc(sizeof (double) * ndata);
+    double W = 2. * M_PI * gsl_stats_sd(data->data + timecol, data->tda, ndata) / Pmin;
+    double avg = gsl_stats_mean(data->data + valcol, data->tda, ndata);
+    double w0 = 0., chi2_h = 0.;
+    for (int i = 0; i < ndata; i++) {
+        t[i] = MGET(data, i, timecol) - MGET(data, 0, timecol);
+        x[i] = MGET(data, i, valcol) - avg;
+        sig[i] = 1. / (MGET(data, i, sigcol) * MGET(data, i, sigcol));
+        w0 += sig[i];
+        chi2_h += x[i] * x[i] * sig[i];
+    }
 
-    for (int i = 0; i < nthreads; i++) {
-        w[i] = (ok_periodogram_workspace*) malloc(sizeof (ok_periodogram_workspace));
-        w[i]->per = NULL;
-        w[i]->buf = NULL;
-        w[i]->calc_z_fap = false;
-        mock[i] = ok_matrix_copy(data);
-        if (i > 0) {
-            rng[i] = gsl_rng_alloc(gsl_rng_default);
-            gsl_rng_set(rng[i], seed + i);
+    int order = 0, nfft = 0;
+    double* cdf = NULL, * sdf = NULL, * seeds = NULL;
+    if (method == PS_METHOD_FAST)
+        ok_periodogram_fast_grid((w.tol > 0 ? w.tol : PS_FAST_TOL), samples, &order, &nfft);
+    else {
+        cdf = ok_periodogram_alloc(ndata);
+        sdf = ok_periodogram_alloc(ndata);
+        for (int i = 0; i < ndata; i++) {
+            cdf[i] = cos(2 * M_PI * df * t[i]);
+            sdf[i] = sin(2 * M_PI * df * t[i]);
         }
+        seeds = ok_periodogram_seeds(t, ndata, fmin, df, samples);
     }
 
-    gsl_matrix* ret = ok_matrix_copy(ok_periodogram_ls(data, samples, Pmin, Pmax, method, timecol, valcol, sigcol, NULL));
+    // Thread-local permuted data
+    int* perm[nthreads];
+    double* tsig[nthreads], * tx[nthreads], * twx[nthreads];
+    gsl_rng * rng[nthreads];
+    for (int i = 0; i < nthreads; i++) {
+        perm[i] = (int*) malloc(sizeof (int) * ndata);
+        tsig[i] = ok_periodogram_alloc(ndata);
+        tx[i] = (double*) malloc(sizeof (double) * ndata);
+        twx[i] = ok_periodogram_alloc(ndata);
+        rng[i] = ok_rng_stream_alloc(seed, 0);
+    }
 
     gsl_vector* zmax = (p != NULL && p->zm != NULL ? p->zm : gsl_vector_alloc(trials));
 
+    ok_budget_start(budget);
+
     bool abort = false;
+    bool* completed = (bool*) calloc(trials, sizeof (bool));
     #pragma omp parallel for
     for (int i = 0; i < trials; i++) {
-        if (!abort) {
+        if (!abort && ok_budget_check(budget, INVALID_NUMBER) == BUDGET_OK) {
             int nt = omp_get_thread_num();
 
-            ok_bootstrap_matrix_mean(data, T_TIME, T_VAL, mock[nt], rng[nt]);
-            ok_periodogram_ls(mock[nt], samples, Pmin, Pmax, method, timecol, valcol, sigcol, w[nt]);
-            zmax->data[i] = w[nt]->zmax;
+            // Stream keyed by the trial index
+            ok_rng_stream_set(rng[nt], seed, i);
+            for (int j = 0; j < ndata; j++)
+                perm[nt][j] = j;
+            gsl_ran_shuffle(rng[nt], perm[nt], ndata, sizeof (int));
+            for (int j = 0; j < ndata; j++) {
+                tsig[nt][j] = sig[perm[nt][j]];
+                tx[nt][j] = x[perm[nt][j]];
+                twx[nt][j] = tx[nt][j] * tsig[nt][j];
+            }
+
+            if (method == PS_METHOD_FAST)
+                zmax->data[i] = ok_periodogram_fast(t, tx[nt], tsig[nt], ndata, fmin, df, samples, order, nfft,
+                                                    NULL, w0, chi2_h, W, NULL);
+            else
+                zmax->data[i] = ok_periodogram_exact(t, tsig[nt], twx[nt], cdf, sdf, seeds, ndata, fmin, df,
+                                                     samples, w0, chi2_h, W, NULL);
+            completed[i] = true;
+            ok_budget_count(budget, 1);
 
             if (nt == 0 && prog != NULL) {
                 int ret = prog(i * nthreads, trials, NULL,
@@ -403,32 +1006,53 @@ gsl_matrix* ok_periodogram_boot(const gsl_matrix* data, const unsigned int trial
         }
     }
 
-    gsl_sort(zmax->data, 1, trials);
+    ok_budget_stop(budget);
+
+    // Only the completed trials are used (the run might have been interrupted
+    // or stopped by the budget)
+    int done = 0;
+    for (int i = 0; i < trials; i++)
+        if (completed[i])
+            zmax->data[done++] = zmax->data[i];
+    free(completed);
 
-    for (int i = 0; i < ret->size1; i++) {
-        if (MGET(ret, i, PS_Z) > zmax->data[trials - 1])
-            MSET(ret, i, PS_FAP, 1. / (double) trials);
+    gsl_sort(zmax->data, 1, done);
+
+    double gev[3];
+    bool fit = (fap == PS_FAP_GEV && ok_gev_fit(zmax->data, done, gev));
+
+    for (int i = 0; i < ret->size1 && done > 0; i++) {
+        if (fit)
+            MSET(ret, i, PS_FAP, ok_gev_fap(MGET(ret, i, PS_Z), gev));
+        else if (MGET(ret, i, PS_Z) > zmax->data[done - 1])
+            MSET(ret, i, PS_FAP, 1. / (double) done);
         else if (MGET(ret, i, PS_Z) < zmax->data[0])
             MSET(ret, i, PS_FAP, 1.);
         else {
-            int idx = ok_bsearch(zmax->data, MGET(ret, i, PS_Z), trials);
-            MSET(ret, i, PS_FAP, (double) (trials - idx) / (double) trials);
+            int idx = ok_bsearch(zmax->data, MGET(ret, i, PS_Z), done);
+            MSET(ret, i, PS_FAP, (double) (done - idx) / (double) done);
         }
     }
 
-
-
     for (int i = 0; i < nthreads; i++) {
-        gsl_matrix_free(w[i]->buf);
-        gsl_matrix_free(w[i]->per);
-        free(w[i]);
-        gsl_matrix_free(mock[i]);
+        free(perm[i]);
+        free(tsig[i]);
+        free(tx[i]);
+        free(twx[i]);
         gsl_rng_free(rng[i]);
     }
+    free(t);
+    free(x);
+    free(sig);
+    free(cdf);
+    free(sdf);
+    free(seeds);
 
     if (p != NULL) {
-        if (p->zm != NULL)
-            gsl_vector_free(zmax);
-    }
+        p->zm = zmax;
+        if (fit)
+            memcpy(p->gev, gev, sizeof (double) * 3);
+    } else
+        gsl_vector_free(zmax);
     return ret;
 }
@@ -25,6 +25,16 @@ extern "C" {
     
 #define PS_TYPE_DATA 0
 #define PS_TYPE_RESIDUALS 1
+
+    // Methods of ok_periodogram_ls: exact sums, or fast approximate sums (Press & Rybicki, 1989)
+#define PS_METHOD_EXACT 0
+#define PS_METHOD_FAST 1
+    // Default tolerance of PS_METHOD_FAST
+#define PS_FAST_TOL 1e-6
+
+    // FAP estimators of ok_periodogram_boot: fraction of the trials, or generalized extreme-value fit
+#define PS_FAP_EMPIRICAL 0
+#define PS_FAP_GEV 1
     
     typedef struct {
         double W;
@@ -38,15 +48,25 @@ extern "C" {
         gsl_matrix* per;
         gsl_matrix* buf;
         gsl_vector* zm;
+        // Tolerance of PS_METHOD_FAST, relative to the sum of the weights of the data
+        // (0 = PS_FAST_TOL)
+        double tol;
+        // Location, scale and shape of the extreme-value distribution fitted by
+        // ok_periodogram_boot (PS_FAP_GEV)
+        double gev[3];
     } ok_periodogram_workspace;
     
     gsl_matrix* ok_periodogram_ls(const gsl_matrix* data, const unsigned int samples, const double Pmin, const double Pmax, const int method,
         unsigned int timecol, unsigned int valcol, unsigned int sigcol, ok_periodogram_workspace* p);
 
     gsl_matrix* ok_periodogram_boot(const gsl_matrix* data, const unsigned int trials, const unsigned int samples, 
-        const double Pmin, const double Pmax, const int method,
+        const double Pmin, const double Pmax, const int method, const int fap,
         const unsigned int timecol, const unsigned int valcol, const unsigned int sigcol,
-        const unsigned long int seed, ok_periodogram_workspace* p, ok_progress prog);
+        const unsigned long int seed, ok_budget* budget, ok_periodogram_workspace* p, ok_progress prog);
+
+    gsl_matrix* ok_periodogram_gls(const gsl_matrix* data, const unsigned int samples, const double Pmin, const double Pmax,
+        const bool trend, unsigned int timecol, unsigned int valcol, unsigned int sigcol, int setcol,
+        ok_periodogram_workspace* p);
 
     
     gsl_matrix* ok_periodogram_full(ok_kernel* k, int type, int algo, bool circular, unsigned int sample,
@@ -0,0 +1,91 @@
+#include "stdint.h"
+#include "assert.h"
+#include "rng.h"
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+typedef struct {
+    // ctr[0..1] count the blocks of the stream, ctr[2..3] identify the stream
+    uint32_t ctr[4];
+    uint32_t key[2];
+    uint32_t out[4];
+    unsigned int idx;
+} ok_philox_state;
+
+static void ok_philox_block(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]) {
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    uint32_t k0 = key[0], k1 = key[1];
+
+    for (int i = 0; i < PHILOX_ROUNDS; i++) {
+        if (i > 0) {
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        uint64_t p0 = (uint64_t) PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t) PHILOX_M1 * c2;
+        uint32_t n0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t) p1;
+        c3 = (uint32_t) p0;
+        c0 = n0;
+        c2 = n2;
+    }
+
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+static void ok_philox_set(void* vstate, unsigned long int seed) {
+    ok_philox_state* st = (ok_philox_state*) vstate;
+    st->key[0] = (uint32_t) seed;
+    st->key[1] = (uint32_t) ((uint64_t) seed >> 32);
+    st->ctr[0] = st->ctr[1] = st->ctr[2] = st->ctr[3] = 0;
+    st->idx = 4;
+}
+
+static unsigned long int ok_philox_get(void* vstate) {
+    ok_philox_state* st = (ok_philox_state*) vstate;
+    if (st->idx == 4) {
+        ok_philox_block(st->ctr, st->key, st->out);
+        if (++st->ctr[0] == 0)
+            st->ctr[1]++;
+        st->idx = 0;
+    }
+    return st->out[st->idx++];
+}
+
+static double ok_philox_get_double(void* vstate) {
+    return ok_philox_get(vstate) / 4294967296.0;
+}
+
+static const gsl_rng_type ok_philox_type = {
+    "philox4x32-10",
+    0xffffffffUL,
+    0,
+    sizeof (ok_philox_state),
+    &ok_philox_set,
+    &ok_philox_get,
+    &ok_philox_get_double
+};
+
+const gsl_rng_type* ok_rng_philox = &ok_philox_type;
+
+gsl_rng* ok_rng_stream_alloc(unsigned long int seed, unsigned long int stream) {
+    gsl_rng* r = gsl_rng_alloc(ok_rng_philox);
+    ok_rng_stream_set(r, seed, stream);
+    return r;
+}
+
+void ok_rng_stream_set(gsl_rng* r, unsigned long int seed, unsigned long int stream) {
+    assert(r->type == ok_rng_philox);
+    gsl_rng_set(r, seed);
+    ok_philox_state* st = (ok_philox_state*) r->state;
+    st->ctr[2] = (uint32_t) stream;
+    st->ctr[3] = (uint32_t) ((uint64_t) stream >> 32);
+}
@@ -0,0 +1,49 @@
+/*
+ * File:   rng.h
+ */
+
+#ifndef RNG_H
+#define	RNG_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "gsl/gsl_rng.h"
+
+    /**
+     * Counter-based generator Philox4x32-10 (Salmon et al. 2011), as a GSL generator type.
+     * The output is a keyed bijection of a 128-bit counter, so that independent streams
+     * are obtained by fixing part of the counter (see ok_rng_stream_set) instead of
+     * carrying a separate state per thread.
+     */
+    extern const gsl_rng_type* ok_rng_philox;
+
+    /**
+     * Allocates a Philox generator positioned at the start of the given stream.
+     * @param seed Seed (key) shared by all the streams of a run
+     * @param stream Index of the stream (e.g. the trial or the chain)
+     * @return A new generator; free with gsl_rng_free
+     */
+    gsl_rng* ok_rng_stream_alloc(unsigned long int seed, unsigned long int stream);
+
+    /**
+     * Repositions a Philox generator at the start of the given stream. The sequence
+     * depends only on (seed, stream), not on the previous use of the generator.
+     * Parallel routines draw one seed from the generator of the kernel and key each
+     * stream on the index of a unit of work (a trial, a chain, a block of candidates),
+     * never on the thread that runs it: their results then do not depend on the
+     * number of threads or on the scheduling. K_setRngStream does the same for the
+     * generator of a kernel.
+     * @param r A generator of type ok_rng_philox
+     * @param seed Seed (key) shared by all the streams of a run
+     * @param stream Index of the stream (e.g. the trial or the chain)
+     */
+    void ok_rng_stream_set(gsl_rng* r, unsigned long int seed, unsigned long int stream);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* RNG_H */
+
@@ -8,11 +8,14 @@
 #include "math.h"
 #include "utils.h"
 #include "kernel.h"
+#include "rng.h"
 
 double* K_minimize_sa_iter(ok_kernel* k2, const int N, const double T_0, const double alpha,
-        const double* steps, double* best_chi, int* stop, int verbose) {
+        const double* steps, double* best_chi, int* stop, int verbose,
+        unsigned long int seed, int chain) {
     double chi2_orig = k2->minfunc(k2);
-    ok_kernel* k = K_clone(k2);
+    ok_kernel* k = K_cloneFlags(k2, SHARE_BUDGET);
+    K_setRngStream(k, seed, chain);
     ok_kernel_minimizer_pars mpars = K_getMinimizedVariables(k);
     double** pars = mpars.pars;
     int npars = mpars.npars;
@@ -62,6 +65,8 @@ double* K_minimize_sa_iter(ok_kernel* k2, const int N, const double T_0, const d
                 best_pars[i] = *(pars[i]);
         }
 
+        if (K_checkBudget(k, k->minfunc(k)) != BUDGET_OK)
+            *stop = PROGRESS_STOP;
         if (*stop == PROGRESS_STOP)
             break;
         if (omp_get_thread_num() == 0 && k2->progress != NULL && (it % every == 0)) {
@@ -165,11 +170,13 @@ int K_minimize_sa(ok_kernel* k, int trials, double params[]) {
         }
     }
 
+    // Streams keyed by the chain index
+    unsigned long int seed = gsl_rng_get(k->rng);
 #pragma omp parallel for
     for (int ch = 0; ch < chains; ch++) {
         best_pars[ch] = K_minimize_sa_iter(k, trials, T_0, alpha,
                 mpars.steps,
-                &(best_chi[ch]), &status, verbose);
+                &(best_chi[ch]), &status, verbose, seed, ch);
     }
 
     for (int ch = 1; ch < chains; ch++) {
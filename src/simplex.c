@@ -139,6 +139,10 @@ int K_minimize_simplex_iter(ok_kernel* k, int maxiter, double params[]) {
             break;
         
         double min_value = gsl_multimin_fminimizer_minimum(s);
+        if (K_checkBudget(k, min_value) != BUDGET_OK) {
+            status = PROGRESS_STOP;
+            break;
+        }
         /*if (last_min_value - min_value < dminValue) {
             steps_wo_improvement++;
             if (steps_wo_improvement > max_steps_wo_improvement)
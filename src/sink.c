@@ -0,0 +1,305 @@
+#include "string.h"
+#include "stdio.h"
+#include "sink.h"
+#include "utils.h"
+#include "gsl/gsl_matrix.h"
+#include "gsl/gsl_vector.h"
+
+#ifndef JAVASCRIPT
+#include <pthread.h>
+#endif
+
+#define OK_SINK_HEADER (4 * sizeof (int))
+
+/*
+ * Each record has the layout of an item of KL_save_bin: the tag, the three merits (total,
+ * prior, likelihood), the rows x cols elements and the npars parameters. The ring buffer
+ * holds 'capacity' serialized records; records [head, head + count) are waiting to be
+ * written. written[c] counts the records of chain c that are already in its file.
+ */
+struct ok_sink {
+    int nchains;
+    int rows;
+    int cols;
+    int npars;
+    size_t recsize;
+
+    int capacity;
+    char* ring;
+    int* ring_chain;
+    int head;
+    int count;
+
+    FILE** out;
+    FILE** in;
+    char** paths;
+    int* pushed;
+    int* written;
+    bool error;
+    bool closing;
+    bool started;
+
+#ifndef JAVASCRIPT
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+    pthread_cond_t drained;
+#endif
+};
+
+// Writes n records of the ring starting from slot 'from', then updates the headers of the
+// files that received them. Only called by the writer (or by ok_sink_push without threads).
+static bool ok_sink_write(ok_sink* s, const int from, const int n, int* added) {
+    bool ok = true;
+    memset(added, 0, sizeof (int) * s->nchains);
+
+    for (int i = 0; i < n; i++) {
+        int slot = (from + i) % s->capacity;
+        int c = s->ring_chain[slot];
+        ok = (fwrite(s->ring + slot * s->recsize, 1, s->recsize, s->out[c]) == s->recsize) && ok;
+        added[c]++;
+    }
+
+    for (int c = 0; c < s->nchains; c++)
+        if (added[c] > 0) {
+            int size = s->written[c] + added[c];
+            ok = (fseek(s->out[c], 0, SEEK_SET) == 0) && ok;
+            ok = (fwrite(&size, sizeof (int), 1, s->out[c]) == 1) && ok;
+            ok = (fseek(s->out[c], 0, SEEK_END) == 0) && ok;
+            ok = (fflush(s->out[c]) == 0) && ok;
+        }
+    return ok;
+}
+
+#ifndef JAVASCRIPT
+
+static void* ok_sink_writer(void* arg) {
+    ok_sink* s = (ok_sink*) arg;
+    int added[s->nchains];
+
+    pthread_mutex_lock(&s->lock);
+    while (true) {
+        while (s->count == 0 && !s->closing)
+            pthread_cond_wait(&s->not_empty, &s->lock);
+        if (s->count == 0)
+            break;
+
+        // The records being written are not touched by the producer until count is decreased
+        int from = s->head;
+        int n = MIN(s->count, s->capacity - s->head);
+        pthread_mutex_unlock(&s->lock);
+
+        bool ok = ok_sink_write(s, from, n, added);
+
+        pthread_mutex_lock(&s->lock);
+        for (int c = 0; c < s->nchains; c++)
+            s->written[c] += added[c];
+        s->error = s->error || !ok;
+        s->head = (s->head + n) % s->capacity;
+        s->count -= n;
+        pthread_cond_broadcast(&s->not_full);
+        pthread_cond_broadcast(&s->drained);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+#endif
+
+/**
+ * Opens a sink that streams the samples of nchains chains to the files
+ * stem_0.bin, stem_1.bin, ... (overwritten if they exist). Each file can be read
+ * back with KL_load_bin, also while the run is in progress.
+ * @param stem Stem of the file names
+ * @param nchains Number of chains
+ * @param rows Rows of the element matrices of the samples
+ * @param cols Columns of the element matrices of the samples
+ * @param npars Size of the parameter vectors of the samples
+ * @param capacity Number of samples buffered in memory; ok_sink_push blocks while the
+ * buffer is full
+ * @return A new sink, or NULL if a file could not be opened
+ */
+ok_sink* ok_sink_open(const char* stem, const int nchains, const int rows, const int cols, const int npars,
+                      const int capacity) {
+    ok_sink* s = (ok_sink*) calloc(1, sizeof (ok_sink));
+    s->nchains = nchains;
+    s->rows = rows;
+    s->cols = cols;
+    s->npars = npars;
+    s->recsize = sizeof (int) + sizeof (double) * (3 + rows * cols + npars);
+    s->capacity = MAX(capacity, 1);
+    s->ring = (char*) malloc(s->capacity * s->recsize);
+    s->ring_chain = (int*) calloc(s->capacity, sizeof (int));
+    s->out = (FILE**) calloc(nchains, sizeof (FILE*));
+    s->in = (FILE**) calloc(nchains, sizeof (FILE*));
+    s->paths = (char**) calloc(nchains, sizeof (char*));
+    s->pushed = (int*) calloc(nchains, sizeof (int));
+    s->written = (int*) calloc(nchains, sizeof (int));
+
+    bool ok = true;
+    for (int c = 0; c < nchains; c++) {
+        s->paths[c] = (char*) malloc(strlen(stem) + 32);
+        sprintf(s->paths[c], "%s_%d.bin", stem, c);
+        s->out[c] = fopen(s->paths[c], "wb");
+        int hdr[4] = {0, rows, cols, npars};
+        ok = ok && s->out[c] != NULL && fwrite(hdr, sizeof (int), 4, s->out[c]) == 4 && fflush(s->out[c]) == 0;
+    }
+
+#ifndef JAVASCRIPT
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->not_full, NULL);
+    pthread_cond_init(&s->not_empty, NULL);
+    pthread_cond_init(&s->drained, NULL);
+    if (ok) {
+        s->started = (pthread_create(&s->writer, NULL, ok_sink_writer, s) == 0);
+        ok = s->started;
+    }
+#endif
+
+    if (!ok) {
+        s->error = true;
+        ok_sink_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * Appends a sample to the file of a chain. The sample is copied, so that it can be
+ * freed as soon as the call returns. Only one thread should push samples to a sink.
+ * @param s Sink
+ * @param chain Index of the chain
+ * @param it Sample, whose elements and parameters have the sizes given to ok_sink_open
+ * @return false if a write error occurred
+ */
+bool ok_sink_push(ok_sink* s, const int chain, const ok_list_item* it) {
+#ifndef JAVASCRIPT
+    pthread_mutex_lock(&s->lock);
+    while (s->count == s->capacity && !s->error)
+        pthread_cond_wait(&s->not_full, &s->lock);
+    if (s->error) {
+        pthread_mutex_unlock(&s->lock);
+        return false;
+    }
+#endif
+
+    int slot = (s->head + s->count) % s->capacity;
+    char* rec = s->ring + slot * s->recsize;
+    double merits[3] = {it->merit, it->merit_pr, it->merit_li};
+    memcpy(rec, &(it->tag), sizeof (int));
+    rec += sizeof (int);
+    memcpy(rec, merits, sizeof (double) * 3);
+    rec += sizeof (double) * 3;
+    for (int i = 0; i < s->rows; i++) {
+        memcpy(rec, it->elements->data + i * it->elements->tda, sizeof (double) * s->cols);
+        rec += sizeof (double) * s->cols;
+    }
+    for (int i = 0; i < s->npars; i++) {
+        memcpy(rec, it->params->data + i * it->params->stride, sizeof (double));
+        rec += sizeof (double);
+    }
+    s->ring_chain[slot] = chain;
+    s->pushed[chain]++;
+
+#ifndef JAVASCRIPT
+    s->count++;
+    pthread_cond_signal(&s->not_empty);
+    bool ok = !s->error;
+    pthread_mutex_unlock(&s->lock);
+    return ok;
+#else
+    int added[s->nchains];
+    s->error = !ok_sink_write(s, slot, 1, added) || s->error;
+    s->written[chain] += added[chain];
+    return !s->error;
+#endif
+}
+
+/**
+ * Reads back a sample of a chain that was pushed to the sink, waiting for it to be
+ * written if needed.
+ * @param s Sink
+ * @param chain Index of the chain
+ * @param idx Index of the sample within the chain
+ * @param elements Filled with the elements of the sample (rows x cols)
+ * @param params Filled with the parameters of the sample (npars)
+ * @return false if the sample was never pushed or could not be read
+ */
+bool ok_sink_read(ok_sink* s, const int chain, const int idx, gsl_matrix* elements, gsl_vector* params) {
+#ifndef JAVASCRIPT
+    pthread_mutex_lock(&s->lock);
+    while (s->written[chain] <= idx && s->pushed[chain] > idx && !s->error)
+        pthread_cond_wait(&s->drained, &s->lock);
+    bool ok = (s->written[chain] > idx);
+    pthread_mutex_unlock(&s->lock);
+#else
+    bool ok = (s->written[chain] > idx);
+#endif
+    if (!ok || idx < 0)
+        return false;
+
+    if (s->in[chain] == NULL)
+        s->in[chain] = fopen(s->paths[chain], "rb");
+    if (s->in[chain] == NULL)
+        return false;
+
+    long pos = OK_SINK_HEADER + (long) idx * s->recsize + sizeof (int) + 3 * sizeof (double);
+    return fseek(s->in[chain], pos, SEEK_SET) == 0 && gsl_matrix_fread(s->in[chain], elements) == 0 &&
+            gsl_vector_fread(s->in[chain], params) == 0;
+}
+
+/**
+ * Returns the number of samples pushed to the sink for a chain.
+ * @param s Sink
+ * @param chain Index of the chain
+ * @return Number of samples
+ */
+int ok_sink_count(ok_sink* s, const int chain) {
+    return s->pushed[chain];
+}
+
+/**
+ * Writes the samples still in the buffer, closes the files and frees the sink.
+ * @param s Sink (can be NULL)
+ * @return true if all the samples were written successfully
+ */
+bool ok_sink_close(ok_sink* s) {
+    if (s == NULL)
+        return true;
+
+#ifndef JAVASCRIPT
+    // The writer is stopped even after a write error, since it may still be waiting
+    if (s->started) {
+        pthread_mutex_lock(&s->lock);
+        s->closing = true;
+        pthread_cond_broadcast(&s->not_empty);
+        pthread_cond_broadcast(&s->not_full);
+        pthread_cond_broadcast(&s->drained);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->writer, NULL);
+    }
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->not_full);
+    pthread_cond_destroy(&s->not_empty);
+    pthread_cond_destroy(&s->drained);
+#endif
+
+    bool ok = !s->error;
+    for (int c = 0; c < s->nchains; c++) {
+        if (s->out[c] != NULL)
+            ok = (fclose(s->out[c]) == 0) && ok;
+        if (s->in[c] != NULL)
+            fclose(s->in[c]);
+        free(s->paths[c]);
+    }
+    free(s->out);
+    free(s->in);
+    free(s->paths);
+    free(s->pushed);
+    free(s->written);
+    free(s->ring);
+    free(s->ring_chain);
+    free(s);
+    return ok;
+}
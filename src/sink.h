@@ -0,0 +1,34 @@
+/*
+ * File:   sink.h
+ */
+
+#ifndef SINK_H
+#define	SINK_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "systemic.h"
+
+    /*
+     * A chain sink streams the samples of one or more chains to binary files (one per chain,
+     * in the format of KL_save_bin, so that each file can be read back with KL_load_bin).
+     * Samples are copied to a bounded ring buffer and written by a background thread; the
+     * header of each file is kept up to date with the number of samples written so far.
+     */
+    typedef struct ok_sink ok_sink;
+
+    ok_sink* ok_sink_open(const char* stem, const int nchains, const int rows, const int cols, const int npars,
+                          const int capacity);
+    bool ok_sink_push(ok_sink* s, const int chain, const ok_list_item* it);
+    bool ok_sink_read(ok_sink* s, const int chain, const int idx, gsl_matrix* elements, gsl_vector* params);
+    int ok_sink_count(ok_sink* s, const int chain);
+    bool ok_sink_close(ok_sink* s);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SINK_H */
+
@@ -0,0 +1,435 @@
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+#include "sketch.h"
+#include "utils.h"
+
+/*
+ * KLL quantile sketch: level h holds values of weight 2^h. When a level reaches its
+ * capacity it is sorted and compacted, promoting every other value (alternately the
+ * even or the odd ones) to the next level, so that the total weight is preserved.
+ * The capacities shrink geometrically (by 2/3) from the top level, which holds up to
+ * k values; the sketch never holds more than about 3k values.
+ */
+typedef struct ok_sketch {
+    int k;
+    int levels;
+    double** items;
+    int* size;
+    int* alloc;
+    unsigned int flips;
+} ok_sketch;
+
+typedef struct ok_weighted {
+    double v;
+    double w;
+} ok_weighted;
+
+typedef struct ok_summary_column {
+    bool angle;
+    long n;
+    // Welford running mean and sum of squared deviations
+    double mean;
+    double m2;
+    // sums of the sines and cosines of the angles
+    double sn;
+    double cs;
+    ok_sketch* x;
+    ok_sketch* sin;
+    ok_sketch* cos;
+} ok_summary_column;
+
+struct ok_summary {
+    int rows;
+    int cols;
+    int npars;
+    int ncols;
+    long n;
+    ok_summary_column* c;
+};
+
+static ok_sketch* ok_sketch_alloc(const int k) {
+    ok_sketch* s = (ok_sketch*) calloc(1, sizeof (ok_sketch));
+    s->k = k;
+    return s;
+}
+
+static void ok_sketch_free(ok_sketch* s) {
+    if (s == NULL)
+        return;
+    for (int h = 0; h < s->levels; h++)
+        free(s->items[h]);
+    free(s->items);
+    free(s->size);
+    free(s->alloc);
+    free(s);
+}
+
+static int ok_sketch_cap(const ok_sketch* s, const int h) {
+    int c = (int) ceil(s->k * pow(2. / 3., s->levels - 1 - h));
+    return MAX(c, 2);
+}
+
+// Adds the levels up to h, if missing
+static void ok_sketch_grow(ok_sketch* s, const int h) {
+    if (h >= s->levels) {
+        s->items = (double**) realloc(s->items, sizeof (double*) * (h + 1));
+        s->size = (int*) realloc(s->size, sizeof (int) * (h + 1));
+        s->alloc = (int*) realloc(s->alloc, sizeof (int) * (h + 1));
+        for (int l = s->levels; l <= h; l++) {
+            s->items[l] = NULL;
+            s->size[l] = s->alloc[l] = 0;
+        }
+        s->levels = h + 1;
+    }
+}
+
+static void ok_sketch_push(ok_sketch* s, const int h, const double x) {
+    ok_sketch_grow(s, h);
+    if (s->size[h] == s->alloc[h]) {
+        s->alloc[h] = MAX(2 * s->alloc[h], 8);
+        s->items[h] = (double*) realloc(s->items[h], sizeof (double) * s->alloc[h]);
+    }
+    s->items[h][s->size[h]++] = x;
+}
+
+static int ok_sketch_cmp(const void* a, const void* b) {
+    double x = *((const double*) a);
+    double y = *((const double*) b);
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+// Compacts the levels that are over capacity; returns false if none was
+static bool ok_sketch_compress(ok_sketch* s) {
+    bool compacted = false;
+    for (int h = 0; h < s->levels; h++) {
+        int n = s->size[h];
+        if (n < ok_sketch_cap(s, h))
+            continue;
+
+        ok_sketch_grow(s, h + 1);
+        double* v = s->items[h];
+        qsort(v, n, sizeof (double), ok_sketch_cmp);
+
+        // With an odd number of values, the largest one stays at this level
+        int keep = n % 2;
+        int offset = (s->flips++) & 1;
+        for (int i = offset; i < n - keep; i += 2)
+            ok_sketch_push(s, h + 1, v[i]);
+        if (keep)
+            v[0] = v[n - 1];
+        s->size[h] = keep;
+        compacted = true;
+    }
+    return compacted;
+}
+
+static void ok_sketch_add(ok_sketch* s, const double x) {
+    ok_sketch_push(s, 0, x);
+    if (s->size[0] >= ok_sketch_cap(s, 0))
+        ok_sketch_compress(s);
+}
+
+static void ok_sketch_merge(ok_sketch* dest, const ok_sketch* src) {
+    for (int h = 0; h < src->levels; h++)
+        for (int i = 0; i < src->size[h]; i++)
+            ok_sketch_push(dest, h, src->items[h][i]);
+    while (ok_sketch_compress(dest))
+        ;
+}
+
+static int ok_weighted_cmp(const void* a, const void* b) {
+    return ok_sketch_cmp(&(((const ok_weighted*) a)->v), &(((const ok_weighted*) b)->v));
+}
+
+// Values held by the sketch with their weights (to be freed by the caller)
+static ok_weighted* ok_sketch_items(const ok_sketch* s, int* m) {
+    int count = 0;
+    for (int h = 0; h < s->levels; h++)
+        count += s->size[h];
+
+    ok_weighted* ret = (ok_weighted*) malloc(sizeof (ok_weighted) * MAX(count, 1));
+    *m = 0;
+    for (int h = 0; h < s->levels; h++)
+        for (int i = 0; i < s->size[h]; i++) {
+            ret[*m].v = s->items[h][i];
+            ret[*m].w = ldexp(1., h);
+            (*m)++;
+        }
+    return ret;
+}
+
+/*
+ * Quantile q of m weighted values, interpolating between order statistics as
+ * gsl_stats_quantile_from_sorted_data (exact while the values have unit weight).
+ * The values are sorted in place.
+ */
+static double ok_weighted_quantile(ok_weighted* it, const int m, const double q) {
+    if (m == 0)
+        return 0.;
+    qsort(it, m, sizeof (ok_weighted), ok_weighted_cmp);
+
+    double n = 0;
+    for (int i = 0; i < m; i++)
+        n += it[i].w;
+
+    double index = RANGE(q, 0., 1.) * (n - 1);
+    double lhs = floor(index);
+    double delta = index - lhs;
+
+    double c = 0;
+    for (int i = 0; i < m; i++) {
+        if (lhs < c + it[i].w) {
+            double hi = (lhs + 1 < c + it[i].w || i == m - 1 ? it[i].v : it[i + 1].v);
+            return (1 - delta) * it[i].v + delta * hi;
+        }
+        c += it[i].w;
+    }
+    return it[m - 1].v;
+}
+
+static double ok_sketch_quantile(const ok_sketch* s, const double q) {
+    int m;
+    ok_weighted* it = ok_sketch_items(s, &m);
+    double ret = ok_weighted_quantile(it, m, q);
+    free(it);
+    return ret;
+}
+
+// Distance (in radians) of the angle x (in degrees) from the angle c (in radians), as ok_mad_angle
+static double ok_angle_dist(const double x, const double c) {
+    double val = fmod(TO_RAD(x), 2 * M_PI);
+    if (val < 0)
+        val += 2 * M_PI;
+    double diff = MIN(RADRANGE(fabs(val - c)), RADRANGE(fabs(val - c + TWOPI)));
+    return MIN(diff, RADRANGE(fabs(val - c - TWOPI)));
+}
+
+/**
+ * Allocates an empty summary for samples with rows x cols orbital elements
+ * and npars parameters.
+ * @param rows Rows of the element matrices (number of planets + 1)
+ * @param cols Columns of the element matrices
+ * @param npars Number of parameters
+ * @param size Number of values retained by the top level of each quantile sketch
+ * (0 for OK_SKETCH_SIZE); the rank error of the quantiles is roughly 2 / size, and
+ * each column retains at most about 3 * size values
+ * @return A new summary
+ */
+ok_summary* KS_alloc(const int rows, const int cols, const int npars, const int size) {
+    ok_summary* s = (ok_summary*) calloc(1, sizeof (ok_summary));
+    s->rows = rows;
+    s->cols = cols;
+    s->npars = npars;
+    // The merit follows the elements and the parameters
+    s->ncols = rows * cols + npars + 1;
+    s->c = (ok_summary_column*) calloc(s->ncols, sizeof (ok_summary_column));
+
+    const int k = (size > 0 ? size : OK_SKETCH_SIZE);
+    for (int i = 0; i < s->ncols; i++) {
+        int j = i % cols;
+        ok_summary_column* c = s->c + i;
+        c->angle = (i < rows * cols) && (j == MA || j == LOP || j == INC || j == NODE || j == TRUEANOMALY);
+        c->x = ok_sketch_alloc(k);
+        if (c->angle) {
+            c->sin = ok_sketch_alloc(k);
+            c->cos = ok_sketch_alloc(k);
+        }
+    }
+    return s;
+}
+
+void KS_free(ok_summary* s) {
+    if (s == NULL)
+        return;
+    for (int i = 0; i < s->ncols; i++) {
+        ok_sketch_free(s->c[i].x);
+        ok_sketch_free(s->c[i].sin);
+        ok_sketch_free(s->c[i].cos);
+    }
+    free(s->c);
+    free(s);
+}
+
+static void ok_summary_add(ok_summary_column* c, const double x) {
+    c->n++;
+    double d = x - c->mean;
+    c->mean += d / c->n;
+    c->m2 += d * (x - c->mean);
+    ok_sketch_add(c->x, x);
+    if (c->angle) {
+        double sn = sin(TO_RAD(x));
+        double cs = cos(TO_RAD(x));
+        c->sn += sn;
+        c->cs += cs;
+        ok_sketch_add(c->sin, sn);
+        ok_sketch_add(c->cos, cs);
+    }
+}
+
+/**
+ * Adds a sample to the summary.
+ * @param s Summary
+ * @param elements Orbital elements (rows x cols)
+ * @param params Parameters (npars)
+ * @param merit Merit of the sample
+ */
+void KS_add(ok_summary* s, const gsl_matrix* elements, const gsl_vector* params, const double merit) {
+    for (int i = 0; i < s->rows; i++)
+        for (int j = 0; j < s->cols; j++)
+            ok_summary_add(s->c + i * s->cols + j, MGET(elements, i, j));
+    for (int j = 0; j < s->npars; j++)
+        ok_summary_add(s->c + s->rows * s->cols + j, VGET(params, j));
+    ok_summary_add(s->c + s->ncols - 1, merit);
+    s->n++;
+}
+
+/**
+ * Merges the samples of a summary into another one (e.g. the summaries filled
+ * by different threads).
+ * @param dest Summary receiving the samples
+ * @param src Summary with the same dimensions (unchanged)
+ */
+void KS_merge(ok_summary* dest, const ok_summary* src) {
+    assert(dest->ncols == src->ncols);
+    for (int i = 0; i < dest->ncols; i++) {
+        ok_summary_column* a = dest->c + i;
+        const ok_summary_column* b = src->c + i;
+        if (b->n == 0)
+            continue;
+
+        long n = a->n + b->n;
+        double d = b->mean - a->mean;
+        a->mean += d * b->n / n;
+        a->m2 += b->m2 + d * d * ((double) a->n * b->n / n);
+        a->n = n;
+        a->sn += b->sn;
+        a->cs += b->cs;
+        ok_sketch_merge(a->x, b->x);
+        if (a->angle) {
+            ok_sketch_merge(a->sin, b->sin);
+            ok_sketch_merge(a->cos, b->cos);
+        }
+    }
+    dest->n += src->n;
+}
+
+int KS_getSize(const ok_summary* s) {
+    return (int) s->n;
+}
+
+int KS_getNplanets(const ok_summary* s) {
+    return s->rows - 1;
+}
+
+static double ok_summary_median(const ok_summary_column* c) {
+    if (!c->angle)
+        return ok_sketch_quantile(c->x, 0.5);
+    double avg = atan2(ok_sketch_quantile(c->sin, 0.5), ok_sketch_quantile(c->cos, 0.5));
+    if (avg < 0)
+        avg += 2 * M_PI;
+    return TO_DEG(avg);
+}
+
+/*
+ * Statistic 'what' of a column (see KS_getElementsStats). Means and standard deviations
+ * (except the one of angles) are exact; medians, MADs and percentiles are computed on the
+ * sketches, and the standard deviation of angles on the sketch of their values.
+ */
+static double ok_summary_stat(const ok_summary_column* c, const int what) {
+    if (c->n == 0)
+        return 0.;
+
+    switch (what) {
+        case STAT_MEAN:
+            if (c->angle) {
+                double avg = atan2(c->sn / c->n, c->cs / c->n);
+                if (avg < 0)
+                    avg += 2 * M_PI;
+                return TO_DEG(avg);
+            }
+            return c->mean;
+        case STAT_STDDEV:
+            if (c->n <= 1)
+                return 0.;
+            if (c->angle) {
+                double avg = atan2(c->sn / c->n, c->cs / c->n);
+                if (avg < 0)
+                    avg += 2 * M_PI;
+                int m;
+                ok_weighted* it = ok_sketch_items(c->x, &m);
+                double dev = 0, n = 0;
+                for (int i = 0; i < m; i++) {
+                    double diff = ok_angle_dist(it[i].v, avg);
+                    dev += it[i].w * diff * diff;
+                    n += it[i].w;
+                }
+                free(it);
+                return TO_DEG(sqrt(dev / n));
+            }
+            return sqrt(c->m2 / (c->n - 1));
+        case STAT_MEDIAN:
+            return ok_summary_median(c);
+        case STAT_MAD:
+        {
+            double med = ok_summary_median(c);
+            int m;
+            ok_weighted* it = ok_sketch_items(c->x, &m);
+            for (int i = 0; i < m; i++)
+                it[i].v = (c->angle ? ok_angle_dist(it[i].v, TO_RAD(med)) : fabs(it[i].v - med));
+            double mad = ok_weighted_quantile(it, m, 0.5);
+            free(it);
+            return 1.4826 * (c->angle ? TO_DEG(mad) : mad);
+        }
+        case STAT_IAT:
+            // The samples of a summary are independent
+            return 1.;
+        case STAT_ESS:
+            return (double) c->n;
+        default:
+            // percentiles
+            return ok_sketch_quantile(c->x, (double) (what) / 100.);
+    }
+}
+
+/**
+ * Get a summary statistic for the orbital elements, as KL_getElementsStats.
+ * Means and standard deviations are exact (except the standard deviation of angles);
+ * medians, MADs and percentiles are approximated by the quantile sketches, and
+ * are exact while the summary holds fewer samples than the size of the sketches.
+ * STAT_IAT is 1 and STAT_ESS is the number of samples, since the samples are independent.
+ * @param s Summary
+ * @param what One of STAT_MEAN, STAT_MEDIAN, STAT_STDDEV, STAT_MAD, STAT_IAT,
+ * STAT_ESS or a percentile (0-100).
+ * @return A matrix whose entries are the summary statistic for the
+ * corresponding orbital element, or NULL if the summary is empty
+ */
+gsl_matrix* KS_getElementsStats(const ok_summary* s, const int what) {
+    if (s->n == 0 || s->rows == 0)
+        return NULL;
+
+    gsl_matrix* m = gsl_matrix_alloc(s->rows, s->cols);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < s->rows * s->cols; i++)
+        m->data[(i / s->cols) * m->tda + i % s->cols] = ok_summary_stat(s->c + i, what);
+    return m;
+}
+
+/**
+ * Get a summary statistic for the parameters, as KL_getParsStats (see KS_getElementsStats).
+ * @param s Summary
+ * @param what One of STAT_MEAN, STAT_MEDIAN, STAT_STDDEV, STAT_MAD, STAT_IAT,
+ * STAT_ESS or a percentile (0-100).
+ * @return A vector whose entries are the summary statistic for the
+ * corresponding orbital parameter, followed by the one of the merit.
+ */
+gsl_vector* KS_getParsStats(const ok_summary* s, const int what) {
+    gsl_vector* ret = gsl_vector_calloc(PARAMS_SIZE + 1);
+    if (s->n == 0)
+        return ret;
+    assert(s->npars == PARAMS_SIZE);
+
+    for (int j = 0; j < PARAMS_SIZE + 1; j++)
+        VSET(ret, j, ok_summary_stat(s->c + s->rows * s->cols + j, what));
+    return ret;
+}
@@ -0,0 +1,40 @@
+/*
+ * File:   sketch.h
+ */
+
+#ifndef SKETCH_H
+#define	SKETCH_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "systemic.h"
+
+    // Default number of values retained by the top level of each quantile sketch
+#define OK_SKETCH_SIZE 200
+
+    /*
+     * A summary accumulates the statistics of a stream of samples (orbital elements,
+     * parameters and merit) in bounded memory, without storing the samples: each column
+     * keeps a running mean and variance (Welford), the sums of sines and cosines of
+     * angles, and mergeable quantile sketches (KLL) for medians, MADs and percentiles.
+     * Summaries filled by different threads can be merged.
+     */
+    typedef struct ok_summary ok_summary;
+
+    ok_summary* KS_alloc(const int rows, const int cols, const int npars, const int size);
+    void KS_free(ok_summary* s);
+    void KS_add(ok_summary* s, const gsl_matrix* elements, const gsl_vector* params, const double merit);
+    void KS_merge(ok_summary* dest, const ok_summary* src);
+    int KS_getSize(const ok_summary* s);
+    int KS_getNplanets(const ok_summary* s);
+    gsl_matrix* KS_getElementsStats(const ok_summary* s, const int what);
+    gsl_vector* KS_getParsStats(const ok_summary* s, const int what);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SKETCH_H */
+
@@ -72,6 +72,8 @@
 #define STAT_MEDIAN -1
 #define STAT_STDDEV -2
 #define STAT_MAD -3
+#define STAT_IAT -4
+#define STAT_ESS -5
 #define STAT_QUART_25 25
 #define STAT_QUART_50 50
 #define STAT_QUART_75 75
@@ -165,8 +167,21 @@ extern char * ok_all_orb_labels[ALL_ELEMENTS_SIZE];
 #define OPT_MCMC_ACCRATIO 8
 #define OPT_MCMC_NMIN 9
 #define OPT_MCMC_SAVE_EVERY 40
+#define OPT_MCMC_ADAPTIVE 41
+#define OPT_MCMC_CHECKPOINT_EVERY 42
+#define OPT_MCMC_SWAP_EVERY 43
+#define OPT_MCMC_ADAPT_TEMPS 44
+#define OPT_MCMC_EVIDENCE 45
+#define OPT_MCMC_SURROGATE 46
+#define OPT_MCMC_SURROGATE_ACC 47
+#define OPT_MCMC_STREAM 48
 #define OPT_VERBOSE_DIAGS 7
 
+// Surrogate models for delayed acceptance (OPT_MCMC_SURROGATE)
+#define SURROGATE_NONE 0
+#define SURROGATE_KEPLER 1
+#define SURROGATE_LOOSE 2
+
 #define OPT_LM_MINCHI_PAR 10
 #define OPT_LM_HIGH_DF 11
 #define OPT_LM_MAX_ITER_AT_SCALE 12
@@ -184,12 +199,53 @@ extern char * ok_all_orb_labels[ALL_ELEMENTS_SIZE];
 #define OPT_DE_F_MAX 33
 #define OPT_DE_USE_STEPS 34
 
+#define OPT_CMAES_POPSIZE 50
+#define OPT_CMAES_SIGMA 51
+#define OPT_CMAES_RESTARTS 52
+#define OPT_CMAES_BIPOP 53
+#define OPT_CMAES_TOLFUN 54
+
+#define OPT_LBFGS_MEMORY 60
+#define OPT_LBFGS_PGTOL 61
+#define OPT_LBFGS_FTOL 62
+#define OPT_LBFGS_CENTRAL 63
+
+#define OPT_GA_POPSIZE 70
+#define OPT_GA_TOURNAMENT 71
+#define OPT_GA_CROSSOVER 72
+#define OPT_GA_BLEND 73
+#define OPT_GA_MUTATION 74
+#define OPT_GA_MUTATION_SCALE 75
+#define OPT_GA_ELITE 76
+#define OPT_GA_STALL 77
+#define OPT_GA_POLISH 78
+
+#define OPT_ENSEMBLE_A 80
+#define OPT_ENSEMBLE_DE 81
+#define OPT_ENSEMBLE_INIT 82
+
+#define OPT_NESTED_SLICES 90
+#define OPT_NESTED_BATCH 91
+#define OPT_NESTED_TOL 92
+#define OPT_NESTED_EQUAL_WEIGHTS 93
+
+#define OPT_NUTS_TARGET_ACCEPT 100
+#define OPT_NUTS_MAX_DEPTH 101
+#define OPT_NUTS_DENSE 102
+#define OPT_NUTS_FD_STEP 103
+#define OPT_NUTS_INIT 104
+
 
 
 #define PROGRESS_CONTINUE 0
 #define PROGRESS_STOP 1
 #define PROGRESS_BREAK 2
 
+#define BUDGET_OK 0
+#define BUDGET_EVALS 1
+#define BUDGET_TIME 2
+#define BUDGET_TARGET 3
+
 #define STATUS_SUCCESS GSL_SUCCESS
 
 #define TDS_PRIMARY 1
@@ -214,6 +270,7 @@ extern char * ok_all_orb_labels[ALL_ELEMENTS_SIZE];
 #define GUI_RESERVED_2 (1 << 13)
 #define GUI_RESERVED_3 (1 << 14)
 #define GUI_RESERVED_4 (1 << 15)
+#define SHARE_BUDGET (1 << 16)
 
 #define ASTROCENTRIC 0
 #define JACOBI (1 << 10)
@@ -223,6 +280,11 @@ extern char * ok_all_orb_labels[ALL_ELEMENTS_SIZE];
 #define DIFFEVOL 2
 #define SA 3
 #define GD 4
+#define CMAES 5
+#define LBFGSB 6
+#define GA 7
+// Number of slots for minimizers (built-in or added with K_register_minimizer)
+#define MINIMIZERS_SIZE 16
 
 #define INTEGRATION_SUCCESS 0
 #define INTEGRATION_FAILURE_SMALL_TIMESTEP (1 << 11)
@@ -269,6 +331,29 @@ typedef void(*ok_icallback)(int);
 
 typedef int(*ok_progress)(int current, int max, void* state, const char* function);
 
+typedef struct ok_budget {
+    // Maximum number of evaluations of the model (0 = no limit)
+    unsigned long int max_evals;
+    // Maximum wall-clock time in seconds (0 = no limit)
+    double max_time;
+    // Target value of the merit function; a run stops once it reaches
+    // a value <= target (INVALID_NUMBER = no target)
+    double target;
+
+    // Budget used by the last run: number of evaluations, elapsed
+    // wall-clock time and BUDGET_* code of the limit that stopped it
+    // (BUDGET_OK if none)
+    unsigned long int evals;
+    double elapsed;
+    int status;
+
+    // Start time, nesting depth of the runs sharing the budget and
+    // number of kernels referencing it
+    double start;
+    int depth;
+    int refs;
+} ok_budget;
+
 typedef struct ok_integrator_options {
     // Absolute and relative accuracy (used by the RK integrators and SWIFT_BS)
     double abs_acc;
@@ -386,6 +471,14 @@ struct ok_kernel {
     ok_model_function model_function;
     int last_error;
 
+    // gradient of the function to minimize with respect to the minimized
+    // variables (NAN for the components that are not available)
+    ok_callback2 gradfunc;
+
+    // computational budget (possibly shared with the workspaces
+    // used by the current run)
+    ok_budget* budget;
+
     ok_info* info;
 };
 
@@ -398,12 +491,37 @@ typedef struct ok_list_item {
     int tag;
 } ok_list_item;
 
+/*
+ * Column-major storage of a list (see KL_map): entry n of a column is at index n. The
+ * columns are the rows x cols element matrices (in row-major order, i.e. column
+ * i * cols + j holds element (i, j)), then the npars parameters, then the merit, the
+ * prior and the likelihood (OK_KL_MERIT, OK_KL_MERIT_PR, OK_KL_MERIT_LI).
+ */
+typedef struct ok_list_columns {
+    int rows;
+    int cols;
+    int npars;
+    const double* data;
+    const int* tags;
+    // mapped region (or buffer) holding the columns, and its length in bytes
+    void* base;
+    size_t length;
+    bool mapped;
+} ok_list_columns;
+
+#define OK_KL_MERIT 0
+#define OK_KL_MERIT_PR 1
+#define OK_KL_MERIT_LI 2
+
 typedef struct ok_list {
     ok_kernel* prototype;
     ok_list_item** kernels;
     int size;
+    // statistics of the temperatures of parallel tempering (gsl_matrix*, see KL_getTempStats), or NULL
     void* diags;
     int type;
+    // read-only column-major storage (in that case kernels is NULL), or NULL
+    ok_list_columns* columns;
 } ok_list;
 
 typedef struct ok_minimizer_pars {
@@ -417,6 +535,6 @@ typedef struct ok_minimizer_pars {
     ok_kernel* kernel;
 } ok_kernel_minimizer_pars;
 
-#define FREE_MINIMIZER_PARS(p) do { free(p.pars); free(p.steps); free(p.min); free(p.max); free(p.type); } while (0);
+#define FREE_MINIMIZER_PARS(p) do { free(p.pars); free(p.steps); free(p.min); free(p.max); free(p.type); free(p.planet); } while (0);
 
 #endif
@@ -62,11 +62,7 @@ double ok_median_angle(const double* v, int length, bool isRadians) {
         sin_avg->data[i] = sin((isRadians ? v[i] : TO_RAD(v[i])));
     }
 
-    gsl_sort_vector(cos_avg);
-    gsl_sort_vector(sin_avg);
-
-    double avg = atan2(gsl_stats_median_from_sorted_data(sin_avg->data, 1, length),
-            gsl_stats_median_from_sorted_data(cos_avg->data, 1, length));
+    double avg = atan2(ok_median(sin_avg->data, length), ok_median(cos_avg->data, length));
 
     if (avg < 0) {
         avg += 2 * M_PI;
@@ -133,9 +129,7 @@ double ok_mad_angle(double* v, const int length, const double med, const bool is
         v[i] = fabs(diff);
     }
 
-    gsl_sort(v, 1, length);
-
-    double mad = gsl_stats_median_from_sorted_data(v, 1, length);
+    double mad = ok_median(v, length);
     return (isRadians ? mad : TO_DEG(mad));
 }
 
@@ -144,9 +138,168 @@ double ok_mad(double* v, const int length, const double med) {
     for (int i = 0; i < length; i++)
         v[i] = fabs(v[i] - med);
 
-    gsl_sort(v, 1, length);
-    return gsl_stats_median_from_sorted_data(v, 1, length);
+    return ok_median(v, length);
+
+}
+
+#define OK_SWAP(v, i, j) do { double __t = v[i]; v[i] = v[j]; v[j] = __t; } while (0)
+
+// Partially reorders v[lo..hi] so that v[k] holds the value it would have if v were sorted,
+// with no larger value before it and no smaller value after it (quickselect with a median-of-three
+// pivot and three-way partitioning, so that runs of equal values are handled in linear time)
+static void ok_select_range(double* v, int lo, int hi, const int k) {
+    while (hi > lo) {
+        double a = v[lo], b = v[lo + (hi - lo) / 2], c = v[hi];
+        double p = (a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b)));
 
+        int lt = lo, i = lo, gt = hi;
+        while (i <= gt) {
+            if (v[i] < p) {
+                OK_SWAP(v, lt, i);
+                lt++;
+                i++;
+            } else if (v[i] > p) {
+                OK_SWAP(v, i, gt);
+                gt--;
+            } else
+                i++;
+        }
+
+        // v[lo..lt - 1] < p, v[lt..gt] == p, v[gt + 1..hi] > p
+        if (k < lt)
+            hi = lt - 1;
+        else if (k > gt)
+            lo = gt + 1;
+        else
+            return;
+    }
+}
+
+// Selects the sorted (ascending, distinct) ranks of v[lo..hi], splitting the range at each rank
+static void ok_select_ranks(double* v, const int lo, const int hi, const int* ranks, const int nranks) {
+    if (nranks == 0 || hi <= lo)
+        return;
+    int mid = nranks / 2;
+    ok_select_range(v, lo, hi, ranks[mid]);
+    ok_select_ranks(v, lo, ranks[mid] - 1, ranks, mid);
+    ok_select_ranks(v, ranks[mid] + 1, hi, ranks + mid + 1, nranks - mid - 1);
+}
+
+/**
+ * Returns the median of v in O(length) time, without sorting it; the values of v
+ * are reordered. Same as gsl_stats_median_from_sorted_data on the sorted values.
+ * @param v Values
+ * @param length Number of values
+ * @return The median (0 if length is 0)
+ */
+double ok_median(double* v, const int length) {
+    if (length == 0)
+        return 0.;
+    int ranks[2] = {(length - 1) / 2, length / 2};
+    ok_select_ranks(v, 0, length - 1, ranks, (length % 2 == 0 ? 2 : 1));
+    if (length % 2 == 1)
+        return v[length / 2];
+    return (v[ranks[0]] + v[ranks[1]]) / 2.;
+}
+
+/**
+ * Computes several quantiles of v at once, in O(length log nq) time, without sorting
+ * it; the values of v are reordered. Each quantile is the same as the one returned by
+ * gsl_stats_quantile_from_sorted_data on the sorted values.
+ * @param v Values
+ * @param length Number of values
+ * @param q Quantiles to compute (between 0 and 1)
+ * @param nq Number of quantiles (nothing is done if nq <= 0)
+ * @param ret Array of nq doubles, filled with the quantiles (0 if length is 0)
+ */
+void ok_quantiles(double* v, const int length, const double* q, const int nq, double* ret) {
+    if (nq <= 0)
+        return;
+    if (length == 0) {
+        for (int i = 0; i < nq; i++)
+            ret[i] = 0.;
+        return;
+    }
+
+    // Ranks of the two order statistics interpolated by each quantile, sorted and unique
+    int ranks[2 * nq];
+    int nranks = 0;
+    for (int i = 0; i < nq; i++) {
+        int lhs = (int) (RANGE(q[i], 0., 1.) * (length - 1));
+        for (int r = lhs; r <= MIN(lhs + 1, length - 1); r++) {
+            int j = nranks;
+            while (j > 0 && ranks[j - 1] > r)
+                j--;
+            if (j > 0 && ranks[j - 1] == r)
+                continue;
+            for (int l = nranks; l > j; l--)
+                ranks[l] = ranks[l - 1];
+            ranks[j] = r;
+            nranks++;
+        }
+    }
+    ok_select_ranks(v, 0, length - 1, ranks, nranks);
+
+    for (int i = 0; i < nq; i++) {
+        double index = RANGE(q[i], 0., 1.) * (length - 1);
+        int lhs = (int) index;
+        double delta = index - lhs;
+        ret[i] = (lhs == length - 1 ? v[lhs] : (1 - delta) * v[lhs] + delta * v[lhs + 1]);
+    }
+}
+
+/**
+ * In-place radix-2 FFT of the complex sequence (re, im): computes
+ * X_k = sum_m x_m exp(-+2 pi i k m / n), with the + sign if inverse is true. The
+ * inverse transform is not normalized.
+ * @param re Real parts
+ * @param im Imaginary parts
+ * @param n Length of the sequence (a power of 2)
+ * @param inverse Whether to compute the inverse transform
+ */
+void ok_fft(double* re, double* im, const int n, const bool inverse) {
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            double t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+
+    // The twiddle factors are computed directly (not by recurrence), so that long
+    // transforms stay accurate
+    double* twr = (double*) malloc(sizeof (double) * MAX(n / 2, 1));
+    double* twi = (double*) malloc(sizeof (double) * MAX(n / 2, 1));
+    for (int j = 0; j < n / 2; j++) {
+        double ang = (inverse ? 2. : -2.) * M_PI * j / n;
+        twr[j] = cos(ang);
+        twi[j] = sin(ang);
+    }
+
+    for (int len = 2; len <= n; len <<= 1) {
+        int stride = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int j = 0; j < len / 2; j++) {
+                int a = i + j, b = i + j + len / 2;
+                double cr = twr[j * stride], ci = twi[j * stride];
+                double xr = re[b] * cr - im[b] * ci;
+                double xi = re[b] * ci + im[b] * cr;
+                re[b] = re[a] - xr;
+                im[b] = im[a] - xi;
+                re[a] += xr;
+                im[a] += xi;
+            }
+        }
+    }
+    free(twr);
+    free(twi);
 }
 
 /*  */
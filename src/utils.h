@@ -173,6 +173,9 @@ double ok_median_angle(const double* v, const int length, const bool isRadians);
 double ok_stddev_angle(const double* v, const int length, const bool isRadians);
 double ok_mad_angle(double* v, const int length, const double med, const bool isRadians);
 double ok_mad(double* v, const int length, const double med);
+double ok_median(double* v, const int length);
+void ok_quantiles(double* v, const int length, const double* q, const int nq, double* ret);
+void ok_fft(double* re, double* im, const int n, const bool inverse);
 
 char* ok_str_copy(const char* src);
 char* ok_str_cat(const char* a1, const char* a2);